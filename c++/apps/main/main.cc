@@ -1,4 +1,7 @@
 #include "mcmc/mcmc.h"
+#ifdef MCMC_MPI_THREADS
+#include "mcmc/mpi-threads.h"
+#endif
 
 using namespace mcmc;
 using namespace mcmc::preprocess;
@@ -16,6 +19,9 @@ int main(int argc, char *argv[]) {
 #ifdef MCMC_ENABLE_DISTRIBUTED
     bool do_distributed = true;
     bool do_sequential = false;
+#  ifdef MCMC_MPI_THREADS
+    int ranks;
+#  endif
 #else
     bool do_sequential = true;
 #endif
@@ -25,6 +31,10 @@ int main(int argc, char *argv[]) {
       ("help", "help")
 #ifdef MCMC_ENABLE_DISTRIBUTED
       ("sequential", po::bool_switch(&do_sequential), "sequential run")
+#endif
+#ifdef MCMC_MPI_THREADS
+      ("ranks", po::value<int>(&ranks)->default_value(1),
+       "number of in-process ranks; requires --mcmc.dkv-type shm")
 #endif
     ;
     po::variables_map vm;
@@ -58,21 +68,52 @@ int main(int argc, char *argv[]) {
       do_distributed = false;
     }
 
+    auto run_distributed = [](const mcmc::Options &args) {
+      if (args.async) {
+        std::cout << "start MCMC stochastical distributed asynchronous " << std::endl;
+        MCMCSamplerStochasticDistributedAsync mcmcSampler(args);
+        mcmcSampler.init();
+        mcmcSampler.run();
+      } else {
+        std::cout << "start MCMC stochastical distributed " << std::endl;
+        MCMCSamplerStochasticDistributed mcmcSampler(args);
+        mcmcSampler.init();
+        mcmcSampler.run();
+      }
+    };
+
     if (do_distributed) {
-      std::cout << "start MCMC stochastical distributed " << std::endl;
-      MCMCSamplerStochasticDistributed mcmcSampler(args);
-      mcmcSampler.init();
-      mcmcSampler.run();
+#ifdef MCMC_MPI_THREADS
+      // Each rank is a thread; the ranks share the shm D-KV store
+      mpi_threads::Run(ranks, [&remains, ranks, &run_distributed](int rank) {
+        std::vector<std::string> rank_args(remains);
+        rank_args.push_back("--dkv.shm.ranks");
+        rank_args.push_back(std::to_string(ranks));
+        rank_args.push_back("--dkv.shm.rank");
+        rank_args.push_back(std::to_string(rank));
+        mcmc::Options rank_opts(rank_args);
+        run_distributed(rank_opts);
+      });
+#else
+      run_distributed(args);
+#endif
     }
 #endif
 
     if (do_sequential) {
       // Parameter set for Python comparison:
       // -s -f ../../../../datasets/netscience.txt -c relativity -K 15 -m 147 -n 10 --mcmc.alpha 0.01 --mcmc.epsilon 0.0000001 --mcmc.held-out-ratio 0.009999999776 -i 1
-      std::cout << "start MCMC stochastical" << std::endl;
-      MCMCSamplerStochastic mcmcSampler(args);
-      mcmcSampler.init();
-      mcmcSampler.run();
+      if (args.sparse_m > 0) {
+        std::cout << "start MCMC stochastical sparse" << std::endl;
+        MCMCSamplerStochasticSparse mcmcSampler(args);
+        mcmcSampler.init();
+        mcmcSampler.run();
+      } else {
+        std::cout << "start MCMC stochastical" << std::endl;
+        MCMCSamplerStochastic mcmcSampler(args);
+        mcmcSampler.init();
+        mcmcSampler.run();
+      }
     }
 
     return 0;
@@ -0,0 +1,416 @@
+/*
+ * Copyright notice
+ */
+
+/*
+ * Value codecs for the D-KV store. A value is a row of Floats; all but a
+ * short full-precision tail are stored and transferred in a compact encoding
+ * and decoded into the cache buffer.
+ *
+ * Encoded record layout, in bytes:
+ *   [ entries, each of the codec's width ][ pad to Float ][ tail Floats ]
+ *   [ scale Float, q8 only ]
+ * The record is padded to a whole number of Floats.
+ */
+
+#ifndef APPS_MCMC_D_KV_STORE_CODEC_H__
+#define APPS_MCMC_D_KV_STORE_CODEC_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include <dkvstore/config.h>
+
+namespace DKV {
+
+enum class CODEC {
+  NONE,
+  FP16,
+  BF16,
+  Q8,
+};
+
+
+inline std::istream& operator>> (std::istream& in, CODEC& codec) {
+  namespace po = boost::program_options;
+
+  std::string token;
+  in >> token;
+
+  if (false) {
+  } else if (token == "none") {
+    codec = CODEC::NONE;
+  } else if (token == "fp16") {
+    codec = CODEC::FP16;
+  } else if (token == "bf16") {
+    codec = CODEC::BF16;
+  } else if (token == "q8") {
+    codec = CODEC::Q8;
+  } else {
+    throw po::validation_error(po::validation_error::invalid_option_value,
+                               "Unknown D-KV codec");
+  }
+
+  return in;
+}
+
+
+inline std::ostream& operator<< (std::ostream& s, const CODEC& codec) {
+  switch (codec) {
+    case CODEC::NONE:
+      s << "none";
+      break;
+    case CODEC::FP16:
+      s << "fp16";
+      break;
+    case CODEC::BF16:
+      s << "bf16";
+      break;
+    case CODEC::Q8:
+      s << "q8";
+      break;
+  }
+
+  return s;
+}
+
+
+namespace codec {
+
+// IEEE 754 binary16, round to nearest even
+inline uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof x);
+
+  uint32_t sign = (x >> 16) & 0x8000;
+  int32_t exp = static_cast<int32_t>((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+
+  if (((x >> 23) & 0xff) == 0xff) {
+    // inf or nan
+    return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+  }
+  if (exp >= 0x1f) {
+    // overflow
+    return sign | 0x7c00;
+  }
+  if (exp <= 0) {
+    // subnormal or underflow
+    if (exp < -10) {
+      return sign;
+    }
+    mant |= 0x800000;
+    uint32_t shift = 14 - exp;
+    uint32_t h = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1))) {
+      ++h;
+    }
+    return sign | h;
+  }
+
+  uint32_t h = sign | (exp << 10) | (mant >> 13);
+  uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+    // may carry into the exponent, which is the correct rounding
+    ++h;
+  }
+
+  return h;
+}
+
+
+inline float half_to_float(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+
+  if (exp == 0x1f) {
+    x = sign | 0x7f800000 | (mant << 13);
+  } else if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {
+      // subnormal: normalize
+      exp = 127 - 15 + 1;
+      while ((mant & 0x400) == 0) {
+        mant <<= 1;
+        --exp;
+      }
+      mant &= 0x3ff;
+      x = sign | (exp << 23) | (mant << 13);
+    }
+  } else {
+    x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+  }
+
+  float f;
+  memcpy(&f, &x, sizeof f);
+
+  return f;
+}
+
+
+// bfloat16, round to nearest even
+inline uint16_t float_to_bfloat(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof x);
+
+  if ((x & 0x7f800000) == 0x7f800000 && (x & 0x7fffff) != 0) {
+    // keep nan quiet
+    return (x >> 16) | 0x40;
+  }
+  x += 0x7fff + ((x >> 16) & 1);
+
+  return x >> 16;
+}
+
+
+inline float bfloat_to_float(uint16_t h) {
+  uint32_t x = static_cast<uint32_t>(h) << 16;
+  float f;
+  memcpy(&f, &x, sizeof f);
+
+  return f;
+}
+
+}   // namespace codec
+
+
+/**
+ * Encodes/decodes rows of value_size Floats. The last full_precision_tail
+ * Floats of a row are kept as is.
+ * A positive value never decodes to zero: the samplers divide by pi.
+ * q8 assumes non-negative values, as pi is.
+ */
+class Codec {
+ public:
+  Codec() : type_(CODEC::NONE), value_size_(0), tail_(0), record_size_(0) {
+  }
+
+  void Init(CODEC type, ::size_t value_size, ::size_t full_precision_tail) {
+    if (full_precision_tail > kMaxTail) {
+      throw std::invalid_argument("Codec: full precision tail too long");
+    }
+    if (full_precision_tail > value_size) {
+      throw std::invalid_argument("Codec: full precision tail exceeds value");
+    }
+    type_ = type;
+    value_size_ = value_size;
+    tail_ = full_precision_tail;
+    entries_ = value_size - full_precision_tail;
+
+    if (type_ == CODEC::NONE) {
+      tail_offset_ = entries_ * sizeof(Float);
+      record_size_ = value_size;
+    } else {
+      tail_offset_ = (entries_ * width() + sizeof(Float) - 1) /
+                       sizeof(Float) * sizeof(Float);
+      ::size_t bytes = tail_offset_ + tail_ * sizeof(Float);
+      if (type_ == CODEC::Q8) {
+        bytes += sizeof(Float);
+      }
+      record_size_ = bytes / sizeof(Float);
+      // The stores decode records in place, into rows of value_size
+      if (record_size_ > value_size) {
+        throw std::invalid_argument("Codec: encoded record exceeds value");
+      }
+    }
+  }
+
+  CODEC type() const {
+    return type_;
+  }
+
+  bool identity() const {
+    return type_ == CODEC::NONE;
+  }
+
+  /**
+   * @return size of an encoded record, in Floats
+   */
+  ::size_t record_size() const {
+    return record_size_;
+  }
+
+  /**
+   * Encode a row of value_size Floats into record_size Floats.
+   * @argument out may be equal to @argument in.
+   */
+  void Encode(const Float *in, Float *out) const {
+    if (type_ == CODEC::NONE) {
+      if (in != out) {
+        memcpy(out, in, value_size_ * sizeof(Float));
+      }
+      return;
+    }
+
+    Float tail[kMaxTail];
+    for (::size_t t = 0; t < tail_; ++t) {
+      tail[t] = in[entries_ + t];
+    }
+
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(out);
+    Float scale = 0.0;
+    switch (type_) {
+    case CODEC::FP16:
+      for (::size_t i = 0; i < entries_; ++i) {
+        uint16_t h = codec::float_to_half(static_cast<float>(in[i]));
+        if (in[i] > 0 && (h & 0x7fff) == 0) {
+          h = 1;
+        }
+        memcpy(bytes + i * sizeof h, &h, sizeof h);
+      }
+      break;
+    case CODEC::BF16:
+      for (::size_t i = 0; i < entries_; ++i) {
+        uint16_t h = codec::float_to_bfloat(static_cast<float>(in[i]));
+        if (in[i] > 0 && (h & 0x7fff) == 0) {
+          h = 1;
+        }
+        memcpy(bytes + i * sizeof h, &h, sizeof h);
+      }
+      break;
+    case CODEC::Q8:
+      {
+        Float max = 0.0;
+        for (::size_t i = 0; i < entries_; ++i) {
+          max = std::max(max, in[i]);
+        }
+        scale = max / 255;
+        for (::size_t i = 0; i < entries_; ++i) {
+          int q = 0;
+          if (in[i] > 0) {
+            q = std::max(1, std::min(255,
+                                     static_cast<int>(std::lround(in[i] /
+                                                                  scale))));
+          }
+          bytes[i] = static_cast<unsigned char>(q);
+        }
+      }
+      break;
+    case CODEC::NONE:
+      break;
+    }
+
+    Float *tail_out = reinterpret_cast<Float *>(bytes + tail_offset_);
+    for (::size_t t = 0; t < tail_; ++t) {
+      tail_out[t] = tail[t];
+    }
+    if (type_ == CODEC::Q8) {
+      tail_out[tail_] = scale;
+    }
+  }
+
+  /**
+   * Decode a record of record_size Floats into a row of value_size Floats.
+   * @argument out may overlap @argument in if out >= in.
+   */
+  void Decode(const Float *in, Float *out) const {
+    if (type_ == CODEC::NONE) {
+      if (in != out) {
+        memmove(out, in, value_size_ * sizeof(Float));
+      }
+      return;
+    }
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(in);
+    const Float *tail_in = reinterpret_cast<const Float *>(bytes +
+                                                           tail_offset_);
+    Float tail[kMaxTail];
+    for (::size_t t = 0; t < tail_; ++t) {
+      tail[t] = tail_in[t];
+    }
+
+    // Back to front, so the decoded entries don't overwrite encoded entries
+    // that still must be read
+    switch (type_) {
+    case CODEC::FP16:
+      for (::size_t i = entries_; i-- > 0; ) {
+        uint16_t h;
+        memcpy(&h, bytes + i * sizeof h, sizeof h);
+        out[i] = codec::half_to_float(h);
+      }
+      break;
+    case CODEC::BF16:
+      for (::size_t i = entries_; i-- > 0; ) {
+        uint16_t h;
+        memcpy(&h, bytes + i * sizeof h, sizeof h);
+        out[i] = codec::bfloat_to_float(h);
+      }
+      break;
+    case CODEC::Q8:
+      {
+        Float scale = tail_in[tail_];
+        for (::size_t i = entries_; i-- > 0; ) {
+          out[i] = bytes[i] * scale;
+        }
+      }
+      break;
+    case CODEC::NONE:
+      break;
+    }
+
+    for (::size_t t = 0; t < tail_; ++t) {
+      out[entries_ + t] = tail[t];
+    }
+  }
+
+  /**
+   * Decode @argument n records that are packed at stride record_size into
+   * rows at stride value_size, in place
+   */
+  void DecodeInPlace(Float *area, ::size_t n) const {
+    if (type_ == CODEC::NONE) {
+      return;
+    }
+    for (::size_t j = n; j-- > 0; ) {
+      Decode(area + j * record_size_, area + j * value_size_);
+    }
+  }
+
+  /**
+   * Quantize a row as a store/fetch round trip would
+   */
+  void RoundTrip(const Float *in, Float *out) const {
+    Encode(in, out);
+    Decode(out, out);
+  }
+
+ private:
+  ::size_t width() const {
+    switch (type_) {
+    case CODEC::FP16:
+    case CODEC::BF16:
+      return sizeof(uint16_t);
+    case CODEC::Q8:
+      return sizeof(uint8_t);
+    case CODEC::NONE:
+      break;
+    }
+    return sizeof(Float);
+  }
+
+  static const ::size_t kMaxTail = 4;
+
+  CODEC type_;
+  ::size_t value_size_;
+  ::size_t tail_;
+  ::size_t entries_;
+  ::size_t tail_offset_;
+  ::size_t record_size_;
+};
+
+}   // namespace DKV
+
+#endif  // ndef APPS_MCMC_D_KV_STORE_CODEC_H__
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <vector>
 #include <unordered_map>
 #include <string>
@@ -26,12 +27,17 @@
 #include <boost/program_options.hpp>
 
 #include <dkvstore/config.h>
+#include <dkvstore/DKVCodec.h>
+
+#include "mcmc/numa.h"
+#include "mcmc/huge-pages.h"
 
 
 namespace DKV {
 
 enum TYPE {
   FILE,
+  SHM,
 #ifdef MCMC_ENABLE_RAMCLOUD
   RAMCLOUD,
 #endif
@@ -50,6 +56,8 @@ inline std::istream& operator>> (std::istream& in, TYPE& dkv_type) {
   if (false) {
   } else if (token == "file") {
     dkv_type = DKV::TYPE::FILE;
+  } else if (token == "shm") {
+    dkv_type = DKV::TYPE::SHM;
 #ifdef MCMC_ENABLE_RAMCLOUD
   } else if (token == "ramcloud") {
     dkv_type = DKV::TYPE::RAMCLOUD;
@@ -72,6 +80,9 @@ inline std::ostream& operator<< (std::ostream& s, const TYPE& dkv_type) {
     case DKV::TYPE::FILE:
       s << "file";
       break;
+    case DKV::TYPE::SHM:
+      s << "shm";
+      break;
 #ifdef MCMC_ENABLE_RAMCLOUD
     case DKV::TYPE::RAMCLOUD:
       s << "ramcloud";
@@ -109,7 +120,7 @@ class DKVException : public std::exception {
   }
 
  protected:
-  const std::string &reason_;
+  const std::string reason_;
 };
 
 
@@ -121,15 +132,21 @@ class Buffer {
 
   ~Buffer() {
     if (managed_) {
-      delete[] buffer_;
+      mcmc::huge_pages::Free(buffer_, capacity_ * sizeof(ValueType));
       buffer_ = (ValueType *)0x55555555;
     }
   }
 
-  void Init(::size_t capacity) {
-    delete[] buffer_;
+  // Large buffers come from huge pages if the policy says so
+  void Init(::size_t capacity, const std::string &name) {
+    if (managed_) {
+      mcmc::huge_pages::Free(buffer_, capacity_ * sizeof(ValueType));
+    }
     capacity_ = capacity;
-    buffer_ = new ValueType[capacity];
+    buffer_ = static_cast<ValueType *>(
+                mcmc::huge_pages::Allocate(capacity * sizeof(ValueType),
+                                           name));
+    managed_ = true;
   }
 
   void Init(ValueType *buffer, ::size_t capacity) {
@@ -180,8 +197,13 @@ class DKVStoreInterface {
  public:
   typedef int32_t KeyType;
   typedef Float ValueType;
+  typedef ::size_t Handle;
 
-  DKVStoreInterface(const std::vector<std::string> &args) { }
+  DKVStoreInterface(const std::vector<std::string> &args)
+      : current_cache_(&cache_buffer_), next_handle_(0),
+        codec_type_(CODEC::NONE), codec_tail_(0), epochs_(1), epoch_(0),
+        numa_policy_(mcmc::numa::POLICY::NONE), run_id_(0) {
+  }
 
   virtual ~DKVStoreInterface() {
   }
@@ -190,8 +212,114 @@ class DKVStoreInterface {
                     ::size_t max_cache_capacity, ::size_t max_write_capacity) {
     value_size_ = value_size;
     total_values_ = total_values;
-    cache_buffer_.Init(value_size * max_cache_capacity);
-    write_buffer_.Init(value_size * max_write_capacity);
+    codec_.Init(codec_type_, value_size, codec_tail_);
+    cache_buffer_.Init(value_size * max_cache_capacity, "D-KV cache");
+    write_buffer_.Init(value_size * max_write_capacity, "D-KV write buffer");
+  }
+
+  /**
+   * Store and transfer values encoded with @argument codec. The last
+   * @argument full_precision_tail elements of each value are kept as is.
+   * Values are decoded into the cache area. Call before Init().
+   */
+  void SetCodec(CODEC codec, ::size_t full_precision_tail) {
+    codec_type_ = codec;
+    codec_tail_ = full_precision_tail;
+  }
+
+  const Codec &codec() const {
+    return codec_;
+  }
+
+  /**
+   * Keep two versions of each value, one for the current and one for the
+   * next epoch. Reads see the current epoch, writes go to the next epoch,
+   * so a value can be read while its next version is being written.
+   * FlipEpoch() makes the next epoch current. Call before Init().
+   */
+  void SetEpochs(bool on) {
+    epochs_ = on ? 2 : 1;
+  }
+
+  ::size_t epochs() const {
+    return epochs_;
+  }
+
+  /**
+   * Place the pages of the local value area over the NUMA nodes of this
+   * host by @argument policy. Call before Init(); a store that cannot place
+   * its values ignores it.
+   */
+  void SetNuma(mcmc::numa::POLICY policy) {
+    numa_policy_ = policy;
+  }
+
+  /**
+   * An id that all ranks of this run share and that differs across runs,
+   * e.g. drawn by the master and broadcast. A store whose ranks meet at a
+   * named resource uses it to tell its own run from one that crashed and
+   * left the resource behind. 0, the default, is no id. Call before Init().
+   */
+  void SetRunId(uint64_t run_id) {
+    run_id_ = run_id;
+  }
+
+  /**
+   * @return the NUMA node, as numbered by mcmc::numa::Topology, whose
+   * memory holds the value of @argument key; -1 if unknown
+   */
+  virtual int NumaNode(KeyType key) const {
+    return -1;
+  }
+
+  /**
+   * Make the next epoch current. All writes to the next epoch must have
+   * completed, at all peers, and reads of the current epoch are over.
+   * @reentrant: no
+   */
+  void FlipEpoch() {
+    epoch_ = write_slot();
+  }
+
+  /**
+   * Carve the cache area into @argument n regions of equal size, so one
+   * region can be filled by ReadKVRecordsAsync() while the contents of another
+   * are being consumed. Call after Init(). A synchronous ReadKVRecords() still
+   * uses the whole cache area, so don't mix it with outstanding async reads.
+   */
+  void InitCacheRegions(::size_t n) {
+    ::size_t region_size = cache_buffer_.capacity() / value_size_ / n *
+                             value_size_;
+    cache_region_.resize(n);
+    for (::size_t r = 0; r < n; ++r) {
+      cache_region_[r].Init(cache_buffer_.buffer() + r * region_size,
+                            region_size);
+    }
+  }
+
+  /**
+   * Place the values by a partition of the keys instead of round robin.
+   * @argument part maps each key to a part 0..parts>, one part per host
+   * that stores values. The keys are relabeled so each part is a contiguous
+   * range. Call after Init(), before the first write.
+   */
+  virtual void SetPartition(const std::vector<int32_t> &part,
+                            ::size_t parts) {
+    if (part.size() != total_values_) {
+      throw DKVException("SetPartition: partition does not cover the keys");
+    }
+    part_start_.assign(parts + 1, 0);
+    for (auto p : part) {
+      ++part_start_[p + 1];
+    }
+    for (::size_t p = 0; p < parts; ++p) {
+      part_start_[p + 1] += part_start_[p];
+    }
+    std::vector<KeyType> next(part_start_.begin(), part_start_.end() - 1);
+    label_.resize(part.size());
+    for (::size_t k = 0; k < part.size(); ++k) {
+      label_[k] = next[part[k]]++;
+    }
   }
 
   virtual bool include_master() {
@@ -216,6 +344,41 @@ class DKVStoreInterface {
                              const std::vector<KeyType> &key,
                              RW_MODE::RWMode rw_mode) = 0;
 
+  /**
+   * Split-phase version of ReadKVRecords(). Starts populating cache region
+   * @argument region with the values belonging to @argument keys; the
+   * pointers in @argument cache are valid immediately, the values they point
+   * to only after Wait() on the returned handle.
+   * The default implementation performs a synchronous read.
+   * @reentrant: no
+   */
+  virtual Handle ReadKVRecordsAsync(::size_t region,
+                                    std::vector<ValueType *> &cache,
+                                    const std::vector<KeyType> &key,
+                                    RW_MODE::RWMode rw_mode) {
+    current_cache_ = &cache_region_[region];
+    ReadKVRecords(cache, key, rw_mode);
+    current_cache_ = &cache_buffer_;
+
+    return next_handle_++;
+  }
+
+  /**
+   * Complete the async operation that returned @argument handle, and all
+   * operations issued before it.
+   * @reentrant: no
+   */
+  virtual void Wait(Handle handle) {
+  }
+
+  /**
+   * Purge one cache region; leaves the other regions intact
+   * @reentrant: no
+   */
+  virtual void PurgeCacheRegion(::size_t region) {
+    cache_region_[region].reset();
+  }
+
   /**
    * Write key/value pairs.
    * @param value
@@ -226,6 +389,20 @@ class DKVStoreInterface {
   virtual void WriteKVRecords(const std::vector<KeyType> &key,
                               const std::vector<const ValueType *> &value) = 0;
 
+  /**
+   * Split-phase version of WriteKVRecords(). The write is complete after
+   * Wait() on the returned handle; until then, @argument value must stay
+   * valid and the store may not be read at @argument key.
+   * The default implementation performs a synchronous write.
+   * @reentrant: no
+   */
+  virtual Handle WriteKVRecordsAsync(const std::vector<KeyType> &key,
+                                     const std::vector<const ValueType *> &value) {
+    WriteKVRecords(key, value);
+
+    return next_handle_++;
+  }
+
   /**
    * Zerocopy write interface. Obtain a vector of value pointers to fill.
    * Written out by a call to WriteKVRecords, which performs the binding from
@@ -247,11 +424,54 @@ class DKVStoreInterface {
   virtual void PurgeKVRecords() = 0;
 
  protected:
+  bool partitioned() const {
+    return ! label_.empty();
+  }
+
+  ::size_t PartOf(KeyType key) const {
+    return std::upper_bound(part_start_.begin(), part_start_.end(),
+                            label_[key]) - part_start_.begin() - 1;
+  }
+
+  // Index of @argument key within its part
+  ::size_t IndexInPart(KeyType key) const {
+    return label_[key] - part_start_[PartOf(key)];
+  }
+
+  // The slot that holds the values of the current epoch
+  ::size_t read_slot() const {
+    return epoch_;
+  }
+
+  // The slot that holds the values of the next epoch
+  ::size_t write_slot() const {
+    return (epoch_ + 1) % epochs_;
+  }
+
   ::size_t value_size_;
   ::size_t total_values_;
 
   Buffer<ValueType> cache_buffer_;
   Buffer<ValueType> write_buffer_;
+  std::vector<Buffer<ValueType> > cache_region_;
+  // Where ReadKVRecords allocates its cache entries
+  Buffer<ValueType> *current_cache_;
+  Handle next_handle_;
+
+  CODEC codec_type_;
+  ::size_t codec_tail_;
+  Codec codec_;
+
+  ::size_t epochs_;
+  ::size_t epoch_;
+
+  mcmc::numa::POLICY numa_policy_;
+
+  uint64_t run_id_;
+
+  // SetPartition: relabeled key, and the first label of each part
+  std::vector<KeyType> label_;
+  std::vector<KeyType> part_start_;
 
   std::unordered_map<KeyType, ValueType *> value_of_;
 };
@@ -62,12 +62,13 @@ void DKVStoreFile::ReadKVRecords(std::vector<ValueType *> &cache,
                                  RW_MODE::RWMode rw_mode) {
   assert(cache.size() >= key.size());
   for (::size_t i = 0; i < key.size(); i++) {
-    ValueType *cache_pointer = cache_buffer_.get(value_size_);
+    ValueType *cache_pointer = current_cache_->get(value_size_);
 
-    std::string pi_file = PiFileName(key[i]);
+    std::string pi_file = PiFileName(key[i], read_slot());
     std::ifstream reader(pi_file.c_str());
     reader.read(reinterpret_cast<char *>(cache_pointer),
-                value_size_ * sizeof(ValueType));
+                codec_.record_size() * sizeof(ValueType));
+    codec_.DecodeInPlace(cache_pointer, 1);
     cache[i] = cache_pointer;
     value_of_[key[i]] = cache_pointer;
   }
@@ -98,21 +99,31 @@ void DKVStoreFile::FlushKVRecords(const std::vector<KeyType> &key) {
 
 void DKVStoreFile::PurgeKVRecords() {
   cache_buffer_.reset();
+  for (auto &r : cache_region_) {
+    r.reset();
+  }
   write_buffer_.reset();
   value_of_.clear();
 }
 
 void DKVStoreFile::WriteKVRecord(const KeyType key,
                                  const ValueType *cached) {
-  std::string pi_file = PiFileName(key);
+  std::string pi_file = PiFileName(key, write_slot());
   CreateDirNameOf(pi_file);
   std::ofstream writer(pi_file.c_str(),
                        std::ios_base::out | std::ios_base::trunc);
-  writer.write(reinterpret_cast<const char *>(cached),
-               value_size_ * sizeof(ValueType));
+  if (codec_.identity()) {
+    writer.write(reinterpret_cast<const char *>(cached),
+                 value_size_ * sizeof(ValueType));
+  } else {
+    std::vector<ValueType> encoded(value_size_);
+    codec_.Encode(cached, encoded.data());
+    writer.write(reinterpret_cast<const char *>(encoded.data()),
+                 codec_.record_size() * sizeof(ValueType));
+  }
 }
 
-const std::string DKVStoreFile::PiFileName(KeyType node) const {
+const std::string DKVStoreFile::PiFileName(KeyType node, ::size_t slot) const {
   const int kMaxDigits = 4;
   std::ostringstream s;
   if (options_.dir() != "") {
@@ -124,6 +135,9 @@ const std::string DKVStoreFile::PiFileName(KeyType node) const {
     s << std::hex << h_digit << "/";
   }
   s << std::dec << node;
+  if (epochs_ > 1) {
+    s << "." << slot;
+  }
 
   return s.str();
 }
@@ -75,7 +75,7 @@ class DKVStoreFile : public DKVStoreInterface {
   virtual void PurgeKVRecords();
 
  private:
-  const std::string PiFileName(KeyType node) const;
+  const std::string PiFileName(KeyType node, ::size_t slot) const;
   void CreateDirNameOf(const std::string &filename) const;
   void WriteKVRecord(const KeyType key, const ValueType *cached);
 
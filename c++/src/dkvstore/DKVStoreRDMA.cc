@@ -8,6 +8,8 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+
 #ifdef MCMC_ENABLE_RDMA
 #include <infiniband/verbs.h>
 #endif
@@ -101,9 +103,14 @@ DKVStoreRDMA::~DKVStoreRDMA() {
   std::cout << t_write_.finish << std::endl;
 
   std::cout << t_barrier_ << std::endl;
+  std::cout << t_wait_ << std::endl;
+  std::cout << t_codec_ << std::endl;
 
   std::cout << "posts " << num_posts_ << " messages " << msgs_per_post_ <<
     " msgs/post " << ((double)msgs_per_post_ / num_posts_) << std::endl;
+  std::cout << "keys read " << keys_read_ << " remote duplicates " <<
+    keys_duplicate_ << " coalesced into a preceding transfer " <<
+    keys_coalesced_ << std::endl;
   // std::chrono::high_resolution_clock::duration dt;
   std::cout << "Local read   " << bytes_local_read     << "B " <<
     GBs_from_timer(t_read_.local, bytes_local_read) << "GB/s" << std::endl;
@@ -112,6 +119,11 @@ DKVStoreRDMA::~DKVStoreRDMA() {
   std::cout << "Remote read  " << bytes_remote_read    << "B " <<
     GBs_from_time(dt, bytes_remote_read) << "GB/s per-host loop " <<
     GBs_from_time(dth, bytes_remote_read) << "GB/s" << std::endl;
+  if (bytes_local_read + bytes_remote_read > 0) {
+    std::cout << "Local read share " <<
+      (100.0 * bytes_local_read / (bytes_local_read + bytes_remote_read)) <<
+      "%" << std::endl;
+  }
   std::cout << "Local write  " << bytes_local_written  << "B " <<
     GBs_from_timer(t_write_.local, bytes_local_written) << "GB/s" << std::endl;
   dt = t_write_.outer.total() - t_write_.local.total();
@@ -173,6 +185,8 @@ void DKVStoreRDMA::Init(::size_t value_size, ::size_t total_values,
   t_write_.finish = Timer("     finish write");
   t_write_.host   = Timer("     per-host write");
   t_barrier_      = Timer("RDMA barrier");
+  t_wait_         = Timer("RDMA wait for async ops");
+  t_codec_        = Timer("RDMA encode/decode");
 
   oob_network_.Init(options_.oob_server(), options_.oob_port(),
                     options_.mutable_oob_num_servers(), &oob_rank_);
@@ -219,27 +233,35 @@ void DKVStoreRDMA::Init(::size_t value_size, ::size_t total_values,
 
   value_size_ = value_size;
   total_values_ = total_values;
+  codec_.Init(codec_type_, value_size, codec_tail_);
+  record_size_ = codec_.record_size();
+  std::cout << "D-KV codec " << codec_.type() << " record size " <<
+    record_size_ << " value size " << value_size << std::endl;
   /* memory buffer to hold the value data */
   ::size_t my_values;
   if (include_master_) {
     my_values = (total_values + options_.oob_num_servers() - 1) / options_.oob_num_servers();
   } else {
-    if (oob_rank_ == 0) {
-      // something smallish, does not matter how much
-      my_values = max_cache_capacity;
-    } else {
-      my_values = (total_values + (options_.oob_num_servers() - 1) - 1) / (options_.oob_num_servers() - 1);
-    }
+    my_values = (total_values + (options_.oob_num_servers() - 1) - 1) / (options_.oob_num_servers() - 1);
+  }
+  // All hosts agree on the slot size, so remote offsets can be computed
+  slot_size_ = my_values * record_size_;
+  if (! include_master_ && oob_rank_ == 0) {
+    // something smallish, does not matter how much
+    value_.Init(&res_, max_cache_capacity * record_size_, "D-KV values");
+  } else {
+    value_.Init(&res_, epochs_ * slot_size_, "D-KV values");
   }
-  value_.Init(&res_, my_values * value_size);
   std::cout << "MR/value " << value_ << std::endl;
 
   /* memory buffer to hold the cache data */
-  cache_.Init(&res_, &cache_buffer_, max_cache_capacity * value_size);
+  cache_.Init(&res_, &cache_buffer_, max_cache_capacity * value_size,
+              "D-KV cache");
   std::cout << "MR/cache " << cache_ << std::endl;
 
   /* memory buffer to hold the zerocopy write data */
-  write_.Init(&res_, &write_buffer_, max_write_capacity * value_size);
+  write_.Init(&res_, &write_buffer_, max_write_capacity * value_size,
+              "D-KV write buffer");
   std::cout << "MR/write " << write_ << std::endl;
 
   peer_.resize(options_.oob_num_servers());
@@ -331,6 +353,7 @@ void DKVStoreRDMA::Init(::size_t value_size, ::size_t total_values,
     post_descriptor_[i].resize(q_size);
   }
   posts_.resize(num_batches);
+  cookies_ = options_.post_send_chunk();
 }
 
 template <typename T>
@@ -343,19 +366,40 @@ std::vector<const T*>& constify(std::vector<T*>& v) {
 }
 
 
+void DKVStoreRDMA::SetPartition(const std::vector<int32_t> &part,
+                                ::size_t parts) {
+  ::size_t servers = include_master_ ? options_.oob_num_servers() :
+                                       options_.oob_num_servers() - 1;
+  if (parts != servers) {
+    throw RDMAException("SetPartition: #parts must equal #hosts that store values");
+  }
+  DKVStoreInterface::SetPartition(part, parts);
+  for (::size_t p = 0; p < parts; ++p) {
+    if (static_cast< ::size_t>(part_start_[p + 1] - part_start_[p]) *
+          record_size_ > slot_size_) {
+      throw RDMAException("SetPartition: part exceeds the value area of its host");
+    }
+  }
+}
+
+
 int32_t DKVStoreRDMA::HostOf(DKVStoreRDMA::KeyType key) {
-  if (include_master_) {
+  if (partitioned()) {
+    return (include_master_ ? 0 : 1) + PartOf(key);
+  } else if (include_master_) {
     return key % options_.oob_num_servers();
   } else {
     return 1 + key % (options_.oob_num_servers() - 1);
   }
 }
 
-uint64_t DKVStoreRDMA::OffsetOf(DKVStoreRDMA::KeyType key) {
-  if (include_master_) {
-    return key / options_.oob_num_servers() * value_size_;
+uint64_t DKVStoreRDMA::OffsetOf(DKVStoreRDMA::KeyType key, ::size_t slot) {
+  if (partitioned()) {
+    return slot * slot_size_ + IndexInPart(key) * record_size_;
+  } else if (include_master_) {
+    return slot * slot_size_ + key / options_.oob_num_servers() * record_size_;
   } else {
-    return key / (options_.oob_num_servers() - 1) * value_size_;
+    return slot * slot_size_ + key / (options_.oob_num_servers() - 1) * record_size_;
   }
 }
 
@@ -385,16 +429,15 @@ void DKVStoreRDMA::post_batches(
     uint32_t local_key,
     enum ibv_wr_opcode opcode,
     BatchTimer &timer) {
-  ::size_t cookies = options_.post_send_chunk();
   ::size_t num_batches = (options_.oob_num_servers() + options_.batch_size() - 1) / options_.batch_size();
   for (::size_t h = 0; h < num_batches; ++h) {
     ::size_t peer = (h + oob_rank_ / num_batches) % num_batches;
     if (posts[peer] > 0) {      // correct statistics
       timer.host.start();
       for (::size_t i = 0; i < posts[peer]; ++i) {
-        if (cookies == 0) {
+        if (cookies_ == 0) {
           // Run out of cookies. Aqcuire at least one.
-          cookies = PollForCookies(0, 1, timer);
+          cookies_ = PollForCookies(0, 1, timer);
         }
 
         timer.post.start();
@@ -411,7 +454,7 @@ void DKVStoreRDMA::post_batches(
         }
         timer.post.stop();
         num_posts_++;
-        cookies--;
+        cookies_--;
       }
       timer.host.stop();
     }
@@ -420,15 +463,15 @@ void DKVStoreRDMA::post_batches(
       barrier();
     }
   }
-
-  // Collect the remaining cookies
-  PollForCookies(cookies, options_.post_send_chunk(), timer);
+  // The caller collects the outstanding cookies
 }
 
 
-void DKVStoreRDMA::ReadKVRecords(std::vector<DKVStoreRDMA::ValueType *> &cache,
-                                 const std::vector<KeyType> &key,
-                                 RW_MODE::RWMode rw_mode) {
+void DKVStoreRDMA::PostReadKVRecords(
+    Buffer<DKVStoreRDMA::ValueType> *cache_buffer,
+    std::vector<DKVStoreRDMA::ValueType *> &cache,
+    const std::vector<KeyType> &key,
+    RW_MODE::RWMode rw_mode) {
   if (rw_mode != RW_MODE::READ_ONLY) {
     std::cerr << "Ooppssss.......... writeable records not yet implemented" << std::endl;
   }
@@ -437,43 +480,91 @@ void DKVStoreRDMA::ReadKVRecords(std::vector<DKVStoreRDMA::ValueType *> &cache,
     throw RDMAException("cache.size < key.size");
   }
 
-  t_read_.outer.start();
+  keys_read_ += key.size();
 
   if (options_.oob_num_servers() > 1 /* res_.ib.context != NULL */) {
     for (auto &s : posts_) {
       s = 0;
     }
+
+    // Collect the unique remote keys; local keys are read directly
+    remote_key_.clear();
+    remote_cached_.clear();
     for (::size_t i = 0; i < key.size(); i++) {
       ::size_t owner = HostOf(key[i]);
       if (owner == oob_rank_) {
         // FIXME: do this asynchronously
         t_read_.local.start();
         // Read directly, without RDMA
-        cache[i] = value_.area_ + OffsetOf(key[i]);
+        if (codec_.identity()) {
+          cache[i] = value_.area_ + OffsetOf(key[i], read_slot());
+        } else {
+          cache[i] = cache_buffer->get(value_size_);
+          codec_.Decode(value_.area_ + OffsetOf(key[i], read_slot()), cache[i]);
+        }
 
-        bytes_local_read += value_size_ * sizeof(ValueType);
+        bytes_local_read += record_size_ * sizeof(ValueType);
         t_read_.local.stop();
 
+      } else if (remote_cached_.insert({ key[i], NULL }).second) {
+        remote_key_.push_back({ static_cast<int32_t>(owner),
+                                OffsetOf(key[i], read_slot()), key[i] });
       } else {
-        ValueType *target = cache_buffer_.get(value_size_);
-        cache[i] = target;
+        ++keys_duplicate_;
+      }
+    }
 
-        ::size_t batch = owner / options_.batch_size();
-        ::size_t n = posts_[batch];
-        posts_[batch] += 1;
-        assert(post_descriptor_.capacity() > batch);
-        assert(post_descriptor_[batch].capacity() > n);
+    // Sort the remote keys by location, so keys that are contiguous at
+    // their host are fetched in one transfer
+    std::sort(remote_key_.begin(), remote_key_.end());
+    ::size_t run_start = 0;
+    while (run_start < remote_key_.size()) {
+      const RemoteKey &first = remote_key_[run_start];
+      ::size_t run_end = run_start + 1;
+      while (run_end < remote_key_.size() &&
+             remote_key_[run_end].owner == first.owner &&
+             remote_key_[run_end].offset ==
+               first.offset + (run_end - run_start) * record_size_) {
+        ++run_end;
+      }
+      ::size_t run = run_end - run_start;
+      keys_coalesced_ += run - 1;
+
+      // The run arrives packed at record_size, and is decoded in place to
+      // stride value_size
+      ValueType *target = cache_buffer->get(run * value_size_);
+      for (::size_t j = 0; j < run; ++j) {
+        remote_cached_[remote_key_[run_start + j].key] =
+          target + j * value_size_;
+      }
+      if (! codec_.identity()) {
+        pending_decode_.push_back({ target, run });
+      }
 
-        auto *d = &post_descriptor_[batch][n];
-        d->connection_ = &peer_[owner].connection;
-        d->rkey_ = peer_[owner].props.value_rkey;
-        d->local_addr_ = target;
-        d->sizes_ = value_size_ * sizeof(ValueType);
-        d->remote_addr_ = (const ValueType *)(peer_[owner].props.value +
-                                              OffsetOf(key[i]) *
-                                                 sizeof(ValueType));
+      ::size_t owner = first.owner;
+      ::size_t batch = owner / options_.batch_size();
+      ::size_t n = posts_[batch];
+      posts_[batch] += 1;
+      assert(post_descriptor_.capacity() > batch);
+      assert(post_descriptor_[batch].capacity() > n);
+
+      auto *d = &post_descriptor_[batch][n];
+      d->connection_ = &peer_[owner].connection;
+      d->rkey_ = peer_[owner].props.value_rkey;
+      d->local_addr_ = target;
+      d->sizes_ = run * record_size_ * sizeof(ValueType);
+      d->remote_addr_ = (const ValueType *)(peer_[owner].props.value +
+                                            first.offset * sizeof(ValueType));
 
-        bytes_remote_read += value_size_ * sizeof(ValueType);
+      bytes_remote_read += run * record_size_ * sizeof(ValueType);
+
+      run_start = run_end;
+    }
+
+    // Fan out the fetched values over the requested keys
+    for (::size_t i = 0; i < key.size(); i++) {
+      if (HostOf(key[i]) != static_cast<int32_t>(oob_rank_)) {
+        cache[i] = remote_cached_[key[i]];
       }
     }
 
@@ -482,24 +573,102 @@ void DKVStoreRDMA::ReadKVRecords(std::vector<DKVStoreRDMA::ValueType *> &cache,
 
   } else {
     t_read_.local.start();
+    if (codec_.identity()) {
 #pragma omp parallel for
-    for (::size_t i = 0; i < key.size(); i++) {
-      // Read directly, without RDMA
-      cache[i] = value_.area_ + OffsetOf(key[i]);
+      for (::size_t i = 0; i < key.size(); i++) {
+        // Read directly, without RDMA
+        cache[i] = value_.area_ + OffsetOf(key[i], read_slot());
+      }
+    } else {
+      ValueType *target = cache_buffer->get(key.size() * value_size_);
+#pragma omp parallel for
+      for (::size_t i = 0; i < key.size(); i++) {
+        cache[i] = target + i * value_size_;
+        codec_.Decode(value_.area_ + OffsetOf(key[i], read_slot()), cache[i]);
+      }
     }
     t_read_.local.stop();
 
-    bytes_local_read += key.size() * value_size_ * sizeof(ValueType);
+    bytes_local_read += key.size() * record_size_ * sizeof(ValueType);
   }
+}
 
+
+void DKVStoreRDMA::ReadKVRecords(std::vector<DKVStoreRDMA::ValueType *> &cache,
+                                 const std::vector<KeyType> &key,
+                                 RW_MODE::RWMode rw_mode) {
+  t_read_.outer.start();
+  PostReadKVRecords(current_cache_, cache, key, rw_mode);
+  // Collect the remaining cookies
+  cookies_ = PollForCookies(cookies_, options_.post_send_chunk(), t_read_);
+  DecodePending();
   t_read_.outer.stop();
 }
 
 
+void DKVStoreRDMA::DecodePending() {
+  if (pending_decode_.size() == 0) {
+    return;
+  }
+  t_codec_.start();
+#pragma omp parallel for schedule(dynamic, 1)
+  for (::size_t i = 0; i < pending_decode_.size(); ++i) {
+    codec_.DecodeInPlace(pending_decode_[i].first, pending_decode_[i].second);
+  }
+  pending_decode_.clear();
+  t_codec_.stop();
+}
+
+
+DKVStoreRDMA::Handle DKVStoreRDMA::ReadKVRecordsAsync(
+    ::size_t region,
+    std::vector<DKVStoreRDMA::ValueType *> &cache,
+    const std::vector<KeyType> &key,
+    RW_MODE::RWMode rw_mode) {
+  t_read_.outer.start();
+  PostReadKVRecords(&cache_region_[region], cache, key, rw_mode);
+  t_read_.outer.stop();
+
+  return next_handle_++;
+}
+
+
+void DKVStoreRDMA::Wait(DKVStoreRDMA::Handle handle) {
+  // Completions are not tied to a handle: wait until the send queue is
+  // drained, which completes this operation and all earlier ones
+  t_wait_.start();
+  t_read_.outer.start();
+  cookies_ = PollForCookies(cookies_, options_.post_send_chunk(), t_read_);
+  DecodePending();
+  t_read_.outer.stop();
+  t_wait_.stop();
+}
+
+
 void DKVStoreRDMA::WriteKVRecords(const std::vector<KeyType> &key,
                                   const std::vector<const ValueType *> &value) {
   t_write_.outer.start();
+  PostWriteKVRecords(key, value);
+  // Collect the remaining cookies
+  cookies_ = PollForCookies(cookies_, options_.post_send_chunk(), t_write_);
+  t_write_.outer.stop();
+}
+
+
+DKVStoreRDMA::Handle DKVStoreRDMA::WriteKVRecordsAsync(
+    const std::vector<KeyType> &key,
+    const std::vector<const ValueType *> &value) {
+  t_write_.outer.start();
+  PostWriteKVRecords(key, value);
+  t_write_.outer.stop();
+
+  return next_handle_++;
+}
+
 
+void DKVStoreRDMA::PostWriteKVRecords(
+    const std::vector<KeyType> &key,
+    const std::vector<const ValueType *> &value) {
   if (value.size() < key.size()) {
     throw RDMAException("value.size < key.size");
   }
@@ -514,23 +683,23 @@ void DKVStoreRDMA::WriteKVRecords(const std::vector<KeyType> &key,
         // FIXME: do this asynchronously
         t_write_.local.start();
         // Write directly, without RDMA
-        ValueType *target = value_.area_ + OffsetOf(key[i]);
-        memcpy(target, value[i], value_size_ * sizeof(ValueType));
+        ValueType *target = value_.area_ + OffsetOf(key[i], write_slot());
+        codec_.Encode(value[i], target);
         t_write_.local.stop();
 
-        bytes_local_written += value_size_ * sizeof(ValueType);
+        bytes_local_written += record_size_ * sizeof(ValueType);
 
       } else {
         const ValueType *source;
-        if (write_.contains(value[i])) {
+        if (codec_.identity() && write_.contains(value[i])) {
           source = value[i];
         } else {
-          ValueType *v = write_buffer_.get(value_size_);
-          memcpy(v, value[i], value_size_ * sizeof(ValueType));
+          ValueType *v = write_buffer_.get(record_size_);
+          codec_.Encode(value[i], v);
           source = v;
         }
         assert(source >= write_buffer_.buffer());
-        assert(source + value_size_ <= write_buffer_.buffer() + write_buffer_.capacity());
+        assert(source + record_size_ <= write_buffer_.buffer() + write_buffer_.capacity());
 
         ::size_t batch = owner / options_.batch_size();
         ::size_t n = posts_[batch];
@@ -542,11 +711,11 @@ void DKVStoreRDMA::WriteKVRecords(const std::vector<KeyType> &key,
         d->connection_ = &peer_[owner].connection;
         d->rkey_ = peer_[owner].props.value_rkey;
         d->local_addr_ = const_cast<ValueType *>(source);       // sorry, API
-        d->sizes_ = value_size_ * sizeof(ValueType);
+        d->sizes_ = record_size_ * sizeof(ValueType);
         d->remote_addr_ = (const ValueType *)(peer_[owner].props.value +
-                                              OffsetOf(key[i]) * sizeof(ValueType));
+                                              OffsetOf(key[i], write_slot()) * sizeof(ValueType));
 
-        bytes_remote_written += value_size_ * sizeof(ValueType);
+        bytes_remote_written += record_size_ * sizeof(ValueType);
       }
     }
 
@@ -559,15 +728,13 @@ void DKVStoreRDMA::WriteKVRecords(const std::vector<KeyType> &key,
     for (::size_t i = 0; i < key.size(); i++) {
       // FIXME: do this asynchronously
       // Write directly, without RDMA
-      ValueType *target = value_.area_ + OffsetOf(key[i]);
-      memcpy(target, value[i], value_size_ * sizeof(ValueType));
+      ValueType *target = value_.area_ + OffsetOf(key[i], write_slot());
+      codec_.Encode(value[i], target);
 
     }
-    bytes_local_written += key.size() * value_size_ * sizeof(ValueType);
+    bytes_local_written += key.size() * record_size_ * sizeof(ValueType);
     t_write_.local.stop();
   }
-
-  t_write_.outer.stop();
 }
 
 
@@ -592,6 +759,9 @@ void DKVStoreRDMA::FlushKVRecords(const std::vector<KeyType> &key) {
  */
 void DKVStoreRDMA::PurgeKVRecords() {
   cache_buffer_.reset();
+  for (auto &r : cache_region_) {
+    r.reset();
+  }
   write_buffer_.reset();
 }
 
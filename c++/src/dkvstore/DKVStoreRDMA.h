@@ -20,6 +20,7 @@
 #include <inttypes.h>
 
 #include <vector>
+#include <unordered_map>
 #include <string>
 #include <sstream>
 #include <iostream>
@@ -162,33 +163,38 @@ class rdma_area {
   }
 
   ~rdma_area() {
-    if (area_owned_) {
-      delete[] area_;
-    } else {
-      if (rd_mrfree(&region_, res_) != 0) {
-        throw QPerfException("rd_mrfree");
+    if (! area_owned_) {
+      if (rd_mrdereg(&region_, res_) != 0) {
+        throw QPerfException("rd_mrdereg");
       }
     }
+    mcmc::huge_pages::Free(area_, n_elements_ * sizeof(ValueType));
   }
 
-  void Init(const DEVICE *device, ::size_t n_elements) {
+  // Large areas come from huge pages if the policy says so, which also saves
+  // the NIC translation entries
+  void Init(const DEVICE *device, ::size_t n_elements,
+            const std::string &name) {
     res_ = device;
     n_elements_ = n_elements;
 
     /* allocate the memory buffer that will hold the data */
     area_owned_ = (res_->ib.context == NULL);
-    if (area_owned_) {
-      area_ = new ValueType[n_elements];
-    } else {
-      if (rd_mralloc(&region_, device, n_elements * sizeof(ValueType)) != 0) {
-        throw QPerfException("rd_mralloc");
+    area_ = static_cast<ValueType *>(
+              mcmc::huge_pages::Allocate(n_elements * sizeof(ValueType),
+                                         name));
+    if (! area_owned_) {
+      memset(area_, 0, n_elements * sizeof(ValueType));
+      if (rd_mrreg(&region_, device, area_,
+                   n_elements * sizeof(ValueType)) != 0) {
+        throw QPerfException("rd_mrreg");
       }
-      area_ = reinterpret_cast<ValueType *>(region_.vaddr);
     }
   }
 
-  void Init(const DEVICE *device, Buffer<ValueType> *buffer, ::size_t n_elements) {
-    Init(device, n_elements);
+  void Init(const DEVICE *device, Buffer<ValueType> *buffer,
+            ::size_t n_elements, const std::string &name) {
+    Init(device, n_elements, name);
     buffer->Init(area_, n_elements);
   }
 
@@ -312,6 +318,8 @@ class DKVStoreRDMA : public DKVStoreInterface {
     return include_master_;
   }
 
+  virtual void SetPartition(const std::vector<int32_t> &part, ::size_t parts);
+
   template <typename T>
   std::vector<const T*>& constify(std::vector<T*>& v) {
     // Compiler doesn't know how to automatically convert
@@ -326,9 +334,27 @@ class DKVStoreRDMA : public DKVStoreInterface {
                              const std::vector<KeyType> &key,
                              RW_MODE::RWMode rw_mode);
 
+  /**
+   * Posts the RDMA reads for the remote keys but does not wait for their
+   * completion; that is done in Wait()
+   */
+  virtual Handle ReadKVRecordsAsync(::size_t region,
+                                    std::vector<ValueType *> &cache,
+                                    const std::vector<KeyType> &key,
+                                    RW_MODE::RWMode rw_mode);
+
+  virtual void Wait(Handle handle);
+
   VIRTUAL void WriteKVRecords(const std::vector<KeyType> &key,
                               const std::vector<const ValueType *> &value);
 
+  /**
+   * Posts the RDMA writes for the remote keys but does not wait for their
+   * completion; that is done in Wait()
+   */
+  virtual Handle WriteKVRecordsAsync(const std::vector<KeyType> &key,
+                                     const std::vector<const ValueType *> &value);
+
   VIRTUAL std::vector<ValueType *> GetWriteKVRecords(::size_t n);
 
   VIRTUAL void FlushKVRecords(const std::vector<KeyType> &key);
@@ -341,12 +367,35 @@ class DKVStoreRDMA : public DKVStoreInterface {
   VIRTUAL void barrier();
 
  private:
+  // A key that is not hosted locally, tagged with its remote location
+  struct RemoteKey {
+    int32_t owner;
+    uint64_t offset;
+    KeyType key;
+
+    bool operator< (const RemoteKey &other) const {
+      return owner < other.owner ||
+               (owner == other.owner && offset < other.offset);
+    }
+  };
+
   int32_t HostOf(DKVStoreRDMA::KeyType key);
 
-  uint64_t OffsetOf(DKVStoreRDMA::KeyType key);
+  // Offset of @argument key in its host's value area, in ValueTypes
+  uint64_t OffsetOf(DKVStoreRDMA::KeyType key, ::size_t slot);
 
   ::size_t PollForCookies(::size_t current, ::size_t at_least, BatchTimer &timer);
 
+  void PostReadKVRecords(Buffer<ValueType> *cache_buffer,
+                         std::vector<ValueType *> &cache,
+                         const std::vector<KeyType> &key,
+                         RW_MODE::RWMode rw_mode);
+
+  void DecodePending();
+
+  void PostWriteKVRecords(const std::vector<KeyType> &key,
+                          const std::vector<const ValueType *> &value);
+
   void post_batches(const std::vector<std::vector<PostDescriptor<ValueType> > > &post_descriptor,
                     const std::vector< ::size_t> &posts,
                     uint32_t local_key,
@@ -362,6 +411,21 @@ class DKVStoreRDMA : public DKVStoreInterface {
 
   std::vector<std::vector<PostDescriptor<ValueType> > > post_descriptor_;
   std::vector< ::size_t> posts_;
+  // Per-call state of PostReadKVRecords, lifted to class to avoid
+  // (de)allocation in each call
+  std::vector<RemoteKey> remote_key_;
+  std::unordered_map<KeyType, ValueType *> remote_cached_;
+  // Remote runs that are fetched encoded: (target, #records), decoded in
+  // place after completion
+  std::vector<std::pair<ValueType *, ::size_t> > pending_decode_;
+  // Size of a value as stored in the KV area and transferred, in ValueTypes
+  ::size_t record_size_;
+  // Size of the values of one epoch in a host's value area, in ValueTypes
+  ::size_t slot_size_;
+
+  // free slots in the send queue; posts that have not yet been polled for
+  // completion hold a cookie
+  ::size_t cookies_;
 
   bool include_master_;	// if unset, the KV area is distributed over all nodes
                         // except the master. Watch out for the case #hosts == 1
@@ -378,9 +442,15 @@ class DKVStoreRDMA : public DKVStoreInterface {
   BatchTimer t_read_;
   BatchTimer t_write_;
   Timer t_barrier_;
+  Timer t_wait_;
+  Timer t_codec_;
   ::size_t msgs_per_post_ = 0;
   ::size_t num_posts_ = 0;
 
+  int64_t keys_read_ = 0;
+  int64_t keys_duplicate_ = 0;
+  int64_t keys_coalesced_ = 0;
+
   int64_t bytes_local_read = 0;
   int64_t bytes_remote_read = 0;
   int64_t bytes_local_written = 0;
@@ -81,10 +81,14 @@ void DKVStoreRamCloud::ReadKVRecords(std::vector<ValueType *> &cache,
     }
   }
   // batch requests
+  std::vector<KeyType> slot_key(key.size());
+  for (::size_t i = 0; i < key.size(); ++i) {
+    slot_key[i] = SlotKey(key[i], read_slot());
+  }
   std::vector<RAMCloud::MultiReadObject*> reqs(key.size());
   for (::size_t i = 0; i < key.size(); ++i) {
     reqs[i] = new RAMCloud::MultiReadObject(table_id_,
-                                            &key[i], sizeof key[i],
+                                            &slot_key[i], sizeof slot_key[i],
                                             bufs[i]);
   }
   client_->multiRead(reqs.data(), key.size());
@@ -95,20 +99,20 @@ void DKVStoreRamCloud::ReadKVRecords(std::vector<ValueType *> &cache,
      * bufs[i]->copy(0, K*sizeof(ValueType), vals[i].data());
      */
     assert((*bufs[i])->getValue() != NULL);
-    if (rw_mode == RW_MODE::READ_ONLY) {
+    if (rw_mode == RW_MODE::READ_ONLY && codec_.identity()) {
       cache[i] = (ValueType *)(*bufs[i])->getValue();
     } else {
-      ValueType *cache_pointer = cache_buffer_.get(value_size_);
+      ValueType *cache_pointer = current_cache_->get(value_size_);
       cache[i] = cache_pointer;
       value_of_[key[i]] = cache_pointer;
-      memcpy(cache[i], (*bufs[i])->getValue(), value_size_ * sizeof(ValueType));
+      codec_.Decode((const ValueType *)(*bufs[i])->getValue(), cache[i]);
     }
   }
 
   for (auto e : reqs) {
     delete e;
   }
-  if (rw_mode != RW_MODE::READ_ONLY) {
+  if (rw_mode != RW_MODE::READ_ONLY || ! codec_.identity()) {
     for (auto b : bufs) {
       delete b;
     }
@@ -118,11 +122,24 @@ void DKVStoreRamCloud::ReadKVRecords(std::vector<ValueType *> &cache,
 void DKVStoreRamCloud::WriteKVRecords(const std::vector<KeyType> &key,
                                       const std::vector<const ValueType *> &value) {
   std::vector<RAMCloud::MultiWriteObject *> req(key.size());
+  std::vector<KeyType> slot_key(key.size());
+  std::vector<ValueType> encoded;
+  if (! codec_.identity()) {
+    encoded.resize(key.size() * codec_.record_size());
+  }
   for (::size_t i = 0; i < key.size(); i++) {
+    const ValueType *v = value[i];
+    if (! codec_.identity()) {
+      ValueType *e = encoded.data() + i * codec_.record_size();
+      codec_.Encode(v, e);
+      v = e;
+    }
+    slot_key[i] = SlotKey(key[i], write_slot());
     req[i] = new RAMCloud::MultiWriteObject(table_id_,
-                                            &key[i], sizeof key[i],
-                                            value[i],
-                                            value_size_ * sizeof(ValueType));
+                                            &slot_key[i], sizeof slot_key[i],
+                                            v,
+                                            codec_.record_size() *
+                                              sizeof(ValueType));
   }
   client_->multiWrite(req.data(), key.size());
 
@@ -158,6 +175,9 @@ void DKVStoreRamCloud::PurgeKVRecords() {
 
   // Clear the copied read/write buffer(s)
   cache_buffer_.reset();
+  for (auto &r : cache_region_) {
+    r.reset();
+  }
   write_buffer_.reset();
   value_of_.clear();
 }
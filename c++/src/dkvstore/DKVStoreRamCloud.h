@@ -93,6 +93,11 @@ class DKVStoreRamCloud : public DKVStoreInterface {
   virtual void PurgeKVRecords();
 
  private:
+  // The epoch slots are disjoint key ranges
+  KeyType SlotKey(KeyType key, ::size_t slot) const {
+    return key + static_cast<KeyType>(slot * total_values_);
+  }
+
   DKVStoreRamCloudOptions options_;
   RAMCloud::RamCloud *client_ = NULL;
   uint64_t table_id_;
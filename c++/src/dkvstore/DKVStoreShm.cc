@@ -0,0 +1,395 @@
+/*
+ * Copyright notice
+ */
+
+#include "dkvstore/DKVStoreShm.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <cassert>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+namespace DKV {
+namespace DKVShm {
+
+namespace {
+
+::size_t EnvironmentNumber(const char *name, const char *value) {
+  try {
+    return boost::lexical_cast< ::size_t>(value);
+  } catch (boost::bad_lexical_cast const&) {
+    throw DKVException(std::string("Cannot determine shm rank from ") + name +
+                       "=" + value);
+  }
+}
+
+}   // namespace
+
+bool RankFromEnvironment(::size_t *rank, ::size_t *ranks) {
+  static const char *const launcher[][2] = {
+    { "OMPI_COMM_WORLD_SIZE", "OMPI_COMM_WORLD_RANK" },
+    { "PMI_SIZE", "PMI_RANK" },
+    { "SLURM_NTASKS", "SLURM_PROCID" },
+  };
+  for (auto &l : launcher) {
+    const char *size = getenv(l[0]);
+    const char *my_rank = getenv(l[1]);
+    if (size != NULL && my_rank != NULL) {
+      *ranks = EnvironmentNumber(l[0], size);
+      *rank = EnvironmentNumber(l[1], my_rank);
+      return true;
+    }
+  }
+
+  // prun lists one host per rank
+  const char *hosts = getenv("PRUN_PE_HOSTS");
+  const char *my_rank = getenv("PRUN_CPU_RANK");
+  if (hosts != NULL && my_rank != NULL) {
+    std::string trimmed(hosts);
+    boost::trim(trimmed);
+    std::vector<std::string> host_list;
+    boost::split(host_list, trimmed, boost::is_any_of(" "),
+                 boost::token_compress_on);
+    *ranks = host_list.size();
+    *rank = EnvironmentNumber("PRUN_CPU_RANK", my_rank);
+    return true;
+  }
+
+  // A PMIx launcher sets no size
+  my_rank = getenv("PMIX_RANK");
+  if (my_rank != NULL) {
+    *ranks = 0;
+    *rank = EnvironmentNumber("PMIX_RANK", my_rank);
+    return true;
+  }
+
+  return false;
+}
+
+uint64_t RunIdFromEnvironment() {
+  std::string job;
+  const char *id;
+  if ((id = getenv("PMIX_NAMESPACE")) != NULL) {
+    job = id;
+  } else if ((id = getenv("OMPI_MCA_ess_base_jobid")) != NULL) {
+    job = id;
+  } else if ((id = getenv("SLURM_JOB_ID")) != NULL) {
+    job = id;
+    if ((id = getenv("SLURM_STEP_ID")) != NULL) {
+      job += std::string(".") + id;
+    }
+  } else {
+    return 0;
+  }
+  // Only 0 means no id
+  uint64_t run_id = std::hash<std::string>()(job);
+  return (run_id == 0) ? 1 : run_id;
+}
+
+
+DKVStoreShmOptions::DKVStoreShmOptions()
+  : name_("/mcmc-dkv"), ranks_(0), rank_(0), from_launcher_(false),
+    desc_("D-KV shared memory options") {
+  namespace po = boost::program_options;
+  desc_.add_options()
+    ("dkv.shm.name",
+     po::value<std::string>(&name_)->default_value("/mcmc-dkv"),
+     "Shared memory segment name")
+    ("dkv.shm.ranks",
+     po::value< ::size_t>(&ranks_)->default_value(0),
+     "Number of ranks that share the store (0: from the environment)")
+    ("dkv.shm.rank",
+     po::value< ::size_t>(&rank_)->default_value(0),
+     "My rank; only used if dkv.shm.ranks is set")
+    ;
+}
+
+void DKVStoreShmOptions::Parse(const std::vector<std::string> &args) {
+  namespace po = boost::program_options;
+  po::variables_map vm;
+  po::basic_command_line_parser<char> clp(args);
+  clp.options(desc_).allow_unregistered();
+  po::store(clp.run(), vm);
+  po::notify(vm);
+
+  if (ranks_ == 0) {
+    from_launcher_ = RankFromEnvironment(&rank_, &ranks_);
+  }
+  if (ranks_ != 0 && rank_ >= ranks_) {
+    throw DKVException("dkv.shm.rank must be < dkv.shm.ranks");
+  }
+  if (name_.size() == 0 || name_[0] != '/') {
+    name_ = "/" + name_;
+  }
+}
+
+
+DKVStoreShm::DKVStoreShm(const std::vector<std::string> &args)
+    : DKVStoreInterface(args), record_size_(0), slot_size_(0),
+      segment_bytes_(0),
+      header_(NULL), area_(NULL) {
+  options_.Parse(args);
+}
+
+DKVStoreShm::~DKVStoreShm() {
+  if (header_ != NULL) {
+    mcmc::huge_pages::Forget(area_);
+    munmap(header_, segment_bytes_);
+  }
+}
+
+void DKVStoreShm::SetRank(::size_t rank, ::size_t ranks) {
+  bool named = options_.ranks() != 0 || options_.from_launcher();
+  if (named && (options_.rank() != rank ||
+                (options_.ranks() != 0 && options_.ranks() != ranks))) {
+    std::ostringstream s;
+    s << "shm rank " << rank << " of " << ranks << " differs from the " <<
+      (options_.from_launcher() ? "launcher's " : "") << "rank " <<
+      options_.rank() << " of " << options_.ranks();
+    throw DKVException(s.str());
+  }
+  options_.set_rank(rank);
+  options_.set_ranks(ranks);
+}
+
+void DKVStoreShm::Init(::size_t value_size, ::size_t total_values,
+                       ::size_t max_cache_capacity,
+                       ::size_t max_write_capacity) {
+  ::DKV::DKVStoreInterface::Init(value_size, total_values,
+                                 max_cache_capacity, max_write_capacity);
+  record_size_ = codec_.record_size();
+
+  if (options_.ranks() == 0) {
+    if (options_.from_launcher()) {
+      throw DKVException("The launcher sets no number of ranks; set "
+                         "dkv.shm.ranks");
+    }
+    // A process on its own
+    options_.set_ranks(1);
+    options_.set_rank(0);
+  }
+
+  // Keep the values aligned at a cache line; at a page if they are NUMA
+  // placed, so the header page is not bound and each slot starts a page
+  ::size_t align = 64;
+  if (numa_policy_ != mcmc::numa::POLICY::NONE) {
+    align = sysconf(_SC_PAGESIZE);
+  }
+  ::size_t header_bytes = (sizeof(Header) + align - 1) / align * align;
+  ::size_t slot_bytes = total_values * record_size_ * sizeof(ValueType);
+  slot_bytes = (slot_bytes + align - 1) / align * align;
+  slot_size_ = slot_bytes / sizeof(ValueType);
+  segment_bytes_ = header_bytes + epochs_ * slot_bytes;
+
+  if (options_.rank() == 0) {
+    CreateSegment(segment_bytes_);
+  } else {
+    AttachSegment(segment_bytes_);
+  }
+  area_ = reinterpret_cast<ValueType *>(reinterpret_cast<char *>(header_) +
+                                        header_bytes);
+  // Each rank advises its own mapping. POSIX shared memory is not on
+  // hugetlbfs, so transparent huge pages are the most it can get.
+  (void)mcmc::huge_pages::Advise(area_, epochs_ * slot_bytes,
+                                 "D-KV shm values");
+
+  if (numa_policy_ != mcmc::numa::POLICY::NONE) {
+    placement_ = mcmc::numa::Placement(numa_policy_, mcmc::numa::Topology(),
+                                       total_values,
+                                       record_size_ * sizeof(ValueType));
+    // The policy is shared by all mappings of the segment; the values are
+    // untouched until the barrier below
+    if (options_.rank() == 0) {
+      for (::size_t slot = 0; slot < epochs_; ++slot) {
+        if (! placement_.Apply(area_ + slot * slot_size_)) {
+          std::cerr << "Warning: cannot bind the shm values to their NUMA "
+            "nodes: " << strerror(errno) << std::endl;
+          break;
+        }
+      }
+    }
+  }
+
+  std::cerr << "D-KV shm segment " << options_.name() << " " <<
+    (segment_bytes_ / 1048576.0) << "MB rank " << options_.rank() << " of " <<
+    options_.ranks() << std::endl;
+
+  barrier();
+  // Everybody has it mapped; the mapping outlives the name
+  if (options_.rank() == 0) {
+    shm_unlink(options_.name().c_str());
+  }
+}
+
+void DKVStoreShm::CreateSegment(::size_t segment_bytes) {
+  // Remove a segment that a crashed run left behind
+  shm_unlink(options_.name().c_str());
+  int fd = shm_open(options_.name().c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) {
+    throw DKVException("shm_open(" + options_.name() + "): " +
+                       strerror(errno));
+  }
+  if (ftruncate(fd, segment_bytes) != 0) {
+    close(fd);
+    throw DKVException("ftruncate shm segment: " + std::string(strerror(errno)));
+  }
+  void *addr = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw DKVException("mmap shm segment: " + std::string(strerror(errno)));
+  }
+  header_ = static_cast<Header *>(addr);
+
+  header_->run_id = run_id_;
+  header_->ranks = options_.ranks();
+  header_->area_bytes = segment_bytes;
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  if (pthread_barrier_init(&header_->barrier, &attr,
+                           static_cast<unsigned>(options_.ranks())) != 0) {
+    throw DKVException("pthread_barrier_init");
+  }
+  pthread_barrierattr_destroy(&attr);
+  // Publish: the other ranks poll for the magic
+  __atomic_store_n(&header_->magic, kMagic, __ATOMIC_RELEASE);
+}
+
+void DKVStoreShm::AttachSegment(::size_t segment_bytes) {
+  const auto timeout = std::chrono::seconds(60);
+  auto start = std::chrono::steady_clock::now();
+  while (true) {
+    if (std::chrono::steady_clock::now() - start > timeout) {
+      throw DKVException("Timeout attaching to shm segment " +
+                         options_.name());
+    }
+
+    int fd = shm_open(options_.name().c_str(), O_RDWR, 0600);
+    if (fd == -1) {
+      if (errno != ENOENT) {
+        throw DKVException("shm_open(" + options_.name() + "): " +
+                           strerror(errno));
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast< ::size_t>(st.st_size) < segment_bytes) {
+      // rank 0 has not yet sized it
+      close(fd);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    void *addr = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      throw DKVException("mmap shm segment: " + std::string(strerror(errno)));
+    }
+    Header *header = static_cast<Header *>(addr);
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != kMagic ||
+        header->run_id != run_id_) {
+      // Not yet published, or left behind by a crashed run; rank 0
+      // replaces that by ours
+      munmap(addr, segment_bytes);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    if (header->ranks != options_.ranks() ||
+        header->area_bytes != segment_bytes) {
+      munmap(addr, segment_bytes);
+      throw DKVException("shm segment " + options_.name() +
+                         " does not match my ranks/value size");
+    }
+    header_ = header;
+    break;
+  }
+}
+
+void DKVStoreShm::ReadKVRecords(std::vector<ValueType *> &cache,
+                                const std::vector<KeyType> &key,
+                                RW_MODE::RWMode rw_mode) {
+  assert(cache.size() >= key.size());
+  if (rw_mode == RW_MODE::READ_ONLY && codec_.identity()) {
+    // Zero copy
+    for (::size_t i = 0; i < key.size(); i++) {
+      cache[i] = Record(key[i], read_slot());
+    }
+    return;
+  }
+
+  ValueType *target = current_cache_->get(key.size() * value_size_);
+#pragma omp parallel for
+  for (::size_t i = 0; i < key.size(); i++) {
+    cache[i] = target + i * value_size_;
+    codec_.Decode(Record(key[i], read_slot()), cache[i]);
+  }
+  if (rw_mode != RW_MODE::READ_ONLY) {
+    for (::size_t i = 0; i < key.size(); i++) {
+      value_of_[key[i]] = cache[i];
+    }
+  }
+}
+
+void DKVStoreShm::WriteKVRecords(const std::vector<KeyType> &key,
+                                 const std::vector<const ValueType *> &value) {
+  assert(value.size() >= key.size());
+#pragma omp parallel for
+  for (::size_t i = 0; i < key.size(); ++i) {
+    codec_.Encode(value[i], Record(key[i], write_slot()));
+  }
+}
+
+std::vector<DKVStoreShm::ValueType *> DKVStoreShm::GetWriteKVRecords(::size_t n) {
+  std::vector<ValueType *> w(n);
+  for (::size_t i = 0; i < n; i++) {
+    w[i] = write_buffer_.get(value_size_);
+  }
+
+  return w;
+}
+
+void DKVStoreShm::FlushKVRecords(const std::vector<KeyType> &key) {
+  std::vector<const ValueType *> value(key.size());
+  for (::size_t i = 0; i < key.size(); i++) {
+    value[i] = value_of_[key[i]];
+  }
+  WriteKVRecords(key, value);
+  write_buffer_.reset();
+}
+
+void DKVStoreShm::PurgeKVRecords() {
+  cache_buffer_.reset();
+  for (auto &r : cache_region_) {
+    r.reset();
+  }
+  write_buffer_.reset();
+  value_of_.clear();
+}
+
+void DKVStoreShm::barrier() {
+  int r = pthread_barrier_wait(&header_->barrier);
+  if (r != 0 && r != PTHREAD_BARRIER_SERIAL_THREAD) {
+    throw DKVException("pthread_barrier_wait: " + std::string(strerror(r)));
+  }
+}
+
+} // namespace DKVShm
+} // namespace DKV
@@ -0,0 +1,147 @@
+/*
+ * Copyright notice
+ */
+
+/*
+ * Distributed Key-Value Store that offers just enough functionality to
+ * support the MCMC Stochastical applications.
+ *
+ * Shared-memory implementation for ranks that run on one host: all values
+ * live in one POSIX shared memory segment that every rank maps.
+ */
+
+#ifndef APPS_MCMC_D_KV_STORE_SHM_DKV_STORE_H__
+#define APPS_MCMC_D_KV_STORE_SHM_DKV_STORE_H__
+
+#include <pthread.h>
+
+#include "dkvstore/DKVStore.h"
+
+namespace DKV {
+namespace DKVShm {
+
+/**
+ * The rank and number of ranks that the launcher (mpirun, srun, prun, or
+ * the D-KV benchmark's forked ranks) sets in the environment. @return false
+ * if it sets no rank; @argument ranks is 0 if it sets a rank but no size.
+ */
+bool RankFromEnvironment(::size_t *rank, ::size_t *ranks);
+
+/**
+ * An id that the launcher's environment gives all ranks of one launch, from
+ * its job id; 0 if it has none. For programs that have no master to draw a
+ * run id (see DKVStoreInterface::SetRunId()).
+ */
+uint64_t RunIdFromEnvironment();
+
+class DKVStoreShmOptions : public DKVStoreOptions {
+ public:
+  DKVStoreShmOptions();
+
+  void Parse(const std::vector<std::string> &args) override;
+
+  boost::program_options::options_description* GetMutable() override {
+    return &desc_;
+  }
+
+  inline const std::string& name() const { return name_; }
+  inline ::size_t ranks() const { return ranks_; }
+  inline ::size_t rank() const { return rank_; }
+  // Whether the rank was taken from the launcher's environment
+  inline bool from_launcher() const { return from_launcher_; }
+
+  inline void set_ranks(::size_t ranks) { ranks_ = ranks; }
+  inline void set_rank(::size_t rank) { rank_ = rank; }
+
+ private:
+  std::string name_;
+  ::size_t ranks_;
+  ::size_t rank_;
+  bool from_launcher_;
+  boost::program_options::options_description desc_;
+
+  friend std::ostream& operator<<(std::ostream& out,
+                                  const DKVStoreShmOptions& opts);
+};
+
+inline std::ostream& operator<<(std::ostream& out,
+                                const DKVStoreShmOptions& opts) {
+  out << opts.desc_;
+  return out;
+}
+
+class DKVStoreShm : public DKVStoreInterface {
+
+ public:
+  typedef DKVStoreInterface::KeyType KeyType;
+  typedef DKVStoreInterface::ValueType ValueType;
+
+  DKVStoreShm(const std::vector<std::string> &args);
+
+  virtual ~DKVStoreShm();
+
+  /**
+   * My rank among the @argument ranks that share the store, as my
+   * communicator has it. The options or the launcher's environment, if they
+   * name a rank, must agree. Without this, or either of those, the store is
+   * rank 0 of 1. Call before Init().
+   */
+  void SetRank(::size_t rank, ::size_t ranks);
+
+  virtual void Init(::size_t value_size, ::size_t total_values,
+                    ::size_t max_cache_capacity, ::size_t max_write_capacity);
+
+  virtual void ReadKVRecords(std::vector<ValueType *> &cache,
+                             const std::vector<KeyType> &key,
+                             RW_MODE::RWMode rw_mode);
+
+  virtual void WriteKVRecords(const std::vector<KeyType> &key,
+                              const std::vector<const ValueType *> &value);
+
+  virtual std::vector<ValueType *> GetWriteKVRecords(::size_t n);
+
+  virtual void FlushKVRecords(const std::vector<KeyType> &key);
+
+  virtual void PurgeKVRecords();
+
+  virtual void barrier();
+
+  virtual int NumaNode(KeyType key) const {
+    return placement_.node(key);
+  }
+
+ private:
+  // Lives at the start of the segment, followed by the values
+  struct Header {
+    uint64_t magic;
+    uint64_t run_id;
+    uint64_t ranks;
+    uint64_t area_bytes;
+    pthread_barrier_t barrier;
+  };
+
+  static const uint64_t kMagic = 0x4d434d43444b5653ULL;   // "MCMCDKVS"
+
+  void CreateSegment(::size_t segment_bytes);
+  void AttachSegment(::size_t segment_bytes);
+
+  // The epoch slots are consecutive copies of the whole value area
+  ValueType *Record(KeyType key, ::size_t slot) const {
+    return area_ + slot * slot_size_ + key * record_size_;
+  }
+
+  DKVStoreShmOptions options_;
+
+  ::size_t record_size_;
+  // in ValueType; page aligned if the values are NUMA placed
+  ::size_t slot_size_;
+  ::size_t segment_bytes_;
+  mcmc::numa::Placement placement_;
+  Header *header_;
+  ValueType *area_;
+};
+
+} // namespace DKVShm
+} // namespace DKV
+
+#endif  // def APPS_MCMC_D_KV_STORE_SHM_DKV_STORE_H__
@@ -656,6 +656,46 @@ rd_mrfree(REGION *region, const DEVICE *dev)
 }
 
 
+/*
+ * Register a memory region that the caller allocated, e.g. on huge pages.
+ */
+int
+rd_mrreg(REGION *region, const DEVICE *dev, void *vaddr, size_t size)
+{
+    int flags;
+
+    flags = IBV_ACCESS_LOCAL_WRITE  |
+	IBV_ACCESS_REMOTE_READ  |
+	IBV_ACCESS_REMOTE_WRITE |
+	IBV_ACCESS_REMOTE_ATOMIC;
+    region->vaddr = vaddr;
+    region->mr = ibv_reg_mr(dev->pd, region->vaddr, size, flags);
+    if (!region->mr)
+	return error(SYS, "failed to register memory region");
+    region->key  = region->mr->rkey;
+    region->size = size;
+
+    return 0;
+}
+
+
+/*
+ * Deregister a memory region of rd_mrreg; the caller frees the memory.
+ */
+int
+rd_mrdereg(REGION *region, const DEVICE *dev)
+{
+    if (region->mr)
+        ibv_dereg_mr(region->mr);
+    region->mr = NULL;
+    region->vaddr = NULL;
+    region->size = 0;
+    region->key = 0;
+
+    return 0;
+}
+
+
 /*
  * Open an InfiniBand device.
  */
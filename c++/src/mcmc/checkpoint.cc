@@ -0,0 +1,303 @@
+#include "mcmc/checkpoint.h"
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace mcmc {
+namespace checkpoint {
+
+namespace {
+
+const uint64_t kMagic = 0x4d434d43434b5054ULL;       // "MCMCCKPT"
+const uint32_t kVersion = 1;
+
+struct Header {
+  uint64_t magic;
+  uint32_t version;
+  int32_t rank;
+  uint64_t step;
+  uint64_t bytes;
+  uint32_t crc;
+  uint32_t pad[7];
+};
+static_assert(sizeof(Header) == 64, "checkpoint header must be 64 bytes");
+
+uint32_t Crc(const std::vector<char> &data) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data.data(), data.size());
+  return crc.checksum();
+}
+
+std::string LatestPath(const std::string &dir) {
+  return dir + "/latest";
+}
+
+// Make the contents of @argument file durable, close it and rename it from
+// @argument tmp to @argument path; then make the rename durable
+void SyncRename(FILE *file, const std::string &tmp, const std::string &path,
+                const std::string &dir) {
+  bool ok = (fflush(file) == 0 && ! ferror(file) && fsync(fileno(file)) == 0);
+  int err = errno;
+  ok = (fclose(file) == 0) && ok;
+  if (! ok) {
+    std::remove(tmp.c_str());
+    throw IOException("Cannot write " + tmp + ": " + strerror(err));
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    throw IOException("Cannot rename " + tmp + ": " + strerror(errno));
+  }
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1 || fsync(fd) != 0) {
+    err = errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    throw IOException("Cannot sync directory " + dir + ": " + strerror(err));
+  }
+  close(fd);
+}
+
+}   // namespace
+
+
+Stream::Stream(const std::string &dir, ::size_t step, int rank)
+    : dir_(dir), path_(Path(dir, step, rank)), tmp_(path_ + ".tmp"),
+      step_(step), rank_(rank), file_(NULL), bytes_(0) {
+  file_ = fopen(tmp_.c_str(), "wb");
+  if (file_ == NULL) {
+    throw IOException("Cannot create checkpoint " + tmp_ + ": " +
+                      strerror(errno));
+  }
+  // The header is completed by Commit()
+  Header header;
+  memset(&header, 0, sizeof header);
+  if (fwrite(&header, sizeof header, 1, file_) != 1) {
+    fclose(file_);
+    std::remove(tmp_.c_str());
+    throw IOException("Cannot write checkpoint " + tmp_);
+  }
+}
+
+
+Stream::~Stream() {
+  if (file_ != NULL) {
+    fclose(file_);
+    std::remove(tmp_.c_str());
+  }
+}
+
+
+void Stream::PutBytes(const void *data, ::size_t size) {
+  if (fwrite(data, 1, size, file_) != size) {
+    throw IOException("Cannot write checkpoint " + tmp_ + ": " +
+                      strerror(errno));
+  }
+  crc_.process_bytes(data, size);
+  bytes_ += size;
+}
+
+
+void Stream::Commit() {
+  Header header;
+  memset(&header, 0, sizeof header);
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.rank = rank_;
+  header.step = step_;
+  header.bytes = bytes_;
+  header.crc = crc_.checksum();
+  if (fseek(file_, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof header, 1, file_) != 1) {
+    throw IOException("Cannot write checkpoint " + tmp_ + ": " +
+                      strerror(errno));
+  }
+
+  FILE *file = file_;
+  file_ = NULL;
+  SyncRename(file, tmp_, path_, dir_);
+}
+
+
+Writer::Writer(const std::string &dir, int rank)
+    : dir_(dir), rank_(rank), ok_(true) {
+}
+
+
+Writer::~Writer() {
+  Wait();
+}
+
+
+void Writer::Write(::size_t step, Image &&image) {
+  Wait();
+  image_ = std::move(image);
+  thread_ = std::thread(&Writer::WriteImage, this, step);
+}
+
+
+bool Writer::Wait() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  return ok_;
+}
+
+
+void Writer::WriteImage(::size_t step) {
+  try {
+    WriteFile(dir_, step, rank_, image_);
+    ok_ = true;
+  } catch (std::exception &e) {
+    std::cerr << "Checkpoint of step " << step << " fails: " << e.what() <<
+      std::endl;
+    ok_ = false;
+  }
+  // Release the memory of the image while the computation continues
+  image_ = Image();
+}
+
+
+ForkWriter::ForkWriter(const std::string &dir, int rank)
+    : dir_(dir), rank_(rank), child_(-1), ok_(true) {
+}
+
+
+ForkWriter::~ForkWriter() {
+  Wait();
+}
+
+
+void ForkWriter::Write(::size_t step,
+                       const std::function<void(Stream *)> &build) {
+  Wait();
+  std::cout.flush();
+  std::cerr.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw IOException("Cannot fork checkpoint writer");
+  }
+  if (pid == 0) {
+    int status = 0;
+    try {
+      Stream out(dir_, step, rank_);
+      build(&out);
+      out.Commit();
+    } catch (std::exception &e) {
+      std::cerr << "Checkpoint of step " << step << " fails: " << e.what() <<
+        std::endl;
+      status = 1;
+    } catch (...) {
+      std::cerr << "Checkpoint of step " << step << " fails" << std::endl;
+      status = 1;
+    }
+    // Do not run the caller's exit handlers or destructors
+    _exit(status);
+  }
+  child_ = pid;
+}
+
+
+bool ForkWriter::Wait() {
+  if (child_ > 0) {
+    int status;
+    if (waitpid(child_, &status, 0) != child_) {
+      ok_ = false;
+    } else {
+      ok_ = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    child_ = -1;
+  }
+
+  return ok_;
+}
+
+
+void WriteFile(const std::string &dir, ::size_t step, int rank,
+               const Image &image) {
+  Stream out(dir, step, rank);
+  out.PutBytes(image.data().data(), image.data().size());
+  out.Commit();
+}
+
+
+std::string Path(const std::string &dir, ::size_t step, int rank) {
+  std::ostringstream s;
+  s << dir << "/checkpoint." << step << "." << rank;
+  return s.str();
+}
+
+
+Image Read(const std::string &dir, ::size_t step, int rank) {
+  std::string path = Path(dir, step, rank);
+  std::ifstream in(path, std::ios::binary);
+  if (! in) {
+    throw IOException("Cannot open checkpoint " + path);
+  }
+
+  Header header;
+  in.read(reinterpret_cast<char *>(&header), sizeof header);
+  if (! in || header.magic != kMagic) {
+    throw MalformattedException("Not a checkpoint: " + path);
+  }
+  if (header.version != kVersion) {
+    throw MalformattedException("Unsupported checkpoint version in " + path);
+  }
+  if (header.rank != rank || header.step != step) {
+    throw MalformattedException("Checkpoint " + path +
+                                " has the wrong rank or step");
+  }
+
+  Image image;
+  image.data().resize(header.bytes);
+  in.read(image.data().data(), header.bytes);
+  if (! in) {
+    throw MalformattedException("Checkpoint " + path + " is truncated");
+  }
+  if (Crc(image.data()) != header.crc) {
+    throw MalformattedException("Checkpoint " + path + " has a bad CRC");
+  }
+
+  return image;
+}
+
+
+void Commit(const std::string &dir, ::size_t step) {
+  std::string path = LatestPath(dir);
+  std::string tmp = path + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (out == NULL) {
+    throw IOException("Cannot write " + tmp + ": " + strerror(errno));
+  }
+  fprintf(out, "%zu\n", step);
+  SyncRename(out, tmp, path, dir);
+}
+
+
+void Remove(const std::string &dir, ::size_t step, int rank) {
+  std::remove(Path(dir, step, rank).c_str());
+}
+
+
+::size_t Latest(const std::string &dir) {
+  std::string path = LatestPath(dir);
+  std::ifstream in(path);
+  ::size_t step;
+  if (! (in >> step)) {
+    throw IOException("No consistent checkpoint in " + dir);
+  }
+
+  return step;
+}
+
+}   // namespace checkpoint
+}   // namespace mcmc
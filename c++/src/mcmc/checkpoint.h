@@ -0,0 +1,288 @@
+#ifndef MCMC_CHECKPOINT_H__
+#define MCMC_CHECKPOINT_H__
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <boost/crc.hpp>
+
+#include "mcmc/config.h"
+#include "mcmc/exception.h"
+
+namespace mcmc {
+namespace checkpoint {
+
+/**
+ * The Put side of a checkpoint: trivially copyable values and vectors, as a
+ * flat byte sequence. @argument Sink provides PutBytes() and size().
+ */
+template <class Sink>
+class Output {
+ public:
+  template <typename T>
+  void Put(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "checkpoint values must be trivially copyable");
+    sink()->PutBytes(&value, sizeof value);
+  }
+
+  template <typename T>
+  void Put(const std::vector<T> &value) {
+    Put<uint64_t>(value.size());
+    for (auto & v : value) {
+      Put(v);
+    }
+  }
+
+  void Put(const std::string &value) {
+    Put<uint64_t>(value.size());
+    sink()->PutBytes(value.data(), value.size());
+  }
+
+  // Pad to a multiple of @argument alignment
+  void Align(::size_t alignment = 64) {
+    static const char zeros[64] = { 0 };
+    ::size_t pad = (alignment - sink()->size() % alignment) % alignment;
+    while (pad > 0) {
+      ::size_t n = std::min(pad, sizeof zeros);
+      sink()->PutBytes(zeros, n);
+      pad -= n;
+    }
+  }
+
+ private:
+  Sink *sink() {
+    return static_cast<Sink *>(this);
+  }
+};
+
+
+/**
+ * In-memory checkpoint image. Values are read back with Get() in the order
+ * they were Put().
+ *
+ * The image follows a 64-byte file header, so after Align() a large array
+ * starts at a 64-byte aligned file offset and can be mmapped in place.
+ */
+class Image : public Output<Image> {
+ public:
+  Image() : cursor_(0) {
+  }
+
+  void PutBytes(const void *data, ::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    data_.insert(data_.end(), bytes, bytes + size);
+  }
+
+  ::size_t size() const {
+    return data_.size();
+  }
+
+  template <typename T>
+  void Get(T *value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "checkpoint values must be trivially copyable");
+    GetBytes(value, sizeof *value);
+  }
+
+  template <typename T>
+  void Get(std::vector<T> *value) {
+    uint64_t size;
+    Get(&size);
+    value->resize(size);
+    for (auto & v : *value) {
+      Get(&v);
+    }
+  }
+
+  void Get(std::string *value) {
+    uint64_t size;
+    Get(&size);
+    if (size > data_.size() - cursor_) {
+      throw MalformattedException("Checkpoint image truncated");
+    }
+    value->assign(data_.data() + cursor_, size);
+    cursor_ += size;
+  }
+
+  void GetBytes(void *data, ::size_t size) {
+    if (size > data_.size() - cursor_) {
+      throw MalformattedException("Checkpoint image truncated");
+    }
+    memcpy(data, data_.data() + cursor_, size);
+    cursor_ += size;
+  }
+
+  // Skip the padding of the matching Align()
+  void SkipAlign(::size_t alignment = 64) {
+    cursor_ = (cursor_ + alignment - 1) / alignment * alignment;
+  }
+
+  std::vector<char> &data() {
+    return data_;
+  }
+
+  const std::vector<char> &data() const {
+    return data_;
+  }
+
+ private:
+  std::vector<char> data_;
+  ::size_t cursor_;
+};
+
+
+/**
+ * A checkpoint file that is written as it is built, with the file layout of
+ * an Image: nothing is kept in memory but the stdio buffer, and the CRC is
+ * computed on the fly. The file is written under a temporary name; Commit()
+ * completes the header, makes the file durable and renames it. Without
+ * Commit(), the temporary file is removed.
+ * @throw IOException
+ */
+class Stream : public Output<Stream> {
+ public:
+  Stream(const std::string &dir, ::size_t step, int rank);
+
+  ~Stream();
+
+  void PutBytes(const void *data, ::size_t size);
+
+  ::size_t size() const {
+    return bytes_;
+  }
+
+  void Commit();
+
+ private:
+  std::string dir_;
+  std::string path_;
+  std::string tmp_;
+  ::size_t step_;
+  int rank_;
+  FILE *file_;
+  boost::crc_32_type crc_;
+  ::size_t bytes_;
+};
+
+
+/**
+ * Writes the checkpoint images of one rank. A write runs in a background
+ * thread, so the caller may continue to compute; the image is first written
+ * to a temporary file that is renamed when complete, so a crash never leaves
+ * a partial checkpoint under the final name.
+ */
+class Writer {
+ public:
+  Writer(const std::string &dir, int rank);
+
+  ~Writer();
+
+  /**
+   * Start writing @argument image as the checkpoint of @argument step.
+   * Waits for the previous write to complete first.
+   */
+  void Write(::size_t step, Image &&image);
+
+  /**
+   * Wait until the last write has completed.
+   * @return whether it succeeded
+   */
+  bool Wait();
+
+ private:
+  void WriteImage(::size_t step);
+
+  std::string dir_;
+  int rank_;
+  Image image_;
+  std::thread thread_;
+  bool ok_;
+};
+
+
+/**
+ * Writes checkpoints from a forked child process. The child sees a
+ * copy-on-write snapshot of the caller's memory, so the caller continues
+ * at once, and no copy of the state is made up front: only the pages the
+ * caller modifies while the child writes are duplicated. The child streams
+ * the state to the file, so it does not copy it either.
+ *
+ * The child must not use the caller's other threads or their locks.
+ */
+class ForkWriter {
+ public:
+  ForkWriter(const std::string &dir, int rank);
+
+  ~ForkWriter();
+
+  /**
+   * Fork a child that writes the checkpoint of @argument step with
+   * @argument build. Waits for the previous child first.
+   */
+  void Write(::size_t step, const std::function<void(Stream *)> &build);
+
+  /**
+   * Wait until the last child has exited.
+   * @return whether it succeeded
+   */
+  bool Wait();
+
+ private:
+  std::string dir_;
+  int rank_;
+  int child_;
+  bool ok_;
+};
+
+
+/**
+ * Write @argument image as the checkpoint of @argument rank at
+ * @argument step, under a temporary name that is synced and renamed when
+ * complete.
+ * @throw IOException
+ */
+void WriteFile(const std::string &dir, ::size_t step, int rank,
+               const Image &image);
+
+/**
+ * @return the file name of the checkpoint of @argument rank at
+ * @argument step
+ */
+std::string Path(const std::string &dir, ::size_t step, int rank);
+
+/**
+ * Read and verify the checkpoint of @argument rank at @argument step
+ */
+Image Read(const std::string &dir, ::size_t step, int rank);
+
+/**
+ * Mark the checkpoint of @argument step as consistent: all ranks have
+ * written it.
+ */
+void Commit(const std::string &dir, ::size_t step);
+
+/**
+ * Remove the checkpoint of @argument rank at @argument step, once a later
+ * one is consistent
+ */
+void Remove(const std::string &dir, ::size_t step, int rank);
+
+/**
+ * @return the step of the latest consistent checkpoint
+ */
+::size_t Latest(const std::string &dir);
+
+}   // namespace checkpoint
+}   // namespace mcmc
+
+#endif  // ndef MCMC_CHECKPOINT_H__
@@ -0,0 +1,87 @@
+#ifndef MCMC_CHUNK_TUNER_H__
+#define MCMC_CHUNK_TUNER_H__
+
+#include <cmath>
+
+#include <algorithm>
+
+namespace mcmc {
+
+/**
+ * Chunk size for a double-buffered pipeline that fetches chunk c + 1 while
+ * it computes chunk c. With fetch time a + b * n and compute time c * n for
+ * a chunk of n items, the fetch is hidden once a + b * n <= c * n; a larger
+ * chunk only lengthens the exposed fetch of the first chunk. If fetching is
+ * the bottleneck (b >= c), the largest chunk amortizes the latency a best.
+ *
+ * The per-item times are running averages, so the chunk size follows the
+ * load of the machine.
+ */
+class ChunkTuner {
+ public:
+  ChunkTuner(::size_t min_chunk = 1, ::size_t max_chunk = 1)
+      : min_chunk_(min_chunk), max_chunk_(max_chunk), chunk_(max_chunk),
+        latency_(0.0), fetch_per_item_(-1.0), compute_per_item_(-1.0) {
+  }
+
+  void SetLatency(double seconds) {
+    latency_ = seconds;
+    Update();
+  }
+
+  void Fetched(::size_t items, double seconds) {
+    if (items > 0) {
+      Average(std::max(0.0, seconds - latency_) / items, &fetch_per_item_);
+      Update();
+    }
+  }
+
+  void Computed(::size_t items, double seconds) {
+    if (items > 0) {
+      Average(seconds / items, &compute_per_item_);
+      Update();
+    }
+  }
+
+  ::size_t chunk() const {
+    return chunk_;
+  }
+
+  double latency() const {
+    return latency_;
+  }
+
+ private:
+  static void Average(double sample, double *average) {
+    if (*average < 0.0) {
+      *average = sample;
+    } else {
+      *average = kDecay * *average + (1.0 - kDecay) * sample;
+    }
+  }
+
+  void Update() {
+    if (fetch_per_item_ < 0.0 || compute_per_item_ < 0.0 ||
+        compute_per_item_ <= fetch_per_item_) {
+      chunk_ = max_chunk_;
+    } else {
+      double n = std::ceil(latency_ / (compute_per_item_ - fetch_per_item_));
+      n = std::min(n, static_cast<double>(max_chunk_));
+      chunk_ = std::max(static_cast< ::size_t>(n),
+                        std::min(min_chunk_, max_chunk_));
+    }
+  }
+
+  static constexpr double kDecay = 0.9;
+
+  ::size_t min_chunk_;
+  ::size_t max_chunk_;
+  ::size_t chunk_;
+  double latency_;
+  double fetch_per_item_;
+  double compute_per_item_;
+};
+
+}   // namespace mcmc
+
+#endif  // ndef MCMC_CHUNK_TUNER_H__
@@ -0,0 +1,54 @@
+#include "mcmc/comm-thread.h"
+
+namespace mcmc {
+
+CommThread::CommThread(const std::function<void()> &setup)
+    : stop_(false), thread_(&CommThread::Serve, this, setup) {
+}
+
+
+CommThread::~CommThread() {
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+}
+
+
+std::future<void> CommThread::Post(const std::function<void()> &job) {
+  std::packaged_task<void()> task(job);
+  std::future<void> done = task.get_future();
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    jobs_.push_back(std::move(task));
+  }
+  cond_.notify_one();
+
+  return done;
+}
+
+
+void CommThread::Serve(const std::function<void()> &setup) {
+  if (setup) {
+    setup();
+  }
+
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      cond_.wait(lock, [this]() { return stop_ || ! jobs_.empty(); });
+      // Run what was posted before stopping
+      if (jobs_.empty()) {
+        break;
+      }
+      task = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    task();
+  }
+}
+
+}   // namespace mcmc
@@ -0,0 +1,52 @@
+#ifndef MCMC_COMM_THREAD_H__
+#define MCMC_COMM_THREAD_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "mcmc/config.h"
+
+namespace mcmc {
+
+/**
+ * A thread that runs communication jobs in the order they are posted, so
+ * the caller and its OpenMP team can compute while a job communicates.
+ *
+ * MPI must be initialized with MPI_THREAD_MULTIPLE, and a job's collectives
+ * must use a communicator of their own: the caller may be inside a
+ * collective on MPI_COMM_WORLD at the same time.
+ */
+class CommThread {
+ public:
+  /**
+   * @argument setup runs first in the new thread
+   */
+  explicit CommThread(const std::function<void()> &setup =
+                        std::function<void()>());
+
+  ~CommThread();
+
+  /**
+   * Queue @argument job.
+   * @return a future that is ready when the job has run; its get()
+   * rethrows what the job threw
+   */
+  std::future<void> Post(const std::function<void()> &job);
+
+ private:
+  void Serve(const std::function<void()> &setup);
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::deque<std::packaged_task<void()> > jobs_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}   // namespace mcmc
+
+#endif  // ndef MCMC_COMM_THREAD_H__
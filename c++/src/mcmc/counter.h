@@ -1,6 +1,7 @@
 #ifndef MCMC_COUNTER_H__
 #define MCMC_COUNTER_H__
 
+#include <iomanip>
 #include <iostream>
 #include <string>
 
@@ -44,7 +45,7 @@ class Counter {
   std::string name_;
 };
 
-std::ostream &operator<<(std::ostream &s, const Counter &counter) {
+inline std::ostream &operator<<(std::ostream &s, const Counter &counter) {
   return counter.put(s);
 }
 
@@ -15,8 +15,12 @@
 #include "mcmc/config.h"
 
 #ifdef MCMC_ENABLE_DISTRIBUTED
+#ifdef MCMC_MPI_THREADS
+#include "mcmc/mpi-threads.h"
+#else
 #include <mpi.h>
 #endif
+#endif
 
 #include <unistd.h>
 
@@ -0,0 +1,291 @@
+#include "mcmc/huge-pages.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <vector>
+
+namespace mcmc {
+namespace huge_pages {
+
+namespace {
+
+const ::size_t kHugePage = 2 * 1024 * 1024;
+
+struct Area {
+  std::string name;
+  ::size_t bytes;
+  ::size_t mapped;
+  BACKING backing;
+};
+
+POLICY policy_ = POLICY::NONE;
+std::mutex lock_;
+std::map<void *, Area> areas_;
+
+::size_t round_up(::size_t bytes, ::size_t unit) {
+  return (bytes + unit - 1) / unit * unit;
+}
+
+// Does the kernel hand out transparent huge pages for madvised areas
+// (sysfs @argument file says so), at least on paper
+bool thp_allowed(const std::string &file) {
+  std::ifstream in("/sys/kernel/mm/transparent_hugepage/" + file);
+  std::string setting;
+  if (! std::getline(in, setting)) {
+    return false;
+  }
+  return setting.find("[never]") == std::string::npos &&
+         setting.find("[deny]") == std::string::npos;
+}
+
+// 2^shift byte hugetlb pages; fails unless the admin reserved them
+void *map_hugetlb(::size_t bytes, int shift, Area *area) {
+  area->mapped = round_up(bytes, static_cast< ::size_t>(1) << shift);
+  void *p = mmap(NULL, area->mapped, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                   (shift << MAP_HUGE_SHIFT),
+                 -1, 0);
+  area->backing = (shift == 30) ? BACKING::HUGETLB_1G : BACKING::HUGETLB_2M;
+  return p;
+}
+
+// Aligned at a huge page, so the kernel can back all of it with them
+void *map_thp(::size_t bytes, Area *area) {
+  area->mapped = round_up(bytes, kHugePage);
+  void *p = mmap(NULL, area->mapped + kHugePage, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return p;
+  }
+  char *start = static_cast<char *>(p);
+  char *aligned = reinterpret_cast<char *>(
+                    round_up(reinterpret_cast<uintptr_t>(start), kHugePage));
+  if (aligned > start) {
+    munmap(start, aligned - start);
+  }
+  munmap(aligned + area->mapped, start + kHugePage - aligned);
+
+  if (madvise(aligned, area->mapped, MADV_HUGEPAGE) == 0 &&
+      thp_allowed("enabled")) {
+    area->backing = BACKING::THP;
+  } else {
+    area->backing = BACKING::PAGES;
+  }
+  return aligned;
+}
+
+// A mapping of /proc/self/smaps and its bytes on huge pages of any kind
+struct Mapping {
+  uintptr_t begin;
+  uintptr_t end;
+  ::size_t huge;
+};
+
+std::vector<Mapping> read_smaps() {
+  std::vector<Mapping> mappings;
+  std::ifstream in("/proc/self/smaps");
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    fields >> key;
+    if (key.empty()) {
+      continue;
+    }
+    if (key.back() != ':') {
+      // a mapping header: begin-end perms offset dev inode path
+      auto dash = key.find('-');
+      if (dash == std::string::npos) {
+        continue;
+      }
+      Mapping m;
+      m.begin = std::stoull(key.substr(0, dash), NULL, 16);
+      m.end = std::stoull(key.substr(dash + 1), NULL, 16);
+      m.huge = 0;
+      mappings.push_back(m);
+    } else if (! mappings.empty() &&
+               (key == "AnonHugePages:" || key == "ShmemPmdMapped:" ||
+                key == "FilePmdMapped:" || key == "Private_Hugetlb:" ||
+                key == "Shared_Hugetlb:")) {
+      ::size_t kb;
+      if (fields >> kb) {
+        mappings.back().huge += kb * 1024;
+      }
+    }
+  }
+  return mappings;
+}
+
+// The bytes of [@argument p, p + @argument bytes) on huge pages. smaps only
+// counts per mapping, so a mapping that reaches outside the area counts for
+// at most its overlap.
+::size_t huge_bytes(const std::vector<Mapping> &mappings, void *p,
+                    ::size_t bytes) {
+  uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+  uintptr_t end = begin + bytes;
+  ::size_t huge = 0;
+  for (auto &m : mappings) {
+    if (m.end <= begin || m.begin >= end) {
+      continue;
+    }
+    ::size_t overlap = std::min(m.end, end) - std::max(m.begin, begin);
+    huge += std::min(m.huge, overlap);
+  }
+  return huge;
+}
+
+}   // namespace
+
+
+std::ostream& operator<< (std::ostream& s, const BACKING& backing) {
+  switch (backing) {
+    case BACKING::PAGES:
+      s << "base pages";
+      break;
+    case BACKING::THP:
+      s << "transparent huge pages";
+      break;
+    case BACKING::HUGETLB_2M:
+      s << "2MB hugetlb pages";
+      break;
+    case BACKING::HUGETLB_1G:
+      s << "1GB hugetlb pages";
+      break;
+  }
+
+  return s;
+}
+
+
+void SetPolicy(POLICY policy) {
+  policy_ = policy;
+}
+
+
+POLICY Policy() {
+  return policy_;
+}
+
+
+void *Allocate(::size_t bytes, const std::string &name) {
+  if (policy_ == POLICY::NONE || bytes < kMinBytes) {
+    return ::operator new(bytes);
+  }
+
+  Area area;
+  area.name = name;
+  area.bytes = bytes;
+  void *p = MAP_FAILED;
+  if (policy_ == POLICY::HUGETLB_1G) {
+    p = map_hugetlb(bytes, 30, &area);
+  }
+  if (p == MAP_FAILED &&
+      (policy_ == POLICY::HUGETLB_1G || policy_ == POLICY::HUGETLB_2M)) {
+    p = map_hugetlb(bytes, 21, &area);
+  }
+  if (p == MAP_FAILED) {
+    p = map_thp(bytes, &area);
+  }
+  if (p == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+
+  std::lock_guard<std::mutex> guard(lock_);
+  areas_[p] = area;
+
+  return p;
+}
+
+
+void Free(void *p, ::size_t bytes) {
+  if (p == NULL) {
+    return;
+  }
+  if (bytes >= kMinBytes) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto a = areas_.find(p);
+    if (a != areas_.end()) {
+      // An area of Advise() is not mine to unmap
+      ::size_t mapped = a->second.mapped;
+      areas_.erase(a);
+      if (mapped > 0) {
+        munmap(p, mapped);
+        return;
+      }
+    }
+  }
+  ::operator delete(p);
+}
+
+
+BACKING Advise(void *p, ::size_t bytes, const std::string &name) {
+  if (policy_ == POLICY::NONE) {
+    return BACKING::PAGES;
+  }
+
+  // Only the whole huge pages inside the area can be backed
+  char *start = static_cast<char *>(p);
+  char *begin = reinterpret_cast<char *>(
+                  round_up(reinterpret_cast<uintptr_t>(start), kHugePage));
+  Area area;
+  area.name = name;
+  area.bytes = bytes;
+  area.mapped = 0;
+  area.backing = BACKING::PAGES;
+  ::size_t huge = (begin + kHugePage <= start + bytes)
+                    ? (start + bytes - begin) / kHugePage * kHugePage
+                    : 0;
+  if (huge > 0 && madvise(begin, huge, MADV_HUGEPAGE) == 0 &&
+      thp_allowed("shmem_enabled")) {
+    area.backing = BACKING::THP;
+  }
+
+  std::lock_guard<std::mutex> guard(lock_);
+  areas_[p] = area;
+
+  return area.backing;
+}
+
+
+void Forget(void *p) {
+  std::lock_guard<std::mutex> guard(lock_);
+  areas_.erase(p);
+}
+
+
+std::ostream& Report(std::ostream& s) {
+  std::vector<Mapping> mappings = read_smaps();
+  std::lock_guard<std::mutex> guard(lock_);
+  // name -> backing -> bytes, and the bytes of those on huge pages
+  std::map<std::string, std::map<int, std::pair< ::size_t, ::size_t> > > total;
+  for (auto &a : areas_) {
+    auto &t = total[a.second.name][static_cast<int>(a.second.backing)];
+    t.first += a.second.bytes;
+    t.second += huge_bytes(mappings, a.first, a.second.bytes);
+  }
+
+  s << "Huge pages " << policy_ << ":";
+  if (total.empty()) {
+    s << " no areas of " << (kMinBytes >> 20) << "MB or more";
+  }
+  for (auto &t : total) {
+    for (auto &b : t.second) {
+      s << std::endl << "  " << t.first << " " <<
+        (b.second.first / 1048576.0) << "MB on " <<
+        static_cast<BACKING>(b.first) << ", " <<
+        (b.second.second / 1048576.0) << "MB on huge pages";
+    }
+  }
+  s << std::endl;
+
+  return s;
+}
+
+}   // namespace huge_pages
+}   // namespace mcmc
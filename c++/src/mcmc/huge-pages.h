@@ -0,0 +1,166 @@
+#ifndef MCMC_HUGE_PAGES_H__
+#define MCMC_HUGE_PAGES_H__
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "mcmc/config.h"
+
+namespace mcmc {
+namespace huge_pages {
+
+enum class POLICY {
+  NONE,           // plain heap allocations
+  THP,            // madvise(MADV_HUGEPAGE): transparent huge pages
+  HUGETLB_2M,     // 2MB hugetlb pages, else THP
+  HUGETLB_1G,     // 1GB hugetlb pages, else 2MB, else THP
+};
+
+
+inline std::istream& operator>> (std::istream& in, POLICY& policy) {
+  namespace po = boost::program_options;
+
+  std::string token;
+  in >> token;
+
+  if (false) {
+  } else if (token == "none") {
+    policy = POLICY::NONE;
+  } else if (token == "thp") {
+    policy = POLICY::THP;
+  } else if (token == "2m") {
+    policy = POLICY::HUGETLB_2M;
+  } else if (token == "1g") {
+    policy = POLICY::HUGETLB_1G;
+  } else {
+    throw po::validation_error(po::validation_error::invalid_option_value,
+                               "Unknown huge page policy");
+  }
+
+  return in;
+}
+
+
+inline std::ostream& operator<< (std::ostream& s, const POLICY& policy) {
+  switch (policy) {
+    case POLICY::NONE:
+      s << "none";
+      break;
+    case POLICY::THP:
+      s << "thp";
+      break;
+    case POLICY::HUGETLB_2M:
+      s << "2m";
+      break;
+    case POLICY::HUGETLB_1G:
+      s << "1g";
+      break;
+  }
+
+  return s;
+}
+
+
+// The backing that an area obtained
+enum class BACKING {
+  PAGES,          // base pages
+  THP,            // advised for transparent huge pages
+  HUGETLB_2M,
+  HUGETLB_1G,
+};
+
+std::ostream& operator<< (std::ostream& s, const BACKING& backing);
+
+
+// Areas below this size are plain heap allocations under any policy
+const ::size_t kMinBytes = 2 * 1024 * 1024;
+
+/**
+ * The policy for the areas allocated from here on. Set it from the options
+ * before the large arrays are allocated.
+ */
+void SetPolicy(POLICY policy);
+POLICY Policy();
+
+/**
+ * Allocate @argument bytes as the policy asks: hugetlb pages of the policy's
+ * size, else transparent huge pages, else base pages. Each fallback is
+ * silent; Report() tells what @argument name obtained. The memory is not
+ * initialized.
+ */
+void *Allocate(::size_t bytes, const std::string &name);
+
+/**
+ * Free an area from Allocate() of @argument bytes
+ */
+void Free(void *p, ::size_t bytes);
+
+/**
+ * Ask for transparent huge pages on a mapping made elsewhere, e.g. a shared
+ * memory segment, if the policy is not NONE. Shared memory only gets them if
+ * the kernel's shmem_enabled allows.
+ */
+BACKING Advise(void *p, ::size_t bytes, const std::string &name);
+
+/**
+ * Drop an area of Advise() from the report, before it is unmapped
+ */
+void Forget(void *p);
+
+/**
+ * Per name, the live areas, the backing they asked for, and how much of them
+ * the kernel actually backs with huge pages now, from /proc/self/smaps
+ */
+std::ostream& Report(std::ostream& s);
+
+
+/**
+ * For std::vectors that may grow large, like the graph adjacency
+ */
+template <typename T>
+class Allocator {
+ public:
+  typedef T value_type;
+
+  Allocator(const char *name = "vector") : name_(name) {
+  }
+
+  template <typename U>
+  Allocator(const Allocator<U> &other) : name_(other.name()) {
+  }
+
+  T *allocate(::size_t n) {
+    return static_cast<T *>(Allocate(n * sizeof(T), name_));
+  }
+
+  void deallocate(T *p, ::size_t n) {
+    Free(p, n * sizeof(T));
+  }
+
+  const char *name() const {
+    return name_;
+  }
+
+ private:
+  const char *name_;
+};
+
+// The areas are freed by size, not by name, so all allocators are equal
+template <typename T, typename U>
+bool operator==(const Allocator<T> &, const Allocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const Allocator<T> &, const Allocator<U> &) {
+  return false;
+}
+
+}   // namespace huge_pages
+}   // namespace mcmc
+
+#endif  // ndef MCMC_HUGE_PAGES_H__
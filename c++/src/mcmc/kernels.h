@@ -0,0 +1,243 @@
+#ifndef MCMC_KERNELS_H__
+#define MCMC_KERNELS_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "mcmc/config.h"
+
+namespace mcmc {
+namespace kernels {
+
+/**
+ * The per-edge loops over the K communities of the samplers.
+ *
+ * Each is a template on FIXED_K: a nonzero FIXED_K is K at compile time, so
+ * the loops have a constant trip count; FIXED_K == 0 takes K at run time.
+ * The element-wise loops vectorize either way. The sums over k do not: the
+ * compiler may not reorder floating-point additions. With a FIXED_K that
+ * is a multiple of kLanes, Sum() keeps kLanes partial sums, which the
+ * compiler maps onto vector registers; so those kernels round differently
+ * from the run-time K kernels, within a few ulps per term.
+ *
+ * The per-k terms are recomputed instead of kept in a scratch vector, so no
+ * loop allocates. ForK() picks the instantiation for a K.
+ */
+
+const ::size_t kLanes = 16;
+
+template < ::size_t FIXED_K>
+inline ::size_t Communities(::size_t K) {
+  return (FIXED_K == 0) ? K : FIXED_K;
+}
+
+/**
+ * The sum of @argument term(k) over the K communities
+ */
+template < ::size_t FIXED_K, typename Term>
+inline Float Sum(::size_t K, const Term &term) {
+  const ::size_t k_max = Communities<FIXED_K>(K);
+  if (FIXED_K == 0 || FIXED_K % kLanes != 0) {
+    Float s = FLOAT(0.0);
+    for (::size_t k = 0; k < k_max; k++) {
+      s += term(k);
+    }
+    return s;
+  }
+
+  Float lane[kLanes] = { FLOAT(0.0) };
+  for (::size_t k = 0; k < k_max; k += kLanes) {
+    for (::size_t l = 0; l < kLanes; l++) {
+      lane[l] += term(k + l);
+    }
+  }
+  for (::size_t width = kLanes / 2; width > 0; width /= 2) {
+    for (::size_t l = 0; l < width; l++) {
+      lane[l] += lane[l + width];
+    }
+  }
+  return lane[0];
+}
+
+
+/**
+ * p(y_ab | pi_a, pi_b, beta), summed over (z_ab, z_ba) in O(K)
+ */
+template < ::size_t FIXED_K>
+Float EdgeLikelihood(::size_t K, const Float *pi_a, const Float *pi_b, bool y,
+                     const Float *beta, Float epsilon) {
+  Float s;
+  if (y) {
+    s = Sum<FIXED_K>(K, [=](::size_t k) {
+      return pi_a[k] * pi_b[k] * beta[k];
+    });
+  } else {
+    s = Sum<FIXED_K>(K, [=](::size_t k) {
+      return pi_a[k] * pi_b[k] * (FLOAT(1.0) - beta[k]);
+    });
+    Float sum = Sum<FIXED_K>(K, [=](::size_t k) {
+      return pi_a[k] * pi_b[k];
+    });
+    s += (FLOAT(1.0) - sum) * (FLOAT(1.0) - epsilon);
+  }
+
+  if (s < FLOAT(1.0e-30)) {
+    s = FLOAT(1.0e-30);
+  }
+
+  return s;
+}
+
+
+/**
+ * Add the phi gradient of node a for its edge (@argument y) with neighbor b
+ * to @argument grads; phi_a is a dense row with sum @argument phi_a_sum
+ */
+template < ::size_t FIXED_K>
+void PhiGrads(::size_t K, const Float *pi_a, const Float *phi_a,
+              Float phi_a_sum, const Float *pi_b, int y, const Float *beta,
+              Float epsilon, Float *grads) {
+  const ::size_t k_max = Communities<FIXED_K>(K);
+  Float e = (y == 1) ? epsilon : (FLOAT(1.0) - epsilon);
+  Float prob_sum = Sum<FIXED_K>(K, [=](::size_t k) {
+    Float f = (y == 1) ? (beta[k] - epsilon) : (epsilon - beta[k]);
+    return pi_a[k] * (pi_b[k] * f + e);
+  });
+  for (::size_t k = 0; k < k_max; k++) {
+    Float f = (y == 1) ? (beta[k] - epsilon) : (epsilon - beta[k]);
+    Float prob = pi_a[k] * (pi_b[k] * f + e);
+    grads[k] += (prob / prob_sum) / phi_a[k] - FLOAT(1.0) / phi_a_sum;
+  }
+}
+
+
+/**
+ * As PhiGrads, for a compact row of K + 1: phi_a[k] = pi_a[k] * pi_a[K]
+ */
+template < ::size_t FIXED_K>
+void PhiGradsCompact(::size_t K, const Float *pi_a, const Float *pi_b, int y,
+                     const Float *beta, Float epsilon, Float *grads) {
+  const ::size_t k_max = Communities<FIXED_K>(K);
+  const Float phi_a_sum = pi_a[k_max];
+  Float e = (y == 1) ? epsilon : (FLOAT(1.0) - epsilon);
+  Float prob_sum = Sum<FIXED_K>(K, [=](::size_t k) {
+    Float f = (y == 1) ? (beta[k] - epsilon) : (epsilon - beta[k]);
+    return pi_a[k] * (pi_b[k] * f + e);
+  });
+  for (::size_t k = 0; k < k_max; k++) {
+    Float f = (y == 1) ? (beta[k] - epsilon) : (epsilon - beta[k]);
+    Float prob = pi_a[k] * (pi_b[k] * f + e);
+    grads[k] += ((prob / prob_sum) / pi_a[k] - FLOAT(1.0)) / phi_a_sum;
+  }
+}
+
+
+/**
+ * Add the theta gradient of edge (i, j) to @argument grads_0 and @argument
+ * grads_1. @argument term_0 and @argument term_1 are, for this y,
+ * (1 - y) / theta[k][0] - 1 / theta_sum[k] and y / theta[k][1] -
+ * 1 / theta_sum[k].
+ */
+template < ::size_t FIXED_K>
+void BetaGrads(::size_t K, const Float *pi_i, const Float *pi_j, int y,
+               const Float *beta, Float epsilon, const Float *term_0,
+               const Float *term_1, Float *grads_0, Float *grads_1) {
+  const ::size_t k_max = Communities<FIXED_K>(K);
+  Float pi_sum = Sum<FIXED_K>(K, [=](::size_t k) {
+    return pi_i[k] * pi_j[k];
+  });
+  Float probs_sum = Sum<FIXED_K>(K, [=](::size_t k) {
+    Float f = pi_i[k] * pi_j[k];
+    return (y == 1) ? beta[k] * f : (FLOAT(1.0) - beta[k]) * f;
+  });
+
+  Float prob_0 = ((y == 1) ? epsilon : (FLOAT(1.0) - epsilon)) *
+                   (FLOAT(1.0) - pi_sum);
+  Float prob_sum = probs_sum + prob_0;
+  for (::size_t k = 0; k < k_max; k++) {
+    Float f = pi_i[k] * pi_j[k];
+    Float prob = (y == 1) ? beta[k] * f : (FLOAT(1.0) - beta[k]) * f;
+    Float w = prob / prob_sum;
+    grads_0[k] += w * term_0[k];
+    grads_1[k] += w * term_1[k];
+  }
+}
+
+
+/**
+ * The term_0 and term_1 of BetaGrads for y = 0 and y = 1, from K x 2
+ * @argument theta: term_0 for y is at term + 2 * y * K, term_1 at
+ * term + (2 * y + 1) * K
+ */
+inline void BetaTerms(const std::vector<std::vector<Float> > &theta,
+                      Float *term) {
+  const ::size_t K = theta.size();
+  for (::size_t k = 0; k < K; k++) {
+    Float one_over_theta_sum = FLOAT(1.0) / (theta[k][0] + theta[k][1]);
+    for (int y = 0; y < 2; y++) {
+      term[2 * y * K + k] = (FLOAT(1.0) - y) / theta[k][0] -
+                              one_over_theta_sum;
+      term[(2 * y + 1) * K + k] = y / theta[k][1] - one_over_theta_sum;
+    }
+  }
+}
+
+
+/**
+ * The kernels for one K
+ */
+struct Table {
+  ::size_t fixed_k;   // 0 for the run-time K kernels
+  Float (*edge_likelihood)(::size_t K, const Float *pi_a, const Float *pi_b,
+                           bool y, const Float *beta, Float epsilon);
+  void (*phi_grads)(::size_t K, const Float *pi_a, const Float *phi_a,
+                    Float phi_a_sum, const Float *pi_b, int y,
+                    const Float *beta, Float epsilon, Float *grads);
+  void (*phi_grads_compact)(::size_t K, const Float *pi_a, const Float *pi_b,
+                            int y, const Float *beta, Float epsilon,
+                            Float *grads);
+  void (*beta_grads)(::size_t K, const Float *pi_i, const Float *pi_j, int y,
+                     const Float *beta, Float epsilon, const Float *term_0,
+                     const Float *term_1, Float *grads_0, Float *grads_1);
+};
+
+template < ::size_t FIXED_K>
+const Table &TableFor() {
+  static const Table table = {
+    FIXED_K,
+    &EdgeLikelihood<FIXED_K>,
+    &PhiGrads<FIXED_K>,
+    &PhiGradsCompact<FIXED_K>,
+    &BetaGrads<FIXED_K>,
+  };
+  return table;
+}
+
+/**
+ * The kernels specialized for @argument K if it is one of the K values we
+ * run in production, else the run-time K kernels
+ */
+inline const Table &ForK(::size_t K) {
+  switch (K) {
+  case 32:
+    return TableFor<32>();
+  case 64:
+    return TableFor<64>();
+  case 128:
+    return TableFor<128>();
+  case 256:
+    return TableFor<256>();
+  case 512:
+    return TableFor<512>();
+  case 1024:
+    return TableFor<1024>();
+  default:
+    return TableFor<0>();
+  }
+}
+
+}   // namespace kernels
+}   // namespace mcmc
+
+#endif  // ndef MCMC_KERNELS_H__
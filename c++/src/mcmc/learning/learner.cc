@@ -5,7 +5,9 @@
 namespace mcmc {
 namespace learning {
 
-Learner::Learner(const Options &args) : args_(args), ppxs_heldout_cb_(10) {
+Learner::Learner(const Options &args)
+    : args_(args), pi(huge_pages::Allocator<Float>("pi")),
+      ppxs_heldout_cb_(10) {
   std::cerr << "Floating point precision: " << (sizeof(Float) * CHAR_BIT) <<
     "bit" << std::endl;
 
@@ -32,6 +34,7 @@ Learner::Learner(const Options &args) : args_(args), ppxs_heldout_cb_(10) {
   // parameters related to control model
   K = args_.K;
   epsilon = args_.epsilon;
+  kernels_ = &kernels::ForK(K);
 
   // check the number of iterations.
   step_count = 1;
@@ -46,6 +49,10 @@ Learner::Learner(const Options &args) : args_(args), ppxs_heldout_cb_(10) {
 
 void Learner::InitRandom(::size_t world_rank) {
   std::cerr << "Create per-thread randoms" << std::endl;
+  // May be called again to reseed
+  for (auto r : rng_) {
+    delete r;
+  }
   rng_.resize(omp_get_max_threads());
   int seed;
   seed = args_.random_seed;
@@ -65,7 +72,7 @@ void Learner::Init(bool allocate_pi) {
   // model parameters to learn
   beta = std::vector<Float>(K, FLOAT(0.0));
   if (allocate_pi) {
-    pi = std::vector<std::vector<Float> >(N, std::vector<Float>(K, FLOAT(0.0)));
+    pi.assign(N * K, FLOAT(0.0));
   }
 
   // parameters related to sampling
@@ -117,6 +124,9 @@ void Learner::info(std::ostream &s) {
   s << std::endl;
   s << "sampling strategy " << strategy << std::endl;
   s << "omp max threads " << omp_get_max_threads() << std::endl;
+  if (kernels_->fixed_k != 0) {
+    s << "kernels specialized for K " << kernels_->fixed_k << std::endl;
+  }
 }
 
 void Learner::set_max_iteration(::size_t max_iteration) {
@@ -145,8 +155,7 @@ Float Learner::cal_perplexity(const EdgeMap &data) {
   for (EdgeMap::const_iterator edge = data.begin(); edge != data.end();
        edge++) {
     const Edge &e = edge->first;
-    Float edge_likelihood =
-        cal_edge_likelihood(pi[e.first], pi[e.second], edge->second, beta);
+    Float edge_likelihood = pair_likelihood(e.first, e.second, edge->second);
     if (std::isnan(edge_likelihood)) {
       std::cerr << "edge_likelihood is NaN; potential bug" << std::endl;
     }
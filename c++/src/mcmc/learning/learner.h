@@ -8,6 +8,8 @@
 #include "mcmc/config.h"
 
 #include "mcmc/types.h"
+#include "mcmc/kernels.h"
+#include "mcmc/huge-pages.h"
 #include "mcmc/options.h"
 #include "mcmc/network.h"
 #include "mcmc/preprocess/data_factory.h"
@@ -75,6 +77,18 @@ class Learner {
    */
   Float cal_perplexity(const EdgeMap &data);
 
+  // The K values of pi for node @argument i; a learner that does not keep
+  // pi in memory overrides this
+  virtual const Float *pi_row(Vertex i) const {
+    return &pi[i * K];
+  }
+
+  // The likelihood of edge (@argument a, @argument b); a learner that does
+  // not keep pi as dense rows overrides this
+  virtual Float pair_likelihood(Vertex a, Vertex b, bool y) const {
+    return cal_edge_likelihood(pi_row(a), pi_row(b), y, beta);
+  }
+
   template <typename T>
   static void dump(const std::vector<T> &a, ::size_t n,
                    const std::string &name = "") {
@@ -100,42 +114,8 @@ class Learner {
   template <typename T>
   Float cal_edge_likelihood(const T &pi_a, const T &pi_b, bool y,
                              const std::vector<Float> &beta) const {
-    Float s = FLOAT(0.0);
-#define DONT_FOLD_Y
-#ifdef DONT_FOLD_Y
-    if (y) {
-      for (::size_t k = 0; k < K; k++) {
-        s += pi_a[k] * pi_b[k] * beta[k];
-      }
-    } else {
-      Float sum = FLOAT(0.0);
-      for (::size_t k = 0; k < K; k++) {
-        Float f = pi_a[k] * pi_b[k];
-        s += f * (FLOAT(1.0) - beta[k]);
-        sum += f;
-      }
-      s += (FLOAT(1.0) - sum) * (FLOAT(1.0) - epsilon);
-    }
-#else   // def DONT_FOLD_Y
-    int iy = y ? 1 : 0;
-    int y2_1 = 2 * iy - 1;
-    int y_1 = iy - 1;
-    Float sum = FLOAT(0.0);
-    for (::size_t k = 0; k < K; k++) {
-      Float f = pi_a[k] * pi_b[k];
-      sum += f;
-      s += f * (beta[k] * y2_1 - y_1);
-    }
-    if (!y) {
-      s += (FLOAT(1.0) - sum) * (FLOAT(1.0) - epsilon);
-    }
-#endif  // def DONT_FOLD_Y
-
-    if (s < FLOAT(1.0e-30)) {
-      s = FLOAT(1.0e-30);
-    }
-
-    return s;
+    return kernels_->edge_likelihood(K, &pi_a[0], &pi_b[0], y, beta.data(),
+                                     epsilon);
   }
 
   const Options args_;
@@ -147,8 +127,12 @@ class Learner {
   Float epsilon;
   ::size_t N;
 
+  // the per-edge K loops, specialized for K if it is a common value
+  const kernels::Table *kernels_;
+
   std::vector<Float> beta;
-  std::vector<std::vector<Float> > pi;
+  // N x K, one row after the other, so --mcmc.huge-pages can back it
+  std::vector<Float, huge_pages::Allocator<Float> > pi;
 
   ::size_t mini_batch_size;
   Float link_ratio;
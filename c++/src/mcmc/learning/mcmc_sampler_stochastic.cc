@@ -1,13 +1,20 @@
 #include "mcmc/learning/mcmc_sampler_stochastic.h"
 
+#include <sys/resource.h>
+
 #include <cmath>
 #include <algorithm>  // min, max
+#include <numeric>
+#include <string>
+
+#include "mcmc/exception.h"
+#include "mcmc/huge-pages.h"
 
 namespace mcmc {
 namespace learning {
 
 MCMCSamplerStochastic::MCMCSamplerStochastic(const Options &args)
-    : Learner(args) {
+    : Learner(args), phi(huge_pages::Allocator<Float>("phi")) {
   // step size parameters.
   this->a = args_.a;
   this->b = args_.b;
@@ -27,7 +34,15 @@ MCMCSamplerStochastic::MCMCSamplerStochastic(const Options &args)
 }
 
 void MCMCSamplerStochastic::init() {
-  LoadNetwork();
+  if (args_.out_of_core != "") {
+    // A forked snapshot of a shared file mapping is not consistent
+    if (args_.checkpoint_interval > 0) {
+      throw MCMCException("--mcmc.out-of-core does not support "
+                          "--mcmc.checkpoint-interval");
+    }
+  }
+  huge_pages::SetPolicy(args_.huge_pages);
+  LoadNetwork(0, allocate_pi());
 
   // control parameters for learning
   // num_node_sample = static_cast<
@@ -63,22 +78,96 @@ void MCMCSamplerStochastic::init() {
                  np::SelectColumn<Float>(1));
 
   // parameterization for \pi
-  phi = rng_[0]->gamma(1, 1, N, K);
+  init_phi_pi();
+
+  if (args_.huge_pages != huge_pages::POLICY::NONE) {
+    huge_pages::Report(std::cerr);
+  }
+
+  if (args_.restart && args_.warm_start) {
+    throw MCMCException("--mcmc.restart and --mcmc.warm-start are mutually "
+                        "exclusive");
+  }
+  if (args_.restart || args_.warm_start) {
+    restore_checkpoint(args_.warm_start);
+  }
+  if (args_.checkpoint_interval > 0) {
+    snapshot_writer_ = std::unique_ptr<checkpoint::ForkWriter>(
+                          new checkpoint::ForkWriter(args_.checkpoint_dir, 0));
+  }
+
+  std::cerr << "Done " << __func__ << "()" << std::endl;
+}
+
+MCMCSamplerStochastic::~MCMCSamplerStochastic() {
+}
+
+bool MCMCSamplerStochastic::allocate_pi() const {
+  return args_.out_of_core == "";
+}
+
+void MCMCSamplerStochastic::init_phi_pi() {
+  if (args_.out_of_core != "") {
+    init_out_of_core();
+    return;
+  }
+
+  std::vector<std::vector<Float> > gamma = rng_[0]->gamma(1, 1, N, K);
+  phi.resize(N * K);
+  for (::size_t i = 0; i < N; ++i) {
+    std::copy(gamma[i].begin(), gamma[i].end(), &phi[i * K]);
+  }
   std::cerr << "Done host random for phi" << std::endl;
 #ifndef NDEBUG
-  for (auto pph : phi) {
-    for (auto ph : pph) {
-      assert(ph >= 0.0);
-    }
+  for (auto ph : phi) {
+    assert(ph >= 0.0);
   }
 #endif
-  pi.resize(phi.size(), std::vector<Float>(phi[0].size()));
-  np::row_normalize(&pi, phi);
+  pi.resize(N * K);
+  for (::size_t i = 0; i < N; ++i) {
+    normalize_pi(i);
+  }
+}
 
-  std::cerr << "Done " << __func__ << "()" << std::endl;
+void MCMCSamplerStochastic::normalize_pi(Vertex i) {
+  const Float *phi_i = &phi[i * K];
+  Float phi_sum = std::accumulate(phi_i, phi_i + K, FLOAT(0.0));
+  Float *pi_i = &pi[i * K];
+  for (::size_t k = 0; k < K; ++k) {
+    pi_i[k] = phi_i[k] / phi_sum;
+  }
 }
 
-MCMCSamplerStochastic::~MCMCSamplerStochastic() {
+void MCMCSamplerStochastic::init_out_of_core() {
+  ooc_pi_ = std::unique_ptr<OutOfCorePi>(new OutOfCorePi(args_.out_of_core,
+                                                         N, K));
+  // Row by row, so phi never is in memory as a whole
+  for (::size_t i = 0; i < N; ++i) {
+    std::vector<Float> phi_i = rng_[0]->gamma(1, 1, 1, K)[0];
+    Float phi_sum = np::sum(phi_i);
+    Float *row = ooc_pi_->row(i);
+    for (::size_t k = 0; k < K; ++k) {
+      row[k] = phi_i[k] / phi_sum;
+    }
+    row[K] = phi_sum;
+  }
+  std::cerr << "Done host random for phi in " << args_.out_of_core <<
+    std::endl;
+
+  // The nodes of highest degree are in most minibatches
+  std::vector<Vertex> hot(N);
+  std::iota(hot.begin(), hot.end(), 0);
+  ::size_t resident = std::min(args_.out_of_core_cache, N);
+  std::partial_sort(hot.begin(), hot.begin() + resident, hot.end(),
+                    [this](Vertex a, Vertex b) {
+                      ::size_t fa = network.get_fan_out(a);
+                      ::size_t fb = network.get_fan_out(b);
+                      return fa > fb || (fa == fb && a < b);
+                    });
+  hot.resize(resident);
+  ooc_pi_->SetResident(hot);
+  std::cerr << "Out of core: " << resident << " of " << N <<
+    " rows of pi resident" << std::endl;
 }
 
 void MCMCSamplerStochastic::sampler_stochastic_info(std::ostream &s) {
@@ -100,6 +189,11 @@ void MCMCSamplerStochastic::run() {
   t_update_phi = timer::Timer("  update_phi");
   t_update_pi = timer::Timer("  update_pi");
   t_update_beta = timer::Timer("  update_beta");
+  t_checkpoint = timer::Timer("  checkpoint");
+  t_prefetch = timer::Timer("  prefetch");
+  c_major_faults_ = Counter("major page faults/iteration");
+  c_minor_faults_ = Counter("minor page faults/iteration");
+  c_prefetch_pages_ = Counter("prefetched pages/iteration");
 
   using namespace std::chrono;
   t_start_ = system_clock::now();
@@ -108,6 +202,10 @@ void MCMCSamplerStochastic::run() {
   std::vector<double> timings;
   t1 = clock();
   while (step_count < max_iteration && !is_converged()) {
+    struct rusage usage_before;
+    if (ooc_pi_) {
+      getrusage(RUSAGE_SELF, &usage_before);
+    }
     t_outer.start();
     if ((step_count - 1) % interval == 0) {
       t_perplexity.start();
@@ -145,24 +243,11 @@ void MCMCSamplerStochastic::run() {
     // ************ do in parallel at each host
     // std::cerr << "Sample neighbor nodes" << std::endl;
     std::vector<Vertex> node_vector(nodes.begin(), nodes.end());
-    for (::size_t n = 0; n < node_vector.size(); ++n) {
-      Vertex node = node_vector[n];
-      t_sample_neighbor_nodes.start();
-      // sample a mini-batch of neighbors
-      NeighborSet neighbors;
-      sample_neighbor_nodes(&neighbors, num_node_sample, node, rng_[0]);
-      t_sample_neighbor_nodes.stop();
-
-      t_update_phi.start();
-      update_phi(node, neighbors, eps_t);
-      t_update_phi.stop();
-    }
+    update_phi_nodes(node_vector, eps_t);
 
     // ************ do in parallel at each host
     t_update_pi.start();
-    for (auto i : nodes) {
-      np::normalize(&pi[i], phi[i]);
-    }
+    update_pi_nodes(node_vector);
     t_update_pi.stop();
 
     t_update_beta.start();
@@ -173,15 +258,66 @@ void MCMCSamplerStochastic::run() {
 
     step_count++;
     t_outer.stop();
+    if (ooc_pi_) {
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      c_major_faults_.tick(usage.ru_majflt - usage_before.ru_majflt);
+      c_minor_faults_.tick(usage.ru_minflt - usage_before.ru_minflt);
+    }
+
+    if (args_.checkpoint_interval > 0 &&
+        step_count % args_.checkpoint_interval == 0) {
+      save_checkpoint();
+    }
 
     if (step_count % stats_print_interval_ == 0) {
       PrintStats(std::cout);
     }
   }
 
+  if (snapshot_writer_) {
+    // Checkpoint at shutdown, too
+    if (step_count % args_.checkpoint_interval != 0) {
+      save_checkpoint();
+    }
+    commit_checkpoint();
+  }
+
   PrintStats(std::cout);
 }
 
+void MCMCSamplerStochastic::update_phi_nodes(const std::vector<Vertex> &nodes,
+                                             Float eps_t) {
+  if (ooc_pi_) {
+    update_phi_out_of_core(nodes, eps_t);
+    return;
+  }
+
+  for (::size_t n = 0; n < nodes.size(); ++n) {
+    Vertex node = nodes[n];
+    t_sample_neighbor_nodes.start();
+    // sample a mini-batch of neighbors
+    NeighborSet neighbors;
+    sample_neighbor_nodes(&neighbors, num_node_sample, node, rng_[0]);
+    t_sample_neighbor_nodes.stop();
+
+    t_update_phi.start();
+    update_phi(node, neighbors, eps_t);
+    t_update_phi.stop();
+  }
+}
+
+void MCMCSamplerStochastic::update_pi_nodes(const std::vector<Vertex> &nodes) {
+  if (ooc_pi_) {
+    update_pi_out_of_core(nodes);
+    return;
+  }
+
+  for (auto i : nodes) {
+    normalize_pi(i);
+  }
+}
+
 std::ostream& MCMCSamplerStochastic::PrintStats(std::ostream& out) const {
   timer::Timer::setTabular(true);
   timer::Timer::printHeader(out);
@@ -193,53 +329,171 @@ std::ostream& MCMCSamplerStochastic::PrintStats(std::ostream& out) const {
   out << t_update_phi << std::endl;
   out << t_update_pi << std::endl;
   out << t_update_beta << std::endl;
+  out << t_checkpoint << std::endl;
+  if (ooc_pi_) {
+    out << t_prefetch << std::endl;
+    out << c_major_faults_ << std::endl;
+    out << c_minor_faults_ << std::endl;
+    out << c_prefetch_pages_ << std::endl;
+  }
 
   return out;
 }
 
+
+void MCMCSamplerStochastic::save_checkpoint() {
+  t_checkpoint.start();
+  commit_checkpoint();
+
+  // Runs in the forked child, on its snapshot of our state
+  snapshot_writer_->Write(step_count, [this](checkpoint::Stream *out) {
+    out->Put<uint64_t>(N);
+    out->Put<uint64_t>(K);
+    out->Put<uint64_t>(step_count);
+    out->Put<uint64_t>(average_count);
+    out->Put(theta);
+    out->Put(ppx_per_heldout_edge_);
+    out->Put(std::vector<Float>(ppxs_heldout_cb_.begin(),
+                                  ppxs_heldout_cb_.end()));
+    std::vector<std::string> rng_state;
+    for (auto rng : rng_) {
+      rng_state.push_back(rng->get_state());
+    }
+    out->Put(rng_state);
+    // phi last, as a dense aligned N x K array
+    out->Align();
+    out->PutBytes(phi.data(), N * K * sizeof(Float));
+  });
+  snapshot_pending_ = step_count;
+  t_checkpoint.stop();
+}
+
+
+void MCMCSamplerStochastic::commit_checkpoint() {
+  if (snapshot_pending_ == 0) {
+    return;
+  }
+
+  if (snapshot_writer_->Wait()) {
+    checkpoint::Commit(args_.checkpoint_dir, snapshot_pending_);
+    if (snapshot_committed_ != 0) {
+      checkpoint::Remove(args_.checkpoint_dir, snapshot_committed_, 0);
+    }
+    snapshot_committed_ = snapshot_pending_;
+  } else {
+    std::cerr << "Checkpoint of step " << snapshot_pending_ <<
+      " is incomplete; the latest consistent checkpoint remains step " <<
+      snapshot_committed_ << std::endl;
+  }
+  snapshot_pending_ = 0;
+}
+
+
+void MCMCSamplerStochastic::restore_checkpoint(bool warm_start) {
+  ::size_t step = checkpoint::Latest(args_.checkpoint_dir);
+  checkpoint::Image image = checkpoint::Read(args_.checkpoint_dir, step, 0);
+
+  uint64_t n;
+  uint64_t k;
+  image.Get(&n);
+  image.Get(&k);
+  if (n != N || k != K) {
+    throw MCMCException("Checkpoint of step " + std::to_string(step) +
+                        " does not match N or K");
+  }
+  uint64_t saved_step_count;
+  uint64_t saved_average_count;
+  std::vector<Float> ppx_per_heldout_edge;
+  std::vector<Float> ppxs;
+  std::vector<std::string> rng_state;
+  image.Get(&saved_step_count);
+  image.Get(&saved_average_count);
+  image.Get(&theta);
+  image.Get(&ppx_per_heldout_edge);
+  image.Get(&ppxs);
+  image.Get(&rng_state);
+  image.SkipAlign();
+  if (ooc_pi_) {
+    std::vector<Float> phi_i(K);
+    for (::size_t i = 0; i < N; ++i) {
+      image.GetBytes(phi_i.data(), K * sizeof(Float));
+      Float phi_sum = np::sum(phi_i);
+      Float *row = ooc_pi_->row(i);
+      for (::size_t k = 0; k < K; ++k) {
+        row[k] = phi_i[k] / phi_sum;
+      }
+      row[K] = phi_sum;
+    }
+  } else {
+    image.GetBytes(phi.data(), N * K * sizeof(Float));
+    for (::size_t i = 0; i < N; ++i) {
+      normalize_pi(i);
+    }
+  }
+  std::vector<std::vector<Float> > temp(theta.size(),
+                                         std::vector<Float>(theta[0].size()));
+  np::row_normalize(&temp, theta);
+  std::transform(temp.begin(), temp.end(), beta.begin(),
+                 np::SelectColumn<Float>(1));
+
+  if (warm_start) {
+    // A fresh run: step size, perplexity average and random generators
+    // start anew
+    std::cerr << "Warm start from the checkpoint of step " << step <<
+      std::endl;
+    return;
+  }
+
+  if (rng_state.size() != rng_.size()) {
+    throw MCMCException("Checkpoint has " + std::to_string(rng_state.size()) +
+                        " random generators, restart needs " +
+                        std::to_string(rng_.size()));
+  }
+  for (::size_t i = 0; i < rng_.size(); ++i) {
+    rng_[i]->set_state(rng_state[i]);
+  }
+  step_count = saved_step_count;
+  average_count = saved_average_count;
+  ppx_per_heldout_edge_ = ppx_per_heldout_edge;
+  ppxs_heldout_cb_.clear();
+  for (auto p : ppxs) {
+    ppxs_heldout_cb_.push_back(p);
+  }
+  snapshot_committed_ = step;
+  std::cerr << "Restart from the checkpoint of step " << step << std::endl;
+}
+
 void MCMCSamplerStochastic::update_beta(const MinibatchSet &mini_batch,
                                         Float scale) {
-  std::vector<std::vector<Float> > grads(
-      K, std::vector<Float>(2, FLOAT(0.0)));  // gradients K*2 dimension
-  std::vector<Float> probs(K);
-  // sums = np.sum(self.__theta,1)
-  std::vector<Float> theta_sum(theta.size());
-  std::transform(theta.begin(), theta.end(), theta_sum.begin(),
-                 np::sum<Float>);
+  // gradients K*2 dimension, as two rows of K
+  std::vector<Float> grads_0(K, FLOAT(0.0));
+  std::vector<Float> grads_1(K, FLOAT(0.0));
+  std::vector<Float> term(4 * K);
+  kernels::BetaTerms(theta, term.data());
 
   // update gamma, only update node in the grad
-  Float eps_t = get_eps_t();
   for (auto edge = mini_batch.begin(); edge != mini_batch.end(); edge++) {
     int y = 0;
     if (edge->in(network.get_linked_edges())) {
       y = 1;
     }
-    int i = edge->first;
-    int j = edge->second;
-
-    Float pi_sum = FLOAT(0.0);
-    for (::size_t k = 0; k < K; k++) {
-      pi_sum += pi[i][k] * pi[j][k];
-      Float f = pi[i][k] * pi[j][k];
-      if (y == 1) {
-        probs[k] = beta[k] * f;
-      } else {
-        probs[k] = (FLOAT(1.0) - beta[k]) * f;
-      }
-    }
+    kernels_->beta_grads(K, pi_row(edge->first), pi_row(edge->second), y,
+                         beta.data(), epsilon, &term[2 * y * K],
+                         &term[(2 * y + 1) * K], grads_0.data(),
+                         grads_1.data());
+  }
 
-    Float prob_0 = ((y == 1) ? epsilon : (FLOAT(1.0) - epsilon)) *
-                                          (FLOAT(1.0) - pi_sum);
-    Float prob_sum = np::sum(probs) + prob_0;
-    for (::size_t k = 0; k < K; k++) {
-      Float f = probs[k] / prob_sum;
-      Float one_over_theta_sum = FLOAT(1.0) / theta_sum[k];
-      grads[k][0] += f * ((FLOAT(1.0) - y) / theta[k][0] - one_over_theta_sum);
-      grads[k][1] += f * (y / theta[k][1] - one_over_theta_sum);
-    }
+  std::vector<std::vector<Float> > grads(K, std::vector<Float>(2));
+  for (::size_t k = 0; k < K; k++) {
+    grads[k][0] = grads_0[k];
+    grads[k][1] = grads_1[k];
   }
+  update_theta(grads, scale);
+}
 
-  // update theta
+void MCMCSamplerStochastic::update_theta(
+    const std::vector<std::vector<Float> > &grads, Float scale) {
+  Float eps_t = get_eps_t();
 
   // random noise.
   std::vector<std::vector<Float> > noise = rng_[0]->randn(K, 2);
@@ -268,7 +522,8 @@ void MCMCSamplerStochastic::update_beta(const MinibatchSet &mini_batch,
 
 void MCMCSamplerStochastic::update_phi(Vertex i, const NeighborSet &neighbors,
                                        Float eps_t) {
-  Float phi_i_sum = np::sum(phi[i]);
+  Float *phi_i = &phi[i * K];
+  Float phi_i_sum = std::accumulate(phi_i, phi_i + K, FLOAT(0.0));
   std::vector<Float> grads(K, FLOAT(0.0));  // gradient for K classes
 
   for (auto neighbor : neighbors) {
@@ -282,34 +537,105 @@ void MCMCSamplerStochastic::update_phi(Vertex i, const NeighborSet &neighbors,
       y_ab = 1;
     }
 
-    std::vector<Float> probs(K);
-    Float e = (y_ab == 1) ? epsilon : (FLOAT(1.0) - epsilon);
-    for (::size_t k = 0; k < K; k++) {
-      Float f = (y_ab == 1) ? (beta[k] - epsilon) : (epsilon - beta[k]);
-      probs[k] = pi[i][k] * (pi[neighbor][k] * f + e);
+    kernels_->phi_grads(K, pi_row(i), phi_i, phi_i_sum, pi_row(neighbor),
+                        y_ab, beta.data(), epsilon, grads.data());
+  }
+
+  // random gaussian noise.
+  std::vector<Float> noise = rng_[0]->randn(K);
+  Float Nn = (FLOAT(1.0) * N) / num_node_sample;
+  // update phi for node i
+  for (::size_t k = 0; k < K; k++) {
+    phi_i[k] =
+        std::abs((phi_i[k]
+                 + eps_t / FLOAT(2.0) * (alpha - phi_i[k] + Nn * grads[k]))
+                 + std::sqrt(eps_t * phi_i[k]) * noise[k]
+                 );
+    if (phi_i[k] < MCMC_NONZERO_GUARD) {
+      phi_i[k] = MCMC_NONZERO_GUARD;
+    }
+  }
+
+}
+
+void MCMCSamplerStochastic::update_phi_out_of_core(
+    const std::vector<Vertex> &nodes, Float eps_t) {
+  t_sample_neighbor_nodes.start();
+  ooc_neighbors_.resize(nodes.size());
+  std::vector<Vertex> touched(nodes);
+  for (::size_t n = 0; n < nodes.size(); ++n) {
+    ooc_neighbors_[n].clear();
+    sample_neighbor_nodes(&ooc_neighbors_[n], num_node_sample, nodes[n],
+                          rng_[0]);
+    touched.insert(touched.end(), ooc_neighbors_[n].begin(),
+                   ooc_neighbors_[n].end());
+  }
+  t_sample_neighbor_nodes.stop();
+
+  t_prefetch.start();
+  ::size_t prefetched = ooc_pi_->prefetched_pages();
+  ooc_pi_->Prefetch(touched);
+  c_prefetch_pages_.tick(ooc_pi_->prefetched_pages() - prefetched);
+  t_prefetch.stop();
+
+  t_update_phi.start();
+  ooc_phi_.resize(nodes.size(), std::vector<Float>(K));
+  for (::size_t n = 0; n < nodes.size(); ++n) {
+    update_phi_compact(nodes[n], ooc_neighbors_[n], eps_t,
+                       ooc_phi_[n].data());
+  }
+  t_update_phi.stop();
+}
+
+// As update_phi, with phi[i][k] = pi[i][k] * phi_sum[i]
+void MCMCSamplerStochastic::update_phi_compact(Vertex i,
+                                               const NeighborSet &neighbors,
+                                               Float eps_t, Float *phi_i) {
+  const Float *pi_i = ooc_pi_->row(i);
+  Float phi_i_sum = pi_i[K];
+  std::vector<Float> grads(K, FLOAT(0.0));  // gradient for K classes
+
+  for (auto neighbor : neighbors) {
+    if (i == neighbor) {
+      continue;
     }
 
-    Float prob_sum = np::sum(probs);
-    for (::size_t k = 0; k < K; k++) {
-      grads[k] += (probs[k] / prob_sum) / phi[i][k] - FLOAT(1.0) / phi_i_sum;
+    int y_ab = 0;  // observation
+    Edge edge(std::min(i, neighbor), std::max(i, neighbor));
+    if (edge.in(network.get_linked_edges())) {
+      y_ab = 1;
     }
+
+    kernels_->phi_grads_compact(K, pi_i, ooc_pi_->row(neighbor), y_ab,
+                                beta.data(), epsilon, grads.data());
   }
 
   // random gaussian noise.
   std::vector<Float> noise = rng_[0]->randn(K);
   Float Nn = (FLOAT(1.0) * N) / num_node_sample;
-  // update phi for node i
   for (::size_t k = 0; k < K; k++) {
-    phi[i][k] =
-        std::abs((phi[i][k]
-                 + eps_t / FLOAT(2.0) * (alpha - phi[i][k] + Nn * grads[k]))
-                 + std::sqrt(eps_t * phi[i][k]) * noise[k]
-                 );
-    if (phi[i][k] < MCMC_NONZERO_GUARD) {
-      phi[i][k] = MCMC_NONZERO_GUARD;
+    Float phi_ik = pi_i[k] * phi_i_sum;
+    phi_i[k] = std::abs((phi_ik
+                         + eps_t / FLOAT(2.0) * (alpha - phi_ik + Nn * grads[k]))
+                        + std::sqrt(eps_t * phi_ik) * noise[k]
+                        );
+    if (phi_i[k] < MCMC_NONZERO_GUARD) {
+      phi_i[k] = MCMC_NONZERO_GUARD;
     }
   }
+}
 
+void MCMCSamplerStochastic::update_pi_out_of_core(
+    const std::vector<Vertex> &nodes) {
+  for (::size_t n = 0; n < nodes.size(); ++n) {
+    const std::vector<Float> &phi_i = ooc_phi_[n];
+    Float phi_sum = np::sum(phi_i);
+    Float *row = ooc_pi_->row(nodes[n]);
+    for (::size_t k = 0; k < K; ++k) {
+      row[k] = phi_i[k] / phi_sum;
+    }
+    row[K] = phi_sum;
+  }
 }
 
 MinibatchNodeSet MCMCSamplerStochastic::nodes_in_batch(
@@ -5,6 +5,7 @@
 
 #include <utility>
 #include <chrono>
+#include <memory>
 #include <vector>
 
 #include "mcmc/config.h"
@@ -12,6 +13,9 @@
 #include "mcmc/np.h"
 #include "mcmc/random.h"
 #include "mcmc/timer.h"
+#include "mcmc/checkpoint.h"
+#include "mcmc/counter.h"
+#include "mcmc/out-of-core.h"
 
 #include "mcmc/learning/learner.h"
 
@@ -80,10 +84,42 @@ class MCMCSamplerStochastic : public Learner {
   void run() override;
 
  protected:
-  void update_beta(const MinibatchSet &mini_batch, Float scale);
+  // Does this sampler keep pi as dense rows in memory
+  virtual bool allocate_pi() const;
+  virtual void init_phi_pi();
+
+  // Sample the neighbors of each of @argument nodes and update its phi.
+  // pi follows in update_pi_nodes, so all of phi sees the same pi.
+  virtual void update_phi_nodes(const std::vector<Vertex> &nodes,
+                                Float eps_t);
+  virtual void update_pi_nodes(const std::vector<Vertex> &nodes);
+
+  virtual void update_beta(const MinibatchSet &mini_batch, Float scale);
+  // The Langevin step of theta, and beta from it, for @argument grads
+  void update_theta(const std::vector<std::vector<Float> > &grads,
+                    Float scale);
 
   void update_phi(Vertex i, const NeighborSet &neighbors, Float eps_t);
 
+  // --mcmc.out-of-core: pi and phi_sum live in compact rows in a mapped
+  // file. All neighbor sets of the minibatch are sampled first, so their
+  // rows can be prefetched before the computation touches them.
+  void init_out_of_core();
+  void update_phi_out_of_core(const std::vector<Vertex> &nodes, Float eps_t);
+  void update_phi_compact(Vertex i, const NeighborSet &neighbors, Float eps_t,
+                          Float *phi_i);
+  void update_pi_out_of_core(const std::vector<Vertex> &nodes);
+
+  const Float *pi_row(Vertex i) const override {
+    if (ooc_pi_) {
+      return ooc_pi_->row(i);
+    }
+    return &pi[i * K];
+  }
+
+  // pi[i] = phi[i] / sum(phi[i])
+  void normalize_pi(Vertex i);
+
   inline void sample_neighbor_nodes(NeighborSet *neighbor_nodes,
                                     ::size_t sample_size, Vertex nodeId,
                                     Random::Random *rnd) {
@@ -114,7 +150,16 @@ class MCMCSamplerStochastic : public Learner {
     // return std::pow(1024+step_count, -0.5);
   }
 
-  std::ostream& PrintStats(std::ostream& out) const;
+  virtual std::ostream& PrintStats(std::ostream& out) const;
+
+  // --mcmc.checkpoint-interval: a forked child writes the checkpoint from a
+  // copy-on-write snapshot
+  void save_checkpoint();
+  // The previous checkpoint is complete once its writer has exited
+  void commit_checkpoint();
+  // --mcmc.restart resumes exactly; --mcmc.warm-start only takes phi and
+  // theta, so a new run can use other hyperparameters
+  void restore_checkpoint(bool warm_start);
 
   // replicated in both mcmc_sampler_
   Float a;
@@ -126,7 +171,18 @@ class MCMCSamplerStochastic : public Learner {
   ::size_t stats_print_interval_;
 
   std::vector<std::vector<Float> > theta;  // parameterization for \beta
-  std::vector<std::vector<Float> > phi;    // parameterization for \pi
+  // parameterization for \pi; N x K, as pi
+  std::vector<Float, huge_pages::Allocator<Float> > phi;
+
+  std::unique_ptr<OutOfCorePi> ooc_pi_;
+  // new phi of the minibatch nodes until update_pi
+  std::vector<std::vector<Float> > ooc_phi_;
+  std::vector<NeighborSet> ooc_neighbors_;
+
+  std::unique_ptr<checkpoint::ForkWriter> snapshot_writer_;
+  // steps of the checkpoint being written and of the last consistent one
+  ::size_t snapshot_pending_ = 0;
+  ::size_t snapshot_committed_ = 0;
 
   std::chrono::time_point<std::chrono::system_clock> t_start_;
   timer::Timer t_outer;
@@ -137,6 +193,13 @@ class MCMCSamplerStochastic : public Learner {
   timer::Timer t_update_phi;
   timer::Timer t_update_pi;
   timer::Timer t_update_beta;
+  timer::Timer t_checkpoint;
+  timer::Timer t_prefetch;
+
+  // page faults per iteration, and pages prefetched, with --mcmc.out-of-core
+  Counter c_major_faults_;
+  Counter c_minor_faults_;
+  Counter c_prefetch_pages_;
 };
 
 }  // namespace learning
@@ -1,17 +1,25 @@
 #include <mcmc/learning/mcmc_sampler_stochastic_distr.h>
 
+#include <cassert>
 #include <cinttypes>
 #include <cmath>
 
 #include <utility>
 #include <numeric>
 #include <algorithm>	// min, max
+#include <functional>
+#include <queue>
+#include <random>
 #include <chrono>
+#include <fstream>
+#include <limits>
+#include <sstream>
 
 #include "mcmc/exception.h"
 #include "mcmc/config.h"
 
 #include "mcmc/fixed-size-set.h"
+#include "mcmc/partition.h"
 
 #ifdef MCMC_SINGLE_PRECISION
 #  define FLOATTYPE_MPI MPI_FLOAT
@@ -19,113 +27,14 @@
 #  define FLOATTYPE_MPI MPI_DOUBLE
 #endif
 
-#ifdef MCMC_ENABLE_DISTRIBUTED
+#if defined MCMC_ENABLE_DISTRIBUTED && ! defined MCMC_MPI_THREADS
 #  include <mpi.h>
 #else
-
-#define MPI_SUCCESS		0
-
-typedef int MPI_Comm;
-#define MPI_COMM_WORLD	0
-
-enum MPI_ERRORS {
-  MPI_ERRORS_RETURN,
-  MPI_ERRORS_ARE_FATAL,
-};
-
-enum MPI_Datatype {
-  MPI_INT                    = 0x4c000405,
-  MPI_LONG                   = 0x4c000407,
-  MPI_UNSIGNED_LONG          = 0x4c000408,
-  MPI_DOUBLE                 = 0x4c00080b,
-  MPI_BYTE                   = 0x4c00010d,
-};
-
-enum MPI_Op {
-  MPI_SUM,
-};
-
-void *MPI_IN_PLACE = (void *)0x88888888;
-
-
-int MPI_Init(int *argc, char ***argv) {
-  return MPI_SUCCESS;
-}
-
-int MPI_Finalize() {
-  return MPI_SUCCESS;
-}
-
-int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype,
-              int root, MPI_Comm comm) {
-  return MPI_SUCCESS;
-}
-
-int MPI_Barrier(MPI_Comm comm) {
-  return MPI_SUCCESS;
-}
-
-int MPI_Comm_set_errhandler(MPI_Comm comm, int mode) {
-  return MPI_SUCCESS;
-}
-
-int MPI_Comm_size(MPI_Comm comm, int *mpi_size) {
-  *mpi_size = 1;
-  return MPI_SUCCESS;
-}
-
-int MPI_Comm_rank(MPI_Comm comm, int *mpi_rank) {
-  *mpi_rank = 0;
-  return MPI_SUCCESS;
-}
-
-::size_t mpi_datatype_size(MPI_Datatype type) {
-  switch (type) {
-  case MPI_INT:
-    return sizeof(int32_t);
-  case MPI_LONG:
-    return sizeof(int64_t);
-  case MPI_UNSIGNED_LONG:
-    return sizeof(uint64_t);
-  case MPI_FLOAT:
-    return sizeof(float);
-  case MPI_DOUBLE:
-    return sizeof(double);
-  case MPI_BYTE:
-    return 1;
-  default:
-    std::cerr << "Unknown MPI datatype" << std::cerr;
-    return 0;
-  }
-}
-
-int MPI_Scatter(void *sendbuf, int sendcount, MPI_Datatype sendtype,
-                void *recvbuf, int recvcount, MPI_Datatype recvtype,
-                int root, MPI_Comm comm) {
-  memcpy(recvbuf, sendbuf, sendcount * mpi_datatype_size(sendtype));
-  return MPI_SUCCESS;
-}
-
-int MPI_Scatterv(void *sendbuf, int *sendcounts, int *displs, MPI_Datatype sendtype,
-                 void *recvbuf, int recvcount, MPI_Datatype recvtype,
-                 int root, MPI_Comm comm) {
-  return MPI_Scatter((char *)sendbuf + displs[0] * mpi_datatype_size(sendtype),
-                     sendcounts[0], sendtype,
-                     recvbuf, recvcount, recvtype,
-                     root, comm);
-}
-
-int MPI_Allreduce(void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype,
-                  MPI_Op op, MPI_Comm comm) {
-  if (sendbuf != MPI_IN_PLACE) {
-    memcpy(recvbuf, sendbuf, count * mpi_datatype_size(datatype));
-  }
-  return MPI_SUCCESS;
-}
-
+#  include "mcmc/mpi-threads.h"
 #endif
 
 #include "dkvstore/DKVStoreFile.h"
+#include "dkvstore/DKVStoreShm.h"
 #ifdef MCMC_ENABLE_RAMCLOUD
 #include "dkvstore/DKVStoreRamCloud.h"
 #endif
@@ -148,35 +57,110 @@ do { \
 using ::mcmc::timer::Timer;
 
 
+// splitmix64: spreads consecutive inputs over the whole seed space
+static uint64_t mix_seed(uint64_t x) {
+  x += UINT64_C(0x9e3779b97f4a7c15);
+  x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
+
+// The percentage of the time in @argument work that the caller did not
+// spend in @argument wait for it, i.e. that ran behind its computation
+static double hidden(const Timer &work, const Timer &wait) {
+  double w = std::chrono::duration_cast<std::chrono::duration<double>>(
+               work.total()).count();
+  double t = std::chrono::duration_cast<std::chrono::duration<double>>(
+               wait.total()).count();
+  return (w > 0.0) ? 100.0 * std::max(0.0, w - t) / w : 0.0;
+}
+
+
+// The memory limit of my cgroup in bytes, or -1 if there is none
+static int64_t cgroup_memory_limit() {
+  // cgroup v2, then v1
+  for (auto name : { "/sys/fs/cgroup/memory.max",
+                     "/sys/fs/cgroup/memory/memory.limit_in_bytes" }) {
+    std::ifstream limit(name);
+    std::string token;
+    if (limit >> token) {
+      if (token == "max") {
+        return -1;
+      }
+      try {
+        int64_t bytes = std::stoll(token);
+        // v1 reports an unlimited cgroup as a huge page-aligned number
+        if (bytes > 0 && bytes < (INT64_C(1) << 60)) {
+          return bytes;
+        }
+      } catch (std::exception &e) {
+        throw NumberFormatException(std::string(name) +
+                                    " must be a longlong");
+      }
+      return -1;
+    }
+  }
+
+  return -1;
+}
+
+
+// --mcmc.steal: a claim word packs tag:16 | #nodes:24 | first unclaimed:24
+static const unsigned kClaimBits = 24;
+static const uint64_t kClaimMask = (UINT64_C(1) << kClaimBits) - 1;
+// the owner claims at least this many of its nodes at once
+static const uint64_t kMinClaim = 16;
+
+static uint64_t claim_word(uint64_t tag, uint64_t count, uint64_t next) {
+  return (tag << (2 * kClaimBits)) | (count << kClaimBits) | next;
+}
+
+
 // **************************************************************************
 //
 // class LocalNetwork
 //
 // **************************************************************************
 
-void LocalNetwork::unmarshall_local_graph(::size_t index, const Vertex* linked,
-                                          ::size_t size) {
-  if (linked_edges_.size() <= index) {
-    linked_edges_.resize(index + 1);
-  }
-  linked_edges_[index] = EndpointSet();
-  for (::size_t i = 0; i < size; ++i) {
-    linked_edges_[index].insert(linked[i]);
+void LocalNetwork::unmarshall_local_graph(const std::vector<int32_t> &set_size,
+                                          Adjacency* flat) {
+  offset_.resize(set_size.size() + 1);
+  offset_[0] = 0;
+  for (::size_t i = 0; i < set_size.size(); ++i) {
+    offset_[i + 1] = offset_[i] + set_size[i];
   }
+  assert(offset_.back() == flat->size());
+  linked_edges_.swap(*flat);
 }
 
 void LocalNetwork::reset() {
   linked_edges_.clear();
+  offset_.clear();
 }
 
 bool LocalNetwork::find(const Edge& edge) const {
-  const auto &adj = linked_edges_[edge.first];
+  const Vertex *base = linked_edges(edge.first);
+  ::size_t n = fan_out(edge.first);
+  if (n == 0) {
+    return false;
+  }
+  // Branch-free binary search: the compiler turns the select into a cmov
+  while (n > 1) {
+    ::size_t half = n / 2;
+    base = (base[half] <= edge.second) ? base + half : base;
+    n -= half;
+  }
+
+  return *base == edge.second;
+}
 
-  return adj.find(edge.second) != adj.end();
+::size_t LocalNetwork::fan_out(::size_t i) const {
+  return offset_[i + 1] - offset_[i];
 }
 
-const LocalNetwork::EndpointSet& LocalNetwork::linked_edges(::size_t i) const {
-  return linked_edges_[i];
+const Vertex *LocalNetwork::linked_edges(::size_t i) const {
+  return linked_edges_.data() + offset_[i];
 }
 
 
@@ -213,9 +197,18 @@ void PerpData::Init(::size_t max_perplexity_chunk) {
 //
 // **************************************************************************
 MCMCSamplerStochasticDistributed::MCMCSamplerStochasticDistributed(
-    const Options &args) : MCMCSamplerStochastic(args), mpi_master_(0) {
+    const Options &args) : MCMCSamplerStochastic(args), numa_order_(false),
+                            steal_claim_(0),
+                            steal_nodes_win_(MPI_WIN_NULL),
+                            steal_claim_win_(MPI_WIN_NULL), steal_victim_(0),
+                            mpi_master_(0), theta_rng_(NULL),
+                            beta_comm_(MPI_COMM_WORLD),
+                            checkpoint_pending_(0),
+                            checkpoint_committed_(0), ppx_codec_score_(0.0) {
   t_load_network_          = Timer("  load network graph");
   t_init_dkv_              = Timer("  initialize DKV store");
+  t_partition_             = Timer("  partition pi");
+  t_load_shard_            = Timer("  load graph shard");
   t_populate_pi_           = Timer("  populate pi");
   t_outer_                 = Timer("  iteration");
   t_deploy_minibatch_      = Timer("    deploy minibatch");
@@ -234,17 +227,25 @@ MCMCSamplerStochasticDistributed::MCMCSamplerStochasticDistributed(
   t_update_phi_pi_         = Timer("    update_phi_pi");
   t_load_pi_minibatch_     = Timer("      load minibatch pi");
   t_load_pi_neighbor_      = Timer("      load neighbor pi");
+  t_load_pi_wait_          = Timer("      wait for prefetched pi");
+  t_load_pi_inflight_      = Timer("      prefetched pi in flight");
   t_update_phi_            = Timer("      update_phi");
   t_barrier_phi_           = Timer("      barrier after update phi");
   t_update_pi_             = Timer("      update_pi");
   t_store_pi_minibatch_    = Timer("      store minibatch pi");
+  t_store_pi_wait_         = Timer("      wait for stored pi");
   t_barrier_pi_            = Timer("      barrier after update pi");
+  t_carry_pi_              = Timer("      carry pi to next epoch");
+  t_epoch_barrier_         = Timer("      wait for epoch barrier");
   t_update_beta_           = Timer("    update_beta_theta");
   t_beta_zero_             = Timer("      zero beta grads");
   t_beta_rank_             = Timer("      rank minibatch nodes");
+  t_beta_scatter_          = Timer("      scatter minibatch for update_beta");
+  t_comm_wait_             = Timer("      wait for comm thread");
   t_beta_calc_grads_       = Timer("      beta calc grads");
   t_beta_sum_grads_        = Timer("      beta sum grads");
   t_beta_reduce_grads_     = Timer("      beta reduce(+) grads");
+  t_beta_reduce_wait_      = Timer("      wait for beta reduce(+)");
   t_beta_update_theta_     = Timer("      update theta");
   t_load_pi_beta_          = Timer("      load pi update_beta");
   t_perplexity_            = Timer("  perplexity");
@@ -253,6 +254,13 @@ MCMCSamplerStochasticDistributed::MCMCSamplerStochasticDistributed(
   t_purge_pi_perp_         = Timer("      purge perplexity pi");
   t_reduce_perp_           = Timer("      reduce/plus perplexity");
   c_minibatch_chunk_size_  = Counter("minibatch chunk size");
+  c_minibatch_nodes_at_owner_ = Counter("minibatch nodes at their pi host");
+  c_minibatch_nodes_moved_ = Counter("minibatch nodes moved for balance");
+  c_beta_pi_reused_ = Counter("update_beta pi reused from update_pi");
+  c_phi_nodes_stolen_ = Counter("update_phi nodes stolen from peers");
+  c_numa_local_ = Counter("update_phi pi reads from the local NUMA node");
+  c_numa_remote_ = Counter("update_phi pi reads from a remote NUMA node");
+  t_checkpoint_            = Timer("  checkpoint");
   Timer::setTabular(true);
 }
 
@@ -261,6 +269,25 @@ MCMCSamplerStochasticDistributed::~MCMCSamplerStochasticDistributed() {
   for (auto &p : pi_update_) {
     delete[] p;
   }
+  for (auto r : minibatch_rng_) {
+    delete r;
+  }
+  for (auto r : node_rng_) {
+    delete r;
+  }
+  delete theta_rng_;
+
+  if (comm_thread_) {
+    comm_thread_.reset();
+    (void)MPI_Comm_free(&beta_comm_);
+  }
+
+  if (steal_nodes_win_ != MPI_WIN_NULL) {
+    (void)MPI_Win_unlock_all(steal_nodes_win_);
+    (void)MPI_Win_unlock_all(steal_claim_win_);
+    (void)MPI_Win_free(&steal_nodes_win_);
+    (void)MPI_Win_free(&steal_claim_win_);
+  }
 
   (void)MPI_Finalize();
 }
@@ -386,7 +413,14 @@ void MCMCSamplerStochasticDistributed::BroadcastHeldOut() {
 
 
 void MCMCSamplerStochasticDistributed::MasterAwareLoadNetwork() {
-  if (args_.REPLICATED_NETWORK) {
+  if (args_.decentralized_minibatch) {
+    // All ranks must agree on the held-out and test sets, or they would
+    // sample different minibatches. Then reseed, so the ranks don't draw
+    // the same random numbers for their own work.
+    LoadNetwork(mpi_master_, false);
+    InitRandom(mpi_rank_);
+    InitMinibatchRandom();
+  } else if (args_.REPLICATED_NETWORK) {
     LoadNetwork(mpi_rank_, false);
   } else {
     if (mpi_rank_ == mpi_master_) {
@@ -400,6 +434,136 @@ void MCMCSamplerStochasticDistributed::MasterAwareLoadNetwork() {
 }
 
 
+void MCMCSamplerStochasticDistributed::InitMinibatchRandom() {
+  int r;
+
+  // The number of randoms determines how the minibatch sampling is split
+  // up, so it must be equal at all ranks too
+  int32_t n = omp_get_max_threads();
+  r = MPI_Bcast(&n, 1, MPI_INT, mpi_master_, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Bcast of #minibatch randoms fails");
+
+  int seed = args_.random_seed;
+  minibatch_rng_.resize(n);
+  for (::size_t i = 0; i < minibatch_rng_.size(); ++i) {
+    minibatch_rng_[i] = new Random::Random(seed + 1 + i, seed + 1, false);
+  }
+  network.SetMinibatchRandom(&minibatch_rng_);
+}
+
+
+void MCMCSamplerStochasticDistributed::InitPartition() {
+  int r;
+
+  // One part per pi host, each no larger than a host's share of the values
+  ::size_t parts = master_hosts_pi_ ? mpi_size_ : mpi_size_ - 1;
+  ::size_t capacity = (N + parts - 1) / parts;
+  node_part_.resize(N);
+  if (mpi_rank_ == mpi_master_) {
+    node_part_ = partition::Partition(args_.partition,
+                                      network.get_linked_edges(),
+                                      N, parts, capacity);
+    std::cerr << "Partition " << args_.partition << " over " << parts <<
+      " pi hosts: " <<
+      (100.0 * partition::LocalEdgeFraction(network.get_linked_edges(),
+                                            node_part_)) <<
+      "% of the edges are within a host" << std::endl;
+  }
+  r = MPI_Bcast(node_part_.data(), N, MPI_INT, mpi_master_, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Bcast of the pi partition fails");
+
+  d_kv_store_->SetPartition(node_part_, parts);
+}
+
+
+void MCMCSamplerStochasticDistributed::LoadGraphShard() {
+  int r;
+
+  // Ascending, so the master and I agree on the order without sending it
+  shard_nodes_.clear();
+  for (Vertex n = 0; n < static_cast<Vertex>(N); ++n) {
+    if (node_owner(n) == mpi_rank_) {
+      shard_nodes_.push_back(n);
+    }
+  }
+
+  std::vector<int32_t> set_size(shard_nodes_.size());
+  LocalNetwork::Adjacency flat_shard(
+    huge_pages::Allocator<Vertex>("graph adjacency"));
+  if (mpi_rank_ == mpi_master_) {
+    std::vector<std::vector<Vertex> > shard(mpi_size_);
+    for (Vertex n = 0; n < static_cast<Vertex>(N); ++n) {
+      shard[node_owner(n)].push_back(n);
+    }
+
+    std::vector<int32_t> size_count(mpi_size_);
+    std::vector<int32_t> size_displ(mpi_size_);
+    std::vector<int32_t> shard_count(mpi_size_);
+    std::vector<int32_t> shard_displ(mpi_size_);
+    std::vector<int32_t> shard_set_size;
+    for (int i = 0; i < mpi_size_; ++i) {
+      shard_count[i] = 0;
+      for (auto n : shard[i]) {
+        int32_t fan_out = network.get_fan_out(n);
+        shard_set_size.push_back(fan_out);
+        shard_count[i] += fan_out;
+      }
+      size_count[i] = shard[i].size();
+    }
+    size_displ[0] = 0;
+    shard_displ[0] = 0;
+    for (int i = 1; i < mpi_size_; ++i) {
+      size_displ[i] = size_displ[i - 1] + size_count[i - 1];
+      shard_displ[i] = shard_displ[i - 1] + shard_count[i - 1];
+    }
+
+    r = MPI_Scatterv(shard_set_size.data(), size_count.data(),
+                     size_displ.data(), MPI_INT,
+                     set_size.data(), set_size.size(), MPI_INT,
+                     mpi_master_, MPI_COMM_WORLD);
+    mpi_error_test(r, "MPI_Scatterv of graph shard fan out fails");
+
+    std::vector<Vertex> shards(np::sum(shard_set_size));
+#pragma omp parallel for
+    for (int i = 0; i < mpi_size_; ++i) {
+      ::size_t marshalled = shard_displ[i];
+      for (auto n : shard[i]) {
+        marshalled += network.marshall_edges_from(n,
+                                                  shards.data() + marshalled);
+      }
+    }
+
+    flat_shard.resize(np::sum(set_size));
+    r = MPI_Scatterv(shards.data(), shard_count.data(), shard_displ.data(),
+                     MPI_INT,
+                     flat_shard.data(), flat_shard.size(), MPI_INT,
+                     mpi_master_, MPI_COMM_WORLD);
+    mpi_error_test(r, "MPI_Scatterv of graph shard fails");
+
+  } else {
+    r = MPI_Scatterv(NULL, NULL, NULL, MPI_INT,
+                     set_size.data(), set_size.size(), MPI_INT,
+                     mpi_master_, MPI_COMM_WORLD);
+    mpi_error_test(r, "MPI_Scatterv of graph shard fan out fails");
+
+    flat_shard.resize(np::sum(set_size));
+    r = MPI_Scatterv(NULL, NULL, NULL, MPI_INT,
+                     flat_shard.data(), flat_shard.size(), MPI_INT,
+                     mpi_master_, MPI_COMM_WORLD);
+    mpi_error_test(r, "MPI_Scatterv of graph shard fails");
+  }
+
+  std::cerr << "Graph shard: " << shard_nodes_.size() << " nodes, " <<
+    flat_shard.size() << " edges" << std::endl;
+  local_network_.unmarshall_local_graph(set_size, &flat_shard);
+}
+
+
+bool MCMCSamplerStochasticDistributed::nodes_at_owner() const {
+  return args_.dkv_epochs || args_.graph_shards;
+}
+
+
 void MCMCSamplerStochasticDistributed::InitDKVStore() {
   t_init_dkv_.start();
 
@@ -409,6 +573,21 @@ void MCMCSamplerStochasticDistributed::InitDKVStore() {
     d_kv_store_ = std::unique_ptr<DKV::DKVFile::DKVStoreFile>(
                     new DKV::DKVFile::DKVStoreFile(args_.getRemains()));
     break;
+  case DKV::TYPE::SHM: {
+    // The store's ranks are mine, which may not be what the environment
+    // says, e.g. with MPI_THREADS
+    int local_rank;
+    int local_ranks;
+    host_ranks(&local_rank, &local_ranks);
+    if (local_ranks != mpi_size_) {
+      throw MCMCException("--mcmc.dkv-type shm requires all ranks on one "
+                          "host");
+    }
+    auto shm = new DKV::DKVShm::DKVStoreShm(args_.getRemains());
+    d_kv_store_ = std::unique_ptr<DKV::DKVShm::DKVStoreShm>(shm);
+    shm->SetRank(local_rank, local_ranks);
+    break;
+  }
 #ifdef MCMC_ENABLE_RAMCLOUD
   case DKV::TYPE::RAMCLOUD:
     d_kv_store_ = std::unique_ptr<DKV::DKVRamCloud::DKVStoreRamCloud>(
@@ -443,6 +622,13 @@ void MCMCSamplerStochasticDistributed::InitDKVStore() {
       throw InvalidArgumentException(
               "/proc/meminfo has no line for MemTotal");
     }
+    // In a container or batch job, the cgroup limit is what I can use
+    int64_t cgroup_limit = cgroup_memory_limit();
+    if (cgroup_limit != -1 && cgroup_limit / 1024 < mem_total) {
+      std::cerr << "cgroup memory limit " << cgroup_limit / 1024 <<
+        "KB < MemTotal " << mem_total << "KB" << std::endl;
+      mem_total = cgroup_limit / 1024;
+    }
     // /proc/meminfo reports KB
     ::size_t pi_total = (1024 * mem_total) / ((K + 1) * sizeof(Float));
     args_.max_pi_cache_entries_ = pi_total / 32;
@@ -459,9 +645,24 @@ void MCMCSamplerStochasticDistributed::InitDKVStore() {
     workers = mpi_size_ - 1;
   }
 
-  // pi cache hosts chunked subset of minibatch nodes + their neighbors
-  max_minibatch_chunk_ = args_.max_pi_cache_entries_ / (1 + real_num_node_sample());
-  max_dkv_write_entries_ = (max_minibatch_nodes_ + workers - 1) / workers;
+  // pi cache hosts chunked subset of minibatch nodes + their neighbors.
+  // update_phi double-buffers: it fetches the next chunk into one cache
+  // region while it computes the current chunk from the other
+  max_minibatch_chunk_ = args_.max_pi_cache_entries_ /
+                           (2 * (1 + real_num_node_sample()));
+  if (nodes_at_owner() || args_.async || args_.steal) {
+    // Each node is updated by its owner, so the minibatch may be skewed.
+    // Asynchronous workers each update a whole minibatch. A thief may
+    // update any number of its peers' nodes.
+    max_dkv_write_entries_ = max_minibatch_nodes_;
+  } else {
+    // Leave room for the imbalance that the node assignment tolerates
+    max_dkv_write_entries_ = static_cast< ::size_t>(
+                               std::ceil((1.0 + args_.minibatch_imbalance) *
+                                         max_minibatch_nodes_ / workers));
+    max_dkv_write_entries_ = std::min(max_dkv_write_entries_,
+                                      max_minibatch_nodes_);
+  }
   ::size_t max_my_minibatch_nodes = std::min(max_minibatch_chunk_,
                                              max_dkv_write_entries_);
   ::size_t max_minibatch_neighbors = max_my_minibatch_nodes *
@@ -474,17 +675,17 @@ void MCMCSamplerStochasticDistributed::InitDKVStore() {
   ::size_t max_my_perp_nodes = std::min(2 * max_perplexity_chunk_,
                                         num_perp_nodes);
 
-  // must cache pi[minibatch slice] for update_beta
-  ::size_t max_beta_nodes = (max_minibatch_nodes_ + mpi_size_ - 1) / mpi_size_;
-  max_minibatch_neighbors = std::max(max_minibatch_neighbors, max_beta_nodes);
-  if (max_minibatch_neighbors > args_.max_pi_cache_entries_) {
-    throw MCMCException("pi cache cannot contain pi[minibatch] for beta, "
-                        "refactor so update_beta is chunked");
-  }
-
   ::size_t max_pi_cache = std::max(max_my_minibatch_nodes +
                                      max_minibatch_neighbors,
                                    max_my_perp_nodes);
+  max_pi_cache = std::max(max_pi_cache,
+                          2 * max_my_minibatch_nodes *
+                            (1 + real_num_node_sample()));
+  // update_beta is chunked so its nodes fit in the whole pi cache
+  max_beta_chunk_ = max_pi_cache;
+  // update_phi may use smaller chunks if that suffices to hide the fetches
+  phi_tuner_ = ChunkTuner(16, max_minibatch_chunk_);
+  phi_chunk_size_ = max_minibatch_chunk_;
 
   std::cerr << "minibatch size param " << mini_batch_size <<
     " max " << max_minibatch_nodes_ <<
@@ -500,11 +701,51 @@ void MCMCSamplerStochasticDistributed::InitDKVStore() {
     " mine " << max_my_perp_nodes <<
     " chunk " << max_perplexity_chunk_ << std::endl;
 
+  // phi_sum, the last element of a pi row, is always kept in full precision
+  if (args_.dkv_codec_validate) {
+    d_kv_store_->SetCodec(DKV::CODEC::NONE, 1);
+    validate_codec_.Init(args_.dkv_codec, K + 1, 1);
+    std::cerr << "D-KV codec " << args_.dkv_codec <<
+      ": validate perplexity drift, store pi in full precision" << std::endl;
+  } else {
+    d_kv_store_->SetCodec(args_.dkv_codec, 1);
+  }
+  d_kv_store_->SetEpochs(args_.dkv_epochs);
+  d_kv_store_->SetNuma(args_.numa);
+  // So the shm store's ranks don't meet at a segment of a crashed run
+  uint64_t run_id = 0;
+  if (mpi_rank_ == mpi_master_) {
+    std::random_device device;
+    run_id = (static_cast<uint64_t>(device()) << 32) | device();
+  }
+  int r = MPI_Bcast(&run_id, 1, MPI_UNSIGNED_LONG, mpi_master_,
+                    MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Bcast(D-KV run id) fails");
+  d_kv_store_->SetRunId(run_id);
   d_kv_store_->Init(K + 1, N, max_pi_cache, max_dkv_write_entries_);
+  d_kv_store_->InitCacheRegions(2);
+  numa_order_ = ! thread_numa_node_.empty() && d_kv_store_->NumaNode(0) >= 0;
+  if (args_.numa != numa::POLICY::NONE && ! numa_order_) {
+    std::cerr << "D-KV store " << args_.dkv_type << " does not place its "
+      "values by NUMA node; update_phi ignores --mcmc.numa" << std::endl;
+  }
   t_init_dkv_.stop();
 
   master_hosts_pi_ = d_kv_store_->include_master();
 
+  if (args_.partition != partition::PARTITION::NONE) {
+    t_partition_.start();
+    InitPartition();
+    t_partition_.stop();
+  }
+  if (nodes_at_owner() && master_hosts_pi_ != master_is_worker_) {
+    // Only the owner of a pi row may write it, or a peer could overwrite
+    // the next epoch of a row while its owner carries it forward.
+    // A graph shard only holds the adjacency of the nodes its rank hosts.
+    throw MCMCException("--mcmc.dkv-epochs and --mcmc.graph-shards require "
+                        "that the master is a worker iff it hosts pi values");
+  }
+
   std::cerr << "Master is " << (master_is_worker_ ? "" : "not ") <<
     "a worker, does " << (master_hosts_pi_ ? "" : "not ") <<
     "host pi values" << std::endl;
@@ -514,9 +755,20 @@ void MCMCSamplerStochasticDistributed::InitDKVStore() {
 void MCMCSamplerStochasticDistributed::init() {
   int r;
 
-  // In an OpenMP program: no need for thread support
-  r = MPI_Init(NULL, NULL);
-  mpi_error_test(r, "MPI_Init() fails");
+  if (args_.comm_thread) {
+    // The communication thread and the main thread both call MPI
+    int provided;
+    r = MPI_Init_thread(NULL, NULL, MPI_THREAD_MULTIPLE, &provided);
+    mpi_error_test(r, "MPI_Init_thread() fails");
+    if (provided < MPI_THREAD_MULTIPLE) {
+      throw MCMCException("--mcmc.comm-thread requires an MPI that provides "
+                          "MPI_THREAD_MULTIPLE");
+    }
+  } else {
+    // In an OpenMP program: no need for thread support
+    r = MPI_Init(NULL, NULL);
+    mpi_error_test(r, "MPI_Init() fails");
+  }
 
   r = MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
   mpi_error_test(r, "MPI_Comm_set_errhandler fails");
@@ -535,6 +787,57 @@ void MCMCSamplerStochasticDistributed::init() {
     master_is_worker_ = (mpi_size_ == 1);
   }
 
+  if (args_.decentralized_minibatch) {
+    if (! args_.REPLICATED_NETWORK) {
+      throw MCMCException("--mcmc.decentralized-minibatch requires "
+                          "--mcmc.replicated-graph");
+    }
+    if (strategy == strategy::RANDOM_EDGE) {
+      // its sampling depends on the OpenMP schedule
+      throw MCMCException("--mcmc.decentralized-minibatch requires a "
+                          "stratified random node strategy");
+    }
+  }
+
+  if (args_.warm_start) {
+    throw MCMCException("--mcmc.warm-start is only supported by the "
+                        "sequential sampler");
+  }
+
+  if (args_.steal) {
+    // A thief looks up the edges of the nodes it steals
+    if (! args_.REPLICATED_NETWORK) {
+      throw MCMCException("--mcmc.steal requires --mcmc.replicated-graph");
+    }
+    if (args_.dkv_epochs) {
+      throw MCMCException("--mcmc.steal moves minibatch nodes away from "
+                          "their pi host, which --mcmc.dkv-epochs forbids");
+    }
+  }
+
+  if (args_.comm_thread) {
+    // Its collectives may run concurrently with mine on MPI_COMM_WORLD
+    r = MPI_Comm_dup(MPI_COMM_WORLD, &beta_comm_);
+    mpi_error_test(r, "MPI_Comm_dup() fails");
+#ifdef MCMC_MPI_THREADS
+    comm_thread_.reset(new CommThread(mpi_threads::Inherit()));
+#else
+    comm_thread_.reset(new CommThread());
+#endif
+  }
+
+  if (args_.graph_shards && args_.REPLICATED_NETWORK) {
+    throw MCMCException("--mcmc.graph-shards and --mcmc.replicated-graph "
+                        "are mutually exclusive");
+  }
+
+  if (args_.numa != numa::POLICY::NONE) {
+    // Before anything is allocated, so my threads first touch their memory
+    // from their own NUMA node
+    pin_threads();
+  }
+  huge_pages::SetPolicy(args_.huge_pages);
+
   t_load_network_.start();
   MasterAwareLoadNetwork();
   t_load_network_.stop();
@@ -556,15 +859,58 @@ void MCMCSamplerStochasticDistributed::init() {
 
   InitDKVStore();
 
+  if (args_.graph_shards) {
+    t_load_shard_.start();
+    LoadGraphShard();
+    t_load_shard_.stop();
+  }
+
   // Need to know max_perplexity_chunk_ to Init perp_
   perp_.Init(max_perplexity_chunk_);
+  if (args_.dkv_codec_validate) {
+    perp_.codec_accu_.resize(omp_get_max_threads());
+    perp_.codec_pi_.resize(omp_get_max_threads(),
+                           std::vector<Float>(2 * (K + 1)));
+    ppx_codec_per_heldout_edge_ =
+      std::vector<Float>(network.get_held_out_size(), FLOAT(0.0));
+  }
 
   init_theta();
+  if (args_.allreduce_beta) {
+    // From here on, all ranks apply the same theta updates
+    broadcast_theta();
+    theta_rng_ = new Random::Random(args_.random_seed + 2,
+                                    args_.random_seed + 2, false);
+    grads_beta_packed_.resize(2 * K + 1);
+  }
+
+  node_rng_.resize(omp_get_max_threads());
+  for (auto &r : node_rng_) {
+    r = new Random::Random(args_.random_seed + 3, args_.random_seed + 3,
+                           false);
+  }
 
   t_populate_pi_.start();
-  init_pi();
+  if (args_.restart) {
+    RestoreCheckpoint();
+  } else {
+    init_pi();
+  }
   t_populate_pi_.stop();
 
+  if (args_.huge_pages != huge_pages::POLICY::NONE) {
+    std::ostringstream report;
+    report << "Rank " << mpi_rank_ << ": ";
+    huge_pages::Report(report);
+    std::cerr << report.str();
+  }
+
+  if (args_.checkpoint_interval > 0) {
+    checkpoint_writer_ = std::unique_ptr<checkpoint::Writer>(
+                            new checkpoint::Writer(args_.checkpoint_dir,
+                                                   mpi_rank_));
+  }
+
   pi_update_.resize(max_dkv_write_entries_);
   for (auto &p : pi_update_) {
     p = new Float[K + 1];
@@ -573,6 +919,26 @@ void MCMCSamplerStochasticDistributed::init() {
   for (auto &p : phi_node_) {
     p.resize(K + 1);
   }
+  if (args_.steal) {
+    if (max_dkv_write_entries_ > kClaimMask) {
+      throw MCMCException("--mcmc.steal supports at most " +
+                          std::to_string(kClaimMask) + " minibatch nodes");
+    }
+    steal_nodes_.resize(max_dkv_write_entries_);
+    r = MPI_Win_create(steal_nodes_.data(),
+                       steal_nodes_.size() * sizeof steal_nodes_[0],
+                       sizeof steal_nodes_[0], MPI_INFO_NULL, MPI_COMM_WORLD,
+                       &steal_nodes_win_);
+    mpi_error_test(r, "MPI_Win_create(steal nodes) fails");
+    r = MPI_Win_create(&steal_claim_, sizeof steal_claim_, sizeof steal_claim_,
+                       MPI_INFO_NULL, MPI_COMM_WORLD, &steal_claim_win_);
+    mpi_error_test(r, "MPI_Win_create(steal claim) fails");
+    // Passive target: a claim needs no action of its target
+    r = MPI_Win_lock_all(MPI_MODE_NOCHECK, steal_nodes_win_);
+    mpi_error_test(r, "MPI_Win_lock_all(steal nodes) fails");
+    r = MPI_Win_lock_all(MPI_MODE_NOCHECK, steal_claim_win_);
+    mpi_error_test(r, "MPI_Win_lock_all(steal claim) fails");
+  }
   grads_beta_.resize(omp_get_max_threads());
   for (auto &g : grads_beta_) {
     g = std::vector<std::vector<Float> >(2, std::vector<Float>(K));    // gradients K*2 dimension
@@ -585,6 +951,8 @@ std::ostream& MCMCSamplerStochasticDistributed::PrintStats(
   Timer::printHeader(out);
   out << t_load_network_ << std::endl;
   out << t_init_dkv_ << std::endl;
+  out << t_partition_ << std::endl;
+  out << t_load_shard_ << std::endl;
   out << t_populate_pi_ << std::endl;
   out << t_outer_ << std::endl;
   out << t_deploy_minibatch_ << std::endl;
@@ -603,25 +971,67 @@ std::ostream& MCMCSamplerStochasticDistributed::PrintStats(
   out << t_sample_neighbors_flatten_ << std::endl;
   out << t_load_pi_minibatch_ << std::endl;
   out << t_load_pi_neighbor_ << std::endl;
+  out << t_load_pi_wait_ << std::endl;
+  out << t_load_pi_inflight_ << std::endl;
+  {
+    // Whatever part of the time in flight we did not wait for is hidden
+    // behind the update_phi computation
+    double inflight = std::chrono::duration_cast<std::chrono::duration<double>>(
+                        t_load_pi_inflight_.total()).count();
+    double wait = std::chrono::duration_cast<std::chrono::duration<double>>(
+                    t_load_pi_wait_.total()).count();
+    out << "      prefetched pi hidden " << std::setprecision(3) <<
+      (inflight > 0.0 ? 100.0 * (inflight - wait) / inflight : 0.0) << "%" <<
+      std::endl;
+  }
   out << t_update_phi_ << std::endl;
   out << t_barrier_phi_ << std::endl;
   out << t_update_pi_ << std::endl;
   out << t_store_pi_minibatch_ << std::endl;
+  if (comm_thread_) {
+    out << t_store_pi_wait_ << std::endl;
+    out << "      stored pi hidden " << std::setprecision(3) <<
+      hidden(t_store_pi_minibatch_, t_store_pi_wait_) << "%" << std::endl;
+  }
   out << t_barrier_pi_ << std::endl;
+  out << t_carry_pi_ << std::endl;
   out << t_update_beta_ << std::endl;
   out << t_beta_zero_ << std::endl;
   out << t_beta_rank_ << std::endl;
+  out << t_beta_scatter_ << std::endl;
+  out << t_comm_wait_ << std::endl;
+  if (comm_thread_) {
+    // The part of the scatter that update_beta did not wait for ran
+    // behind update_phi/update_pi
+    out << "      update_beta scatter hidden " << std::setprecision(3) <<
+      hidden(t_beta_scatter_, t_comm_wait_) << "%" << std::endl;
+  }
   out << t_load_pi_beta_ << std::endl;
   out << t_beta_calc_grads_ << std::endl;
   out << t_beta_sum_grads_ << std::endl;
   out << t_beta_reduce_grads_ << std::endl;
+  if (comm_thread_) {
+    out << t_beta_reduce_wait_ << std::endl;
+    out << "      beta reduce(+) hidden " << std::setprecision(3) <<
+      hidden(t_beta_reduce_grads_, t_beta_reduce_wait_) << "%" << std::endl;
+  }
   out << t_beta_update_theta_ << std::endl;
+  out << t_epoch_barrier_ << std::endl;
   out << t_perplexity_ << std::endl;
   out << t_load_pi_perp_ << std::endl;
   out << t_cal_edge_likelihood_ << std::endl;
   out << t_purge_pi_perp_ << std::endl;
   out << t_reduce_perp_ << std::endl;
   out << c_minibatch_chunk_size_ << std::endl;
+  out << c_minibatch_nodes_at_owner_ << std::endl;
+  out << c_minibatch_nodes_moved_ << std::endl;
+  out << t_checkpoint_ << std::endl;
+  out << c_beta_pi_reused_ << std::endl;
+  out << c_phi_nodes_stolen_ << std::endl;
+  if (numa_order_) {
+    out << c_numa_local_ << std::endl;
+    out << c_numa_remote_ << std::endl;
+  }
 
   return out;
 }
@@ -639,6 +1049,10 @@ void MCMCSamplerStochasticDistributed::run() {
   r = MPI_Barrier(MPI_COMM_WORLD);
   mpi_error_test(r, "MPI_Barrier(initial) fails");
 
+  if (args_.adaptive_chunk) {
+    probe_pi_latency();
+  }
+
   t_start_ = std::chrono::system_clock::now();
 
   while (step_count < max_iteration && ! is_converged()) {
@@ -655,35 +1069,46 @@ void MCMCSamplerStochasticDistributed::run() {
     check_perplexity(false);
 
     t_deploy_minibatch_.start();
-    // edgeSample is nonempty only at the master
+    // edgeSample is nonempty only at the master, unless all ranks sample
     // assigns nodes_
     EdgeSample edgeSample = deploy_mini_batch();
     t_deploy_minibatch_.stop();
+
+    if (comm_thread_ && ! args_.decentralized_minibatch) {
+      // update_beta needs its slices of the minibatch only after update_pi
+      post_scatter_minibatch_for_theta(edgeSample.first);
+    }
     // std::cerr << "Minibatch nodes " << nodes_.size() << std::endl;
 
     t_update_phi_pi_.start();
     update_phi(&phi_node_);
 
-    // barrier: peers must not read pi already updated in the current iteration
-    t_barrier_phi_.start();
-    r = MPI_Barrier(MPI_COMM_WORLD);
-    mpi_error_test(r, "MPI_Barrier(post pi) fails");
-    t_barrier_phi_.stop();
+    // With epochs, update_pi writes the next epoch of pi, and update_beta
+    // reads the current epoch and then closes it
+    if (! args_.dkv_epochs) {
+      // barrier: peers must not read pi already updated in the current iteration
+      t_barrier_phi_.start();
+      r = MPI_Barrier(MPI_COMM_WORLD);
+      mpi_error_test(r, "MPI_Barrier(post pi) fails");
+      t_barrier_phi_.stop();
+    }
 
     update_pi(phi_node_);
 
-    // barrier: ensure we read pi/phi_sum from current iteration
-    t_barrier_pi_.start();
-    r = MPI_Barrier(MPI_COMM_WORLD);
-    mpi_error_test(r, "MPI_Barrier(post pi) fails");
-    t_barrier_pi_.stop();
+    if (! args_.dkv_epochs) {
+      // barrier: ensure we read pi/phi_sum from current iteration
+      t_barrier_pi_.start();
+      r = MPI_Barrier(MPI_COMM_WORLD);
+      mpi_error_test(r, "MPI_Barrier(post pi) fails");
+      t_barrier_pi_.stop();
+    }
     t_update_phi_pi_.stop();
 
     t_update_beta_.start();
     update_beta(*edgeSample.first, edgeSample.second);
     t_update_beta_.stop();
 
-    if (mpi_rank_ == mpi_master_) {
+    if (mpi_rank_ == mpi_master_ || args_.decentralized_minibatch) {
       delete edgeSample.first;
     }
 
@@ -691,11 +1116,22 @@ void MCMCSamplerStochasticDistributed::run() {
     t_outer_.stop();
     // auto l2 = std::chrono::system_clock::now();
 
+    if (args_.checkpoint_interval > 0 &&
+        step_count % args_.checkpoint_interval == 0) {
+      t_checkpoint_.start();
+      SaveCheckpoint();
+      t_checkpoint_.stop();
+    }
+
     if (step_count % stats_print_interval_ == 0) {
       PrintStats(std::cout);
     }
   }
 
+  if (checkpoint_writer_) {
+    CommitCheckpoint();
+  }
+
   r = MPI_Barrier(MPI_COMM_WORLD);
   mpi_error_test(r, "MPI_Barrier(post pi) fails");
 
@@ -704,6 +1140,8 @@ void MCMCSamplerStochasticDistributed::run() {
   r = MPI_Barrier(MPI_COMM_WORLD);
   mpi_error_test(r, "MPI_Barrier(post pi) fails");
 
+  print_phi_balance();
+
   PrintStats(std::cout);
 }
 
@@ -757,15 +1195,14 @@ void MCMCSamplerStochasticDistributed::init_pi() {
     p = new Float[K + 1];
   }
 
-  ::size_t servers = master_hosts_pi_ ? mpi_size_ : mpi_size_ - 1;
-  ::size_t my_max = N / servers;
-  int my_server = master_hosts_pi_ ? mpi_rank_ : mpi_rank_ - 1;
-  if (my_server < 0) {
-    my_max = 0;
-  } else if (static_cast<::size_t>(my_server) < N - my_max * servers) {
-    ++my_max;
+  std::vector<int32_t> my_nodes;
+  for (::size_t n = 0; n < N; ++n) {
+    if (node_owner(n) == mpi_rank_) {
+      my_nodes.push_back(n);
+    }
   }
-  int last_node = my_server;
+  ::size_t my_max = my_nodes.size();
+  auto next_node = my_nodes.begin();
   while (my_max > 0) {
     ::size_t chunk = std::min(max_dkv_write_entries_, my_max);
     my_max -= chunk;
@@ -787,13 +1224,16 @@ void MCMCSamplerStochasticDistributed::init_pi() {
       pi_from_phi(pi[j], phi_pi[j]);
     }
 
-    std::vector<int32_t> node(chunk);
-    for (::size_t j = 0; j < chunk; ++j) {
-      node[j] = last_node;
-      last_node += servers;
-    }
+    std::vector<int32_t> node(next_node, next_node + chunk);
+    next_node += chunk;
 
     d_kv_store_->WriteKVRecords(node, constify(pi));
+    if (d_kv_store_->epochs() > 1) {
+      // Both epochs start out equal
+      d_kv_store_->FlipEpoch();
+      d_kv_store_->WriteKVRecords(node, constify(pi));
+      d_kv_store_->FlipEpoch();
+    }
     d_kv_store_->PurgeKVRecords();
     std::cerr << ".";
   }
@@ -804,6 +1244,194 @@ void MCMCSamplerStochasticDistributed::init_pi() {
   }
 }
 
+void MCMCSamplerStochasticDistributed::SaveCheckpoint() {
+  int r;
+
+  // Consistent cut: all pi updates of this iteration have landed
+  r = MPI_Barrier(MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Barrier(checkpoint) fails");
+
+  CommitCheckpoint();
+
+  checkpoint::Image image;
+  image.Put<uint64_t>(N);
+  image.Put<uint64_t>(K);
+  image.Put<int32_t>(mpi_size_);
+  image.Put<uint64_t>(step_count);
+  image.Put<uint64_t>(average_count);
+  image.Put(theta);
+  image.Put(ppx_per_heldout_edge_);
+  image.Put(ppx_codec_per_heldout_edge_);
+  image.Put(std::vector<Float>(ppxs_heldout_cb_.begin(),
+                               ppxs_heldout_cb_.end()));
+
+  std::vector<std::string> rng_state;
+  for (auto rng : rng_) {
+    rng_state.push_back(rng->get_state());
+  }
+  image.Put(rng_state);
+  rng_state.clear();
+  for (auto rng : minibatch_rng_) {
+    rng_state.push_back(rng->get_state());
+  }
+  image.Put(rng_state);
+  rng_state.clear();
+  if (theta_rng_ != NULL) {
+    rng_state.push_back(theta_rng_->get_state());
+  }
+  image.Put(rng_state);
+
+  std::vector<int32_t> my_nodes;
+  for (::size_t n = 0; n < N; ++n) {
+    if (node_owner(n) == mpi_rank_) {
+      my_nodes.push_back(n);
+    }
+  }
+  image.Put(my_nodes);
+  std::vector<Float *> pi(max_minibatch_chunk_);
+  for (::size_t chunk_start = 0; chunk_start < my_nodes.size();
+       chunk_start += max_minibatch_chunk_) {
+    ::size_t chunk = std::min(max_minibatch_chunk_,
+                              my_nodes.size() - chunk_start);
+    std::vector<int32_t> chunk_nodes(my_nodes.begin() + chunk_start,
+                                     my_nodes.begin() + chunk_start + chunk);
+    d_kv_store_->ReadKVRecords(pi, chunk_nodes, DKV::RW_MODE::READ_ONLY);
+    for (::size_t i = 0; i < chunk; ++i) {
+      image.PutBytes(pi[i], (K + 1) * sizeof(Float));
+    }
+    d_kv_store_->PurgeKVRecords();
+  }
+
+  // The file is written while the sampler continues
+  checkpoint_writer_->Write(step_count, std::move(image));
+  checkpoint_pending_ = step_count;
+}
+
+
+void MCMCSamplerStochasticDistributed::CommitCheckpoint() {
+  if (checkpoint_pending_ == 0) {
+    return;
+  }
+
+  int r;
+  int ok = checkpoint_writer_->Wait();
+  r = MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Allreduce(checkpoint written) fails");
+  if (ok) {
+    if (mpi_rank_ == mpi_master_) {
+      checkpoint::Commit(args_.checkpoint_dir, checkpoint_pending_);
+    }
+    // Only drop the previous checkpoint once the new one is marked
+    r = MPI_Barrier(MPI_COMM_WORLD);
+    mpi_error_test(r, "MPI_Barrier(checkpoint commit) fails");
+    if (checkpoint_committed_ != 0) {
+      checkpoint::Remove(args_.checkpoint_dir, checkpoint_committed_,
+                         mpi_rank_);
+    }
+    checkpoint_committed_ = checkpoint_pending_;
+  } else if (mpi_rank_ == mpi_master_) {
+    std::cerr << "Checkpoint of step " << checkpoint_pending_ <<
+      " is incomplete; the latest consistent checkpoint remains step " <<
+      checkpoint_committed_ << std::endl;
+  }
+  checkpoint_pending_ = 0;
+}
+
+
+void MCMCSamplerStochasticDistributed::RestoreCheckpoint() {
+  int r;
+  uint64_t step = 0;
+  if (mpi_rank_ == mpi_master_) {
+    step = checkpoint::Latest(args_.checkpoint_dir);
+  }
+  r = MPI_Bcast(&step, 1, MPI_UNSIGNED_LONG, mpi_master_, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Bcast(checkpoint step) fails");
+
+  checkpoint::Image image = checkpoint::Read(args_.checkpoint_dir, step,
+                                             mpi_rank_);
+  uint64_t n;
+  uint64_t k;
+  int32_t size;
+  image.Get(&n);
+  image.Get(&k);
+  image.Get(&size);
+  if (n != N || k != K || size != mpi_size_) {
+    throw MCMCException("Checkpoint of step " + std::to_string(step) +
+                        " does not match N, K or the number of ranks");
+  }
+  uint64_t count;
+  image.Get(&count);
+  step_count = count;
+  image.Get(&count);
+  average_count = count;
+  image.Get(&theta);
+  image.Get(&ppx_per_heldout_edge_);
+  image.Get(&ppx_codec_per_heldout_edge_);
+  std::vector<Float> ppxs;
+  image.Get(&ppxs);
+  ppxs_heldout_cb_.clear();
+  for (auto p : ppxs) {
+    ppxs_heldout_cb_.push_back(p);
+  }
+
+  std::vector<std::string> rng_state;
+  image.Get(&rng_state);
+  if (rng_state.size() != rng_.size()) {
+    throw MCMCException("Checkpoint has " + std::to_string(rng_state.size()) +
+                        " thread random generators, restart needs " +
+                        std::to_string(rng_.size()));
+  }
+  for (::size_t i = 0; i < rng_.size(); ++i) {
+    rng_[i]->set_state(rng_state[i]);
+  }
+  image.Get(&rng_state);
+  if (rng_state.size() != minibatch_rng_.size()) {
+    throw MCMCException("Checkpoint minibatch random generators do not "
+                        "match");
+  }
+  for (::size_t i = 0; i < minibatch_rng_.size(); ++i) {
+    minibatch_rng_[i]->set_state(rng_state[i]);
+  }
+  image.Get(&rng_state);
+  if (rng_state.size() != (theta_rng_ == NULL ? 0 : 1)) {
+    throw MCMCException("Checkpoint theta random generator does not match");
+  }
+  if (theta_rng_ != NULL) {
+    theta_rng_->set_state(rng_state[0]);
+  }
+
+  std::vector<int32_t> my_nodes;
+  image.Get(&my_nodes);
+  std::vector<Float*> pi(max_dkv_write_entries_);
+  for (auto & p : pi) {
+    p = new Float[K + 1];
+  }
+  for (::size_t chunk_start = 0; chunk_start < my_nodes.size();
+       chunk_start += max_dkv_write_entries_) {
+    ::size_t chunk = std::min(max_dkv_write_entries_,
+                              my_nodes.size() - chunk_start);
+    for (::size_t i = 0; i < chunk; ++i) {
+      image.GetBytes(pi[i], (K + 1) * sizeof(Float));
+    }
+    std::vector<int32_t> node(my_nodes.begin() + chunk_start,
+                              my_nodes.begin() + chunk_start + chunk);
+    d_kv_store_->WriteKVRecords(node, constify(pi));
+    if (d_kv_store_->epochs() > 1) {
+      d_kv_store_->FlipEpoch();
+      d_kv_store_->WriteKVRecords(node, constify(pi));
+      d_kv_store_->FlipEpoch();
+    }
+    d_kv_store_->PurgeKVRecords();
+  }
+  for (auto & p : pi) {
+    delete[] p;
+  }
+
+  checkpoint_committed_ = step;
+  std::cerr << "Restart from the checkpoint of step " << step << std::endl;
+}
+
+
 
 void MCMCSamplerStochasticDistributed::check_perplexity(bool force) {
   if (force || (step_count - 1) % interval == 0) {
@@ -822,6 +1450,15 @@ void MCMCSamplerStochasticDistributed::check_perplexity(bool force) {
                 << " time: " << std::setprecision(3) << (t_ms / 1000.0)
                 << " perplexity for hold out set: " << std::setprecision(12) <<
                 ppx_score << std::endl;
+      if (args_.dkv_codec_validate) {
+        std::cout << std::fixed << "step count: " << step_count <<
+          " perplexity full precision " << std::setprecision(12) <<
+          ppx_score << " codec " << args_.dkv_codec << " " <<
+          ppx_codec_score_ << " drift " << (ppx_codec_score_ - ppx_score) <<
+          " (" << std::setprecision(6) <<
+          (100.0 * (ppx_codec_score_ - ppx_score) / ppx_score) << "%)" <<
+          std::endl;
+      }
       double seconds = t_ms / 1000.0;
       timings_.push_back(seconds);
     }
@@ -831,11 +1468,26 @@ void MCMCSamplerStochasticDistributed::check_perplexity(bool force) {
 }
 
 
-void MCMCSamplerStochasticDistributed::ScatterSubGraph(
-    const std::vector<std::vector<int32_t> > &subminibatch) {
-  std::vector<int32_t> set_size(nodes_.size());
-  std::vector<Vertex> flat_subgraph;
-  int r;
+void MCMCSamplerStochasticDistributed::index_graph_shard() {
+  shard_index_.resize(nodes_.size());
+  for (::size_t i = 0; i < nodes_.size(); ++i) {
+    auto it = std::lower_bound(shard_nodes_.begin(), shard_nodes_.end(),
+                               nodes_[i]);
+    if (it == shard_nodes_.end() || *it != nodes_[i]) {
+      throw MCMCException("Minibatch node " + std::to_string(nodes_[i]) +
+                          " is not in my graph shard");
+    }
+    shard_index_[i] = it - shard_nodes_.begin();
+  }
+}
+
+
+void MCMCSamplerStochasticDistributed::ScatterSubGraph(
+    const std::vector<std::vector<int32_t> > &subminibatch) {
+  std::vector<int32_t> set_size(nodes_.size());
+  LocalNetwork::Adjacency flat_subgraph(
+    huge_pages::Allocator<Vertex>("graph adjacency"));
+  int r;
 
   local_network_.reset();
 
@@ -945,17 +1597,124 @@ void MCMCSamplerStochasticDistributed::ScatterSubGraph(
   }
 
   t_scatter_subgraph_unmarshall_.start();
-  ::size_t offset = 0;
-  for (::size_t i = 0; i < set_size.size(); ++i) {
-    Vertex* marshall = &flat_subgraph[offset];
-    local_network_.unmarshall_local_graph(i, marshall, set_size[i]);
-    offset += set_size[i];
-  }
+  local_network_.unmarshall_local_graph(set_size, &flat_subgraph);
   t_scatter_subgraph_unmarshall_.stop();
 }
 
 
+// Estimated work of a minibatch node: its neighbor sample, and its
+// adjacency list that is shipped and searched
+::size_t MCMCSamplerStochasticDistributed::node_cost(Vertex node) const {
+  return real_num_node_sample() + network.get_linked_edges().edges_at(node).size();
+}
+
+
+void MCMCSamplerStochasticDistributed::assign_mini_batch_nodes(
+    const MinibatchNodeSet &nodes,
+    std::vector<std::vector<int32_t> >* subminibatch) {
+  subminibatch->resize(mpi_size_);	// FIXME: lift to class, size is static
+
+  // Prefer the worker that hosts a node's pi, so its pi is read and written
+  // locally, as long as that worker's cost stays within the tolerated
+  // imbalance
+  ::size_t first_worker = master_is_worker_ ? 0 : 1;
+  ::size_t workers = mpi_size_ - first_worker;
+  std::vector< ::size_t> cost(nodes.size());
+  ::size_t total_cost = 0;
+  ::size_t i = 0;
+  for (auto n: nodes) {
+    cost[i] = node_cost(n);
+    total_cost += cost[i];
+    ++i;
+  }
+  ::size_t upper_bound = static_cast< ::size_t>(
+                           std::ceil((1.0 + args_.minibatch_imbalance) *
+                                     total_cost / workers));
+  if (nodes_at_owner()) {
+    // Only the owner may write a node's pi, or hold its adjacency
+    upper_bound = total_cost;
+  }
+
+  std::vector< ::size_t> load(mpi_size_, 0);
+  std::vector<std::pair< ::size_t, Vertex> > unassigned;
+  i = 0;
+  for (auto n: nodes) {
+    ::size_t owner = node_owner(n);
+    if (owner < first_worker ||
+        (*subminibatch)[owner].size() == max_dkv_write_entries_ ||
+        (load[owner] > 0 && load[owner] + cost[i] > upper_bound)) {
+      unassigned.push_back({ cost[i], n });
+    } else {
+      (*subminibatch)[owner].push_back(n);
+      load[owner] += cost[i];
+    }
+    ++i;
+  }
+  c_minibatch_nodes_at_owner_.tick(nodes.size() - unassigned.size());
+  c_minibatch_nodes_moved_.tick(unassigned.size());
+
+  // Largest first, each to the least loaded worker that has room left.
+  // Deterministic, so all ranks compute the same assignment if they sample
+  // the minibatch.
+  std::sort(unassigned.begin(), unassigned.end(),
+            std::greater<std::pair< ::size_t, Vertex> >());
+  typedef std::pair< ::size_t, ::size_t> LoadRank;
+  std::priority_queue<LoadRank, std::vector<LoadRank>,
+                      std::greater<LoadRank> > least_loaded;
+  for (::size_t w = first_worker; w < static_cast< ::size_t>(mpi_size_); ++w) {
+    if ((*subminibatch)[w].size() < max_dkv_write_entries_) {
+      least_loaded.push({ load[w], w });
+    }
+  }
+  for (auto u: unassigned) {
+    assert(! least_loaded.empty());
+    LoadRank lr = least_loaded.top();
+    least_loaded.pop();
+    (*subminibatch)[lr.second].push_back(u.second);
+    lr.first += u.first;
+    if ((*subminibatch)[lr.second].size() < max_dkv_write_entries_) {
+      least_loaded.push(lr);
+    }
+  }
+}
+
+
+void MCMCSamplerStochasticDistributed::check_my_mini_batch_size() const {
+  if (nodes_.size() > pi_update_.size()) {
+    PRINT_MEM_USAGE();
+    std::ostringstream msg;
+    msg << "Out of bounds for pi_update_/phi_node_: bounds " << pi_update_.size() << " required " << nodes_.size();
+    throw BufferSizeException(msg.str());
+  }
+}
+
+
+EdgeSample MCMCSamplerStochasticDistributed::sample_my_mini_batch() {
+  // All ranks sample the same minibatch from the same randoms, and they all
+  // assign its nodes the same way, so each can take its own share without
+  // communication
+  t_mini_batch_.start();
+  EdgeSample edgeSample = network.sample_mini_batch(mini_batch_size, strategy);
+  t_mini_batch_.stop();
+
+  t_nodes_in_mini_batch_.start();
+  MinibatchNodeSet nodes = nodes_in_batch(*edgeSample.first);
+  t_nodes_in_mini_batch_.stop();
+
+  std::vector<std::vector<int32_t> > subminibatch;
+  assign_mini_batch_nodes(nodes, &subminibatch);
+  nodes_.swap(subminibatch[mpi_rank_]);
+  check_my_mini_batch_size();
+
+  return edgeSample;
+}
+
+
 EdgeSample MCMCSamplerStochasticDistributed::deploy_mini_batch() {
+  if (args_.decentralized_minibatch) {
+    return sample_my_mini_batch();
+  }
+
   std::vector<std::vector<int> > subminibatch;
   std::vector<int32_t> minibatch_chunk(mpi_size_);      // FIXME: lift to class
   std::vector<int32_t> scatter_minibatch;               // FIXME: lift to class
@@ -978,28 +1737,7 @@ EdgeSample MCMCSamplerStochasticDistributed::deploy_mini_batch() {
     // std::cerr << "mini_batch size " << mini_batch.size() <<
     //   " num_node_sample " << num_node_sample << std::endl;
 
-    subminibatch.resize(mpi_size_);	// FIXME: lift to class, size is static
-
-    ::size_t workers = master_is_worker_ ? mpi_size_ : mpi_size_ - 1;
-    ::size_t upper_bound = (nodes.size() + workers - 1) / workers;
-    std::unordered_set<Vertex> unassigned;
-    for (auto n: nodes) {
-      ::size_t owner = node_owner(n);
-      if (subminibatch[owner].size() == upper_bound) {
-        unassigned.insert(n);
-      } else {
-        subminibatch[owner].push_back(n);
-      }
-    }
-
-    ::size_t i = master_is_worker_ ? 0 : 1;
-    for (auto n: unassigned) {
-      while (subminibatch[i].size() == upper_bound) {
-        ++i;
-        assert(i < static_cast< ::size_t>(mpi_size_));
-      }
-      subminibatch[i].push_back(n);
-    }
+    assign_mini_batch_nodes(nodes, &subminibatch);
 
     scatter_minibatch.clear();
     int32_t running_sum = 0;
@@ -1019,12 +1757,7 @@ EdgeSample MCMCSamplerStochasticDistributed::deploy_mini_batch() {
                   mpi_master_, MPI_COMM_WORLD);
   mpi_error_test(r, "MPI_Scatter of minibatch chunks fails");
   nodes_.resize(my_minibatch_size);
-  if (nodes_.size() > pi_update_.size()) {
-    PRINT_MEM_USAGE();
-    std::ostringstream msg;
-    msg << "Out of bounds for pi_update_/phi_node_: bounds " << pi_update_.size() << " required " << nodes_.size();
-    throw BufferSizeException(msg.str());
-  }
+  check_my_mini_batch_size();
 
   if (mpi_rank_ == mpi_master_) {
     // TODO Master scatters the minibatch nodes over the workers,
@@ -1048,7 +1781,9 @@ EdgeSample MCMCSamplerStochasticDistributed::deploy_mini_batch() {
   }
 
 
-  if (! args_.REPLICATED_NETWORK) {
+  if (args_.graph_shards) {
+    index_graph_shard();
+  } else if (! args_.REPLICATED_NETWORK) {
     t_scatter_subgraph_.start();
     ScatterSubGraph(subminibatch);
     t_scatter_subgraph_.stop();
@@ -1058,6 +1793,47 @@ EdgeSample MCMCSamplerStochasticDistributed::deploy_mini_batch() {
 }
 
 
+Random::Random* MCMCSamplerStochasticDistributed::node_random(
+    Vertex node, NodeRandomUse use) {
+  uint64_t stream = mix_seed(args_.random_seed);
+  stream = mix_seed(stream ^ step_count);
+  stream = mix_seed(stream ^ ((static_cast<uint64_t>(node) << 1) | use));
+  Random::Random* rng = node_rng_[omp_get_thread_num()];
+  rng->reseed(mix_seed(stream), stream | 1);
+  return rng;
+}
+
+
+void MCMCSamplerStochasticDistributed::DrawNodeNeighbors(
+    Vertex node, Random::Random* rng, int32_t *neighbors_out) {
+  const ::size_t p = real_num_node_sample();
+  // std::unordered_set neighbors;
+  FixedSizeSet neighbors(p);
+  // std::vector<Vertex> neighbors;
+  // sample a mini-batch of neighbors
+  while (neighbors.size() < p) {
+    const Vertex neighborId = rng->randint(0, N - 1);
+    if (neighborId != node
+        && neighbors.find(neighborId) == neighbors.end()
+        // && std::find(neighbors.begin(), neighbors.end(), neighborId) == neighbors.end()
+        ) {
+      const Edge edge = Edge(std::min(node, neighborId),
+                             std::max(node, neighborId));
+      if (! edge.in(held_out_test_)) {
+        neighbors.insert(neighborId);
+        // neighbors.push_back(neighborId);
+      }
+    }
+  }
+
+  ::size_t j = 0;
+  for (auto n : neighbors) {
+    neighbors_out[j] = n;
+    ++j;
+  }
+}
+
+
 void MCMCSamplerStochasticDistributed::DrawNeighbors(
     const int32_t* chunk_nodes,
     ::size_t n_chunk_nodes,
@@ -1067,90 +1843,398 @@ void MCMCSamplerStochasticDistributed::DrawNeighbors(
   c_minibatch_chunk_size_.tick(n_chunk_nodes);
 #pragma omp parallel for // schedule(static, 1)
   for (::size_t i = 0; i < n_chunk_nodes; ++i) {
-    const Vertex node = chunk_nodes[i];
-    auto* rng = rng_[omp_get_thread_num()];
-    // std::unordered_set neighbors;
-    FixedSizeSet neighbors(p);
-    // std::vector<Vertex> neighbors;
-    // sample a mini-batch of neighbors
-    while (neighbors.size() < p) {
-      const Vertex neighborId = rng->randint(0, N - 1);
-      if (neighborId != node
-          && neighbors.find(neighborId) == neighbors.end()
-          // && std::find(neighbors.begin(), neighbors.end(), neighborId) == neighbors.end()
-          ) {
-        const Edge edge = Edge(std::min(node, neighborId),
-                               std::max(node, neighborId));
-        if (! edge.in(held_out_test_)) {
-          neighbors.insert(neighborId);
-          // neighbors.push_back(neighborId);
-        }
-      }
-    }
-
     // Cannot use flat_neighbors.insert() because it may (concurrently)
     // attempt to resize flat_neighbors.
-    ::size_t j = i * p;
-    for (auto n : neighbors) {
-      flat_neighbors[j] = n;
-      ++j;
-    }
+    DrawNodeNeighbors(chunk_nodes[i],
+                      node_random(chunk_nodes[i], NODE_RANDOM_NEIGHBORS),
+                      flat_neighbors + i * p);
   }
   t_sample_neighbors_sample_.stop();
 }
 
 
-void MCMCSamplerStochasticDistributed::update_phi(
-    std::vector<std::vector<Float> >* phi_node) {
-  std::vector<Float*> pi_node;
-  std::vector<Float*> pi_neighbor;
-  std::vector<int32_t> flat_neighbors;
+bool MCMCSamplerStochasticDistributed::claim_phi_chunk(::size_t claimed,
+                                                       PhiChunk* chunk) {
+  chunk->start = claimed;
+  if (! args_.steal) {
+    ::size_t n = std::min(phi_chunk_size_, nodes_.size() - claimed);
+    chunk->nodes.assign(nodes_.begin() + claimed,
+                        nodes_.begin() + claimed + n);
+    return n > 0;
+  }
 
-  Float eps_t = get_eps_t();
+  // My phi_node_ and pi_update_ bound what I can take on
+  ::size_t max = std::min(phi_chunk_size_, pi_update_.size() - claimed);
+  chunk->nodes.clear();
+  if (max == 0) {
+    return false;
+  }
+  (void)claim_phi_nodes(mpi_rank_, max, false, &chunk->nodes);
+  // Steal from one peer until it is drained, then move on to the next
+  while (chunk->nodes.empty() && steal_victim_ != mpi_rank_) {
+    if (claim_phi_nodes(steal_victim_, max, true, &chunk->nodes)) {
+      c_phi_nodes_stolen_.tick(chunk->nodes.size());
+    } else {
+      steal_victim_ = (steal_victim_ + 1) % mpi_size_;
+    }
+  }
+  phi_nodes_.insert(phi_nodes_.end(), chunk->nodes.begin(),
+                    chunk->nodes.end());
 
-  for (::size_t chunk_start = 0;
-       chunk_start < nodes_.size();
-       chunk_start += max_minibatch_chunk_) {
-    ::size_t chunk = std::min(max_minibatch_chunk_,
-                              nodes_.size() - chunk_start);
+  return ! chunk->nodes.empty();
+}
+
+
+void MCMCSamplerStochasticDistributed::fetch_phi_chunk(::size_t region,
+                                                       bool parallel,
+                                                       PhiChunk* chunk) {
+  ::size_t n = chunk->nodes.size();
 
-    std::vector<int32_t> chunk_nodes(nodes_.begin() + chunk_start,
-                                     nodes_.begin() + chunk_start + chunk);
+  // ************ sample neighbor nodes in parallel at each host ******
+  chunk->pi_neighbor.resize(n * real_num_node_sample());
+  chunk->flat_neighbors.resize(n * real_num_node_sample());
+  t_sample_neighbor_nodes_.start();
+  if (parallel) {
+    DrawNeighbors(chunk->nodes.data(), n, chunk->flat_neighbors.data());
+  } else {
+    t_sample_neighbors_sample_.start();
+    c_minibatch_chunk_size_.tick(n);
+    for (::size_t i = 0; i < n; ++i) {
+      DrawNodeNeighbors(chunk->nodes[i],
+                        node_random(chunk->nodes[i], NODE_RANDOM_NEIGHBORS),
+                        chunk->flat_neighbors.data() +
+                          i * real_num_node_sample());
+    }
+    t_sample_neighbors_sample_.stop();
+  }
+  t_sample_neighbor_nodes_.stop();
 
-    // ************ sample neighbor nodes in parallel at each host ******
-    // std::cerr << "Sample neighbor nodes" << std::endl;
-    pi_neighbor.resize(chunk_nodes.size() * real_num_node_sample());
-    flat_neighbors.resize(chunk_nodes.size() * real_num_node_sample());
-    t_sample_neighbor_nodes_.start();
-    DrawNeighbors(chunk_nodes.data(), chunk_nodes.size(), flat_neighbors.data());
-    t_sample_neighbor_nodes_.stop();
+  // in flight until update_phi has waited for it
+  t_load_pi_inflight_.start();
+  chunk->issued = std::chrono::high_resolution_clock::now();
 
-    // ************ load minibatch node pi from D-KV store **************
+  chunk->pi_node.resize(n);
+  auto read = [this, region, chunk]() {
+    // ************ start loading minibatch node pi from D-KV store *****
     t_load_pi_minibatch_.start();
-    pi_node.resize(chunk_nodes.size());
-    d_kv_store_->ReadKVRecords(pi_node, chunk_nodes, DKV::RW_MODE::READ_ONLY);
+    (void)d_kv_store_->ReadKVRecordsAsync(region, chunk->pi_node,
+                                          chunk->nodes,
+                                          DKV::RW_MODE::READ_ONLY);
     t_load_pi_minibatch_.stop();
 
-    // ************ load neighor pi from D-KV store **********
+    // ************ start loading neighbor pi from D-KV store ***********
     t_load_pi_neighbor_.start();
-    d_kv_store_->ReadKVRecords(pi_neighbor,
-                               flat_neighbors,
-                               DKV::RW_MODE::READ_ONLY);
+    chunk->handle = d_kv_store_->ReadKVRecordsAsync(region,
+                                                    chunk->pi_neighbor,
+                                                    chunk->flat_neighbors,
+                                                    DKV::RW_MODE::READ_ONLY);
     t_load_pi_neighbor_.stop();
+  };
+
+  if (comm_thread_) {
+    // The comm thread also completes the reads, so the store is never
+    // accessed by two threads at once
+    chunk->ready = comm_thread_->Post([this, read, chunk]() {
+      read();
+      d_kv_store_->Wait(chunk->handle);
+    });
+  } else {
+    read();
+  }
+}
+
+
+void MCMCSamplerStochasticDistributed::host_ranks(int* local_rank,
+                                                  int* local_ranks) {
+#ifdef MCMC_MPI_THREADS
+  // All ranks are threads of this process
+  *local_rank = mpi_rank_;
+  *local_ranks = mpi_size_;
+#else
+  MPI_Comm local;
+  int r = MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, mpi_rank_,
+                              MPI_INFO_NULL, &local);
+  mpi_error_test(r, "MPI_Comm_split_type() fails");
+  r = MPI_Comm_rank(local, local_rank);
+  mpi_error_test(r, "MPI_Comm_rank(host) fails");
+  r = MPI_Comm_size(local, local_ranks);
+  mpi_error_test(r, "MPI_Comm_size(host) fails");
+  r = MPI_Comm_free(&local);
+  mpi_error_test(r, "MPI_Comm_free(host) fails");
+#endif
+}
+
+
+void MCMCSamplerStochasticDistributed::pin_threads() {
+  int local_rank;
+  int local_ranks;
+  host_ranks(&local_rank, &local_ranks);
+
+  numa::Topology topology;
+  thread_numa_node_ = numa::PinThreads(topology, local_rank, local_ranks);
+  if (thread_numa_node_.empty()) {
+    std::cerr << "Warning: cannot pin my threads; --mcmc.numa only places "
+      "the D-KV values" << std::endl;
+    return;
+  }
+
+  std::cerr << "NUMA " << args_.numa << ": " << topology.nodes() <<
+    " node(s), rank " << local_rank << " of " << local_ranks <<
+    " on this host pins its threads to node(s)";
+  for (auto n : thread_numa_node_) {
+    std::cerr << " " << n;
+  }
+  std::cerr << std::endl;
+}
+
+
+void MCMCSamplerStochasticDistributed::order_phi_chunk(
+    const PhiChunk &chunk) {
+  const ::size_t threads = thread_numa_node_.size();
+  const ::size_t nodes = thread_numa_node_.back() + 1;
+
+  // Counting sort by NUMA node; bucket n is [start[n], start[n + 1])
+  std::vector< ::size_t> start(nodes + 1, 0);
+  std::vector<int> node_of(chunk.nodes.size());
+  for (::size_t i = 0; i < chunk.nodes.size(); ++i) {
+    // A node that none of my threads runs on goes with my last node
+    node_of[i] = std::min(d_kv_store_->NumaNode(chunk.nodes[i]),
+                          static_cast<int>(nodes - 1));
+    ++start[node_of[i] + 1];
+  }
+  for (::size_t n = 0; n < nodes; ++n) {
+    start[n + 1] += start[n];
+  }
+  phi_order_.resize(chunk.nodes.size());
+  std::vector< ::size_t> next(start.begin(), start.end() - 1);
+  for (::size_t i = 0; i < chunk.nodes.size(); ++i) {
+    phi_order_[next[node_of[i]]++] = i;
+  }
+
+  // The threads of a NUMA node split its bucket. A bucket without threads
+  // falls to the thread before it, or to thread 0.
+  phi_bounds_.resize(threads + 1);
+  phi_bounds_[0] = 0;
+  ::size_t first = 0;
+  for (::size_t t = 1; t < threads; ++t) {
+    int n = thread_numa_node_[t];
+    if (n != thread_numa_node_[t - 1]) {
+      first = t;
+    }
+    ::size_t team = std::upper_bound(thread_numa_node_.begin(),
+                                     thread_numa_node_.end(), n) -
+                      thread_numa_node_.begin() - first;
+    phi_bounds_[t] = start[n] + (start[n + 1] - start[n]) * (t - first) / team;
+  }
+  phi_bounds_[threads] = chunk.nodes.size();
+}
+
+
+void MCMCSamplerStochasticDistributed::probe_pi_latency() {
+  // The time to read one pi row, best of a few, from all over the store
+  const ::size_t probes = 8;
+  double latency = std::numeric_limits<double>::max();
+  std::vector<int32_t> key(1);
+  std::vector<Float*> pi(1);
+  for (::size_t i = 0; i < probes; ++i) {
+    key[0] = (mpi_rank_ + 1 + i * (N / probes)) % N;
+    auto start = std::chrono::high_resolution_clock::now();
+    d_kv_store_->ReadKVRecords(pi, key, DKV::RW_MODE::READ_ONLY);
+    double t = std::chrono::duration<double>(
+                 std::chrono::high_resolution_clock::now() - start).count();
+    d_kv_store_->PurgeKVRecords();
+    latency = std::min(latency, t);
+  }
+  phi_tuner_.SetLatency(latency);
+  std::cerr << "pi fetch latency " << (latency * 1000000.0) << "us" <<
+    std::endl;
+}
+
+
+void MCMCSamplerStochasticDistributed::publish_phi_nodes() {
+  int r;
+
+  // The peers read the nodes only after they see the claim word
+  std::copy(nodes_.begin(), nodes_.end(), steal_nodes_.begin());
+  r = MPI_Win_sync(steal_nodes_win_);
+  mpi_error_test(r, "MPI_Win_sync(steal nodes) fails");
+
+  uint64_t word = claim_word((step_count + 1) & 0xffff, nodes_.size(), 0);
+  uint64_t previous;
+  r = MPI_Fetch_and_op(&word, &previous, MPI_UNSIGNED_LONG, mpi_rank_, 0,
+                       MPI_REPLACE, steal_claim_win_);
+  mpi_error_test(r, "MPI_Fetch_and_op(publish claim) fails");
+  r = MPI_Win_flush(mpi_rank_, steal_claim_win_);
+  mpi_error_test(r, "MPI_Win_flush(publish claim) fails");
+}
 
+
+bool MCMCSamplerStochasticDistributed::claim_phi_nodes(
+    int rank, ::size_t max, bool steal, std::vector<int32_t>* nodes) {
+  const uint64_t tag = (step_count + 1) & 0xffff;
+  int r;
+
+  nodes->clear();
+  uint64_t word;
+  r = MPI_Fetch_and_op(NULL, &word, MPI_UNSIGNED_LONG, rank, 0, MPI_NO_OP,
+                       steal_claim_win_);
+  mpi_error_test(r, "MPI_Fetch_and_op(read claim) fails");
+  r = MPI_Win_flush(rank, steal_claim_win_);
+  mpi_error_test(r, "MPI_Win_flush(read claim) fails");
+
+  while (true) {
+    uint64_t count = (word >> kClaimBits) & kClaimMask;
+    uint64_t next = word & kClaimMask;
+    // A peer that has not yet published this iteration has nothing for me
+    if ((word >> (2 * kClaimBits)) != tag || next >= count) {
+      return false;
+    }
+    // Guided: the owner takes an eighth of what is left, so a slow owner
+    // leaves nodes to steal; a thief takes half
+    uint64_t left = count - next;
+    uint64_t n = steal ? (left + 1) / 2
+                       : std::max((left + 7) / 8, std::min(left, kMinClaim));
+    n = std::min(n, static_cast<uint64_t>(max));
+
+    uint64_t claimed = claim_word(tag, count, next + n);
+    uint64_t seen;
+    r = MPI_Compare_and_swap(&claimed, &word, &seen, MPI_UNSIGNED_LONG, rank,
+                             0, steal_claim_win_);
+    mpi_error_test(r, "MPI_Compare_and_swap(claim) fails");
+    r = MPI_Win_flush(rank, steal_claim_win_);
+    mpi_error_test(r, "MPI_Win_flush(claim) fails");
+    if (seen == word) {
+      nodes->resize(n);
+      r = MPI_Get(nodes->data(), n, MPI_INT, rank, next, n, MPI_INT,
+                  steal_nodes_win_);
+      mpi_error_test(r, "MPI_Get(claimed nodes) fails");
+      r = MPI_Win_flush(rank, steal_nodes_win_);
+      mpi_error_test(r, "MPI_Win_flush(claimed nodes) fails");
+      return true;
+    }
+    // Someone else claimed in between
+    word = seen;
+  }
+}
+
+
+void MCMCSamplerStochasticDistributed::update_phi(
+    std::vector<std::vector<Float> >* phi_node) {
+  Float eps_t = get_eps_t();
+
+  if (mpi_rank_ == mpi_master_ && ! master_is_worker_) {
+    return;
+  }
+
+  if (args_.adaptive_chunk) {
+    phi_chunk_size_ = phi_tuner_.chunk();
+  }
+
+  if (args_.steal) {
+    // My own nodes first, then the peers' from the next rank on
+    publish_phi_nodes();
+    phi_nodes_.clear();
+    steal_victim_ = (mpi_rank_ + 1) % mpi_size_;
+  }
+
+  ::size_t current = 0;
+  if (claim_phi_chunk(0, &phi_chunk_[current])) {
+    fetch_phi_chunk(current, true, &phi_chunk_[current]);
+  }
+
+  bool has_next = ! phi_chunk_[current].nodes.empty();
+  while (has_next) {
+    PhiChunk &chunk = phi_chunk_[current];
+    ::size_t chunk_start = chunk.start;
+
+    t_load_pi_wait_.start();
+    if (comm_thread_) {
+      chunk.ready.get();
+    } else {
+      d_kv_store_->Wait(chunk.handle);
+    }
+    t_load_pi_wait_.stop();
+    t_load_pi_inflight_.stop();
+    auto computing = std::chrono::high_resolution_clock::now();
+    if (chunk_start == 0) {
+      // The first fetch is not overlapped, so it shows the full fetch time
+      phi_tuner_.Fetched(chunk.nodes.size(),
+                         std::chrono::duration<double>(computing -
+                                                       chunk.issued).count());
+    }
+
+    // Software pipeline: one thread samples the neighbors of the next chunk
+    // and issues the reads for its pi, then joins the other threads that
+    // compute this chunk. The D-KV store is accessed by that one thread only.
+    // Claims are MPI calls, so they stay with the master thread.
+    has_next = claim_phi_chunk(chunk_start + chunk.nodes.size(),
+                               &phi_chunk_[1 - current]);
+
+    // The degrees of the minibatch nodes are skewed, so the threads steal
+    // each other's share of the chunk; the fetching thread joins late
     t_update_phi_.start();
-#pragma omp parallel for // num_threads (12)
-    for (::size_t i = 0; i < chunk_nodes.size(); ++i) {
-      Vertex node = chunk_nodes[i];
-      update_phi_node(chunk_start + i, node, pi_node[i],
-                      flat_neighbors.begin() + i * real_num_node_sample(),
-                      pi_neighbor.begin() + i * real_num_node_sample(),
-                      eps_t, rng_[omp_get_thread_num()],
-                      &(*phi_node)[chunk_start + i]);
+    if (numa_order_) {
+      order_phi_chunk(chunk);
+      phi_schedule_.Reset(phi_bounds_, 16);
+    } else {
+      phi_schedule_.Reset(chunk.nodes.size(), omp_get_max_threads(), 16);
+    }
+    ::size_t numa_local = 0;
+    ::size_t numa_remote = 0;
+#pragma omp parallel reduction(+ : numa_local, numa_remote)
+    {
+      if (has_next) {
+#pragma omp single nowait
+        fetch_phi_chunk(1 - current, false, &phi_chunk_[1 - current]);
+      }
+
+      ::size_t begin;
+      ::size_t end;
+      while (phi_schedule_.Next(omp_get_thread_num(), &begin, &end)) {
+        for (::size_t j = begin; j < end; ++j) {
+          ::size_t i = numa_order_ ? phi_order_[j] : j;
+          Vertex node = chunk.nodes[i];
+          if (numa_order_) {
+            int mine = thread_numa_node_[omp_get_thread_num()];
+            ::size_t local = (d_kv_store_->NumaNode(node) == mine);
+            for (::size_t n = 0; n < real_num_node_sample(); ++n) {
+              int32_t neighbor = chunk.flat_neighbors[
+                                   i * real_num_node_sample() + n];
+              local += (d_kv_store_->NumaNode(neighbor) == mine);
+            }
+            numa_local += local;
+            numa_remote += 1 + real_num_node_sample() - local;
+          }
+          ::size_t index = args_.graph_shards ? shard_index_[chunk_start + i]
+                                              : chunk_start + i;
+          update_phi_node(index, node, chunk.pi_node[i],
+                          chunk.flat_neighbors.begin() +
+                            i * real_num_node_sample(),
+                          chunk.pi_neighbor.begin() +
+                            i * real_num_node_sample(),
+                          eps_t, node_random(node, NODE_RANDOM_NOISE),
+                          &(*phi_node)[chunk_start + i]);
+        }
+      }
     }
     t_update_phi_.stop();
+    c_numa_local_.tick(numa_local);
+    c_numa_remote_.tick(numa_remote);
+    phi_tuner_.Computed(chunk.nodes.size(),
+                        std::chrono::duration<double>(
+                          std::chrono::high_resolution_clock::now() -
+                          computing).count());
+
+    post_dkv([this, current]() {
+      d_kv_store_->PurgeCacheRegion(current);
+    });
+    current = 1 - current;
+  }
+  wait_dkv();
 
-    d_kv_store_->PurgeKVRecords();
+  if (args_.steal) {
+    // From here on, my minibatch nodes are those whose phi I computed
+    nodes_.swap(phi_nodes_);
   }
 }
 
@@ -1232,107 +2316,406 @@ void MCMCSamplerStochasticDistributed::update_pi(
   // calculate and store updated values for pi/phi_sum
 
   if (mpi_rank_ != mpi_master_ || master_is_worker_) {
-    t_update_pi_.start();
+    // Write chunk c asynchronously while pi is calculated for chunk c + 1
+    ::size_t n_chunks = (nodes_.size() + max_minibatch_chunk_ - 1) /
+                          max_minibatch_chunk_;
+    std::vector<std::vector<int32_t> > chunk_nodes(n_chunks);
+    std::vector<std::vector<const Float *> > chunk_pi(n_chunks);
+    DKV::DKVStoreInterface::Handle handle = 0;
+    for (::size_t c = 0; c < n_chunks; ++c) {
+      ::size_t chunk_start = c * max_minibatch_chunk_;
+      ::size_t chunk_end = std::min(chunk_start + max_minibatch_chunk_,
+                                    nodes_.size());
+      t_update_pi_.start();
 #pragma omp parallel for // num_threads (12)
-    for (::size_t i = 0; i < nodes_.size(); ++i) {
-      pi_from_phi(pi_update_[i], phi_node[i]);
+      for (::size_t i = chunk_start; i < chunk_end; ++i) {
+        pi_from_phi(pi_update_[i], phi_node[i]);
+      }
+      t_update_pi_.stop();
+
+      chunk_nodes[c].assign(nodes_.begin() + chunk_start,
+                            nodes_.begin() + chunk_end);
+      chunk_pi[c].assign(pi_update_.begin() + chunk_start,
+                         pi_update_.begin() + chunk_end);
+      if (comm_thread_) {
+        // The comm thread stores this chunk while I compute the next
+        post_dkv([this, &chunk_nodes, &chunk_pi, c]() {
+          t_store_pi_minibatch_.start();
+          d_kv_store_->Wait(d_kv_store_->WriteKVRecordsAsync(chunk_nodes[c],
+                                                             chunk_pi[c]));
+          t_store_pi_minibatch_.stop();
+        });
+      } else {
+        t_store_pi_minibatch_.start();
+        handle = d_kv_store_->WriteKVRecordsAsync(chunk_nodes[c],
+                                                  chunk_pi[c]);
+        t_store_pi_minibatch_.stop();
+      }
     }
-    t_update_pi_.stop();
+    if (comm_thread_) {
+      t_store_pi_wait_.start();
+      wait_dkv();
+      t_store_pi_wait_.stop();
+    } else {
+      t_store_pi_minibatch_.start();
+      if (n_chunks > 0) {
+        d_kv_store_->Wait(handle);
+      }
+      t_store_pi_minibatch_.stop();
+    }
+    d_kv_store_->PurgeKVRecords();
+
+    if (args_.dkv_epochs) {
+      carry_pi_forward();
+    }
+  }
+}
 
-    t_store_pi_minibatch_.start();
-    d_kv_store_->WriteKVRecords(nodes_, constify(pi_update_));
-    t_store_pi_minibatch_.stop();
+
+void MCMCSamplerStochasticDistributed::carry_pi_forward() {
+  // Invariant: at the start of an iteration, both epochs of pi are equal
+  // except for the nodes updated in the previous iteration. Those nodes that
+  // are not updated in this iteration too must have their current pi copied
+  // into the next epoch. All of them are mine, so this is a local copy.
+  t_carry_pi_.start();
+  std::unordered_set<Vertex> updated(nodes_.begin(), nodes_.end());
+  std::vector<int32_t> stale;
+  for (auto n : prev_nodes_) {
+    if (updated.find(n) == updated.end()) {
+      stale.push_back(n);
+    }
+  }
+
+  std::vector<Float *> pi(max_minibatch_chunk_);
+  for (::size_t chunk_start = 0; chunk_start < stale.size();
+       chunk_start += max_minibatch_chunk_) {
+    ::size_t chunk = std::min(max_minibatch_chunk_,
+                              stale.size() - chunk_start);
+    std::vector<int32_t> chunk_nodes(stale.begin() + chunk_start,
+                                     stale.begin() + chunk_start + chunk);
+    d_kv_store_->ReadKVRecords(pi, chunk_nodes, DKV::RW_MODE::READ_ONLY);
+    d_kv_store_->WriteKVRecords(chunk_nodes, constify(pi));
     d_kv_store_->PurgeKVRecords();
   }
+
+  prev_nodes_ = nodes_;
+  t_carry_pi_.stop();
 }
 
 
-void MCMCSamplerStochasticDistributed::broadcast_theta_beta() {
-  t_broadcast_theta_beta_.start();
-  if (! args_.REPLICATED_NETWORK) {
-    std::vector<Float> theta_marshalled(2 * K);   // FIXME: lift to class level
-    if (mpi_rank_ == mpi_master_) {
-      for (::size_t k = 0; k < K; ++k) {
-        for (::size_t i = 0; i < 2; ++i) {
-          theta_marshalled[2 * k + i] = theta[k][i];
-        }
+void MCMCSamplerStochasticDistributed::print_phi_balance() {
+  int r;
+
+  bool worker = (mpi_rank_ != mpi_master_ || master_is_worker_);
+  double mine = std::chrono::duration<double>(t_update_phi_.total()).count();
+  double fastest = worker ? mine : std::numeric_limits<double>::max();
+  double slowest = worker ? mine : 0.0;
+  r = MPI_Allreduce(MPI_IN_PLACE, &fastest, 1, MPI_DOUBLE, MPI_MIN,
+                    MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Allreduce(update_phi min) fails");
+  r = MPI_Allreduce(MPI_IN_PLACE, &slowest, 1, MPI_DOUBLE, MPI_MAX,
+                    MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Allreduce(update_phi max) fails");
+
+  if (mpi_rank_ == mpi_master_) {
+    std::cout << "update_phi time over the workers: fastest " << fastest <<
+      "s slowest " << slowest << "s spread " << (slowest - fastest) <<
+      "s" << std::endl;
+  }
+}
+
+
+void MCMCSamplerStochasticDistributed::broadcast_theta() {
+  std::vector<Float> theta_marshalled(2 * K);   // FIXME: lift to class level
+  if (mpi_rank_ == mpi_master_) {
+    for (::size_t k = 0; k < K; ++k) {
+      for (::size_t i = 0; i < 2; ++i) {
+        theta_marshalled[2 * k + i] = theta[k][i];
       }
     }
-    int r = MPI_Bcast(theta_marshalled.data(), theta_marshalled.size(),
-                      FLOATTYPE_MPI, mpi_master_, MPI_COMM_WORLD);
-    mpi_error_test(r, "MPI_Bcast(theta) fails");
-    if (mpi_rank_ != mpi_master_) {
-      for (::size_t k = 0; k < K; ++k) {
-        for (::size_t i = 0; i < 2; ++i) {
-          theta[k][i] = theta_marshalled[2 * k + i];
-        }
+  }
+  int r = MPI_Bcast(theta_marshalled.data(), theta_marshalled.size(),
+                    FLOATTYPE_MPI, mpi_master_, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Bcast(theta) fails");
+  if (mpi_rank_ != mpi_master_) {
+    for (::size_t k = 0; k < K; ++k) {
+      for (::size_t i = 0; i < 2; ++i) {
+        theta[k][i] = theta_marshalled[2 * k + i];
       }
     }
   }
+}
+
+
+void MCMCSamplerStochasticDistributed::broadcast_theta_beta() {
+  t_broadcast_theta_beta_.start();
+  if (! args_.allreduce_beta) {
+    broadcast_theta();
+  }
   //-------- after broadcast of theta, replicate this at all peers:
   beta_from_theta();
   t_broadcast_theta_beta_.stop();
 }
 
 
+void MCMCSamplerStochasticDistributed::rank_minibatch_slice(
+    const EdgeMapItem* begin, const EdgeMapItem* end,
+    BetaSlice* slice) const {
+  std::unordered_map<Vertex, int32_t> node_rank;
+  slice->nodes.clear();
+  slice->edges.resize(end - begin);
+  ::size_t e = 0;
+  for (auto item = begin; item != end; ++item) {
+    Vertex v[2] = { item->edge.first, item->edge.second };
+    int32_t rank[2];
+    for (::size_t x = 0; x < 2; ++x) {
+      auto it = node_rank.find(v[x]);
+      if (it == node_rank.end()) {
+        rank[x] = slice->nodes.size();
+        node_rank[v[x]] = rank[x];
+        slice->nodes.push_back(v[x]);
+      } else {
+        rank[x] = it->second;
+      }
+    }
+    slice->edges[e].first = rank[0];
+    slice->edges[e].second = rank[1];
+    slice->edges[e].is_edge = item->is_edge;
+    ++e;
+  }
+}
+
+
 void MCMCSamplerStochasticDistributed::scatter_minibatch_for_theta(
     const MinibatchSet &mini_batch,
-    std::vector<EdgeMapItem>* mini_batch_slice) {
+    BetaSlice* mini_batch_slice,
+    MPI_Comm comm) {
   int   r;
   std::vector<unsigned char> flattened_minibatch;
+  // per rank: #nodes, #edges
+  std::vector<int32_t> scatter_count(2 * mpi_size_);
   std::vector<int32_t> scatter_size(mpi_size_);
   std::vector<int32_t> scatter_displs(mpi_size_);
 
   if (mpi_rank_ == mpi_master_) {
-    flattened_minibatch.resize(mini_batch.size() * sizeof(EdgeMapItem));
+    std::vector<EdgeMapItem> items;
+    items.reserve(mini_batch.size());
+    for (auto e: mini_batch) {
+      items.push_back(EdgeMapItem(e, e.in(network.get_linked_edges())));
+    }
+
+    // The master ranks the slice of each peer, so the peers need not
+    t_beta_rank_.start();
     ::size_t chunk = mini_batch.size() / mpi_size_;
     ::size_t surplus = mini_batch.size() - chunk * mpi_size_;
-    ::size_t running_sum = 0;
-    ::size_t i;
-    for (i = 0; i < surplus; ++i) {
-      scatter_size[i] = (chunk + 1) * sizeof(EdgeMapItem);
-      scatter_displs[i] = running_sum;
-      running_sum += (chunk + 1) * sizeof(EdgeMapItem);
+    std::vector<BetaSlice> slice(mpi_size_);
+#pragma omp parallel for
+    for (int i = 0; i < mpi_size_; ++i) {
+      ::size_t rank = i;
+      ::size_t start = rank * chunk + std::min(rank, surplus);
+      ::size_t end = start + chunk + (rank < surplus ? 1 : 0);
+      rank_minibatch_slice(items.data() + start, items.data() + end,
+                           &slice[i]);
     }
-    for (; i < (::size_t)mpi_size_; ++i) {
-      scatter_size[i] = chunk * sizeof(EdgeMapItem);
+    t_beta_rank_.stop();
+
+    ::size_t running_sum = 0;
+    for (int i = 0; i < mpi_size_; ++i) {
+      scatter_count[2 * i] = slice[i].nodes.size();
+      scatter_count[2 * i + 1] = slice[i].edges.size();
+      scatter_size[i] = slice[i].nodes.size() * sizeof(Vertex) +
+                          slice[i].edges.size() * sizeof(BetaEdge);
       scatter_displs[i] = running_sum;
-      running_sum += chunk * sizeof(EdgeMapItem);
+      running_sum += scatter_size[i];
     }
+    flattened_minibatch.resize(running_sum);
     auto *marshall = flattened_minibatch.data();
-    for (auto e: mini_batch) {
-      EdgeMapItem ei(e, e.in(network.get_linked_edges()));
-      memcpy(marshall, &ei, sizeof ei);
-      marshall += sizeof ei;
+    for (int i = 0; i < mpi_size_; ++i) {
+      ::size_t bytes = slice[i].nodes.size() * sizeof(Vertex);
+      memcpy(marshall, slice[i].nodes.data(), bytes);
+      marshall += bytes;
+      bytes = slice[i].edges.size() * sizeof(BetaEdge);
+      memcpy(marshall, slice[i].edges.data(), bytes);
+      marshall += bytes;
     }
   }
 
-  int32_t my_minibatch_bytes;
-  r = MPI_Scatter(scatter_size.data(), 1, MPI_INT,
-                  &my_minibatch_bytes, 1, MPI_INT,
-                  mpi_master_, MPI_COMM_WORLD);
+  int32_t my_count[2];
+  r = MPI_Scatter(scatter_count.data(), 2, MPI_INT,
+                  my_count, 2, MPI_INT,
+                  mpi_master_, comm);
   mpi_error_test(r, "MPI_Scatter of minibatch sizes for update_beta fails");
 
-  mini_batch_slice->resize(my_minibatch_bytes / sizeof(EdgeMapItem));
+  int32_t my_minibatch_bytes = my_count[0] * sizeof(Vertex) +
+                                 my_count[1] * sizeof(BetaEdge);
+  std::vector<unsigned char> my_minibatch(my_minibatch_bytes);
   if (mpi_rank_ == mpi_master_) {
     r = MPI_Scatterv(flattened_minibatch.data(), scatter_size.data(),
                      scatter_displs.data(), MPI_BYTE,
-                     mini_batch_slice->data(), my_minibatch_bytes, MPI_BYTE,
-                     mpi_master_, MPI_COMM_WORLD);
+                     my_minibatch.data(), my_minibatch_bytes, MPI_BYTE,
+                     mpi_master_, comm);
     mpi_error_test(r, "MPI_Scatterv of minibatch for update_beta fails");
 
   } else {
     r = MPI_Scatterv(NULL, NULL,
                      NULL, MPI_BYTE,
-                     mini_batch_slice->data(), my_minibatch_bytes, MPI_BYTE,
-                     mpi_master_, MPI_COMM_WORLD);
+                     my_minibatch.data(), my_minibatch_bytes, MPI_BYTE,
+                     mpi_master_, comm);
     mpi_error_test(r, "MPI_Scatterv of minibatch for update_beta fails");
   }
+
+  mini_batch_slice->nodes.resize(my_count[0]);
+  mini_batch_slice->edges.resize(my_count[1]);
+  const auto *unmarshall = my_minibatch.data();
+  memcpy(mini_batch_slice->nodes.data(), unmarshall,
+         my_count[0] * sizeof(Vertex));
+  unmarshall += my_count[0] * sizeof(Vertex);
+  memcpy(mini_batch_slice->edges.data(), unmarshall,
+         my_count[1] * sizeof(BetaEdge));
 }
 
 
-void MCMCSamplerStochasticDistributed::beta_calc_grads(
-    const std::vector<EdgeMapItem>& mini_batch_slice) {
+void MCMCSamplerStochasticDistributed::post_dkv(
+    const std::function<void()> &job) {
+  if (comm_thread_) {
+    dkv_jobs_.push_back(comm_thread_->Post(job));
+  } else {
+    job();
+  }
+}
+
+
+void MCMCSamplerStochasticDistributed::wait_dkv() {
+  for (auto &job : dkv_jobs_) {
+    job.get();
+  }
+  dkv_jobs_.clear();
+}
+
+
+void MCMCSamplerStochasticDistributed::post_scatter_minibatch_for_theta(
+    const MinibatchSet *mini_batch) {
+  // The master's OpenMP team that ranks the slices runs alongside the
+  // main thread's team
+  beta_slice_ready_ = comm_thread_->Post([this, mini_batch]() {
+    t_beta_scatter_.start();
+    scatter_minibatch_for_theta(*mini_batch, &beta_slice_, beta_comm_);
+    t_beta_scatter_.stop();
+  });
+}
+
+
+void MCMCSamplerStochasticDistributed::slice_minibatch_for_theta(
+    const MinibatchSet &mini_batch,
+    BetaSlice* mini_batch_slice) {
+  // Same slices as scatter_minibatch_for_theta
+  ::size_t chunk = mini_batch.size() / mpi_size_;
+  ::size_t surplus = mini_batch.size() - chunk * mpi_size_;
+  ::size_t my_rank = mpi_rank_;
+  ::size_t my_start = my_rank * chunk + std::min(my_rank, surplus);
+  ::size_t my_end = my_start + chunk + (my_rank < surplus ? 1 : 0);
+
+  std::vector<EdgeMapItem> items;
+  items.reserve(my_end - my_start);
+  ::size_t i = 0;
+  for (auto e: mini_batch) {
+    if (i >= my_end) {
+      break;
+    }
+    if (i >= my_start) {
+      items.push_back(EdgeMapItem(e, e.in(network.get_linked_edges())));
+    }
+    ++i;
+  }
+
+  t_beta_rank_.start();
+  rank_minibatch_slice(items.data(), items.data() + items.size(),
+                       mini_batch_slice);
+  t_beta_rank_.stop();
+}
+
+
+void MCMCSamplerStochasticDistributed::beta_load_pi(
+    const BetaSlice& mini_batch_slice, bool reuse_pi_update,
+    std::vector<Float*>* pi) {
+  t_load_pi_beta_.start();
+  const auto &nodes = mini_batch_slice.nodes;
+  pi->resize(nodes.size());
+
+  std::vector<Vertex> fetch_nodes;
+  std::vector< ::size_t> fetch_rank;
+  if (reuse_pi_update) {
+    // pi_update_ still holds the pi that I stored for my minibatch nodes
+    std::vector<std::pair<Vertex, ::size_t> > mine(nodes_.size());
+    for (::size_t i = 0; i < nodes_.size(); ++i) {
+      mine[i] = { nodes_[i], i };
+    }
+    std::sort(mine.begin(), mine.end());
+    for (::size_t i = 0; i < nodes.size(); ++i) {
+      auto it = std::lower_bound(mine.begin(), mine.end(),
+                                 std::make_pair(nodes[i], ::size_t(0)));
+      if (it != mine.end() && it->first == nodes[i]) {
+        (*pi)[i] = pi_update_[it->second];
+      } else {
+        fetch_nodes.push_back(nodes[i]);
+        fetch_rank.push_back(i);
+      }
+    }
+  } else {
+    fetch_nodes = nodes;
+  }
+  c_beta_pi_reused_.tick(nodes.size() - fetch_nodes.size());
+
+  std::vector<Float*> fetched(fetch_nodes.size());
+  d_kv_store_->ReadKVRecords(fetched, fetch_nodes, DKV::RW_MODE::READ_ONLY);
+  if (reuse_pi_update) {
+    for (::size_t i = 0; i < fetched.size(); ++i) {
+      (*pi)[fetch_rank[i]] = fetched[i];
+    }
+  } else {
+    pi->swap(fetched);
+  }
+  t_load_pi_beta_.stop();
+}
+
+
+::size_t MCMCSamplerStochasticDistributed::beta_chunk(
+    const BetaSlice& mini_batch_slice, ::size_t start,
+    std::vector< ::size_t>* stamp, std::vector<int32_t>* chunk_rank,
+    BetaSlice* chunk) const {
+  // stamp[n] == start iff slice node n is in this chunk, at chunk_rank[n]
+  chunk->nodes.clear();
+  chunk->edges.clear();
+  ::size_t e;
+  for (e = start; e < mini_batch_slice.edges.size(); ++e) {
+    const auto &edge = mini_batch_slice.edges[e];
+    ::size_t added = ((*stamp)[edge.first] != start) +
+                       ((*stamp)[edge.second] != start &&
+                        edge.second != edge.first);
+    if (chunk->nodes.size() + added > max_beta_chunk_) {
+      break;
+    }
+    BetaEdge chunk_edge;
+    int32_t *end_point[2] = { &chunk_edge.first, &chunk_edge.second };
+    int32_t slice_end_point[2] = { edge.first, edge.second };
+    for (::size_t x = 0; x < 2; ++x) {
+      int32_t n = slice_end_point[x];
+      if ((*stamp)[n] != start) {
+        (*stamp)[n] = start;
+        (*chunk_rank)[n] = chunk->nodes.size();
+        chunk->nodes.push_back(mini_batch_slice.nodes[n]);
+      }
+      *end_point[x] = (*chunk_rank)[n];
+    }
+    chunk_edge.is_edge = edge.is_edge;
+    chunk->edges.push_back(chunk_edge);
+  }
+
+  return e;
+}
+
+
+void MCMCSamplerStochasticDistributed::beta_zero_grads() {
   t_beta_zero_.start();
 #pragma omp parallel for
   for (int i = 0; i < omp_get_max_threads(); ++i) {
@@ -1341,48 +2724,28 @@ void MCMCSamplerStochasticDistributed::beta_calc_grads(
       grads_beta_[i][1][k] = 0.0;
     }
   }
+  t_beta_zero_.stop();
+}
+
 
+void MCMCSamplerStochasticDistributed::beta_calc_grads(
+    const BetaSlice& mini_batch_slice,
+    const std::vector<Float*>& pi) {
   // sums = np.sum(self.__theta,1)
   std::vector<Float> theta_sum(theta.size());
   std::transform(theta.begin(), theta.end(), theta_sum.begin(),
                  np::sum<Float>);
-  t_beta_zero_.stop();
-
-  t_beta_rank_.start();
-  std::unordered_map<Vertex, Vertex> node_rank;
-  std::vector<Vertex> nodes;
-  for (auto e : mini_batch_slice) {
-    Vertex i = e.edge.first;
-    Vertex j = e.edge.second;
-    if (node_rank.find(i) == node_rank.end()) {
-      ::size_t next = node_rank.size();
-      node_rank[i] = next;
-      nodes.push_back(i);
-    }
-    if (node_rank.find(j) == node_rank.end()) {
-      ::size_t next = node_rank.size();
-      node_rank[j] = next;
-      nodes.push_back(j);
-    }
-    assert(node_rank.size() == nodes.size());
-  }
-  t_beta_rank_.stop();
-
-  t_load_pi_beta_.start();
-  std::vector<Float*> pi(node_rank.size());
-  d_kv_store_->ReadKVRecords(pi, nodes, DKV::RW_MODE::READ_ONLY);
-  t_load_pi_beta_.stop();
 
   // update gamma, only update node in the grad
   t_beta_calc_grads_.start();
 #pragma omp parallel for // num_threads (12)
-  for (::size_t e = 0; e < mini_batch_slice.size(); ++e) {
-    const auto *edge = &mini_batch_slice[e];
+  for (::size_t e = 0; e < mini_batch_slice.edges.size(); ++e) {
+    const auto *edge = &mini_batch_slice.edges[e];
     std::vector<Float> probs(K);
 
-    int y = (int)edge->is_edge;
-    Vertex i = node_rank[edge->edge.first];
-    Vertex j = node_rank[edge->edge.second];
+    int y = edge->is_edge;
+    int32_t i = edge->first;
+    int32_t j = edge->second;
 
     Float pi_sum = 0.0;
     for (::size_t k = 0; k < K; ++k) {
@@ -1411,9 +2774,7 @@ void MCMCSamplerStochasticDistributed::beta_calc_grads(
 }
 
 
-void MCMCSamplerStochasticDistributed::beta_sum_grads() {
-  int r;
-
+void MCMCSamplerStochasticDistributed::beta_sum_thread_grads() {
   t_beta_sum_grads_.start();
 #pragma omp parallel for
   for (::size_t k = 0; k < K; ++k) {
@@ -1423,34 +2784,82 @@ void MCMCSamplerStochasticDistributed::beta_sum_grads() {
     }
   }
   t_beta_sum_grads_.stop();
+}
+
+
+void MCMCSamplerStochasticDistributed::beta_sum_grads(Float *scale) {
+  beta_sum_thread_grads();
+  beta_reduce_grads(scale, MPI_COMM_WORLD);
+}
+
+
+void MCMCSamplerStochasticDistributed::beta_reduce_grads(Float *scale,
+                                                         MPI_Comm comm) {
+  int r;
 
-  //-------- reduce(+) of the grads_[0][*][0,1] to the master
   t_beta_reduce_grads_.start();
-  if (mpi_rank_ == mpi_master_) {
+  if (args_.allreduce_beta) {
+    //-------- one allreduce(+) of the grads_[0][*][0,1], packed, and of
+    // the minibatch scale, which only the master knows
+    std::copy(grads_beta_[0][0].begin(), grads_beta_[0][0].end(),
+              grads_beta_packed_.begin());
+    std::copy(grads_beta_[0][1].begin(), grads_beta_[0][1].end(),
+              grads_beta_packed_.begin() + K);
+    grads_beta_packed_[2 * K] = (mpi_rank_ == mpi_master_) ? *scale : 0.0;
+    r = MPI_Allreduce(MPI_IN_PLACE, grads_beta_packed_.data(), 2 * K + 1,
+                      FLOATTYPE_MPI, MPI_SUM, comm);
+    mpi_error_test(r, "Allreduce/plus of grads_beta_ fails");
+    std::copy(grads_beta_packed_.begin(), grads_beta_packed_.begin() + K,
+              grads_beta_[0][0].begin());
+    std::copy(grads_beta_packed_.begin() + K,
+              grads_beta_packed_.begin() + 2 * K,
+              grads_beta_[0][1].begin());
+    *scale = grads_beta_packed_[2 * K];
+
+  //-------- reduce(+) of the grads_[0][*][0,1] to the master
+  } else if (mpi_rank_ == mpi_master_) {
     r = MPI_Reduce(MPI_IN_PLACE, grads_beta_[0][0].data(), K, FLOATTYPE_MPI,
-                   MPI_SUM, mpi_master_, MPI_COMM_WORLD);
+                   MPI_SUM, mpi_master_, comm);
     mpi_error_test(r, "Reduce/plus of grads_beta_[0][0] fails");
     r = MPI_Reduce(MPI_IN_PLACE, grads_beta_[0][1].data(), K, FLOATTYPE_MPI,
-                   MPI_SUM, mpi_master_, MPI_COMM_WORLD);
+                   MPI_SUM, mpi_master_, comm);
     mpi_error_test(r, "Reduce/plus of grads_beta_[0][1] fails");
   } else {
     r = MPI_Reduce(grads_beta_[0][0].data(), NULL, K, FLOATTYPE_MPI,
-                   MPI_SUM, mpi_master_, MPI_COMM_WORLD);
+                   MPI_SUM, mpi_master_, comm);
     mpi_error_test(r, "Reduce/plus of grads_beta_[0][0] fails");
     r = MPI_Reduce(grads_beta_[0][1].data(), NULL, K, FLOATTYPE_MPI,
-                   MPI_SUM, mpi_master_, MPI_COMM_WORLD);
+                   MPI_SUM, mpi_master_, comm);
     mpi_error_test(r, "Reduce/plus of grads_beta_[0][1] fails");
   }
   t_beta_reduce_grads_.stop();
 }
 
 
+std::vector<std::vector<Float> >
+MCMCSamplerStochasticDistributed::beta_theta_noise() {
+  if (args_.allreduce_beta || mpi_rank_ == mpi_master_) {
+    Random::Random* rng = args_.allreduce_beta ? theta_rng_ : rng_[0];
+    return rng->randn(K, 2);
+  }
+
+  return std::vector<std::vector<Float> >();
+}
+
+
 void MCMCSamplerStochasticDistributed::beta_update_theta(Float scale) {
-  if (mpi_rank_ == mpi_master_) {
+  beta_update_theta(scale, beta_theta_noise());
+}
+
+
+void MCMCSamplerStochasticDistributed::beta_update_theta(
+    Float scale, const std::vector<std::vector<Float> > &noise) {
+  // With allreduce, every rank has the same grads and draws the same noise,
+  // so theta stays identical at all ranks without a broadcast. This relies
+  // on MPI_Allreduce delivering bitwise equal sums to all ranks.
+  if (args_.allreduce_beta || mpi_rank_ == mpi_master_) {
     t_beta_update_theta_.start();
     Float eps_t = get_eps_t();
-    // random noise.
-    std::vector<std::vector<Float> > noise = rng_[0]->randn(K, 2);
 #pragma omp parallel for
     for (::size_t k = 0; k < K; ++k) {
       for (::size_t i = 0; i < 2; ++i) {
@@ -1470,19 +2879,97 @@ void MCMCSamplerStochasticDistributed::beta_update_theta(Float scale) {
 }
 
 
-void MCMCSamplerStochasticDistributed::update_beta(
-    const MinibatchSet &mini_batch, Float scale) {
-  std::vector<EdgeMapItem> mini_batch_slice;
+void MCMCSamplerStochasticDistributed::beta_calc_slice_grads(
+    const BetaSlice& mini_batch_slice, bool reuse_pi_update,
+    const std::function<void()> &last_read) {
+  beta_zero_grads();
+
+  // In chunks whose nodes fit in the pi cache
+  std::vector< ::size_t> stamp(mini_batch_slice.nodes.size(),
+                               std::numeric_limits< ::size_t>::max());
+  std::vector<int32_t> chunk_rank(mini_batch_slice.nodes.size());
+  BetaSlice chunk;
+  std::vector<Float*> pi;
+  ::size_t start = 0;
+  do {
+    ::size_t end = beta_chunk(mini_batch_slice, start, &stamp, &chunk_rank,
+                              &chunk);
+    if (end == start && start < mini_batch_slice.edges.size()) {
+      throw MCMCException("pi cache cannot contain the nodes of one edge");
+    }
+    beta_load_pi(chunk, reuse_pi_update, &pi);
+    if (end == mini_batch_slice.edges.size()) {
+      last_read();
+    }
 
-  scatter_minibatch_for_theta(mini_batch, &mini_batch_slice);
+    beta_calc_grads(chunk, pi);
+    d_kv_store_->PurgeKVRecords();
+    start = end;
+  } while (start < mini_batch_slice.edges.size());
+}
 
-  beta_calc_grads(mini_batch_slice);
 
-  beta_sum_grads();
+void MCMCSamplerStochasticDistributed::update_beta(
+    const MinibatchSet &mini_batch, Float scale) {
+  BetaSlice mini_batch_slice;
+
+  if (args_.decentralized_minibatch) {
+    slice_minibatch_for_theta(mini_batch, &mini_batch_slice);
+  } else if (comm_thread_) {
+    t_comm_wait_.start();
+    beta_slice_ready_.get();
+    t_comm_wait_.stop();
+    std::swap(mini_batch_slice, beta_slice_);
+  } else {
+    t_beta_scatter_.start();
+    scatter_minibatch_for_theta(mini_batch, &mini_batch_slice,
+                                MPI_COMM_WORLD);
+    t_beta_scatter_.stop();
+  }
 
-  beta_update_theta(scale);
+  // update_beta reads the pi that update_pi just stored, unless it reads
+  // the current epoch. With a lossy codec, the store holds another value
+  // than pi_update_.
+  bool reuse_pi_update = ! args_.dkv_epochs &&
+                           (args_.dkv_codec == DKV::CODEC::NONE ||
+                            args_.dkv_codec_validate);
+
+  // With epochs, the last chunk is my last read of the current epoch.
+  // Once all peers are past that point, the epoch can be closed. Overlap
+  // that barrier with the beta computation.
+  MPI_Request epoch_barrier = MPI_REQUEST_NULL;
+  beta_calc_slice_grads(mini_batch_slice, reuse_pi_update, [&]() {
+    if (args_.dkv_epochs) {
+      int r = MPI_Ibarrier(MPI_COMM_WORLD, &epoch_barrier);
+      mpi_error_test(r, "MPI_Ibarrier(epoch) fails");
+    }
+  });
+
+  if (comm_thread_) {
+    // Draw the theta noise while the comm thread reduces the grads
+    beta_sum_thread_grads();
+    std::future<void> reduced = comm_thread_->Post([this, &scale]() {
+      beta_reduce_grads(&scale, beta_comm_);
+    });
+    std::vector<std::vector<Float> > noise = beta_theta_noise();
+    t_beta_reduce_wait_.start();
+    reduced.get();
+    t_beta_reduce_wait_.stop();
+    beta_update_theta(scale, noise);
+  } else {
+    beta_sum_grads(&scale);
+    beta_update_theta(scale);
+  }
 
   d_kv_store_->PurgeKVRecords();
+
+  if (args_.dkv_epochs) {
+    t_epoch_barrier_.start();
+    int r = MPI_Wait(&epoch_barrier, MPI_STATUS_IGNORE);
+    mpi_error_test(r, "MPI_Wait(epoch barrier) fails");
+    t_epoch_barrier_.stop();
+    d_kv_store_->FlipEpoch();
+  }
 }
 
 
@@ -1523,6 +3010,10 @@ Float MCMCSamplerStochasticDistributed::cal_perplexity_held_out() {
     a.link.reset();
     a.non_link.reset();
   }
+  for (auto & a : perp_.codec_accu_) {
+    a.link.reset();
+    a.non_link.reset();
+  }
 
   for (::size_t chunk_start = 0;
        chunk_start < perp_.data_.size();
@@ -1578,6 +3069,24 @@ Float MCMCSamplerStochasticDistributed::cal_perplexity_held_out() {
           std::cerr << "non_link_likelihood is NaN; potential bug" << std::endl;
         }
       }
+
+      if (args_.dkv_codec_validate) {
+        // the same likelihood, with pi as the codec would store it
+        Float *pi_a = perp_.codec_pi_[omp_get_thread_num()].data();
+        Float *pi_b = pi_a + K + 1;
+        validate_codec_.RoundTrip(perp_.pi_[a], pi_a);
+        validate_codec_.RoundTrip(perp_.pi_[b], pi_b);
+        Float codec_likelihood = cal_edge_likelihood(pi_a, pi_b,
+                                                     edge_in.is_edge, beta);
+        ppx_codec_per_heldout_edge_[i] =
+          (ppx_codec_per_heldout_edge_[i] * (average_count - 1) +
+           codec_likelihood) / average_count;
+        perp_accu &codec_accu = perp_.codec_accu_[omp_get_thread_num()];
+        perp_counter &counter = edge_in.is_edge ? codec_accu.link :
+                                                  codec_accu.non_link;
+        counter.count++;
+        counter.likelihood += std::log(ppx_codec_per_heldout_edge_[i]);
+      }
     }
 
     t_purge_pi_perp_.start();
@@ -1591,6 +3100,13 @@ Float MCMCSamplerStochasticDistributed::cal_perplexity_held_out() {
     perp_.accu_[0].non_link.count += perp_.accu_[i].non_link.count;
     perp_.accu_[0].non_link.likelihood += perp_.accu_[i].non_link.likelihood;
   }
+  for (::size_t i = 1; i < perp_.codec_accu_.size(); ++i) {
+    perp_accu &c = perp_.codec_accu_[0];
+    c.link.count += perp_.codec_accu_[i].link.count;
+    c.link.likelihood += perp_.codec_accu_[i].link.likelihood;
+    c.non_link.count += perp_.codec_accu_[i].non_link.count;
+    c.non_link.likelihood += perp_.codec_accu_[i].non_link.likelihood;
+  }
 
   t_cal_edge_likelihood_.stop();
 
@@ -1608,6 +3124,16 @@ Float MCMCSamplerStochasticDistributed::cal_perplexity_held_out() {
   perp_accu accu;
   t_reduce_perp_.start();
   reduce_plus(perp_.accu_[0], &accu);
+  if (args_.dkv_codec_validate) {
+    perp_accu codec_accu;
+    reduce_plus(perp_.codec_accu_[0], &codec_accu);
+    ppx_codec_score_ = 0.0;
+    if (codec_accu.link.count + codec_accu.non_link.count != 0) {
+      ppx_codec_score_ = -(codec_accu.link.likelihood +
+                           codec_accu.non_link.likelihood) /
+                         (codec_accu.link.count + codec_accu.non_link.count);
+    }
+  }
   t_reduce_perp_.stop();
 
   // direct calculation.
@@ -1624,7 +3150,9 @@ Float MCMCSamplerStochasticDistributed::cal_perplexity_held_out() {
 
 
 int MCMCSamplerStochasticDistributed::node_owner(Vertex node) const {
-  if (master_hosts_pi_) {
+  if (! node_part_.empty()) {
+    return (master_hosts_pi_ ? 0 : 1) + node_part_[node];
+  } else if (master_hosts_pi_) {
     return node % mpi_size_;
   } else {
     return 1 + (node % (mpi_size_ - 1));
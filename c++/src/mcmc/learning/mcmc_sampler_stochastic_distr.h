@@ -1,15 +1,29 @@
 #ifndef MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_DISTR_H__
 #define MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_DISTR_H__
 
-#include <unordered_set>
+#include <functional>
+#include <future>
+#include <unordered_map>
 #include <iostream>
 
 #include "mcmc/config.h"
 
+#ifdef MCMC_MPI_THREADS
+#include "mcmc/mpi-threads.h"
+#else
+#include <mpi.h>
+#endif
+
 #include "dkvstore/DKVStore.h"
 #include "mcmc/random.h"
 #include "mcmc/timer.h"
 #include "mcmc/counter.h"
+#include "mcmc/chunk-tuner.h"
+#include "mcmc/checkpoint.h"
+#include "mcmc/comm-thread.h"
+#include "mcmc/work-stealing.h"
+#include "mcmc/numa.h"
+#include "mcmc/huge-pages.h"
 
 #include "mcmc/learning/mcmc_sampler_stochastic.h"
 
@@ -23,19 +37,32 @@ using ::mcmc::timer::Timer;
 // the edges, i.c. the edges whose first element is in the minibatch
 class LocalNetwork {
  public:
-  typedef typename std::unordered_set<Vertex> EndpointSet;
+  // A graph shard is large and its lookups are random: on huge pages
+  typedef std::vector<Vertex, huge_pages::Allocator<Vertex> > Adjacency;
+
+  LocalNetwork()
+      : linked_edges_(huge_pages::Allocator<Vertex>("graph adjacency")),
+        offset_(huge_pages::Allocator< ::size_t>("graph offsets")) {
+  }
 
-  void unmarshall_local_graph(::size_t index, const Vertex* linked,
-                              ::size_t size);
+  /**
+   * Take over the marshalled adjacency @argument flat, which holds
+   * set_size[i] sorted neighbors of each node i in turn.
+   */
+  void unmarshall_local_graph(const std::vector<int32_t> &set_size,
+                              Adjacency* flat);
 
   void reset();
 
   bool find(const Edge& edge) const;
 
-  const EndpointSet &linked_edges(::size_t i) const;
+  ::size_t fan_out(::size_t i) const;
+  const Vertex *linked_edges(::size_t i) const;
 
  protected:
-  std::vector<EndpointSet> linked_edges_;
+  Adjacency linked_edges_;
+  // the adjacency of node i is linked_edges_[offset_[i] .. offset_[i + 1]>
+  std::vector< ::size_t, huge_pages::Allocator< ::size_t> > offset_;
 };
 
 
@@ -68,6 +95,40 @@ class PerpData {
   // OpenMP parallelism requires a vector
   std::vector<EdgeMapItem> data_;
   std::vector<perp_accu> accu_;
+  // codec validation: per-thread accumulators and pi round-trip scratch
+  std::vector<perp_accu> codec_accu_;
+  std::vector<std::vector<Float> > codec_pi_;
+};
+
+
+// One chunk of my minibatch nodes in update_phi: the nodes, their neighbor
+// sample, and pointers into the cache region that holds their pi. Their
+// phi goes to phi_node_[start ..]
+struct PhiChunk {
+  ::size_t start;
+  std::vector<int32_t> nodes;
+  std::vector<int32_t> flat_neighbors;
+  std::vector<Float*> pi_node;
+  std::vector<Float*> pi_neighbor;
+  DKV::DKVStoreInterface::Handle handle;
+  // --mcmc.comm-thread: the reads, issued and completed on the comm thread
+  std::future<void> ready;
+  // when the reads were issued
+  std::chrono::high_resolution_clock::time_point issued;
+};
+
+
+// My slice of the minibatch for update_beta in rank-indexed form: the edges
+// refer to their end points by index into nodes, which holds each once
+struct BetaEdge {
+  int32_t first;
+  int32_t second;
+  int32_t is_edge;
+};
+
+struct BetaSlice {
+  std::vector<Vertex> nodes;
+  std::vector<BetaEdge> edges;
 };
 
 
@@ -133,23 +194,76 @@ class MCMCSamplerStochasticDistributed : public MCMCSamplerStochastic {
 
   void InitDKVStore();
 
+  void InitMinibatchRandom();
+
+  void InitPartition();
+
+  void LoadGraphShard();
+  // Each minibatch node must be updated by its pi host
+  bool nodes_at_owner() const;
+
   ::size_t real_num_node_sample() const;
 
   void init_theta();
   void beta_from_theta();
 
   void init_pi();
+
+  // --mcmc.checkpoint-interval: at an iteration boundary, each rank writes
+  // its state and the pi rows it hosts in the background
+  void SaveCheckpoint();
+  // Once all ranks have written the pending checkpoint, it is consistent
+  void CommitCheckpoint();
+  // --mcmc.restart: replaces init_pi
+  void RestoreCheckpoint();
+
   // Calculate pi[0..K> ++ phi_sum from phi[0..K>
   void pi_from_phi(Float* pi, const std::vector<Float> &phi);
 
   void ScatterSubGraph(const std::vector<std::vector<int32_t> > &subminibatch);
+  void index_graph_shard();
 
   std::ostream& PrintStats(std::ostream& out) const;
 
   EdgeSample deploy_mini_batch();
+  EdgeSample sample_my_mini_batch();
+  ::size_t node_cost(Vertex node) const;
+  void assign_mini_batch_nodes(
+      const MinibatchNodeSet &nodes,
+      std::vector<std::vector<int32_t> >* subminibatch);
+  void check_my_mini_batch_size() const;
+  // The random stream of @argument node in this iteration, in the generator
+  // of the calling thread. It depends on neither the thread nor the rank
+  // that handles the node, so the results don't depend on the schedule.
+  enum NodeRandomUse { NODE_RANDOM_NEIGHBORS = 0, NODE_RANDOM_NOISE = 1 };
+  Random::Random* node_random(Vertex node, NodeRandomUse use);
+  void DrawNodeNeighbors(Vertex node, Random::Random* rng,
+                         int32_t *neighbors);
   void DrawNeighbors(const int32_t* chunk_nodes,
                      ::size_t n_chunk_nodes,
                      int32_t *flat_neighbors);
+  // The next nodes for update_phi after the @argument claimed ones: my own
+  // minibatch nodes, then, with --mcmc.steal, nodes stolen from my peers.
+  // @return false if none are left
+  bool claim_phi_chunk(::size_t claimed, PhiChunk* chunk);
+  // Sample the neighbors of the chunk nodes and issue the reads of their pi.
+  // Unless @argument parallel, the neighbors are sampled sequentially, for
+  // use by one thread inside a parallel region
+  void fetch_phi_chunk(::size_t region, bool parallel, PhiChunk* chunk);
+  // --mcmc.steal: expose my minibatch nodes to be claimed for this iteration
+  void publish_phi_nodes();
+  // --mcmc.steal: claim up to @argument max of the nodes that @argument rank
+  // published; a thief (@argument steal) takes at most half of what is left
+  bool claim_phi_nodes(int rank, ::size_t max, bool steal,
+                       std::vector<int32_t>* nodes);
+  // My rank among the ranks on this host, and their number
+  void host_ranks(int* local_rank, int* local_ranks);
+  // --mcmc.numa: pin my threads to cpus of this host
+  void pin_threads();
+  // --mcmc.numa: order the nodes of @argument chunk by the NUMA node of their
+  // pi, and start each thread on the nodes of its own NUMA node
+  void order_phi_chunk(const PhiChunk &chunk);
+  void probe_pi_latency();
   void update_phi(std::vector<std::vector<Float> >* phi_node);
   void update_phi_node(::size_t index, Vertex i, const Float* pi_node,
                        const std::vector<int32_t>::iterator &neighbors,
@@ -158,13 +272,51 @@ class MCMCSamplerStochasticDistributed : public MCMCSamplerStochastic {
                        std::vector<Float>* phi_node	// out parameter
                       );
   void update_pi(const std::vector<std::vector<Float> >& phi_node);
+  void carry_pi_forward();
+  // The spread of update_phi time over the workers
+  void print_phi_balance();
 
+  void broadcast_theta();
   void broadcast_theta_beta();
+  void rank_minibatch_slice(const EdgeMapItem* begin, const EdgeMapItem* end,
+                            BetaSlice* slice) const;
   void scatter_minibatch_for_theta(const MinibatchSet &mini_batch,
-                                   std::vector<EdgeMapItem>* mini_batch_slice);
-  void beta_calc_grads(const std::vector<EdgeMapItem>& mini_batch_slice);
-  void beta_sum_grads();
+                                   BetaSlice* mini_batch_slice,
+                                   MPI_Comm comm);
+  // --mcmc.comm-thread: start the scatter of the update_beta slices on the
+  // communication thread; update_beta waits for it
+  void post_scatter_minibatch_for_theta(const MinibatchSet *mini_batch);
+  void slice_minibatch_for_theta(const MinibatchSet &mini_batch,
+                                 BetaSlice* mini_batch_slice);
+  // @argument reuse_pi_update: the pi of my minibatch nodes is taken from
+  // pi_update_ instead of the D-KV store
+  void beta_load_pi(const BetaSlice& mini_batch_slice, bool reuse_pi_update,
+                    std::vector<Float*>* pi);
+  // Chunk of the edges from @argument start whose nodes fit in the pi cache
+  ::size_t beta_chunk(const BetaSlice& mini_batch_slice, ::size_t start,
+                      std::vector< ::size_t>* stamp,
+                      std::vector<int32_t>* chunk_rank,
+                      BetaSlice* chunk) const;
+  void beta_zero_grads();
+  void beta_calc_grads(const BetaSlice& mini_batch_slice,
+                       const std::vector<Float*>& pi);
+  // Zero grads_beta_, then add the grads of the slice, in chunks that fit
+  // in the pi cache; @argument last_read is called after the last pi load
+  void beta_calc_slice_grads(const BetaSlice& mini_batch_slice,
+                             bool reuse_pi_update,
+                             const std::function<void()> &last_read);
+  // Sum the per-thread grads into grads_beta_[0]
+  void beta_sum_thread_grads();
+  // With --mcmc.allreduce-beta, also brings the master's minibatch
+  // @argument scale to all ranks
+  void beta_sum_grads(Float *scale);
+  // The reduction of beta_sum_grads, on @argument comm
+  void beta_reduce_grads(Float *scale, MPI_Comm comm);
+  // The noise of the theta update, drawn at the ranks that update theta
+  std::vector<std::vector<Float> > beta_theta_noise();
   void beta_update_theta(Float scale);
+  void beta_update_theta(Float scale,
+                         const std::vector<std::vector<Float> > &noise);
   void update_beta(const MinibatchSet &mini_batch, Float scale);
 
   void reduce_plus(const perp_accu &in, perp_accu* accu);
@@ -190,12 +342,42 @@ class MCMCSamplerStochasticDistributed : public MCMCSamplerStochastic {
   ::size_t	max_minibatch_nodes_;
   ::size_t	max_minibatch_chunk_;
   ::size_t	max_perplexity_chunk_;
+  ::size_t	max_beta_chunk_;
+  // --mcmc.adaptive-chunk: the update_phi chunk size follows the measured
+  // fetch latency and compute time
+  ChunkTuner    phi_tuner_;
+  ::size_t      phi_chunk_size_;
   ::size_t  max_dkv_write_entries_;
 
   // Lift to class member to avoid (de)allocation in each iteration
   std::vector<int32_t> nodes_;		// my minibatch nodes
   std::vector<Float*> pi_update_;
   std::vector<std::vector<Float>> phi_node_;
+  // --mcmc.dkv-epochs: my minibatch nodes of the previous iteration
+  std::vector<int32_t> prev_nodes_;
+  // update_phi computes one chunk while it fetches the next
+  PhiChunk      phi_chunk_[2];
+  // the threads steal each other's nodes of the chunk being computed
+  WorkStealingRange phi_schedule_;
+  // --mcmc.numa: the NUMA node of each of my threads, non-decreasing; and
+  // whether the D-KV store knows where its values live, so update_phi
+  // computes the chunk in the order of phi_order_, thread t starting at
+  // phi_bounds_[t]
+  std::vector<int> thread_numa_node_;
+  bool          numa_order_;
+  std::vector< ::size_t> phi_order_;
+  std::vector< ::size_t> phi_bounds_;
+  // --mcmc.steal: my minibatch nodes and the word that claims them, exposed
+  // in MPI windows. The claim word packs the iteration tag, the number of
+  // nodes and the first unclaimed node, so a claim is one compare-and-swap.
+  std::vector<int32_t> steal_nodes_;
+  uint64_t      steal_claim_;
+  MPI_Win       steal_nodes_win_;
+  MPI_Win       steal_claim_win_;
+  // the peer that I steal from next, and the nodes that I update this
+  // iteration, in the order of phi_node_
+  int           steal_victim_;
+  std::vector<int32_t> phi_nodes_;
   // gradients K*2 dimension
   std::vector<std::vector<std::vector<Float> > > grads_beta_;
 
@@ -208,13 +390,59 @@ class MCMCSamplerStochasticDistributed : public MCMCSamplerStochastic {
 
   std::unique_ptr<DKV::DKVStoreInterface> d_kv_store_;
 
+  // --mcmc.partition: the part of each node; a part is a pi host
+  std::vector<int32_t> node_part_;
+
+  // --mcmc.decentralized-minibatch: seeded equally at all ranks
+  std::vector<Random::Random*> minibatch_rng_;
+
+  // --mcmc.allreduce-beta: theta noise, seeded equally at all ranks, and
+  // the packed grads_beta_[0][0] ++ grads_beta_[0][1] ++ minibatch scale
+  Random::Random* theta_rng_;
+  std::vector<Float> grads_beta_packed_;
+
+  // per thread, reseeded by node_random()
+  std::vector<Random::Random*> node_rng_;
+
+  // --mcmc.comm-thread: scatters the update_beta slices on beta_comm_
+  // into beta_slice_ while update_phi/update_pi compute, reduces the beta
+  // grads while update_beta draws the theta noise, and runs the D-KV
+  // transfers of update_phi/update_pi while the threads compute
+  std::unique_ptr<CommThread> comm_thread_;
+  MPI_Comm      beta_comm_;
+  std::future<void> beta_slice_ready_;
+  BetaSlice     beta_slice_;
+  std::vector<std::future<void> > dkv_jobs_;
+
+  // Run the D-KV transfer @argument job on the comm thread, after the ones
+  // posted before; without a comm thread, run it now
+  void post_dkv(const std::function<void()> &job);
+  // Wait until the posted D-KV transfers are done
+  void wait_dkv();
+
+  std::unique_ptr<checkpoint::Writer> checkpoint_writer_;
+  // steps of the checkpoint being written and of the last consistent one
+  ::size_t      checkpoint_pending_;
+  ::size_t      checkpoint_committed_;
+
   LocalNetwork  local_network_;
+  // --mcmc.graph-shards: the nodes whose adjacency local_network_ holds,
+  // ascending, and the index in there of each of my minibatch nodes
+  std::vector<int32_t> shard_nodes_;
+  std::vector< ::size_t> shard_index_;
   MinibatchSet  held_out_test_;
 
   PerpData      perp_;
+  // --mcmc.dkv-codec-validate: pi is stored in full precision, perplexity
+  // is also calculated with pi quantized by validate_codec_
+  DKV::Codec    validate_codec_;
+  std::vector<Float> ppx_codec_per_heldout_edge_;
+  Float         ppx_codec_score_;
 
   Timer         t_load_network_;
   Timer         t_init_dkv_;
+  Timer         t_partition_;
+  Timer         t_load_shard_;
   Timer         t_outer_;
   Timer         t_populate_pi_;
   Timer         t_perplexity_;
@@ -235,24 +463,39 @@ class MCMCSamplerStochasticDistributed : public MCMCSamplerStochastic {
   Timer         t_update_phi_;
   Timer         t_load_pi_minibatch_;
   Timer         t_load_pi_neighbor_;
+  Timer         t_load_pi_wait_;
+  Timer         t_load_pi_inflight_;
   Timer         t_barrier_phi_;
   Timer         t_update_pi_;
   Timer         t_store_pi_minibatch_;
+  Timer         t_store_pi_wait_;
   Timer         t_barrier_pi_;
+  Timer         t_carry_pi_;
+  Timer         t_epoch_barrier_;
   Timer         t_update_beta_;
   Timer         t_beta_zero_;
   Timer         t_beta_rank_;
+  Timer         t_beta_scatter_;
+  Timer         t_comm_wait_;
   Timer         t_load_pi_beta_;
   Timer         t_beta_calc_grads_;
   Timer         t_beta_sum_grads_;
   Timer         t_beta_reduce_grads_;
+  Timer         t_beta_reduce_wait_;
   Timer         t_beta_update_theta_;
   Timer         t_load_pi_perp_;
   Timer         t_purge_pi_perp_;
   Timer         t_reduce_perp_;
   Timer         t_broadcast_theta_beta_;
+  Timer         t_checkpoint_;
 
   Counter       c_minibatch_chunk_size_;
+  Counter       c_minibatch_nodes_at_owner_;
+  Counter       c_minibatch_nodes_moved_;
+  Counter       c_beta_pi_reused_;
+  Counter       c_phi_nodes_stolen_;
+  Counter       c_numa_local_;
+  Counter       c_numa_remote_;
 
   std::vector<double> timings_;
 };
@@ -0,0 +1,457 @@
+#include "mcmc/learning/mcmc_sampler_stochastic_distr_async.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef MCMC_MPI_THREADS
+#  include "mcmc/mpi-threads.h"
+#else
+#  include <mpi.h>
+#endif
+
+#include "mcmc/exception.h"
+
+namespace mcmc {
+namespace learning {
+
+namespace {
+const int kRequestTag = 1;
+const int kReplyTag = 2;
+}   // namespace
+
+
+MCMCSamplerStochasticDistributedAsync::MCMCSamplerStochasticDistributedAsync(
+    const Options &args)
+    : MCMCSamplerStochasticDistributed(args),
+      staleness_(args.staleness), beta_interval_(args.beta_interval),
+      next_sequence_(0), committed_(0), max_row_staleness_(0) {
+  if (beta_interval_ == 0) {
+    beta_interval_ = 1;
+  }
+  t_async_sample_          = Timer("  async sample minibatch");
+  t_async_theta_           = Timer("  async update theta");
+  t_async_idle_            = Timer("  async wait for requests");
+  t_async_wait_            = Timer("  async wait for work");
+  c_async_in_flight_       = Counter("minibatches in flight at hand-out");
+  c_async_row_staleness_   = Counter("pending updates per pi row read");
+}
+
+
+MCMCSamplerStochasticDistributedAsync::~MCMCSamplerStochasticDistributedAsync() {
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::init() {
+  if (! args_.REPLICATED_NETWORK) {
+    throw MCMCException("--mcmc.async requires --mcmc.replicated-graph");
+  }
+  if (args_.dkv_epochs || args_.graph_shards ||
+      args_.decentralized_minibatch || args_.allreduce_beta ||
+      args_.comm_thread || args_.steal) {
+    throw MCMCException("--mcmc.async excludes --mcmc.dkv-epochs, "
+                        "--mcmc.graph-shards, "
+                        "--mcmc.decentralized-minibatch, "
+                        "--mcmc.allreduce-beta, --mcmc.comm-thread and "
+                        "--mcmc.steal");
+  }
+  if (args_.checkpoint_interval > 0 || args_.restart) {
+    throw MCMCException("--mcmc.async does not support checkpoints");
+  }
+  if (args_.forced_master_is_worker) {
+    throw MCMCException("--mcmc.async: the master cannot be a worker");
+  }
+
+  MCMCSamplerStochasticDistributed::init();
+
+  if (mpi_size_ < 2) {
+    throw MCMCException("--mcmc.async requires at least one worker besides "
+                        "the master");
+  }
+  if (mpi_rank_ == mpi_master_) {
+    pending_writes_.resize(N, 0);
+  }
+  std::cerr << "Asynchronous workers, staleness " << staleness_ <<
+    " beta interval " << beta_interval_ << std::endl;
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::run() {
+  int r;
+
+  r = MPI_Barrier(MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Barrier(initial) fails");
+
+  t_start_ = std::chrono::system_clock::now();
+
+  if (mpi_rank_ == mpi_master_) {
+    serve();
+    beta_from_theta();
+  } else {
+    work();
+  }
+
+  r = MPI_Barrier(MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Barrier(post pi) fails");
+
+  check_perplexity(true);
+
+  r = MPI_Barrier(MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Barrier(post pi) fails");
+
+  PrintStats(std::cout);
+  PrintAsyncStats(std::cout);
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::serve() {
+  enum class PHASE {
+    RUN,
+    PERPLEXITY,
+    STOP,
+  };
+
+  const int workers = mpi_size_ - 1;
+  // requests that wait for the staleness bound: worker, wants theta
+  std::deque<std::pair<int, bool> > waiting;
+  // workers that got the PERPLEXITY or STOP command of the current phase
+  int answered = 0;
+  bool perplexity_due = false;
+  // As the synchronous sampler, start out with a perplexity
+  PHASE phase = PHASE::PERPLEXITY;
+  std::vector<unsigned char> buffer(sizeof(Request) + 2 * K * sizeof(Float));
+  int r;
+
+  while (phase != PHASE::STOP || answered < workers) {
+    if (phase == PHASE::RUN &&
+        queue_.size() < static_cast< ::size_t>(workers)) {
+      // Sample ahead while no worker asks for work
+      int pending;
+      r = MPI_Iprobe(MPI_ANY_SOURCE, kRequestTag, MPI_COMM_WORLD, &pending,
+                     MPI_STATUS_IGNORE);
+      mpi_error_test(r, "MPI_Iprobe(async request) fails");
+      if (! pending) {
+        sample_work();
+        continue;
+      }
+    }
+
+    t_async_idle_.start();
+    MPI_Status status;
+    r = MPI_Recv(buffer.data(), buffer.size(), MPI_BYTE, MPI_ANY_SOURCE,
+                 kRequestTag, MPI_COMM_WORLD, &status);
+    mpi_error_test(r, "MPI_Recv(async request) fails");
+    t_async_idle_.stop();
+
+    Request request;
+    memcpy(&request, buffer.data(), sizeof request);
+    if (request.has_grads) {
+      complete(request.sequence,
+               reinterpret_cast<const Float *>(buffer.data() +
+                                               sizeof request));
+      if ((step_count - 1) % interval == 0) {
+        perplexity_due = true;
+      }
+    }
+    waiting.push_back({ status.MPI_SOURCE, request.want_theta != 0 });
+
+    if (phase == PHASE::RUN) {
+      if (step_count >= max_iteration || is_converged()) {
+        phase = PHASE::STOP;
+        answered = 0;
+      } else if (perplexity_due) {
+        phase = PHASE::PERPLEXITY;
+        answered = 0;
+        perplexity_due = false;
+      }
+    }
+
+    if (phase == PHASE::RUN) {
+      while (! waiting.empty() && may_dispatch()) {
+        dispatch(waiting.front().first, waiting.front().second);
+        waiting.pop_front();
+      }
+
+    } else {
+      // A worker asks after it completed its minibatch, so once all are
+      // answered, no minibatch is in flight
+      COMMAND command = (phase == PHASE::PERPLEXITY) ? COMMAND::PERPLEXITY
+                                                     : COMMAND::STOP;
+      for (auto w : waiting) {
+        reply(w.first, command, true, 0, NULL);
+        ++answered;
+      }
+      waiting.clear();
+      if (phase == PHASE::PERPLEXITY && answered == workers) {
+        // The master holds its share of the held-out set, too
+        beta_from_theta();
+        check_perplexity(true);
+        phase = PHASE::RUN;
+        answered = 0;
+      }
+    }
+  }
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::sample_work() {
+  t_async_sample_.start();
+  t_mini_batch_.start();
+  EdgeSample edgeSample = network.sample_mini_batch(mini_batch_size, strategy);
+  t_mini_batch_.stop();
+
+  std::vector<EdgeMapItem> items;
+  items.reserve(edgeSample.first->size());
+  for (auto e : *edgeSample.first) {
+    items.push_back(EdgeMapItem(e, e.in(network.get_linked_edges())));
+  }
+  delete edgeSample.first;
+
+  // The ranked slice holds the minibatch nodes and the minibatch edges
+  queue_.push_back(Work());
+  Work &work = queue_.back();
+  work.scale = edgeSample.second;
+  rank_minibatch_slice(items.data(), items.data() + items.size(),
+                       &work.slice);
+  t_async_sample_.stop();
+}
+
+
+bool MCMCSamplerStochasticDistributedAsync::may_dispatch() {
+  if (queue_.empty()) {
+    sample_work();
+  }
+  // A worker would read these pi rows while the minibatches in flight
+  // that update them are not done
+  for (auto n : queue_.front().slice.nodes) {
+    if (static_cast< ::size_t>(pending_writes_[n]) > staleness_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::dispatch(int worker,
+                                                     bool send_theta) {
+  if (queue_.empty()) {
+    sample_work();
+  }
+
+  ::size_t sequence = next_sequence_++;
+  Work &work = in_flight_[sequence];
+  work = std::move(queue_.front());
+  queue_.pop_front();
+
+  c_async_in_flight_.tick(sequence - committed_);
+  for (auto n : work.slice.nodes) {
+    c_async_row_staleness_.tick(pending_writes_[n]);
+    max_row_staleness_ = std::max(max_row_staleness_,
+                                  static_cast< ::size_t>(pending_writes_[n]));
+    ++pending_writes_[n];
+  }
+
+  reply(worker, COMMAND::WORK, send_theta, sequence, &work.slice);
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::complete(::size_t sequence,
+                                                     const Float *grads) {
+  auto work = in_flight_.find(sequence);
+  if (work == in_flight_.end()) {
+    throw MCMCException("Beta grads for minibatch " +
+                        std::to_string(sequence) + " that is not in flight");
+  }
+  for (auto n : work->second.slice.nodes) {
+    --pending_writes_[n];
+  }
+
+  t_async_theta_.start();
+  std::copy(grads, grads + K, grads_beta_[0][0].begin());
+  std::copy(grads + K, grads + 2 * K, grads_beta_[0][1].begin());
+  beta_update_theta(work->second.scale);
+  t_async_theta_.stop();
+
+  in_flight_.erase(work);
+  done_.insert(sequence);
+  while (! done_.empty() && *done_.begin() == committed_) {
+    done_.erase(done_.begin());
+    ++committed_;
+  }
+  ++step_count;
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::reply(int worker,
+                                                  COMMAND command,
+                                                  bool send_theta,
+                                                  ::size_t sequence,
+                                                  const BetaSlice *slice) {
+  Reply header;
+  header.command = static_cast<int32_t>(command);
+  header.has_theta = send_theta;
+  header.sequence = sequence;
+  header.num_nodes = (slice == NULL) ? 0 : slice->nodes.size();
+  header.num_edges = (slice == NULL) ? 0 : slice->edges.size();
+
+  ::size_t theta_bytes = send_theta ? 2 * K * sizeof(Float) : 0;
+  message_.resize(sizeof header + theta_bytes +
+                  header.num_nodes * sizeof(Vertex) +
+                  header.num_edges * sizeof(BetaEdge));
+  auto *marshall = message_.data();
+  memcpy(marshall, &header, sizeof header);
+  marshall += sizeof header;
+  if (send_theta) {
+    Float *theta_marshalled = reinterpret_cast<Float *>(marshall);
+    for (::size_t k = 0; k < K; ++k) {
+      for (::size_t i = 0; i < 2; ++i) {
+        theta_marshalled[2 * k + i] = theta[k][i];
+      }
+    }
+    marshall += theta_bytes;
+  }
+  if (slice != NULL) {
+    memcpy(marshall, slice->nodes.data(), header.num_nodes * sizeof(Vertex));
+    marshall += header.num_nodes * sizeof(Vertex);
+    memcpy(marshall, slice->edges.data(),
+           header.num_edges * sizeof(BetaEdge));
+  }
+
+  int r = MPI_Send(message_.data(), message_.size(), MPI_BYTE, worker,
+                   kReplyTag, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Send(async reply) fails");
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::work() {
+  // As in update_beta: pi_update_ holds the pi of the minibatch nodes
+  bool reuse_pi_update = (args_.dkv_codec == DKV::CODEC::NONE ||
+                          args_.dkv_codec_validate);
+  BetaSlice slice;
+  ::size_t sequence = 0;
+  bool has_grads = false;
+  ::size_t done = 0;
+
+  while (true) {
+    t_async_wait_.start();
+    request(has_grads, done % beta_interval_ == 0, sequence);
+    COMMAND command = receive_reply(&sequence, &slice);
+    t_async_wait_.stop();
+    has_grads = false;
+
+    if (command == COMMAND::STOP) {
+      break;
+    }
+    if (command == COMMAND::PERPLEXITY) {
+      check_perplexity(true);
+      continue;
+    }
+
+    t_outer_.start();
+    // the step size follows the global progress
+    step_count = sequence + 1;
+    nodes_ = slice.nodes;
+    check_my_mini_batch_size();
+
+    t_update_phi_pi_.start();
+    update_phi(&phi_node_);
+    update_pi(phi_node_);
+    t_update_phi_pi_.stop();
+
+    t_update_beta_.start();
+    beta_calc_slice_grads(slice, reuse_pi_update, []() { });
+    beta_sum_thread_grads();
+    t_update_beta_.stop();
+    t_outer_.stop();
+
+    has_grads = true;
+    ++done;
+    if (done % stats_print_interval_ == 0) {
+      PrintStats(std::cout);
+      PrintAsyncStats(std::cout);
+    }
+  }
+}
+
+
+void MCMCSamplerStochasticDistributedAsync::request(bool has_grads,
+                                                    bool want_theta,
+                                                    ::size_t sequence) {
+  Request header;
+  header.has_grads = has_grads;
+  header.want_theta = want_theta;
+  header.sequence = sequence;
+
+  message_.resize(sizeof header + (has_grads ? 2 * K * sizeof(Float) : 0));
+  memcpy(message_.data(), &header, sizeof header);
+  if (has_grads) {
+    Float *grads = reinterpret_cast<Float *>(message_.data() + sizeof header);
+    std::copy(grads_beta_[0][0].begin(), grads_beta_[0][0].end(), grads);
+    std::copy(grads_beta_[0][1].begin(), grads_beta_[0][1].end(), grads + K);
+  }
+
+  int r = MPI_Send(message_.data(), message_.size(), MPI_BYTE, mpi_master_,
+                   kRequestTag, MPI_COMM_WORLD);
+  mpi_error_test(r, "MPI_Send(async request) fails");
+}
+
+
+MCMCSamplerStochasticDistributedAsync::COMMAND
+MCMCSamplerStochasticDistributedAsync::receive_reply(::size_t *sequence,
+                                                     BetaSlice *slice) {
+  int r;
+  MPI_Status status;
+  r = MPI_Probe(mpi_master_, kReplyTag, MPI_COMM_WORLD, &status);
+  mpi_error_test(r, "MPI_Probe(async reply) fails");
+  int bytes;
+  r = MPI_Get_count(&status, MPI_BYTE, &bytes);
+  mpi_error_test(r, "MPI_Get_count(async reply) fails");
+  message_.resize(bytes);
+  r = MPI_Recv(message_.data(), bytes, MPI_BYTE, mpi_master_, kReplyTag,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  mpi_error_test(r, "MPI_Recv(async reply) fails");
+
+  Reply header;
+  const auto *unmarshall = message_.data();
+  memcpy(&header, unmarshall, sizeof header);
+  unmarshall += sizeof header;
+  if (header.has_theta) {
+    const Float *theta_marshalled = reinterpret_cast<const Float *>(unmarshall);
+    for (::size_t k = 0; k < K; ++k) {
+      for (::size_t i = 0; i < 2; ++i) {
+        theta[k][i] = theta_marshalled[2 * k + i];
+      }
+    }
+    beta_from_theta();
+    unmarshall += 2 * K * sizeof(Float);
+  }
+
+  *sequence = header.sequence;
+  slice->nodes.resize(header.num_nodes);
+  slice->edges.resize(header.num_edges);
+  memcpy(slice->nodes.data(), unmarshall, header.num_nodes * sizeof(Vertex));
+  unmarshall += header.num_nodes * sizeof(Vertex);
+  memcpy(slice->edges.data(), unmarshall,
+         header.num_edges * sizeof(BetaEdge));
+
+  return static_cast<COMMAND>(header.command);
+}
+
+
+std::ostream& MCMCSamplerStochasticDistributedAsync::PrintAsyncStats(
+    std::ostream& out) const {
+  out << t_async_sample_ << std::endl;
+  out << t_async_theta_ << std::endl;
+  out << t_async_idle_ << std::endl;
+  out << t_async_wait_ << std::endl;
+  out << c_async_in_flight_ << std::endl;
+  out << c_async_row_staleness_ << std::endl;
+  out << "max pending updates of a pi row read " << max_row_staleness_ <<
+    std::endl;
+
+  return out;
+}
+
+}	// namespace learning
+}	// namespace mcmc
@@ -0,0 +1,122 @@
+#ifndef MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_DISTR_ASYNC_H__
+#define MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_DISTR_ASYNC_H__
+
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "mcmc/config.h"
+
+#include "mcmc/learning/mcmc_sampler_stochastic_distr.h"
+
+namespace mcmc {
+namespace learning {
+
+/**
+ * Bounded-staleness asynchronous variant of the distributed sampler.
+ *
+ * The master does not compute: it samples minibatches into a queue, hands
+ * out one whole minibatch to each worker that asks for work, and updates
+ * theta with the beta grads that a worker returns with its next request.
+ * The workers do not synchronize with each other. They read pi rows that
+ * other workers may be updating, and write their own pi updates
+ * asynchronously.
+ *
+ * Staleness is bounded per pi row: the master counts, for each pi row, the
+ * minibatches in flight that will update it, and hands out the next
+ * minibatch only once none of the rows of its nodes has more than
+ * staleness of them. A worker's reads of those rows then miss at most
+ * staleness updates. The rows of the sampled neighbors are not known to
+ * the master, and are not bounded.
+ *
+ * A worker refreshes beta every beta-interval minibatches. All ranks meet
+ * for the perplexity calculation.
+ */
+class MCMCSamplerStochasticDistributedAsync :
+    public MCMCSamplerStochasticDistributed {
+
+ public:
+  MCMCSamplerStochasticDistributedAsync(const Options &args);
+
+  virtual ~MCMCSamplerStochasticDistributedAsync();
+
+  void init() override;
+
+  void run() override;
+
+ protected:
+  enum class COMMAND : int32_t {
+    WORK,
+    PERPLEXITY,
+    STOP,
+  };
+
+  // worker -> master; followed by the 2K beta grads if has_grads
+  struct Request {
+    int32_t has_grads;
+    int32_t want_theta;
+    int64_t sequence;           // of the minibatch of the grads
+  };
+
+  // master -> worker; followed by theta if has_theta, then for WORK the
+  // nodes and the edges of the minibatch
+  struct Reply {
+    int32_t command;
+    int32_t has_theta;
+    int64_t sequence;
+    int32_t num_nodes;
+    int32_t num_edges;
+  };
+
+  struct Work {
+    Float scale;
+    BetaSlice slice;
+  };
+
+  // master
+  void serve();
+  void sample_work();
+  // Whether the staleness bound allows handing out the next minibatch
+  bool may_dispatch();
+  void dispatch(int worker, bool send_theta);
+  void complete(::size_t sequence, const Float *grads);
+  void reply(int worker, COMMAND command, bool send_theta,
+             ::size_t sequence, const BetaSlice *slice);
+
+  // worker
+  void work();
+  void request(bool has_grads, bool want_theta, ::size_t sequence);
+  COMMAND receive_reply(::size_t *sequence, BetaSlice *slice);
+
+  std::ostream& PrintAsyncStats(std::ostream& out) const;
+
+  ::size_t      staleness_;
+  ::size_t      beta_interval_;
+
+  // master: sampled minibatches, and the minibatches handed out whose grads
+  // have not yet returned
+  std::deque<Work> queue_;
+  std::unordered_map< ::size_t, Work> in_flight_;
+  // minibatches [0, committed_) and done_ have completed
+  ::size_t      next_sequence_;
+  ::size_t      committed_;
+  std::set< ::size_t> done_;
+  // per pi row, the minibatches in flight that update it
+  std::vector<int32_t> pending_writes_;
+
+  std::vector<unsigned char> message_;
+
+  Timer         t_async_sample_;
+  Timer         t_async_theta_;
+  Timer         t_async_idle_;
+  Timer         t_async_wait_;
+  Counter       c_async_in_flight_;
+  Counter       c_async_row_staleness_;
+  ::size_t      max_row_staleness_;
+};
+
+}	// namespace learning
+}	// namespace mcmc
+
+#endif	// ndef MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_DISTR_ASYNC_H__
@@ -0,0 +1,442 @@
+#include "mcmc/learning/mcmc_sampler_stochastic_sparse.h"
+
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <string>
+
+#include "mcmc/exception.h"
+
+namespace mcmc {
+namespace learning {
+
+MCMCSamplerStochasticSparse::MCMCSamplerStochasticSparse(const Options &args)
+    : MCMCSamplerStochastic(args), m_(args.sparse_m), beta_sum_(FLOAT(0.0)),
+      c_candidates_("candidate communities/node"),
+      c_densify_("dense iterations") {
+  if (m_ == 0 || m_ > K) {
+    throw MCMCException("--mcmc.sparse-m must be between 1 and K");
+  }
+}
+
+MCMCSamplerStochasticSparse::~MCMCSamplerStochasticSparse() {
+}
+
+void MCMCSamplerStochasticSparse::init() {
+  if (args_.out_of_core != "") {
+    throw MCMCException("--mcmc.sparse-m does not support "
+                        "--mcmc.out-of-core");
+  }
+  // Checkpoints hold phi as a dense N x K array
+  if (args_.checkpoint_interval > 0 || args_.restart || args_.warm_start) {
+    throw MCMCException("--mcmc.sparse-m does not support checkpoints");
+  }
+
+  MCMCSamplerStochastic::init();
+  update_beta_sum();
+  std::cerr << "Sparse pi: top " << m_ << " of " << K << " communities" <<
+    std::endl;
+}
+
+bool MCMCSamplerStochasticSparse::allocate_pi() const {
+  return false;
+}
+
+void MCMCSamplerStochasticSparse::init_phi_pi() {
+  active_.resize(N * m_);
+  active_phi_.resize(N * m_);
+  residual_.resize(N);
+  phi_sum_.resize(N);
+  candidate_of_.assign(K, -1);
+
+  // Row by row, so phi never is in memory as a whole
+  std::vector<int32_t> all(K);
+  std::iota(all.begin(), all.end(), 0);
+  for (::size_t i = 0; i < N; ++i) {
+    std::vector<Float> phi_i = rng_[0]->gamma(1, 1, 1, K)[0];
+    truncate(all, phi_i, FLOAT(0.0), 0, &active_[i * m_],
+             &active_phi_[i * m_], &residual_[i], &phi_sum_[i]);
+  }
+  std::cerr << "Done host random for sparse phi" << std::endl;
+}
+
+void MCMCSamplerStochasticSparse::truncate(
+    const std::vector<int32_t> &candidates, const std::vector<Float> &phi,
+    Float residual, ::size_t outside, int32_t *active, Float *active_phi,
+    Float *new_residual, Float *phi_sum) const {
+  std::vector< ::size_t> order(candidates.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::nth_element(order.begin(), order.begin() + m_, order.end(),
+                   [&phi, &candidates](::size_t a, ::size_t b) {
+                     return phi[a] > phi[b] ||
+                       (phi[a] == phi[b] && candidates[a] < candidates[b]);
+                   });
+  std::sort(order.begin(), order.begin() + m_,
+            [&candidates](::size_t a, ::size_t b) {
+              return candidates[a] < candidates[b];
+            });
+
+  Float kept = FLOAT(0.0);
+  for (::size_t j = 0; j < m_; ++j) {
+    active[j] = candidates[order[j]];
+    active_phi[j] = phi[order[j]];
+    kept += active_phi[j];
+  }
+  Float demoted = residual * outside;
+  for (::size_t j = m_; j < order.size(); ++j) {
+    demoted += phi[order[j]];
+  }
+
+  // With m == K, no community is inactive
+  Float rest = FLOAT(0.0);
+  if (m_ < K) {
+    rest = demoted / (K - m_);
+    if (rest < MCMC_NONZERO_GUARD) {
+      rest = MCMC_NONZERO_GUARD;
+    }
+  }
+  *new_residual = rest;
+  *phi_sum = kept + rest * (K - m_);
+}
+
+void MCMCSamplerStochasticSparse::merge(Vertex a, Vertex b, Union *u) const {
+  const int32_t *k_a = &active_[a * m_];
+  const int32_t *k_b = &active_[b * m_];
+  const Float *phi_a = &active_phi_[a * m_];
+  const Float *phi_b = &active_phi_[b * m_];
+  Float sum_a = phi_sum_[a];
+  Float sum_b = phi_sum_[b];
+
+  u->k.clear();
+  u->pi_a.clear();
+  u->pi_b.clear();
+  u->rest_a = residual_[a] / sum_a;
+  u->rest_b = residual_[b] / sum_b;
+
+  ::size_t i = 0;
+  ::size_t j = 0;
+  while (i < m_ || j < m_) {
+    if (j == m_ || (i < m_ && k_a[i] < k_b[j])) {
+      u->k.push_back(k_a[i]);
+      u->pi_a.push_back(phi_a[i] / sum_a);
+      u->pi_b.push_back(u->rest_b);
+      ++i;
+    } else if (i == m_ || k_b[j] < k_a[i]) {
+      u->k.push_back(k_b[j]);
+      u->pi_a.push_back(u->rest_a);
+      u->pi_b.push_back(phi_b[j] / sum_b);
+      ++j;
+    } else {
+      u->k.push_back(k_a[i]);
+      u->pi_a.push_back(phi_a[i] / sum_a);
+      u->pi_b.push_back(phi_b[j] / sum_b);
+      ++i;
+      ++j;
+    }
+  }
+}
+
+Float MCMCSamplerStochasticSparse::pair_likelihood(Vertex a, Vertex b,
+                                                   bool y) const {
+  Union u;
+  merge(a, b, &u);
+
+  // s: the linked part, sum_k pi_a[k] pi_b[k] beta[k]
+  Float s = FLOAT(0.0);
+  Float pi_sum = FLOAT(0.0);
+  Float beta_union = FLOAT(0.0);
+  for (::size_t j = 0; j < u.k.size(); ++j) {
+    Float f = u.pi_a[j] * u.pi_b[j];
+    s += f * beta[u.k[j]];
+    pi_sum += f;
+    beta_union += beta[u.k[j]];
+  }
+  Float rest = u.rest_a * u.rest_b;
+  s += rest * (beta_sum_ - beta_union);
+  pi_sum += rest * (K - u.k.size());
+
+  if (! y) {
+    s = (pi_sum - s) + (FLOAT(1.0) - pi_sum) * (FLOAT(1.0) - epsilon);
+  }
+  if (s < FLOAT(1.0e-30)) {
+    s = FLOAT(1.0e-30);
+  }
+
+  return s;
+}
+
+void MCMCSamplerStochasticSparse::update_phi_nodes(
+    const std::vector<Vertex> &nodes, Float eps_t) {
+  bool dense = args_.sparse_densify > 0 &&
+               step_count % args_.sparse_densify == 0;
+  if (dense) {
+    c_densify_.tick();
+  }
+
+  next_active_.resize(nodes.size() * m_);
+  next_phi_.resize(nodes.size() * m_);
+  next_residual_.resize(nodes.size());
+  next_phi_sum_.resize(nodes.size());
+
+  for (::size_t n = 0; n < nodes.size(); ++n) {
+    Vertex node = nodes[n];
+    t_sample_neighbor_nodes.start();
+    // sample a mini-batch of neighbors
+    NeighborSet neighbors;
+    sample_neighbor_nodes(&neighbors, num_node_sample, node, rng_[0]);
+    t_sample_neighbor_nodes.stop();
+
+    t_update_phi.start();
+    update_phi_sparse(n, node, neighbors, eps_t, dense);
+    t_update_phi.stop();
+  }
+}
+
+void MCMCSamplerStochasticSparse::update_phi_sparse(
+    ::size_t n, Vertex i, const NeighborSet &neighbors, Float eps_t,
+    bool dense) {
+  // The candidates: my active communities and those of my neighbors, or
+  // all of them
+  std::vector<int32_t> candidates;
+  auto add = [this, &candidates](int32_t k) {
+    if (candidate_of_[k] < 0) {
+      candidate_of_[k] = candidates.size();
+      candidates.push_back(k);
+    }
+  };
+  if (dense) {
+    for (::size_t k = 0; k < K; ++k) {
+      add(k);
+    }
+  } else {
+    for (::size_t j = 0; j < m_; ++j) {
+      add(active_[i * m_ + j]);
+    }
+    for (auto neighbor : neighbors) {
+      if (neighbor != i) {
+        for (::size_t j = 0; j < m_; ++j) {
+          add(active_[neighbor * m_ + j]);
+        }
+      }
+    }
+  }
+  ::size_t outside = K - candidates.size();
+
+  std::vector<Float> phi_i(candidates.size(), residual_[i]);
+  for (::size_t j = 0; j < m_; ++j) {
+    phi_i[candidate_of_[active_[i * m_ + j]]] = active_phi_[i * m_ + j];
+  }
+
+  std::vector<Float> grads;
+  Float outside_grad;
+  phi_grads(i, neighbors, candidates, &grads, &outside_grad);
+
+  // random gaussian noise.
+  std::vector<Float> noise = rng_[0]->randn(candidates.size());
+  Float Nn = (FLOAT(1.0) * N) / num_node_sample;
+  for (::size_t c = 0; c < candidates.size(); ++c) {
+    Float phi_k = phi_i[c];
+    phi_i[c] = std::abs((phi_k
+                         + eps_t / FLOAT(2.0) * (alpha - phi_k + Nn * grads[c]))
+                        + std::sqrt(eps_t * phi_k) * noise[c]
+                        );
+    if (phi_i[c] < MCMC_NONZERO_GUARD) {
+      phi_i[c] = MCMC_NONZERO_GUARD;
+    }
+  }
+
+  // The communities outside the candidates move as one, with their mean
+  // gradient and the mean of their noise
+  Float residual = residual_[i];
+  if (outside > 0) {
+    Float grad = outside_grad;
+    Float noise_mean = rng_[0]->randn() / std::sqrt(FLOAT(1.0) * outside);
+    residual = std::abs((residual
+                         + eps_t / FLOAT(2.0) * (alpha - residual + Nn * grad))
+                        + std::sqrt(eps_t * residual) * noise_mean
+                        );
+    if (residual < MCMC_NONZERO_GUARD) {
+      residual = MCMC_NONZERO_GUARD;
+    }
+  }
+
+  truncate(candidates, phi_i, residual, outside, &next_active_[n * m_],
+           &next_phi_[n * m_], &next_residual_[n], &next_phi_sum_[n]);
+
+  for (auto k : candidates) {
+    candidate_of_[k] = -1;
+  }
+  c_candidates_.tick(candidates.size());
+}
+
+void MCMCSamplerStochasticSparse::phi_grads(
+    Vertex i, const NeighborSet &neighbors,
+    const std::vector<int32_t> &candidates, std::vector<Float> *grads,
+    Float *outside_grad) const {
+  Float phi_i_sum = phi_sum_[i];
+
+  // The gradient of community k is, summed over the neighbors,
+  //   (probs[k] / prob_sum) / phi_i[k] - 1 / phi_i_sum
+  //     = (pi_b[k] f[k] + e) / (prob_sum phi_i_sum) - 1 / phi_i_sum
+  // with f[k] linear in beta[k]. Outside the union with neighbor b,
+  // pi_b[k] is the same for all k, so that term is background_beta *
+  // beta[k] + background; the union gets its correction.
+  grads->assign(candidates.size(), FLOAT(0.0));
+  Float background_beta = FLOAT(0.0);
+  Float background = FLOAT(0.0);
+  ::size_t count = 0;
+  Union u;
+  for (auto neighbor : neighbors) {
+    if (i == neighbor) {
+      continue;
+    }
+    ++count;
+
+    int y_ab = 0;  // observation
+    Edge edge(std::min(i, neighbor), std::max(i, neighbor));
+    if (edge.in(network.get_linked_edges())) {
+      y_ab = 1;
+    }
+
+    merge(i, neighbor, &u);
+    // f[k] = sign * (beta[k] - epsilon)
+    Float sign = (y_ab == 1) ? FLOAT(1.0) : FLOAT(-1.0);
+    Float e = (y_ab == 1) ? epsilon : (FLOAT(1.0) - epsilon);
+    Float prob_sum = FLOAT(0.0);
+    Float beta_union = FLOAT(0.0);
+    for (::size_t j = 0; j < u.k.size(); ++j) {
+      Float f = sign * (beta[u.k[j]] - epsilon);
+      prob_sum += u.pi_a[j] * (u.pi_b[j] * f + e);
+      beta_union += beta[u.k[j]];
+    }
+    ::size_t rest = K - u.k.size();
+    Float f_rest = sign * ((beta_sum_ - beta_union) - rest * epsilon);
+    prob_sum += u.rest_a * (u.rest_b * f_rest + rest * e);
+
+    Float scale = FLOAT(1.0) / (prob_sum * phi_i_sum);
+    Float b_beta = sign * u.rest_b * scale;
+    Float b = (e - sign * u.rest_b * epsilon) * scale;
+    background_beta += b_beta;
+    background += b;
+    for (::size_t j = 0; j < u.k.size(); ++j) {
+      int32_t k = u.k[j];
+      Float f = sign * (beta[k] - epsilon);
+      (*grads)[candidate_of_[k]] += (u.pi_b[j] * f + e) * scale -
+                                      (b_beta * beta[k] + b);
+    }
+  }
+
+  Float sum_term = count / phi_i_sum;
+  Float beta_candidates = FLOAT(0.0);
+  for (::size_t c = 0; c < candidates.size(); ++c) {
+    Float beta_k = beta[candidates[c]];
+    (*grads)[c] += background_beta * beta_k + background - sum_term;
+    beta_candidates += beta_k;
+  }
+
+  ::size_t outside = K - candidates.size();
+  *outside_grad = FLOAT(0.0);
+  if (outside > 0) {
+    *outside_grad = background_beta * (beta_sum_ - beta_candidates) /
+                      outside + background - sum_term;
+  }
+}
+
+void MCMCSamplerStochasticSparse::update_pi_nodes(
+    const std::vector<Vertex> &nodes) {
+  for (::size_t n = 0; n < nodes.size(); ++n) {
+    Vertex i = nodes[n];
+    std::copy(&next_active_[n * m_], &next_active_[n * m_] + m_,
+              &active_[i * m_]);
+    std::copy(&next_phi_[n * m_], &next_phi_[n * m_] + m_,
+              &active_phi_[i * m_]);
+    residual_[i] = next_residual_[n];
+    phi_sum_[i] = next_phi_sum_[n];
+  }
+}
+
+void MCMCSamplerStochasticSparse::update_beta(const MinibatchSet &mini_batch,
+                                              Float scale) {
+  std::vector<std::vector<Float> > grads;
+  beta_grads(mini_batch, &grads);
+
+  update_theta(grads, scale);
+  update_beta_sum();
+}
+
+void MCMCSamplerStochasticSparse::beta_grads(
+    const MinibatchSet &mini_batch,
+    std::vector<std::vector<Float> > *grads) const {
+  // gradients K*2 dimension
+  grads->assign(K, std::vector<Float>(2, FLOAT(0.0)));
+  std::vector<Float> theta_sum(theta.size());
+  std::transform(theta.begin(), theta.end(), theta_sum.begin(),
+                 np::sum<Float>);
+
+  // probs[k] / prob_sum of an edge is weight[y][k] * (y ? beta[k] :
+  // 1 - beta[k]). Outside the union of the endpoints' active communities,
+  // the weight is the same for all k: it goes to background[y], and the
+  // union corrects it in weight[y][k].
+  Float background[2] = { FLOAT(0.0), FLOAT(0.0) };
+  std::vector<std::vector<Float> > weight(2, std::vector<Float>(K,
+                                                                FLOAT(0.0)));
+  Union u;
+  for (auto edge = mini_batch.begin(); edge != mini_batch.end(); edge++) {
+    int y = 0;
+    if (edge->in(network.get_linked_edges())) {
+      y = 1;
+    }
+    merge(edge->first, edge->second, &u);
+
+    Float pi_sum = FLOAT(0.0);
+    Float probs_sum = FLOAT(0.0);
+    Float beta_union = FLOAT(0.0);
+    for (::size_t j = 0; j < u.k.size(); ++j) {
+      Float f = u.pi_a[j] * u.pi_b[j];
+      Float beta_k = beta[u.k[j]];
+      pi_sum += f;
+      probs_sum += (y == 1) ? beta_k * f : (FLOAT(1.0) - beta_k) * f;
+      beta_union += beta_k;
+    }
+    ::size_t outside = K - u.k.size();
+    Float rest = u.rest_a * u.rest_b;
+    Float beta_rest = beta_sum_ - beta_union;
+    pi_sum += rest * outside;
+    probs_sum += (y == 1) ? rest * beta_rest : rest * (outside - beta_rest);
+
+    Float prob_0 = ((y == 1) ? epsilon : (FLOAT(1.0) - epsilon)) *
+                                          (FLOAT(1.0) - pi_sum);
+    Float prob_sum = probs_sum + prob_0;
+    Float w = rest / prob_sum;
+    background[y] += w;
+    for (::size_t j = 0; j < u.k.size(); ++j) {
+      weight[y][u.k[j]] += u.pi_a[j] * u.pi_b[j] / prob_sum - w;
+    }
+  }
+
+  for (::size_t k = 0; k < K; k++) {
+    Float f_0 = (background[0] + weight[0][k]) * (FLOAT(1.0) - beta[k]);
+    Float f_1 = (background[1] + weight[1][k]) * beta[k];
+    Float one_over_theta_sum = FLOAT(1.0) / theta_sum[k];
+    (*grads)[k][0] += f_0 * (FLOAT(1.0) / theta[k][0] - one_over_theta_sum) -
+                        f_1 * one_over_theta_sum;
+    (*grads)[k][1] += f_1 * (FLOAT(1.0) / theta[k][1] - one_over_theta_sum) -
+                        f_0 * one_over_theta_sum;
+  }
+}
+
+void MCMCSamplerStochasticSparse::update_beta_sum() {
+  beta_sum_ = np::sum(beta);
+}
+
+std::ostream& MCMCSamplerStochasticSparse::PrintStats(
+    std::ostream& out) const {
+  MCMCSamplerStochastic::PrintStats(out);
+  out << c_candidates_ << std::endl;
+  out << c_densify_ << std::endl;
+
+  return out;
+}
+
+}  // namespace learning
+}  // namespace mcmc
@@ -0,0 +1,119 @@
+#ifndef MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_SPARSE_H__
+#define MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_SPARSE_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "mcmc/config.h"
+
+#include "mcmc/counter.h"
+#include "mcmc/learning/mcmc_sampler_stochastic.h"
+
+namespace mcmc {
+namespace learning {
+
+/**
+ * Sequential sampler for large K, with sparse pi.
+ *
+ * Each node keeps phi only for its top m active communities, sorted by
+ * community. Each of its K - m inactive communities has the same phi, the
+ * residual. For two nodes, the communities outside the union of their
+ * active sets all have the same pi product, so the edge likelihood, the phi
+ * gradient and the beta gradient cost O(m) per edge; only the terms in beta
+ * differ across those communities, and they are folded in through the sum
+ * of beta.
+ *
+ * update_phi updates the active communities of a node and of its sampled
+ * neighbors, so a community can become active; the other communities move
+ * as one, with the mean of their gradients. The top m are kept, and the
+ * mass of the rest goes to the residual. Every --mcmc.sparse-densify
+ * iterations, update_phi considers all K communities.
+ */
+class MCMCSamplerStochasticSparse : public MCMCSamplerStochastic {
+ public:
+  MCMCSamplerStochasticSparse(const Options &args);
+
+  virtual ~MCMCSamplerStochasticSparse();
+
+  void init() override;
+
+ protected:
+  bool allocate_pi() const override;
+  void init_phi_pi() override;
+
+  void update_phi_nodes(const std::vector<Vertex> &nodes,
+                        Float eps_t) override;
+  void update_pi_nodes(const std::vector<Vertex> &nodes) override;
+
+  void update_beta(const MinibatchSet &mini_batch, Float scale) override;
+
+  Float pair_likelihood(Vertex a, Vertex b, bool y) const override;
+
+  std::ostream& PrintStats(std::ostream& out) const override;
+
+  // pi of two nodes on the union of their active communities
+  struct Union {
+    std::vector<int32_t> k;
+    std::vector<Float> pi_a;
+    std::vector<Float> pi_b;
+    Float rest_a;   // pi of a in each community outside the union
+    Float rest_b;
+  };
+
+  void merge(Vertex a, Vertex b, Union *u) const;
+
+  // Update phi of node @argument i into slot @argument n of the next state
+  void update_phi_sparse(::size_t n, Vertex i, const NeighborSet &neighbors,
+                         Float eps_t, bool dense);
+
+  // The phi gradient of node @argument i for @argument candidates, which
+  // candidate_of_ indexes, and the mean gradient of the communities outside
+  // them
+  void phi_grads(Vertex i, const NeighborSet &neighbors,
+                 const std::vector<int32_t> &candidates,
+                 std::vector<Float> *grads, Float *outside_grad) const;
+
+  // The K x 2 theta gradient of @argument mini_batch
+  void beta_grads(const MinibatchSet &mini_batch,
+                  std::vector<std::vector<Float> > *grads) const;
+
+  // Keep the top m of @argument phi over @argument candidates; the others,
+  // and the @argument outside communities at @argument residual each, make
+  // up the new residual
+  void truncate(const std::vector<int32_t> &candidates,
+                const std::vector<Float> &phi, Float residual,
+                ::size_t outside, int32_t *active, Float *active_phi,
+                Float *new_residual, Float *phi_sum) const;
+
+  void update_beta_sum();
+
+  ::size_t m_;
+
+  // N x m active communities, ascending, and their phi
+  std::vector<int32_t> active_;
+  std::vector<Float> active_phi_;
+  // phi of each inactive community, and the sum of phi over all K
+  std::vector<Float> residual_;
+  std::vector<Float> phi_sum_;
+
+  // state of the minibatch nodes until update_pi
+  std::vector<int32_t> next_active_;
+  std::vector<Float> next_phi_;
+  std::vector<Float> next_residual_;
+  std::vector<Float> next_phi_sum_;
+
+  // sum of beta over all K
+  Float beta_sum_;
+
+  // scratch: the candidate index of each community, or -1
+  std::vector<int32_t> candidate_of_;
+
+  Counter c_candidates_;
+  Counter c_densify_;
+};
+
+}  // namespace learning
+}  // namespace mcmc
+
+#endif  // ndef MCMC_LEARNING_MCMC_SAMPLER_STOCHASTIC_SPARSE_H__
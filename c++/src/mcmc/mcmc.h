@@ -15,6 +15,10 @@
 #include "mcmc/preprocess/data_factory.h"
 
 #include "mcmc/learning/mcmc_sampler_stochastic.h"
+#include "mcmc/learning/mcmc_sampler_stochastic_sparse.h"
+#ifdef MCMC_ENABLE_DISTRIBUTED
 #include "mcmc/learning/mcmc_sampler_stochastic_distr.h"
+#include "mcmc/learning/mcmc_sampler_stochastic_distr_async.h"
+#endif
 
 #endif	// ndef MCMC_MCMC_H__
@@ -0,0 +1,596 @@
+#include "mcmc/mpi-threads.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+void *const MPI_IN_PLACE = reinterpret_cast<void *>(0x88888888);
+
+namespace mcmc {
+namespace mpi_threads {
+
+namespace {
+
+struct Message {
+  int source;
+  int tag;
+  std::vector<char> data;
+};
+
+// What a rank contributes to the current collective
+struct Slot {
+  const void *send;
+  void *recv;
+  const int *counts;
+  const int *displs;
+};
+
+// The collective and point-to-point state of one communicator
+struct Communicator {
+  explicit Communicator(int size)
+      : arrived(0), generation(0), slot(size), ibarrier_next(size, 0),
+        mailbox(size) {
+  }
+
+  int arrived;
+  uint64_t generation;
+
+  std::vector<Slot> slot;
+
+  // per Ibarrier sequence number: #ranks arrived, #ranks done waiting
+  std::map<uint64_t, std::pair<int, int> > ibarrier;
+  std::vector<uint64_t> ibarrier_next;
+
+  std::vector<std::deque<Message> > mailbox;
+};
+
+// The memory that each rank exposes in one window
+struct Window {
+  explicit Window(int size) : base(size, NULL), disp_unit(size, 1) {
+  }
+
+  std::vector<char *> base;
+  std::vector<int> disp_unit;
+};
+
+// MPI_COMM_WORLD and the communicators that MPI_Comm_dup() can hand out
+const int kMaxComms = 8;
+const int kMaxWindows = 8;
+
+struct World {
+  explicit World(int size)
+      : size(size), comms(kMaxComms, Communicator(size)), next_comm(1),
+        windows(kMaxWindows, Window(size)), next_window(0) {
+  }
+
+  const int size;
+  std::mutex lock;
+  std::condition_variable cond;
+
+  // never resized, so a rank may use an element without the lock
+  std::vector<Communicator> comms;
+  int next_comm;
+
+  // one-sided operations access these under the lock
+  std::vector<Window> windows;
+  int next_window;
+};
+
+thread_local World *my_world = NULL;
+thread_local int my_rank = 0;
+
+World &world() {
+  if (my_world == NULL) {
+    // Outside Run(): a world of one rank
+    static World single(1);
+    my_world = &single;
+  }
+  return *my_world;
+}
+
+Communicator &communicator(World &w, MPI_Comm comm) {
+  return w.comms[comm];
+}
+
+::size_t datatype_size(MPI_Datatype type) {
+  switch (type) {
+  case MPI_INT:
+    return sizeof(int32_t);
+  case MPI_LONG:
+    return sizeof(int64_t);
+  case MPI_UNSIGNED_LONG:
+    return sizeof(uint64_t);
+  case MPI_FLOAT:
+    return sizeof(float);
+  case MPI_DOUBLE:
+    return sizeof(double);
+  case MPI_BYTE:
+    return 1;
+  }
+  return 0;
+}
+
+void barrier(World &w, Communicator &c) {
+  std::unique_lock<std::mutex> lock(w.lock);
+  uint64_t generation = c.generation;
+  if (++c.arrived == w.size) {
+    c.arrived = 0;
+    ++c.generation;
+    w.cond.notify_all();
+  } else {
+    w.cond.wait(lock, [&c, generation]() {
+      return c.generation != generation;
+    });
+  }
+}
+
+// Publish my buffers, and wait until all ranks have published theirs
+void deposit(World &w, Communicator &c, const void *send, void *recv,
+             const int *counts = NULL, const int *displs = NULL) {
+  c.slot[my_rank] = Slot { send, recv, counts, displs };
+  barrier(w, c);
+}
+
+template <typename T>
+void combine(MPI_Op op, const T *in, T *acc, int count) {
+  for (int i = 0; i < count; ++i) {
+    switch (op) {
+    case MPI_SUM:
+      acc[i] += in[i];
+      break;
+    case MPI_MAX:
+      acc[i] = std::max(acc[i], in[i]);
+      break;
+    case MPI_MIN:
+      acc[i] = std::min(acc[i], in[i]);
+      break;
+    case MPI_LAND:
+      acc[i] = acc[i] && in[i];
+      break;
+    case MPI_REPLACE:
+      acc[i] = in[i];
+      break;
+    case MPI_NO_OP:
+      break;
+    }
+  }
+}
+
+void combine(MPI_Datatype type, MPI_Op op, const void *in, void *acc,
+             int count) {
+  switch (type) {
+  case MPI_INT:
+    combine(op, static_cast<const int32_t *>(in), static_cast<int32_t *>(acc),
+            count);
+    break;
+  case MPI_LONG:
+    combine(op, static_cast<const int64_t *>(in), static_cast<int64_t *>(acc),
+            count);
+    break;
+  case MPI_UNSIGNED_LONG:
+    combine(op, static_cast<const uint64_t *>(in),
+            static_cast<uint64_t *>(acc), count);
+    break;
+  case MPI_FLOAT:
+    combine(op, static_cast<const float *>(in), static_cast<float *>(acc),
+            count);
+    break;
+  case MPI_DOUBLE:
+    combine(op, static_cast<const double *>(in), static_cast<double *>(acc),
+            count);
+    break;
+  case MPI_BYTE:
+    combine(op, static_cast<const unsigned char *>(in),
+            static_cast<unsigned char *>(acc), count);
+    break;
+  }
+}
+
+// Reduce the deposited contributions in rank order, so the result is
+// deterministic
+std::vector<char> reduce_deposits(const World &w, const Communicator &c,
+                                  int count, MPI_Datatype type, MPI_Op op) {
+  ::size_t bytes = count * datatype_size(type);
+  std::vector<char> acc(bytes);
+  for (int r = 0; r < w.size; ++r) {
+    const void *in = (c.slot[r].send == MPI_IN_PLACE) ? c.slot[r].recv
+                                                       : c.slot[r].send;
+    if (r == 0) {
+      memcpy(acc.data(), in, bytes);
+    } else {
+      combine(type, op, in, acc.data(), count);
+    }
+  }
+  return acc;
+}
+
+// Rank 0 of @argument comm allocates an id from @argument next, or -1
+int allocate_id(World &w, int *next, int max, MPI_Comm comm) {
+  int id = 0;
+  if (my_rank == 0) {
+    std::unique_lock<std::mutex> lock(w.lock);
+    id = (*next < max) ? (*next)++ : -1;
+  }
+  MPI_Bcast(&id, 1, MPI_INT, 0, comm);
+  return id;
+}
+
+char *target_address(const Window &win, int rank, MPI_Aint disp) {
+  return win.base[rank] + disp * win.disp_unit[rank];
+}
+
+bool matches(const Message &m, int source, int tag) {
+  return (source == MPI_ANY_SOURCE || m.source == source) &&
+    (tag == MPI_ANY_TAG || m.tag == tag);
+}
+
+void set_status(MPI_Status *status, const Message &m) {
+  if (status != MPI_STATUS_IGNORE) {
+    status->MPI_SOURCE = m.source;
+    status->MPI_TAG = m.tag;
+    status->MPI_ERROR = MPI_SUCCESS;
+    status->bytes_ = m.data.size();
+  }
+}
+
+}   // namespace
+
+
+void Run(int ranks, const std::function<void(int rank)> &body) {
+  World w(ranks);
+  std::vector<std::thread> threads;
+  for (int r = 0; r < ranks; ++r) {
+    threads.emplace_back([&w, &body, r]() {
+      my_world = &w;
+      my_rank = r;
+      try {
+        body(r);
+      } catch (std::exception &e) {
+        std::cerr << "Rank " << r << " fails: " << e.what() << std::endl;
+        std::abort();
+      }
+      my_world = NULL;
+      my_rank = 0;
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+
+std::function<void()> Inherit() {
+  World *w = &world();
+  int rank = my_rank;
+  return [w, rank]() {
+    my_world = w;
+    my_rank = rank;
+  };
+}
+
+}   // namespace mpi_threads
+}   // namespace mcmc
+
+
+using namespace mcmc::mpi_threads;
+
+
+int MPI_Init(int *argc, char ***argv) {
+  world();
+  return MPI_SUCCESS;
+}
+
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided) {
+  world();
+  *provided = MPI_THREAD_MULTIPLE;
+  return MPI_SUCCESS;
+}
+
+int MPI_Finalize() {
+  return MPI_SUCCESS;
+}
+
+int MPI_Comm_set_errhandler(MPI_Comm comm, int mode) {
+  return MPI_SUCCESS;
+}
+
+int MPI_Comm_size(MPI_Comm comm, int *mpi_size) {
+  *mpi_size = world().size;
+  return MPI_SUCCESS;
+}
+
+int MPI_Comm_rank(MPI_Comm comm, int *mpi_rank) {
+  world();
+  *mpi_rank = my_rank;
+  return MPI_SUCCESS;
+}
+
+int MPI_Comm_dup(MPI_Comm comm, MPI_Comm *newcomm) {
+  auto &w = world();
+  int id = allocate_id(w, &w.next_comm, kMaxComms, comm);
+  if (id == -1) {
+    return MPI_ERR_OTHER;
+  }
+  *newcomm = id;
+  return MPI_SUCCESS;
+}
+
+int MPI_Comm_free(MPI_Comm *comm) {
+  // The communicators live as long as the world
+  return MPI_SUCCESS;
+}
+
+int MPI_Barrier(MPI_Comm comm) {
+  auto &w = world();
+  barrier(w, communicator(w, comm));
+  return MPI_SUCCESS;
+}
+
+int MPI_Ibarrier(MPI_Comm comm, MPI_Request *request) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  std::unique_lock<std::mutex> lock(w.lock);
+  uint64_t sequence = c.ibarrier_next[my_rank]++;
+  if (++c.ibarrier[sequence].first == w.size) {
+    w.cond.notify_all();
+  }
+  *request = sequence * kMaxComms + comm + 1;
+  return MPI_SUCCESS;
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status) {
+  if (*request == MPI_REQUEST_NULL) {
+    return MPI_SUCCESS;
+  }
+  auto &w = world();
+  auto &c = communicator(w, (*request - 1) % kMaxComms);
+  uint64_t sequence = (*request - 1) / kMaxComms;
+  std::unique_lock<std::mutex> lock(w.lock);
+  w.cond.wait(lock, [&w, &c, sequence]() {
+    return c.ibarrier[sequence].first == w.size;
+  });
+  if (++c.ibarrier[sequence].second == w.size) {
+    c.ibarrier.erase(sequence);
+  }
+  *request = MPI_REQUEST_NULL;
+  return MPI_SUCCESS;
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype,
+              int root, MPI_Comm comm) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  deposit(w, c, buffer, NULL);
+  if (my_rank != root) {
+    memcpy(buffer, c.slot[root].send, count * datatype_size(datatype));
+  }
+  barrier(w, c);
+  return MPI_SUCCESS;
+}
+
+int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                int root, MPI_Comm comm) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  deposit(w, c, sendbuf, recvbuf);
+  if (recvbuf != MPI_IN_PLACE) {
+    ::size_t bytes = sendcount * datatype_size(sendtype);
+    memcpy(recvbuf,
+           static_cast<const char *>(c.slot[root].send) + my_rank * bytes,
+           bytes);
+  }
+  barrier(w, c);
+  return MPI_SUCCESS;
+}
+
+int MPI_Scatterv(const void *sendbuf, const int *sendcounts,
+                 const int *displs, MPI_Datatype sendtype,
+                 void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                 int root, MPI_Comm comm) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  deposit(w, c, sendbuf, recvbuf, sendcounts, displs);
+  if (recvbuf != MPI_IN_PLACE) {
+    const Slot &r = c.slot[root];
+    ::size_t size = datatype_size(sendtype);
+    memcpy(recvbuf,
+           static_cast<const char *>(r.send) + r.displs[my_rank] * size,
+           r.counts[my_rank] * size);
+  }
+  barrier(w, c);
+  return MPI_SUCCESS;
+}
+
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+               MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  deposit(w, c, sendbuf, recvbuf);
+  std::vector<char> result;
+  if (my_rank == root) {
+    result = reduce_deposits(w, c, count, datatype, op);
+  }
+  // The contributions may be in place: only overwrite after all have read
+  barrier(w, c);
+  if (my_rank == root) {
+    memcpy(recvbuf, result.data(), result.size());
+  }
+  return MPI_SUCCESS;
+}
+
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+                  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  deposit(w, c, sendbuf, recvbuf);
+  std::vector<char> result = reduce_deposits(w, c, count, datatype, op);
+  barrier(w, c);
+  memcpy(recvbuf, result.data(), result.size());
+  return MPI_SUCCESS;
+}
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest,
+             int tag, MPI_Comm comm) {
+  auto &w = world();
+  auto &c = communicator(w, comm);
+  const char *data = static_cast<const char *>(buf);
+  Message m {
+    my_rank, tag,
+    std::vector<char>(data, data + count * datatype_size(datatype))
+  };
+  std::unique_lock<std::mutex> lock(w.lock);
+  c.mailbox[dest].push_back(std::move(m));
+  w.cond.notify_all();
+  return MPI_SUCCESS;
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
+             int tag, MPI_Comm comm, MPI_Status *status) {
+  auto &w = world();
+  auto &mailbox = communicator(w, comm).mailbox[my_rank];
+  std::unique_lock<std::mutex> lock(w.lock);
+  std::deque<Message>::iterator m;
+  w.cond.wait(lock, [&]() {
+    m = std::find_if(mailbox.begin(), mailbox.end(),
+                     [source, tag](const Message &m) {
+                       return matches(m, source, tag);
+                     });
+    return m != mailbox.end();
+  });
+  if (m->data.size() > count * datatype_size(datatype)) {
+    return MPI_ERR_OTHER;
+  }
+  memcpy(buf, m->data.data(), m->data.size());
+  set_status(status, *m);
+  mailbox.erase(m);
+  return MPI_SUCCESS;
+}
+
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status *status) {
+  auto &w = world();
+  auto &mailbox = communicator(w, comm).mailbox[my_rank];
+  std::unique_lock<std::mutex> lock(w.lock);
+  std::deque<Message>::iterator m;
+  w.cond.wait(lock, [&]() {
+    m = std::find_if(mailbox.begin(), mailbox.end(),
+                     [source, tag](const Message &m) {
+                       return matches(m, source, tag);
+                     });
+    return m != mailbox.end();
+  });
+  set_status(status, *m);
+  return MPI_SUCCESS;
+}
+
+int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag,
+               MPI_Status *status) {
+  auto &w = world();
+  auto &mailbox = communicator(w, comm).mailbox[my_rank];
+  std::unique_lock<std::mutex> lock(w.lock);
+  auto m = std::find_if(mailbox.begin(), mailbox.end(),
+                        [source, tag](const Message &m) {
+                          return matches(m, source, tag);
+                        });
+  *flag = (m != mailbox.end());
+  if (*flag) {
+    set_status(status, *m);
+  }
+  return MPI_SUCCESS;
+}
+
+int MPI_Get_count(const MPI_Status *status, MPI_Datatype datatype,
+                  int *count) {
+  *count = status->bytes_ / datatype_size(datatype);
+  return MPI_SUCCESS;
+}
+
+int MPI_Win_create(void *base, MPI_Aint size, int disp_unit, MPI_Info info,
+                   MPI_Comm comm, MPI_Win *win) {
+  auto &w = world();
+  int id = allocate_id(w, &w.next_window, kMaxWindows, comm);
+  if (id == -1) {
+    return MPI_ERR_OTHER;
+  }
+  {
+    std::unique_lock<std::mutex> lock(w.lock);
+    w.windows[id].base[my_rank] = static_cast<char *>(base);
+    w.windows[id].disp_unit[my_rank] = disp_unit;
+  }
+  // No one-sided operation before all ranks have exposed their memory
+  barrier(w, communicator(w, comm));
+  *win = id;
+  return MPI_SUCCESS;
+}
+
+int MPI_Win_free(MPI_Win *win) {
+  // Collective: the peers' operations on my memory are complete. The
+  // windows live as long as the world.
+  auto &w = world();
+  barrier(w, communicator(w, MPI_COMM_WORLD));
+  return MPI_SUCCESS;
+}
+
+int MPI_Win_lock_all(int assert, MPI_Win win) {
+  return MPI_SUCCESS;
+}
+
+int MPI_Win_unlock_all(MPI_Win win) {
+  return MPI_SUCCESS;
+}
+
+int MPI_Win_flush(int rank, MPI_Win win) {
+  return MPI_SUCCESS;
+}
+
+int MPI_Win_sync(MPI_Win win) {
+  // Order my preceding stores to my window before the peers' next access
+  auto &w = world();
+  std::unique_lock<std::mutex> lock(w.lock);
+  return MPI_SUCCESS;
+}
+
+int MPI_Get(void *origin_addr, int origin_count, MPI_Datatype origin_datatype,
+            int target_rank, MPI_Aint target_disp, int target_count,
+            MPI_Datatype target_datatype, MPI_Win win) {
+  auto &w = world();
+  std::unique_lock<std::mutex> lock(w.lock);
+  memcpy(origin_addr,
+         target_address(w.windows[win], target_rank, target_disp),
+         origin_count * datatype_size(origin_datatype));
+  return MPI_SUCCESS;
+}
+
+int MPI_Fetch_and_op(const void *origin_addr, void *result_addr,
+                     MPI_Datatype datatype, int target_rank,
+                     MPI_Aint target_disp, MPI_Op op, MPI_Win win) {
+  auto &w = world();
+  std::unique_lock<std::mutex> lock(w.lock);
+  char *target = target_address(w.windows[win], target_rank, target_disp);
+  ::size_t size = datatype_size(datatype);
+  memcpy(result_addr, target, size);
+  combine(datatype, op, origin_addr, target, 1);
+  return MPI_SUCCESS;
+}
+
+int MPI_Compare_and_swap(const void *origin_addr, const void *compare_addr,
+                         void *result_addr, MPI_Datatype datatype,
+                         int target_rank, MPI_Aint target_disp, MPI_Win win) {
+  auto &w = world();
+  std::unique_lock<std::mutex> lock(w.lock);
+  char *target = target_address(w.windows[win], target_rank, target_disp);
+  ::size_t size = datatype_size(datatype);
+  memcpy(result_addr, target, size);
+  if (memcmp(target, compare_addr, size) == 0) {
+    memcpy(target, origin_addr, size);
+  }
+  return MPI_SUCCESS;
+}
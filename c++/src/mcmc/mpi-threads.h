@@ -0,0 +1,155 @@
+#ifndef MCMC_MPI_THREADS_H__
+#define MCMC_MPI_THREADS_H__
+
+/*
+ * In-process stand-in for the subset of MPI that the distributed sampler
+ * uses. Each rank is a thread of one process; mcmc::mpi_threads::Run()
+ * starts the ranks. Outside Run(), the caller is rank 0 of a world of size 1.
+ *
+ * Collectives exchange pointers to the ranks' buffers and copy directly,
+ * so they cost two barriers plus the memcpy. Point-to-point sends are
+ * buffered and never block. MPI_Comm_dup() gives a communicator with its
+ * own collectives and mailboxes, so a rank's helper thread (see Inherit())
+ * can communicate concurrently with it, as with MPI_THREAD_MULTIPLE.
+ * One-sided operations on a window are atomic with respect to each other,
+ * so passive-target epochs and flushes are no-ops.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+#define MPI_SUCCESS             0
+#define MPI_ERR_OTHER           1
+
+typedef int MPI_Comm;
+#define MPI_COMM_WORLD          0
+
+enum MPI_THREAD_LEVEL {
+  MPI_THREAD_SINGLE,
+  MPI_THREAD_FUNNELED,
+  MPI_THREAD_SERIALIZED,
+  MPI_THREAD_MULTIPLE,
+};
+
+enum MPI_ERRORS {
+  MPI_ERRORS_RETURN,
+  MPI_ERRORS_ARE_FATAL,
+};
+
+enum MPI_Datatype {
+  MPI_INT,
+  MPI_LONG,
+  MPI_UNSIGNED_LONG,
+  MPI_FLOAT,
+  MPI_DOUBLE,
+  MPI_BYTE,
+};
+
+enum MPI_Op {
+  MPI_SUM,
+  MPI_MAX,
+  MPI_MIN,
+  MPI_LAND,
+  MPI_REPLACE,
+  MPI_NO_OP,
+};
+
+typedef uint64_t MPI_Request;
+#define MPI_REQUEST_NULL        0
+
+struct MPI_Status {
+  int MPI_SOURCE;
+  int MPI_TAG;
+  int MPI_ERROR;
+  ::size_t bytes_;
+};
+#define MPI_STATUS_IGNORE       (static_cast<MPI_Status *>(NULL))
+
+#define MPI_ANY_SOURCE          (-1)
+#define MPI_ANY_TAG             (-1)
+
+extern void *const MPI_IN_PLACE;
+
+typedef int MPI_Win;
+#define MPI_WIN_NULL            (-1)
+typedef ptrdiff_t MPI_Aint;
+typedef int MPI_Info;
+#define MPI_INFO_NULL           0
+#define MPI_MODE_NOCHECK        1
+
+int MPI_Init(int *argc, char ***argv);
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided);
+int MPI_Finalize();
+int MPI_Comm_set_errhandler(MPI_Comm comm, int mode);
+int MPI_Comm_size(MPI_Comm comm, int *mpi_size);
+int MPI_Comm_rank(MPI_Comm comm, int *mpi_rank);
+int MPI_Comm_dup(MPI_Comm comm, MPI_Comm *newcomm);
+int MPI_Comm_free(MPI_Comm *comm);
+
+int MPI_Barrier(MPI_Comm comm);
+int MPI_Ibarrier(MPI_Comm comm, MPI_Request *request);
+int MPI_Wait(MPI_Request *request, MPI_Status *status);
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype,
+              int root, MPI_Comm comm);
+int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                int root, MPI_Comm comm);
+int MPI_Scatterv(const void *sendbuf, const int *sendcounts,
+                 const int *displs, MPI_Datatype sendtype,
+                 void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                 int root, MPI_Comm comm);
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+               MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm);
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+                  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest,
+             int tag, MPI_Comm comm);
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
+             int tag, MPI_Comm comm, MPI_Status *status);
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status *status);
+int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag,
+               MPI_Status *status);
+int MPI_Get_count(const MPI_Status *status, MPI_Datatype datatype,
+                  int *count);
+
+int MPI_Win_create(void *base, MPI_Aint size, int disp_unit, MPI_Info info,
+                   MPI_Comm comm, MPI_Win *win);
+int MPI_Win_free(MPI_Win *win);
+int MPI_Win_lock_all(int assert, MPI_Win win);
+int MPI_Win_unlock_all(MPI_Win win);
+int MPI_Win_flush(int rank, MPI_Win win);
+int MPI_Win_sync(MPI_Win win);
+int MPI_Get(void *origin_addr, int origin_count, MPI_Datatype origin_datatype,
+            int target_rank, MPI_Aint target_disp, int target_count,
+            MPI_Datatype target_datatype, MPI_Win win);
+int MPI_Fetch_and_op(const void *origin_addr, void *result_addr,
+                     MPI_Datatype datatype, int target_rank,
+                     MPI_Aint target_disp, MPI_Op op, MPI_Win win);
+int MPI_Compare_and_swap(const void *origin_addr, const void *compare_addr,
+                         void *result_addr, MPI_Datatype datatype,
+                         int target_rank, MPI_Aint target_disp, MPI_Win win);
+
+namespace mcmc {
+namespace mpi_threads {
+
+/**
+ * Run @argument body(rank) in @argument ranks threads that form one
+ * MPI_COMM_WORLD, and wait for them all. An exception that escapes a rank
+ * aborts the process, since its peers would block forever.
+ */
+void Run(int ranks, const std::function<void(int rank)> &body);
+
+/**
+ * @return a function that makes the thread that calls it act as the
+ * caller's rank, for helper threads that the rank starts
+ */
+std::function<void()> Inherit();
+
+}   // namespace mpi_threads
+}   // namespace mcmc
+
+#endif  // ndef MCMC_MPI_THREADS_H__
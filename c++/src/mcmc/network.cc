@@ -1,4 +1,7 @@
 #include "mcmc/network.h"
+
+#include <algorithm>
+
 #include "mcmc/preprocess/data_factory.h"
 
 namespace mcmc {
@@ -31,6 +34,7 @@ Network::~Network() {
 void Network::Init(const Options& args, double held_out_ratio,
                    std::vector<Random::Random*>* rng) {
   rng_ = rng;
+  minibatch_rng_ = rng;
 
   held_out_ratio_ = held_out_ratio;
   if (held_out_ratio_ == 0) {
@@ -83,6 +87,10 @@ void Network::Init(const Options& args, double held_out_ratio,
   sampler_max_source_ = args.sampler_max_source_;
 }
 
+void Network::SetMinibatchRandom(std::vector<Random::Random*>* rng) {
+  minibatch_rng_ = rng;
+}
+
 const Data* Network::get_data() const { return data_; }
 
 void Network::ReadSet(FileHandle& f, EdgeMap* set) {
@@ -273,7 +281,7 @@ EdgeSample Network::random_edge_sampling(::size_t mini_batch_size) {
  */
 EdgeSample Network::stratified_random_node_sampling_nonlinks(
     ::size_t mini_batch_size) {
-  Random::Random* rng = (*rng_)[0];
+  Random::Random* rng = (*minibatch_rng_)[0];
   // randomly select the node ID
   int nodeId = rng->randint(0, N - 1);
 
@@ -282,7 +290,7 @@ EdgeSample Network::stratified_random_node_sampling_nonlinks(
   // this is approximation, since the size of self.train_link_map[nodeId]
   // greatly smaller than N.
 
-  std::vector<MinibatchSet> local_minibatch(rng_->size());
+  std::vector<MinibatchSet> local_minibatch(minibatch_rng_->size());
   while (mini_batch_set->size() < mini_batch_size) {
 #pragma omp parallel for
     for (::size_t t = 0; t < local_minibatch.size(); ++t) {
@@ -293,7 +301,7 @@ EdgeSample Network::stratified_random_node_sampling_nonlinks(
     ::size_t sample_size = (mini_batch_size - mini_batch_set->size() + local_minibatch.size() - 1) / local_minibatch.size();
 #pragma omp parallel for
     for (::size_t t = 0; t < local_minibatch.size(); ++t) {
-      Random::Random *rng = (*rng_)[t];
+      Random::Random *rng = (*minibatch_rng_)[t];
       auto nodeList = rng->sampleRange(N, sample_size);
       for (std::vector<int>::iterator neighborId = nodeList->begin();
            neighborId != nodeList->end(); neighborId++) {
@@ -354,7 +362,7 @@ EdgeSample Network::stratified_random_node_sampling_nonlinks(
  */
 EdgeSample Network::stratified_random_node_sampling_links(
     ::size_t mini_batch_size) {
-  Random::Random* rng = (*rng_)[0];
+  Random::Random* rng = (*minibatch_rng_)[0];
 
   MinibatchSet* mini_batch_set = new MinibatchSet();
 
@@ -408,7 +416,7 @@ EdgeSample Network::stratified_random_node_sampling_links(
 
 
 EdgeSample Network::stratified_random_node_sampling(::size_t mini_batch_size) {
-  Random::Random* rng = (*rng_)[0];
+  Random::Random* rng = (*minibatch_rng_)[0];
   // decide to sample links or non-links
   // flag=0: non-link edges  flag=1: link edges
   int flag = rng->randint(0, 1);
@@ -670,6 +678,7 @@ void Network::calc_max_fan_out() {
     marshall_area[i] = n;
     i++;
   }
+  std::sort(marshall_area, marshall_area + i);
 
   return i;
 }
@@ -84,6 +84,13 @@ class Network {
   void Init(const Options& args, double held_out_ratio,
             std::vector<Random::Random*>* rng_threaded);
 
+  /**
+   * Sample the stratified minibatches from @argument rng_threaded instead of
+   * the randoms passed to Init(). Given equal randoms, equal Networks sample
+   * equal minibatches.
+   */
+  void SetMinibatchRandom(std::vector<Random::Random*>* rng_threaded);
+
   const Data* get_data() const;
 
   void ReadSet(FileHandle& f, EdgeMap* set);
@@ -280,6 +287,7 @@ class Network {
 
   ::size_t get_fan_out(Vertex i);
 
+  // The edges are marshalled in ascending order of their other endpoint
   ::size_t marshall_edges_from(Vertex node, Vertex* marshall_area);
 
  protected:
@@ -312,6 +320,7 @@ class Network {
   std::vector< ::size_t> cumulative_edges;
 
   std::vector<Random::Random*>* rng_;
+  std::vector<Random::Random*>* minibatch_rng_;
 
 // The map stores all the neighboring nodes for each node, within the training
 // set. The purpose of keeping this object is to make the stratified sampling
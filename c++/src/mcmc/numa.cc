@@ -0,0 +1,220 @@
+#include "mcmc/numa.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "mcmc/np.h"
+
+namespace mcmc {
+namespace numa {
+
+// Parse a sysfs cpu list like "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::istringstream in(list);
+  std::string range;
+  while (std::getline(in, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    ::size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = (dash == std::string::npos) ? first
+                                           : std::stoi(range.substr(dash + 1));
+    for (int c = first; c <= last; ++c) {
+      cpus.push_back(c);
+    }
+  }
+  return cpus;
+}
+
+
+Topology::Topology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool have_allowed = (sched_getaffinity(0, sizeof allowed, &allowed) == 0);
+
+  const std::string sysfs("/sys/devices/system/node");
+  std::vector<int> ids;
+  DIR *dir = opendir(sysfs.c_str());
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      std::string name(entry->d_name);
+      if (name.compare(0, 4, "node") == 0 && name.size() > 4 &&
+          isdigit(name[4])) {
+        ids.push_back(std::stoi(name.substr(4)));
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(ids.begin(), ids.end());
+
+  for (auto id : ids) {
+    std::ifstream list(sysfs + "/node" + std::to_string(id) + "/cpulist");
+    std::string line;
+    std::getline(list, line);
+    std::vector<int> cpus;
+    for (auto c : parse_cpu_list(line)) {
+      if (! have_allowed || CPU_ISSET(c, &allowed)) {
+        cpus.push_back(c);
+      }
+    }
+    // A node without cpus only has memory
+    if (! cpus.empty()) {
+      node_id_.push_back(id);
+      node_cpus_.push_back(cpus);
+    }
+  }
+
+  if (node_cpus_.empty()) {
+    std::vector<int> cpus;
+    for (int c = 0; c < static_cast<int>(std::thread::hardware_concurrency());
+         ++c) {
+      if (! have_allowed || CPU_ISSET(c, &allowed)) {
+        cpus.push_back(c);
+      }
+    }
+    node_id_.push_back(0);
+    node_cpus_.push_back(cpus);
+  }
+}
+
+
+Placement::Placement()
+    : policy_(POLICY::NONE), node_id_(1, 0), rows_(0), row_bytes_(0),
+      page_bytes_(sysconf(_SC_PAGESIZE)) {
+}
+
+
+Placement::Placement(POLICY policy, const Topology &topology, ::size_t rows,
+                     ::size_t row_bytes)
+    : policy_(policy), rows_(rows), row_bytes_(row_bytes),
+      page_bytes_(sysconf(_SC_PAGESIZE)) {
+  for (::size_t n = 0; n < topology.nodes(); ++n) {
+    node_id_.push_back(topology.id(n));
+  }
+}
+
+
+int Placement::node(::size_t row) const {
+  switch (policy_) {
+  case POLICY::NONE:
+    return -1;
+  case POLICY::INTERLEAVE:
+    return (row * row_bytes_ / page_bytes_) % node_id_.size();
+  case POLICY::PARTITION:
+    return (rows_ == 0) ? 0 : row * node_id_.size() / rows_;
+  }
+  return -1;
+}
+
+
+// glibc has no wrapper; libnuma's would be a new dependency
+static long mbind(void *addr, ::size_t len, int mode,
+                  const std::vector<unsigned long> &mask) {
+  return syscall(SYS_mbind, addr, len, mode, mask.data(),
+                 mask.size() * 8 * sizeof mask[0], 0);
+}
+
+
+bool Placement::Apply(void *base) const {
+  if (policy_ == POLICY::NONE || rows_ == 0) {
+    return true;
+  }
+
+  int max_id = *std::max_element(node_id_.begin(), node_id_.end());
+  const ::size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(max_id / bits + 1);
+  char *start = static_cast<char *>(base);
+  ::size_t bytes = (rows_ * row_bytes_ + page_bytes_ - 1) / page_bytes_ *
+                     page_bytes_;
+
+  if (policy_ == POLICY::INTERLEAVE) {
+    for (auto id : node_id_) {
+      mask[id / bits] |= 1UL << (id % bits);
+    }
+    return mbind(start, bytes, MPOL_INTERLEAVE, mask) == 0;
+  }
+
+  // PARTITION: node n prefers the pages of rows n * rows / nodes ..
+  // (n + 1) * rows / nodes. A page that straddles two blocks goes to the
+  // first one.
+  ::size_t nodes = node_id_.size();
+  for (::size_t n = 0; n < nodes; ++n) {
+    ::size_t from = (n * rows_ / nodes) * row_bytes_;
+    ::size_t to = ((n + 1) * rows_ / nodes) * row_bytes_;
+    from = (from + page_bytes_ - 1) / page_bytes_ * page_bytes_;
+    to = (n == nodes - 1) ? bytes
+                          : (to + page_bytes_ - 1) / page_bytes_ * page_bytes_;
+    if (to <= from) {
+      continue;
+    }
+    std::fill(mask.begin(), mask.end(), 0);
+    mask[node_id_[n] / bits] |= 1UL << (node_id_[n] % bits);
+    if (mbind(start + from, to - from, MPOL_PREFERRED, mask) != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+std::vector<int> PinThreads(const Topology &topology, ::size_t local_rank,
+                            ::size_t local_ranks) {
+  // All my cpus, node after node
+  std::vector<int> cpus;
+  std::vector<int> cpu_node;
+  for (::size_t n = 0; n < topology.nodes(); ++n) {
+    for (auto c : topology.cpus(n)) {
+      cpus.push_back(c);
+      cpu_node.push_back(n);
+    }
+  }
+  if (cpus.empty()) {
+    return std::vector<int>();
+  }
+
+  ::size_t first = local_rank * cpus.size() / local_ranks;
+  ::size_t last = (local_rank + 1) * cpus.size() / local_ranks;
+  if (last == first) {
+    // More ranks than cpus on this host
+    first = local_rank % cpus.size();
+    last = first + 1;
+  }
+
+  std::vector<int> thread_node(omp_get_max_threads());
+  int failed = 0;
+#pragma omp parallel reduction(+ : failed)
+  {
+    ::size_t t = omp_get_thread_num();
+    ::size_t slot = first + t * (last - first) /
+                              std::max(thread_node.size(), last - first);
+    slot = std::min(slot, last - 1);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[slot], &set);
+    if (sched_setaffinity(0, sizeof set, &set) != 0) {
+      ++failed;
+    }
+    thread_node[t] = cpu_node[slot];
+  }
+
+  if (failed > 0) {
+    return std::vector<int>();
+  }
+
+  return thread_node;
+}
+
+}   // namespace numa
+}   // namespace mcmc
@@ -0,0 +1,141 @@
+#ifndef MCMC_NUMA_H__
+#define MCMC_NUMA_H__
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mcmc/config.h"
+
+namespace mcmc {
+namespace numa {
+
+enum class POLICY {
+  NONE,         // first touch
+  INTERLEAVE,   // round robin over the nodes, page by page
+  PARTITION,    // one block of consecutive rows per node
+};
+
+
+inline std::istream& operator>> (std::istream& in, POLICY& policy) {
+  namespace po = boost::program_options;
+
+  std::string token;
+  in >> token;
+
+  if (false) {
+  } else if (token == "none") {
+    policy = POLICY::NONE;
+  } else if (token == "interleave") {
+    policy = POLICY::INTERLEAVE;
+  } else if (token == "partition") {
+    policy = POLICY::PARTITION;
+  } else {
+    throw po::validation_error(po::validation_error::invalid_option_value,
+                               "Unknown NUMA policy");
+  }
+
+  return in;
+}
+
+
+inline std::ostream& operator<< (std::ostream& s, const POLICY& policy) {
+  switch (policy) {
+    case POLICY::NONE:
+      s << "none";
+      break;
+    case POLICY::INTERLEAVE:
+      s << "interleave";
+      break;
+    case POLICY::PARTITION:
+      s << "partition";
+      break;
+  }
+
+  return s;
+}
+
+
+/**
+ * The NUMA nodes of this host and their cpus, from sysfs. Without NUMA
+ * information, the host is one node that has all cpus.
+ */
+class Topology {
+ public:
+  Topology();
+
+  ::size_t nodes() const {
+    return node_cpus_.size();
+  }
+
+  // the kernel's number of @argument node
+  int id(::size_t node) const {
+    return node_id_[node];
+  }
+
+  // the cpus of @argument node that I may run on
+  const std::vector<int> &cpus(::size_t node) const {
+    return node_cpus_[node];
+  }
+
+ private:
+  std::vector<int> node_id_;
+  std::vector<std::vector<int> > node_cpus_;
+};
+
+
+/**
+ * Where the rows of a table live under a policy. The rows are laid out
+ * consecutively from a page-aligned base.
+ */
+class Placement {
+ public:
+  Placement();
+
+  Placement(POLICY policy, const Topology &topology, ::size_t rows,
+            ::size_t row_bytes);
+
+  POLICY policy() const {
+    return policy_;
+  }
+
+  /**
+   * @return the node of @argument row, or -1 if the policy is NONE
+   */
+  int node(::size_t row) const;
+
+  /**
+   * Bind the pages of the table at @argument base to their nodes; call
+   * before the pages are first touched.
+   * @return false if the kernel refuses, e.g. in a container without
+   * NUMA rights; the pages are then placed at first touch
+   */
+  bool Apply(void *base) const;
+
+ private:
+  POLICY policy_;
+  std::vector<int> node_id_;
+  ::size_t rows_;
+  ::size_t row_bytes_;
+  ::size_t page_bytes_;
+};
+
+
+/**
+ * Pin the threads of the OpenMP team. This rank is number @argument
+ * local_rank of @argument local_ranks on this host: it gets an even slice
+ * of the cpus in node order, and its threads are spread over that slice.
+ *
+ * @return the node of each thread; empty if pinning fails
+ */
+std::vector<int> PinThreads(const Topology &topology, ::size_t local_rank,
+                            ::size_t local_ranks);
+
+}   // namespace numa
+}   // namespace mcmc
+
+#endif  // ndef MCMC_NUMA_H__
@@ -9,6 +9,9 @@
 #include "mcmc/config.h"
 #include "mcmc/types.h"
 #include "mcmc/exception.h"
+#include "mcmc/partition.h"
+#include "mcmc/numa.h"
+#include "mcmc/huge-pages.h"
 
 #include "dkvstore/DKVStore.h"
 
@@ -183,6 +186,43 @@ class Options {
       ("mcmc.convergence",
        po::value<double>(&convergence_threshold)->default_value(0.000000000001),
        "convergence threshold")
+      ("mcmc.checkpoint-interval",
+       po::value< ::size_t>(&checkpoint_interval)->default_value(0),
+       "checkpoint every this many iterations; 0 disables checkpoints")
+      ("mcmc.checkpoint-dir",
+       po::value<std::string>(&checkpoint_dir)->default_value("."),
+       "checkpoint directory")
+      ("mcmc.restart",
+       po::bool_switch(&restart)->default_value(false),
+       "resume from the latest consistent checkpoint in "
+       "--mcmc.checkpoint-dir")
+      ("mcmc.warm-start",
+       po::bool_switch(&warm_start)->default_value(false),
+       "start a new run from phi and theta of the latest consistent "
+       "checkpoint in --mcmc.checkpoint-dir (sequential sampler)")
+      ("mcmc.out-of-core",
+       po::value<std::string>(&out_of_core)->default_value(""),
+       "keep pi in this memory-mapped file instead of in memory, for "
+       "graphs whose model exceeds memory (sequential sampler)")
+      ("mcmc.out-of-core-cache",
+       po::value< ::size_t>(&out_of_core_cache)->default_value(16384),
+       "rows of the highest-degree nodes that stay in memory with "
+       "--mcmc.out-of-core")
+      ("mcmc.sparse-m",
+       po::value< ::size_t>(&sparse_m)->default_value(0),
+       "keep only the top this many communities of each node, plus a "
+       "residual mass; 0 keeps pi dense (sequential sampler)")
+      ("mcmc.sparse-densify",
+       po::value< ::size_t>(&sparse_densify)->default_value(16),
+       "--mcmc.sparse-m: every this many iterations, update all K "
+       "communities, so new ones can enter; 0 never")
+      ("mcmc.huge-pages",
+       po::value<huge_pages::POLICY>(&huge_pages)->default_value(
+         huge_pages::POLICY::NONE),
+       "back the D-KV value/cache areas and the graph adjacency, or the "
+       "sequential sampler's pi/phi, with huge pages (none/thp/2m/1g); 2m "
+       "and 1g use hugetlb pages if reserved, else fall back to thp; the "
+       "report gives the huge pages actually obtained")
       ;
     desc_all.add(desc_mcmc);
 
@@ -214,16 +254,76 @@ class Options {
          DKV::TYPE::FILE
 #endif
          ),
-       "D-KV store type (file/ramcloud/rdma)")
+       "D-KV store type (file/shm/ramcloud/rdma)")
+      ("mcmc.dkv-codec",
+       po::value<DKV::CODEC>(&dkv_codec)->default_value(DKV::CODEC::NONE),
+       "D-KV store pi codec (none/fp16/bf16/q8)")
+      ("mcmc.dkv-codec-validate",
+       po::bool_switch(&dkv_codec_validate)->default_value(false),
+       "store pi in full precision, report perplexity drift of the codec")
+      ("mcmc.dkv-epochs",
+       po::bool_switch(&dkv_epochs)->default_value(false),
+       "double-buffer pi in the D-KV store; replaces the barriers after "
+       "update_phi/update_pi by one non-blocking barrier per iteration")
       ("mcmc.max-pi-cache",
        po::value< ::size_t>(&max_pi_cache_entries_)->default_value(0),
        "minibatch chunk size")
+      ("mcmc.adaptive-chunk",
+       po::bool_switch(&adaptive_chunk)->default_value(false),
+       "size the update_phi chunks from the measured pi fetch latency and "
+       "compute time, up to what the pi cache holds")
       ("mcmc.master_is_worker",
        po::bool_switch(&forced_master_is_worker)->default_value(false),
        "master host also is a worker")
       ("mcmc.replicated-graph",
        po::bool_switch(&REPLICATED_NETWORK)->default_value(false),
        "replicate Network graph")
+      ("mcmc.partition",
+       po::value<partition::PARTITION>(&partition)->default_value(
+         partition::PARTITION::NONE),
+       "partition pi over the hosts by graph structure (none/ldg/fennel)")
+      ("mcmc.minibatch-imbalance",
+       po::value<double>(&minibatch_imbalance)->default_value(0.1),
+       "work imbalance that the minibatch node assignment tolerates before "
+       "it moves nodes away from the host of their pi")
+      ("mcmc.decentralized-minibatch",
+       po::bool_switch(&decentralized_minibatch)->default_value(false),
+       "all workers sample the same minibatch and take their share; "
+       "requires --mcmc.replicated-graph")
+      ("mcmc.allreduce-beta",
+       po::bool_switch(&allreduce_beta)->default_value(false),
+       "allreduce the beta gradients and update theta at all ranks; "
+       "replaces the reduce to the master and the theta broadcast")
+      ("mcmc.comm-thread",
+       po::bool_switch(&comm_thread)->default_value(false),
+       "initialize MPI with MPI_THREAD_MULTIPLE; a communication thread "
+       "scatters the update_beta minibatch, runs the pi D-KV transfers and "
+       "reduces the beta grads while the compute threads continue")
+      ("mcmc.steal",
+       po::bool_switch(&steal)->default_value(false),
+       "idle workers steal the update_phi nodes that slower peers have not "
+       "started; requires --mcmc.replicated-graph")
+      ("mcmc.numa",
+       po::value<numa::POLICY>(&numa)->default_value(numa::POLICY::NONE),
+       "pin the threads to cpus and place the shm D-KV values over the NUMA "
+       "nodes (none/interleave/partition); update_phi starts each thread on "
+       "the nodes whose values are local")
+      ("mcmc.async",
+       po::bool_switch(&async)->default_value(false),
+       "asynchronous workers with bounded staleness; the master hands out "
+       "minibatches and updates beta; requires --mcmc.replicated-graph")
+      ("mcmc.staleness",
+       po::value< ::size_t>(&staleness)->default_value(2),
+       "--mcmc.async: a worker's reads of the pi rows of its minibatch nodes "
+       "may miss the updates of at most this many minibatches in flight")
+      ("mcmc.beta-interval",
+       po::value< ::size_t>(&beta_interval)->default_value(1),
+       "--mcmc.async: a worker refreshes beta every this many minibatches")
+      ("mcmc.graph-shards",
+       po::bool_switch(&graph_shards)->default_value(false),
+       "each rank keeps the adjacency of the nodes whose pi it hosts, "
+       "scattered once at startup; replaces the per-iteration subgraph "
+       "scatter")
     ;
     desc_all.add(desc_distr);
 #endif
@@ -297,12 +397,40 @@ class Options {
   int random_seed;
   double convergence_threshold;
 
+  ::size_t checkpoint_interval;
+  std::string checkpoint_dir;
+  bool restart;
+  bool warm_start;
+
+  std::string out_of_core;
+  ::size_t out_of_core_cache;
+
+  ::size_t sparse_m;
+  ::size_t sparse_densify;
+
+  huge_pages::POLICY huge_pages;
+
   std::vector<std::string> remains;
 #ifdef MCMC_ENABLE_DISTRIBUTED
   DKV::TYPE dkv_type;
+  DKV::CODEC dkv_codec;
+  bool dkv_codec_validate;
+  bool dkv_epochs;
   bool forced_master_is_worker;
   mutable ::size_t	max_pi_cache_entries_;
+  bool adaptive_chunk;
   bool REPLICATED_NETWORK;
+  bool decentralized_minibatch;
+  bool graph_shards;
+  bool allreduce_beta;
+  bool comm_thread;
+  bool steal;
+  numa::POLICY numa;
+  bool async;
+  ::size_t staleness;
+  ::size_t beta_interval;
+  double minibatch_imbalance;
+  partition::PARTITION partition;
 #endif
   po::options_description desc_all;
   po::options_description desc_mcmc;
@@ -0,0 +1,116 @@
+#include "mcmc/out-of-core.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+
+#include "mcmc/exception.h"
+
+namespace mcmc {
+
+OutOfCorePi::OutOfCorePi(const std::string &file, ::size_t n, ::size_t k)
+    : file_(file), rows_(n), row_size_(k + 1),
+      bytes_(n * (k + 1) * sizeof(Float)), page_size_(sysconf(_SC_PAGESIZE)),
+      area_(NULL), resident_of_(n, -1), prefetched_pages_(0) {
+  int fd = open(file_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    throw IOException("Cannot create " + file_ + ": " + strerror(errno));
+  }
+  if (ftruncate(fd, bytes_) == -1) {
+    int err = errno;
+    close(fd);
+    throw IOException("Cannot size " + file_ + ": " + strerror(err));
+  }
+  void *p = mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw IOException("Cannot mmap " + file_ + ": " + strerror(err));
+  }
+  area_ = static_cast<Float *>(p);
+
+  // The rows are initialized front to back; afterwards, access is random
+  // and readahead would only evict useful pages
+  madvise(area_, bytes_, MADV_SEQUENTIAL);
+}
+
+
+OutOfCorePi::~OutOfCorePi() {
+  if (area_ != NULL) {
+    try {
+      Sync();
+    } catch (IOException &e) {
+      std::cerr << e.what() << std::endl;
+    }
+    munmap(area_, bytes_);
+  }
+}
+
+
+void OutOfCorePi::SetResident(const std::vector<int32_t> &nodes) {
+  Sync();
+  for (auto i : resident_nodes_) {
+    resident_of_[i] = -1;
+  }
+  resident_nodes_ = nodes;
+  resident_.resize(nodes.size() * row_size_);
+  for (::size_t r = 0; r < nodes.size(); ++r) {
+    const Float *mapped = area_ + nodes[r] * row_size_;
+    std::copy(mapped, mapped + row_size_, resident_.data() + r * row_size_);
+    resident_of_[nodes[r]] = r;
+  }
+
+  madvise(area_, bytes_, MADV_RANDOM);
+}
+
+
+void OutOfCorePi::Prefetch(const std::vector<int32_t> &nodes) {
+  const ::size_t row_bytes = row_size_ * sizeof(Float);
+  pages_.clear();
+  for (auto i : nodes) {
+    if (resident_of_[i] >= 0) {
+      continue;
+    }
+    ::size_t from = i * row_bytes / page_size_;
+    ::size_t to = ((i + 1) * row_bytes - 1) / page_size_;
+    for (::size_t p = from; p <= to; ++p) {
+      pages_.push_back(p);
+    }
+  }
+  std::sort(pages_.begin(), pages_.end());
+  pages_.erase(std::unique(pages_.begin(), pages_.end()), pages_.end());
+
+  // One madvise per run of consecutive pages
+  char *base = reinterpret_cast<char *>(area_);
+  ::size_t p = 0;
+  while (p < pages_.size()) {
+    ::size_t q = p + 1;
+    while (q < pages_.size() && pages_[q] == pages_[q - 1] + 1) {
+      ++q;
+    }
+    madvise(base + pages_[p] * page_size_, (q - p) * page_size_,
+            MADV_WILLNEED);
+    p = q;
+  }
+  prefetched_pages_ += pages_.size();
+}
+
+
+void OutOfCorePi::Sync() {
+  for (::size_t r = 0; r < resident_nodes_.size(); ++r) {
+    const Float *cached = resident_.data() + r * row_size_;
+    std::copy(cached, cached + row_size_,
+              area_ + resident_nodes_[r] * row_size_);
+  }
+  if (msync(area_, bytes_, MS_SYNC) == -1) {
+    throw IOException("Cannot msync " + file_ + ": " + strerror(errno));
+  }
+}
+
+}   // namespace mcmc
@@ -0,0 +1,90 @@
+#ifndef MCMC_OUT_OF_CORE_H__
+#define MCMC_OUT_OF_CORE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "mcmc/config.h"
+#include "mcmc/types.h"
+
+namespace mcmc {
+
+/**
+ * pi for models that exceed memory: N rows of K + 1 Floats in a memory
+ * mapped file, in the compact format of the D-KV store, i.e. the K values
+ * of pi followed by the sum of phi. phi[k] = pi[k] * phi_sum, so pi and phi
+ * take one row.
+ *
+ * The mapping is accessed at random, so the kernel's readahead is off;
+ * Prefetch() the rows of the next computation instead. A few hot rows can
+ * be kept resident in memory; the file is up to date after Sync().
+ */
+class OutOfCorePi {
+ public:
+  /**
+   * Create @argument file, sized for @argument n rows of @argument k + 1
+   * Floats, and map it
+   */
+  OutOfCorePi(const std::string &file, ::size_t n, ::size_t k);
+
+  ~OutOfCorePi();
+
+  ::size_t row_size() const {
+    return row_size_;
+  }
+
+  Float *row(int32_t i) {
+    int32_t r = resident_of_[i];
+    if (r >= 0) {
+      return resident_.data() + r * row_size_;
+    }
+    return area_ + i * row_size_;
+  }
+
+  const Float *row(int32_t i) const {
+    return const_cast<OutOfCorePi *>(this)->row(i);
+  }
+
+  /**
+   * Keep the rows of @argument nodes in memory, e.g. those of the nodes
+   * with the highest degree. Call after the rows are initialized.
+   */
+  void SetResident(const std::vector<int32_t> &nodes);
+
+  /**
+   * Start reading the pages of the rows of @argument nodes that are not
+   * resident; does not wait for them
+   */
+  void Prefetch(const std::vector<int32_t> &nodes);
+
+  /**
+   * Write the resident rows back and flush the mapping to the file
+   */
+  void Sync();
+
+  // Pages prefetched so far
+  ::size_t prefetched_pages() const {
+    return prefetched_pages_;
+  }
+
+ private:
+  std::string file_;
+  ::size_t rows_;
+  ::size_t row_size_;
+  ::size_t bytes_;
+  ::size_t page_size_;
+  Float *area_;
+
+  std::vector<int32_t> resident_of_;
+  std::vector<int32_t> resident_nodes_;
+  std::vector<Float> resident_;
+
+  std::vector<uintptr_t> pages_;
+  ::size_t prefetched_pages_;
+};
+
+}   // namespace mcmc
+
+#endif  // ndef MCMC_OUT_OF_CORE_H__
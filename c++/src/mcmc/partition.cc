@@ -0,0 +1,141 @@
+#include "mcmc/partition.h"
+
+#include <cmath>
+
+#include <deque>
+#include <limits>
+
+#include "mcmc/data.h"
+#include "mcmc/exception.h"
+
+namespace mcmc {
+namespace partition {
+
+namespace {
+
+// Neighbors of v; the graph may not extend to the highest vertex ids
+const GoogleHashSet* neighbors(const NetworkGraph &graph, Vertex v) {
+  if (static_cast< ::size_t>(v) >= graph.edges_at_size()) {
+    return NULL;
+  }
+  return &graph.edges_at(v);
+}
+
+}   // namespace
+
+
+std::vector<int32_t> Partition(PARTITION type, const NetworkGraph &graph,
+                               ::size_t N, ::size_t parts, ::size_t capacity) {
+  if (parts * capacity < N) {
+    throw MCMCException("Partition: parts * capacity < #vertices");
+  }
+
+  std::vector<int32_t> part(N, -1);
+  if (type == PARTITION::NONE || parts == 1) {
+    for (::size_t v = 0; v < N; ++v) {
+      part[v] = v % parts;
+    }
+    return part;
+  }
+
+  // Fennel: score(p) = |N(v) in p| - alpha * gamma * |p|^(gamma - 1)
+  const double gamma = 1.5;
+  const double alpha = std::sqrt(static_cast<double>(parts)) *
+                         (graph.size() / 2) /
+                         std::pow(static_cast<double>(N), gamma);
+
+  std::vector< ::size_t> size(parts, 0);
+  std::vector< ::size_t> hits(parts, 0);
+  std::vector<int32_t> touched;
+  std::vector<bool> queued(N, false);
+  std::deque<Vertex> queue;
+
+  ::size_t next_root = 0;
+  for (::size_t placed = 0; placed < N; ++placed) {
+    if (queue.empty()) {
+      while (queued[next_root]) {
+        ++next_root;
+      }
+      queued[next_root] = true;
+      queue.push_back(next_root);
+    }
+    Vertex v = queue.front();
+    queue.pop_front();
+
+    const GoogleHashSet* adj = neighbors(graph, v);
+    touched.clear();
+    if (adj != NULL) {
+      for (auto w : *adj) {
+        if (part[w] >= 0) {
+          if (hits[part[w]] == 0) {
+            touched.push_back(part[w]);
+          }
+          ++hits[part[w]];
+        } else if (! queued[w]) {
+          queued[w] = true;
+          queue.push_back(w);
+        }
+      }
+    }
+
+    // Default: the smallest part, which also breaks ties
+    ::size_t best = 0;
+    for (::size_t p = 1; p < parts; ++p) {
+      if (size[p] < size[best]) {
+        best = p;
+      }
+    }
+    double best_score = 0.0;
+    if (type == PARTITION::FENNEL) {
+      best_score = - alpha * gamma * std::pow(size[best], gamma - 1.0);
+    }
+    for (auto p : touched) {
+      if (size[p] == capacity) {
+        continue;
+      }
+      double score;
+      if (type == PARTITION::LDG) {
+        score = hits[p] * (1.0 - static_cast<double>(size[p]) / capacity);
+      } else {
+        score = hits[p] - alpha * gamma * std::pow(size[p], gamma - 1.0);
+      }
+      if (score > best_score ||
+          (score == best_score && size[p] < size[best])) {
+        best = p;
+        best_score = score;
+      }
+    }
+    for (auto p : touched) {
+      hits[p] = 0;
+    }
+
+    part[v] = best;
+    ++size[best];
+  }
+
+  return part;
+}
+
+
+double LocalEdgeFraction(const NetworkGraph &graph,
+                         const std::vector<int32_t> &part) {
+  ::size_t local = 0;
+  ::size_t total = 0;
+  for (::size_t v = 0; v < part.size(); ++v) {
+    const GoogleHashSet* adj = neighbors(graph, v);
+    if (adj == NULL) {
+      continue;
+    }
+    for (auto w : *adj) {
+      if (part[v] == part[w]) {
+        ++local;
+      }
+      ++total;
+    }
+  }
+
+  return total == 0 ? 1.0 : static_cast<double>(local) / total;
+}
+
+}   // namespace partition
+}   // namespace mcmc
@@ -0,0 +1,86 @@
+#ifndef MCMC_PARTITION_H__
+#define MCMC_PARTITION_H__
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mcmc/config.h"
+
+namespace mcmc {
+
+class NetworkGraph;
+
+namespace partition {
+
+enum class PARTITION {
+  NONE,         // round robin
+  LDG,          // linear deterministic greedy
+  FENNEL,
+};
+
+
+inline std::istream& operator>> (std::istream& in, PARTITION& partition) {
+  namespace po = boost::program_options;
+
+  std::string token;
+  in >> token;
+
+  if (false) {
+  } else if (token == "none") {
+    partition = PARTITION::NONE;
+  } else if (token == "ldg") {
+    partition = PARTITION::LDG;
+  } else if (token == "fennel") {
+    partition = PARTITION::FENNEL;
+  } else {
+    throw po::validation_error(po::validation_error::invalid_option_value,
+                               "Unknown partitioner");
+  }
+
+  return in;
+}
+
+
+inline std::ostream& operator<< (std::ostream& s, const PARTITION& partition) {
+  switch (partition) {
+    case PARTITION::NONE:
+      s << "none";
+      break;
+    case PARTITION::LDG:
+      s << "ldg";
+      break;
+    case PARTITION::FENNEL:
+      s << "fennel";
+      break;
+  }
+
+  return s;
+}
+
+
+/**
+ * One-pass streaming partitioner of the vertices of a graph. The vertices
+ * are streamed in breadth-first order, and each is placed in the part that
+ * holds most of its neighbors, weighed by a penalty on the part size.
+ * No part grows beyond @argument capacity.
+ *
+ * @return the part of each vertex 0..N>
+ */
+std::vector<int32_t> Partition(PARTITION type, const NetworkGraph &graph,
+                               ::size_t N, ::size_t parts, ::size_t capacity);
+
+/**
+ * @return the fraction of edges whose end points are in the same part
+ */
+double LocalEdgeFraction(const NetworkGraph &graph,
+                         const std::vector<int32_t> &part);
+
+}   // namespace partition
+}   // namespace mcmc
+
+#endif  // ndef MCMC_PARTITION_H__
@@ -1,5 +1,7 @@
 #include "mcmc/random.h"
 
+#include <cstring>
+
 namespace mcmc {
 namespace Random {
 
@@ -520,5 +522,44 @@ std::string Random::state() {
 #endif
 }
 
+std::string Random::get_state() const {
+#ifndef MCMC_RANDOM_SYSTEM
+  return std::string(reinterpret_cast<const char *>(xorshift_state),
+                     sizeof xorshift_state);
+#else
+  std::ostringstream s;
+  s << generator << " " << normalDistribution;
+  return s.str();
+#endif
+}
+
+void Random::set_state(const std::string &state) {
+#ifndef MCMC_RANDOM_SYSTEM
+  if (state.size() != sizeof xorshift_state) {
+    throw MalformattedException("Random state has wrong size");
+  }
+  memcpy(xorshift_state, state.data(), sizeof xorshift_state);
+#else
+  std::istringstream s(state);
+  s >> generator >> normalDistribution;
+  if (! s) {
+    throw MalformattedException("Random state cannot be parsed");
+  }
+#endif
+}
+
+void Random::reseed(uint64_t seed_hi, uint64_t seed_lo) {
+#ifndef MCMC_RANDOM_SYSTEM
+  if (seed_lo == 0) {
+    throw NumberFormatException("Random seed value 0 not allowed");
+  }
+  xorshift_state[0] = seed_lo;
+  xorshift_state[1] = seed_hi;
+#else
+  generator.seed(seed_lo ^ seed_hi);
+  normalDistribution.reset();
+#endif
+}
+
 }  // namespace Random
 }  // namespace mcmc
@@ -69,6 +69,14 @@ class Random {
 
   std::string state();
 
+  // Opaque generator state, e.g. for a checkpoint
+  std::string get_state() const;
+  void set_state(const std::string &state);
+
+  // Restart the generator as if it were constructed with these seeds, but
+  // without the log line; e.g. for one stream per node and iteration
+  void reseed(uint64_t seed_hi, uint64_t seed_lo);
+
  protected:
   std::unordered_set<int> sample(int from, int upto, ::size_t count);
 
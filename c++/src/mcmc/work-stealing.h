@@ -0,0 +1,137 @@
+#ifndef MCMC_WORK_STEALING_H__
+#define MCMC_WORK_STEALING_H__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace mcmc {
+
+/**
+ * Work-stealing schedule of the items [0, n) over a team of threads. Each
+ * thread starts with a contiguous share and takes grains from its front; a
+ * thread whose share is empty steals the back half of the largest share
+ * that is left. Unlike a shared counter, a thread touches the others' state
+ * only to steal, and a thread that joins late (e.g. after it issued the
+ * next prefetch) loses its share to the others instead of holding them up.
+ *
+ * Reset() from one thread before the team starts, then Next() from each
+ * member of the team. The team may be smaller than the number of shares:
+ * unclaimed shares are stolen.
+ */
+class WorkStealingRange {
+ public:
+  WorkStealingRange() : threads_(0), capacity_(0), grain_(1) {
+  }
+
+  void Reset(::size_t n, ::size_t threads, ::size_t grain) {
+    if (threads > capacity_) {
+      share_.reset(new Share[threads]);
+      capacity_ = threads;
+    }
+    threads_ = threads;
+    grain_ = std::max(grain, static_cast< ::size_t>(1));
+    for (::size_t t = 0; t < threads_; ++t) {
+      share_[t].range.store(Pack(n * t / threads_, n * (t + 1) / threads_),
+                            std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Thread t starts with the items [@argument bounds[t], bounds[t + 1]),
+   * e.g. the items that live near it
+   */
+  void Reset(const std::vector< ::size_t> &bounds, ::size_t grain) {
+    ::size_t threads = bounds.size() - 1;
+    if (threads > capacity_) {
+      share_.reset(new Share[threads]);
+      capacity_ = threads;
+    }
+    threads_ = threads;
+    grain_ = std::max(grain, static_cast< ::size_t>(1));
+    for (::size_t t = 0; t < threads_; ++t) {
+      share_[t].range.store(Pack(bounds[t], bounds[t + 1]),
+                            std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * The next items [*begin, *end) for thread @argument me
+   * @return false if all items are taken
+   */
+  bool Next(::size_t me, ::size_t *begin, ::size_t *end) {
+    std::atomic<uint64_t> &mine = share_[me].range;
+    while (true) {
+      uint64_t r = mine.load(std::memory_order_acquire);
+      uint32_t b = Begin(r);
+      uint32_t e = End(r);
+      if (b < e) {
+        uint32_t taken = std::min(b + static_cast<uint32_t>(grain_), e);
+        if (mine.compare_exchange_weak(r, Pack(taken, e),
+                                       std::memory_order_acq_rel)) {
+          *begin = b;
+          *end = taken;
+          return true;
+        }
+        continue;
+      }
+
+      // My share is empty, so no peer will steal from it: the victim's
+      // back half can safely become my share
+      ::size_t victim = threads_;
+      uint32_t most = 0;
+      for (::size_t t = 0; t < threads_; ++t) {
+        uint64_t v = share_[t].range.load(std::memory_order_relaxed);
+        if (End(v) > Begin(v) && End(v) - Begin(v) > most) {
+          most = End(v) - Begin(v);
+          victim = t;
+        }
+      }
+      if (victim == threads_) {
+        return false;
+      }
+      uint64_t v = share_[victim].range.load(std::memory_order_acquire);
+      b = Begin(v);
+      e = End(v);
+      if (b >= e) {
+        continue;
+      }
+      uint32_t mid = b + (e - b) / 2;
+      if (share_[victim].range.compare_exchange_strong(
+            v, Pack(b, mid), std::memory_order_acq_rel)) {
+        mine.store(Pack(mid, e), std::memory_order_release);
+      }
+    }
+  }
+
+ private:
+  static uint64_t Pack(uint64_t begin, uint64_t end) {
+    return (begin << 32) | end;
+  }
+
+  static uint32_t Begin(uint64_t range) {
+    return static_cast<uint32_t>(range >> 32);
+  }
+
+  static uint32_t End(uint64_t range) {
+    return static_cast<uint32_t>(range);
+  }
+
+  // One cache line per share, so the owners do not contend
+  struct Share {
+    std::atomic<uint64_t> range;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  std::unique_ptr<Share[]> share_;
+  ::size_t threads_;
+  ::size_t capacity_;
+  ::size_t grain_;
+};
+
+}   // namespace mcmc
+
+#endif  // ndef MCMC_WORK_STEALING_H__
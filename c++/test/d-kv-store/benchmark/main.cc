@@ -0,0 +1,633 @@
+/*
+ * D-KV store benchmark.
+ *
+ * Runs one D-KV store type over a matrix of
+ *   value size (K + 1) x batch size x key distribution x write fraction
+ * and reports, per configuration and per operation type, the batch latency
+ * percentiles (p50/p99/p999), ops/s (batches/s), keys/s and GB/s as CSV or
+ * JSON (one object per line). Throughput is calculated over the time spent
+ * in the operation, so a read/write mix reports both rates separately.
+ * A timed read includes a pass that sums the bytes of every value read, so
+ * zero-copy reads (shm, or rdma for local keys) pay for touching them.
+ *
+ * Key distributions:
+ *   uniform  uniform over [0, N)
+ *   zipf     Zipf with exponent bench.zipf, popularity ranks scattered over
+ *            the key space so the hot keys are spread over the hosts
+ *   degree   proportional to the vertex degree in the edge list bench.graph,
+ *            which is what the neighbor sampler does
+ *
+ * Multiple ranks: start under mpirun/prun (the rank is taken from the
+ * environment), or use bench.local-ranks to fork local ranks; the latter
+ * is meant for the file and shm stores.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef __INTEL_COMPILER
+#pragma GCC diagnostic ignored "-Wunused-local-typedefs"
+#pragma GCC diagnostic push
+#endif
+#include <boost/program_options.hpp>
+#ifndef __INTEL_COMPILER
+#pragma GCC diagnostic pop
+#endif
+#include <boost/lexical_cast.hpp>
+
+#include <mcmc/exception.h>
+
+#include <dkvstore/DKVStoreFile.h>
+#include <dkvstore/DKVStoreShm.h>
+#ifdef MCMC_ENABLE_RAMCLOUD
+#include <dkvstore/DKVStoreRamCloud.h>
+#endif
+#ifdef MCMC_ENABLE_RDMA
+#include <infiniband/verbs.h>
+#include <dkvstore/DKVStoreRDMA.h>
+#endif
+
+typedef std::chrono::high_resolution_clock hires;
+
+namespace po = boost::program_options;
+
+typedef DKV::DKVStoreInterface::KeyType KeyType;
+typedef DKV::DKVStoreInterface::ValueType ValueType;
+
+
+static std::unique_ptr<DKV::DKVStoreInterface> CreateStore(
+    DKV::TYPE dkv_type, const std::vector<std::string> &args,
+    ::size_t rank, ::size_t n_hosts) {
+  switch (dkv_type) {
+  case DKV::TYPE::FILE:
+    return std::unique_ptr<DKV::DKVStoreInterface>(
+             new DKV::DKVFile::DKVStoreFile(args));
+  case DKV::TYPE::SHM: {
+    auto shm = new DKV::DKVShm::DKVStoreShm(args);
+    std::unique_ptr<DKV::DKVStoreInterface> store(shm);
+    shm->SetRank(rank, n_hosts);
+    return store;
+  }
+#ifdef MCMC_ENABLE_RAMCLOUD
+  case DKV::TYPE::RAMCLOUD:
+    return std::unique_ptr<DKV::DKVStoreInterface>(
+             new DKV::DKVRamCloud::DKVStoreRamCloud(args));
+#endif
+#ifdef MCMC_ENABLE_RDMA
+  case DKV::TYPE::RDMA:
+    return std::unique_ptr<DKV::DKVStoreInterface>(
+             new DKV::DKVRDMA::DKVStoreRDMA(args));
+#endif
+  }
+
+  throw mcmc::InvalidArgumentException("Unknown D-KV store type");
+}
+
+
+class KeyDistribution {
+ public:
+  virtual ~KeyDistribution() {
+  }
+
+  virtual KeyType draw(std::mt19937_64 &rng) = 0;
+};
+
+
+class UniformKeys : public KeyDistribution {
+ public:
+  UniformKeys(::size_t N) : dist_(0, static_cast<KeyType>(N - 1)) {
+  }
+
+  KeyType draw(std::mt19937_64 &rng) override {
+    return dist_(rng);
+  }
+
+ private:
+  std::uniform_int_distribution<KeyType> dist_;
+};
+
+
+class WeightedKeys : public KeyDistribution {
+ public:
+  /**
+   * Draw key permutation[i] with probability proportional to weight[i]
+   */
+  WeightedKeys(const std::vector<double> &weight,
+               const std::vector<KeyType> &permutation)
+      : dist_(weight.begin(), weight.end()), permutation_(permutation) {
+  }
+
+  KeyType draw(std::mt19937_64 &rng) override {
+    return permutation_[dist_(rng)];
+  }
+
+ private:
+  std::discrete_distribution< ::size_t> dist_;
+  std::vector<KeyType> permutation_;
+};
+
+
+/**
+ * Read an edge list: one "from to" pair per line, '#' starts a comment.
+ * @return the vertex degrees
+ */
+static std::vector<double> ReadDegrees(const std::string &filename) {
+  std::ifstream in(filename);
+  if (! in) {
+    throw mcmc::FileException("Cannot open graph " + filename);
+  }
+
+  std::vector<double> degree;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.size() == 0 || line[0] == '#') {
+      continue;
+    }
+    std::istringstream s(line);
+    int64_t from;
+    int64_t to;
+    if (! (s >> from >> to) || from < 0 || to < 0) {
+      throw mcmc::IOException("Cannot parse edge \"" + line + "\"");
+    }
+    ::size_t max = static_cast< ::size_t>(std::max(from, to));
+    if (max >= degree.size()) {
+      degree.resize(max + 1, 0.0);
+    }
+    degree[from] += 1.0;
+    degree[to] += 1.0;
+  }
+
+  return degree;
+}
+
+
+struct LatencyStats {
+  ::size_t count;
+  double p50;
+  double p99;
+  double p999;
+  double mean;
+  double total;
+};
+
+
+// Latencies in seconds; reported in microseconds
+static LatencyStats Summarize(std::vector<double> *latency) {
+  LatencyStats stats = { latency->size(), 0.0, 0.0, 0.0, 0.0, 0.0 };
+  if (latency->size() == 0) {
+    return stats;
+  }
+  std::sort(latency->begin(), latency->end());
+  auto percentile = [latency](double p) {
+    ::size_t ix = static_cast< ::size_t>(std::ceil(p * latency->size()));
+    ix = std::min(std::max(ix, static_cast< ::size_t>(1)), latency->size());
+    return (*latency)[ix - 1];
+  };
+  for (auto l : *latency) {
+    stats.total += l;
+  }
+  stats.p50 = percentile(0.50);
+  stats.p99 = percentile(0.99);
+  stats.p999 = percentile(0.999);
+  stats.mean = stats.total / latency->size();
+
+  return stats;
+}
+
+
+struct Config {
+  ::size_t K;
+  ::size_t batch;
+  std::string distribution;
+  double write_fraction;
+};
+
+
+class Report {
+ public:
+  Report(const std::string &format, bool header)
+      : json_(format == "json") {
+    if (format != "json" && format != "csv") {
+      throw mcmc::InvalidArgumentException("Unknown format " + format);
+    }
+    if (header && ! json_) {
+      s_ << "backend,codec,ranks,rank,N,K,batch,distribution,write_fraction,"
+        "op,count,p50_us,p99_us,p999_us,mean_us,ops_per_s,keys_per_s,"
+        "GB_per_s" << std::endl;
+    }
+  }
+
+  void Add(DKV::TYPE dkv_type, DKV::CODEC codec, int32_t n_hosts,
+           int32_t rank, ::size_t N, const Config &config,
+           const std::string &op, const LatencyStats &stats,
+           ::size_t bytes_per_key) {
+    double ops = (stats.total > 0.0) ? stats.count / stats.total : 0.0;
+    double keys = ops * config.batch;
+    double gbs = keys * bytes_per_key / (1 << 30);
+    std::ostringstream tmp;
+    tmp << dkv_type;
+    std::string backend = tmp.str();
+    tmp.str("");
+    tmp << codec;
+    std::string codec_name = tmp.str();
+
+    s_ << std::setprecision(6);
+    if (json_) {
+      s_ << "{\"backend\":\"" << backend << "\"" <<
+        ",\"codec\":\"" << codec_name << "\"" <<
+        ",\"ranks\":" << n_hosts << ",\"rank\":" << rank <<
+        ",\"N\":" << N << ",\"K\":" << config.K <<
+        ",\"batch\":" << config.batch <<
+        ",\"distribution\":\"" << config.distribution << "\"" <<
+        ",\"write_fraction\":" << config.write_fraction <<
+        ",\"op\":\"" << op << "\"" <<
+        ",\"count\":" << stats.count <<
+        ",\"p50_us\":" << (1e6 * stats.p50) <<
+        ",\"p99_us\":" << (1e6 * stats.p99) <<
+        ",\"p999_us\":" << (1e6 * stats.p999) <<
+        ",\"mean_us\":" << (1e6 * stats.mean) <<
+        ",\"ops_per_s\":" << ops <<
+        ",\"keys_per_s\":" << keys <<
+        ",\"GB_per_s\":" << gbs << "}" << std::endl;
+    } else {
+      s_ << backend << "," << codec_name << "," << n_hosts << "," << rank <<
+        "," << N << "," << config.K << "," << config.batch << "," <<
+        config.distribution << "," << config.write_fraction << "," << op <<
+        "," << stats.count << "," << (1e6 * stats.p50) << "," <<
+        (1e6 * stats.p99) << "," << (1e6 * stats.p999) << "," <<
+        (1e6 * stats.mean) << "," << ops << "," << keys << "," << gbs <<
+        std::endl;
+    }
+  }
+
+  std::string str() const {
+    return s_.str();
+  }
+
+ private:
+  bool json_;
+  std::ostringstream s_;
+};
+
+
+static int run(const std::vector<std::string> &remains,
+               DKV::TYPE dkv_type, DKV::CODEC codec, ::size_t N,
+               const std::vector< ::size_t> &Ks,
+               const std::vector< ::size_t> &batches,
+               const std::vector<std::string> &distributions,
+               const std::vector<double> &write_fractions,
+               double zipf, const std::string &graph,
+               ::size_t iterations, ::size_t warmup, int64_t seed,
+               uint64_t run_id, const std::string &format,
+               const std::string &output) {
+  // The same rank as the shm store takes from the environment
+  ::size_t rank = 0;
+  ::size_t n_hosts = 1;
+  if (DKV::DKVShm::RankFromEnvironment(&rank, &n_hosts) && n_hosts == 0) {
+    throw mcmc::InvalidArgumentException(
+            "The launcher sets my rank but not the number of ranks");
+  }
+
+  std::vector<double> degree;
+  if (std::find(distributions.begin(), distributions.end(), "degree") !=
+        distributions.end()) {
+    if (graph == "") {
+      throw mcmc::InvalidArgumentException(
+              "distribution degree requires bench.graph");
+    }
+    degree = ReadDegrees(graph);
+    if (degree.size() > N) {
+      N = degree.size();
+    }
+    degree.resize(N, 0.0);
+  }
+
+  // The same permutation on all ranks
+  std::vector<KeyType> permutation(N);
+  for (::size_t i = 0; i < N; ++i) {
+    permutation[i] = static_cast<KeyType>(i);
+  }
+  std::mt19937_64 shuffle_rng(seed);
+  std::shuffle(permutation.begin(), permutation.end(), shuffle_rng);
+
+  ::size_t max_batch = *std::max_element(batches.begin(), batches.end());
+
+  Report report(format, rank == 0 || output != "");
+  std::mt19937_64 rng(seed + 1 + rank);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  // sum of the bytes read, printed so the reads cannot be optimized away
+  uint64_t checksum = 0;
+
+  for (::size_t k = 0; k < Ks.size(); ++k) {
+    ::size_t K = Ks[k];
+    ::size_t value_size = K + 1;
+    auto d_kv_store = CreateStore(dkv_type, remains, rank, n_hosts);
+    d_kv_store->SetCodec(codec, 1);
+    // Each K has its own store, which must not be mistaken for the last one
+    if (run_id != 0) {
+      d_kv_store->SetRunId(run_id + k);
+    }
+    d_kv_store->Init(value_size, N, max_batch, max_batch);
+    d_kv_store->barrier();
+
+    // populate my share of the keys
+    {
+      std::vector<ValueType> values(max_batch * value_size);
+      std::vector<KeyType> keys;
+      std::vector<const ValueType *> v;
+      for (::size_t i = rank; i < N; i += n_hosts) {
+        ValueType *pi = values.data() + keys.size() * value_size;
+        for (::size_t k = 0; k < value_size; k++) {
+          pi[k] = (k + 1.0) / value_size;
+        }
+        keys.push_back(static_cast<KeyType>(i));
+        v.push_back(pi);
+        if (keys.size() == max_batch || i + n_hosts >= N) {
+          d_kv_store->WriteKVRecords(keys, v);
+          d_kv_store->PurgeKVRecords();
+          keys.clear();
+          v.clear();
+        }
+      }
+      d_kv_store->barrier();
+    }
+
+    // values for the writes
+    std::vector<ValueType> write_values(max_batch * value_size);
+    std::vector<const ValueType *> write_pointer(max_batch);
+    for (::size_t i = 0; i < max_batch; ++i) {
+      ValueType *pi = write_values.data() + i * value_size;
+      for (::size_t k = 0; k < value_size; k++) {
+        pi[k] = (k + 1.0) / value_size;
+      }
+      write_pointer[i] = pi;
+    }
+    ::size_t bytes_per_key = d_kv_store->codec().record_size() *
+                               sizeof(ValueType);
+
+    for (auto batch : batches) {
+      std::vector<KeyType> keys(batch);
+      std::vector<ValueType *> cache(batch);
+      std::vector<const ValueType *> write_values_batch(
+          write_pointer.begin(), write_pointer.begin() + batch);
+
+      for (auto &distribution : distributions) {
+        std::unique_ptr<KeyDistribution> key_distribution;
+        if (distribution == "uniform") {
+          key_distribution = std::unique_ptr<KeyDistribution>(
+                               new UniformKeys(N));
+        } else if (distribution == "zipf") {
+          std::vector<double> weight(N);
+          for (::size_t i = 0; i < N; ++i) {
+            weight[i] = 1.0 / std::pow(i + 1.0, zipf);
+          }
+          key_distribution = std::unique_ptr<KeyDistribution>(
+                               new WeightedKeys(weight, permutation));
+        } else if (distribution == "degree") {
+          std::vector<KeyType> identity(N);
+          for (::size_t i = 0; i < N; ++i) {
+            identity[i] = static_cast<KeyType>(i);
+          }
+          key_distribution = std::unique_ptr<KeyDistribution>(
+                               new WeightedKeys(degree, identity));
+        } else {
+          throw mcmc::InvalidArgumentException("Unknown key distribution " +
+                                               distribution);
+        }
+
+        for (auto write_fraction : write_fractions) {
+          Config config = { K, batch, distribution, write_fraction };
+          std::vector<double> read_latency;
+          std::vector<double> write_latency;
+          read_latency.reserve(iterations);
+          write_latency.reserve(iterations);
+
+          d_kv_store->barrier();
+          for (::size_t iter = 0; iter < warmup + iterations; ++iter) {
+            for (auto &k : keys) {
+              k = key_distribution->draw(rng);
+            }
+            bool do_write = unit(rng) < write_fraction;
+
+            auto t = hires::now();
+            if (do_write) {
+              d_kv_store->WriteKVRecords(keys, write_values_batch);
+            } else {
+              d_kv_store->ReadKVRecords(cache, keys, DKV::RW_MODE::READ_ONLY);
+              for (::size_t i = 0; i < batch; ++i) {
+                const unsigned char *b =
+                  reinterpret_cast<const unsigned char *>(cache[i]);
+                for (::size_t j = 0; j < value_size * sizeof(ValueType); j++) {
+                  checksum += b[j];
+                }
+              }
+            }
+            double dt = std::chrono::duration_cast<std::chrono::duration<double>>(hires::now() - t).count();
+            d_kv_store->PurgeKVRecords();
+
+            if (iter >= warmup) {
+              if (do_write) {
+                write_latency.push_back(dt);
+              } else {
+                read_latency.push_back(dt);
+              }
+            }
+          }
+          d_kv_store->barrier();
+
+          if (read_latency.size() > 0) {
+            report.Add(dkv_type, codec, n_hosts, rank, N, config, "read",
+                       Summarize(&read_latency), bytes_per_key);
+          }
+          if (write_latency.size() > 0) {
+            report.Add(dkv_type, codec, n_hosts, rank, N, config, "write",
+                       Summarize(&write_latency), bytes_per_key);
+          }
+        }
+      }
+    }
+  }
+
+  if (output == "") {
+    // one write, so the lines of concurrent ranks don't interleave
+    std::string s = report.str();
+    std::cout.write(s.data(), s.size());
+    std::cout.flush();
+  } else {
+    std::string filename = output;
+    if (n_hosts > 1) {
+      filename += "." + boost::lexical_cast<std::string>(rank);
+    }
+    std::ofstream out(filename);
+    out << report.str();
+  }
+  std::cerr << "rank " << rank << " read checksum " << checksum << std::endl;
+
+  return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+  DKV::TYPE dkv_type;
+  DKV::CODEC codec;
+  ::size_t N;
+  std::vector< ::size_t> Ks;
+  std::vector< ::size_t> batches;
+  std::vector<std::string> distributions;
+  std::vector<double> write_fractions;
+  double zipf;
+  std::string graph;
+  ::size_t iterations;
+  ::size_t warmup;
+  ::size_t local_ranks;
+  int64_t seed;
+  std::string format;
+  std::string output;
+
+  po::options_description desc("D-KV store benchmark");
+  desc.add_options()
+    ("help", "help")
+    ("dkv.type",
+     po::value<DKV::TYPE>(&dkv_type)->multitoken()->default_value(
+#ifdef MCMC_ENABLE_RDMA
+        DKV::TYPE::RDMA
+#elif defined MCMC_ENABLE_RAMCLOUD
+        DKV::TYPE::RAMCLOUD
+#else
+        DKV::TYPE::FILE
+#endif
+        ),
+     "D-KV store type (file/shm/ramcloud/rdma)")
+    ("bench.codec",
+     po::value<DKV::CODEC>(&codec)->default_value(DKV::CODEC::NONE),
+     "D-KV store codec (none/fp16/bf16/q8)")
+    ("bench.N",
+     po::value< ::size_t>(&N)->default_value(1 << 20),
+     "number of keys; at least the number of vertices in bench.graph")
+    ("bench.K",
+     po::value<std::vector< ::size_t> >(&Ks)->multitoken()->default_value(
+       std::vector< ::size_t>{ 32, 256, 1024 }, "32 256 1024"),
+     "K values; the value size is K + 1")
+    ("bench.batch",
+     po::value<std::vector< ::size_t> >(&batches)->multitoken()->default_value(
+       std::vector< ::size_t>{ 64, 1024, 16384 }, "64 1024 16384"),
+     "keys per request")
+    ("bench.distribution",
+     po::value<std::vector<std::string> >(&distributions)->multitoken()->default_value(
+       std::vector<std::string>{ "uniform", "zipf" }, "uniform zipf"),
+     "key distributions (uniform/zipf/degree)")
+    ("bench.write-fraction",
+     po::value<std::vector<double> >(&write_fractions)->multitoken()->default_value(
+       std::vector<double>{ 0.0, 0.1 }, "0.0 0.1"),
+     "fraction of the requests that are writes")
+    ("bench.zipf",
+     po::value<double>(&zipf)->default_value(0.99),
+     "Zipf exponent")
+    ("bench.graph",
+     po::value<std::string>(&graph)->default_value(""),
+     "edge list for the degree distribution")
+    ("bench.iterations",
+     po::value< ::size_t>(&iterations)->default_value(100),
+     "measured requests per configuration")
+    ("bench.warmup",
+     po::value< ::size_t>(&warmup)->default_value(5),
+     "unmeasured requests per configuration")
+    ("bench.local-ranks",
+     po::value< ::size_t>(&local_ranks)->default_value(1),
+     "fork this many local ranks")
+    ("bench.seed",
+     po::value<int64_t>(&seed)->default_value(42),
+     "random seed")
+    ("bench.format",
+     po::value<std::string>(&format)->default_value("csv"),
+     "output format (csv/json)")
+    ("bench.output",
+     po::value<std::string>(&output)->default_value(""),
+     "output file, suffixed with .<rank> for multiple ranks "
+     "(default: stdout)")
+    ;
+
+  po::variables_map vm;
+  po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).allow_unregistered().run();
+  po::store(parsed, vm);
+  try {
+    po::notify(vm);
+  } catch (po::error &e) {
+    std::cerr << "Option error: " << e.what() << std::endl;
+    return 33;
+  }
+
+  if (vm.count("help") > 0) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  std::vector<std::string> remains = po::collect_unrecognized(
+    parsed.options, po::include_positional);
+
+  std::vector<pid_t> children;
+  // The forked ranks share the parent's run id; under a launcher, the ranks
+  // share its job id
+  uint64_t run_id = DKV::DKVShm::RunIdFromEnvironment();
+  if (local_ranks > 1) {
+    std::random_device device;
+    run_id = (static_cast<uint64_t>(device()) << 32) | device();
+    std::string size = boost::lexical_cast<std::string>(local_ranks);
+    for (::size_t r = 0; r < local_ranks; ++r) {
+      pid_t pid = 0;
+      if (r > 0) {
+        pid = fork();
+        if (pid == -1) {
+          perror("fork");
+          return 1;
+        }
+      }
+      if (pid == 0) {
+        // the child, or rank 0 in the parent
+        std::string rank = boost::lexical_cast<std::string>(r);
+        setenv("OMPI_COMM_WORLD_SIZE", size.c_str(), 1);
+        setenv("OMPI_COMM_WORLD_RANK", rank.c_str(), 1);
+        if (r > 0) {
+          children.clear();
+          break;
+        }
+      } else {
+        children.push_back(pid);
+      }
+    }
+  }
+
+  int status = 0;
+  try {
+    status = run(remains, dkv_type, codec, N, Ks, batches, distributions,
+                 write_fractions, zipf, graph, iterations, warmup, seed,
+                 run_id, format, output);
+  } catch (std::exception &e) {
+    std::cerr << "Benchmark fails: " << e.what() << std::endl;
+    status = 1;
+  }
+
+  for (auto pid : children) {
+    int child_status;
+    if (waitpid(pid, &child_status, 0) == -1 ||
+        ! WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+      status = 1;
+    }
+  }
+
+  return status;
+}
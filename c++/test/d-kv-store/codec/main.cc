@@ -0,0 +1,173 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <dkvstore/DKVCodec.h>
+
+using DKV::CODEC;
+using DKV::Float;
+
+namespace {
+
+// The most a value @argument x may move in an Encode/Decode round trip of
+// @argument codec; @argument max is the largest entry of its row
+double bound(CODEC codec, double x, double max) {
+  switch (codec) {
+    case CODEC::NONE:
+      return 0.0;
+    case CODEC::FP16:
+      // half an ulp of the 11-bit significand, or, below the normal range,
+      // of the subnormal spacing of 2^-24; a positive value that would round
+      // to 0 becomes that spacing
+      return std::max(std::ldexp(x, -11), std::ldexp(1.0, -24));
+    case CODEC::BF16:
+      // half an ulp of the 8-bit significand
+      return std::ldexp(x, -8);
+    case CODEC::Q8:
+      // half a step of max / 255; a positive value that would round to 0
+      // becomes a whole step. The step itself is rounded to a Float.
+      return max / 255 * (1.0 + std::ldexp(1.0, -20));
+  }
+  return 0.0;
+}
+
+// A row like pi: positive entries that sum to 1, some of them tiny or zero,
+// followed by a tail like the sum of phi
+std::vector<Float> make_row(std::mt19937 *gen, ::size_t entries,
+                            ::size_t tail) {
+  std::gamma_distribution<double> gamma(0.5, 1.0);
+  std::uniform_int_distribution<int> pick(0, 9);
+  std::vector<double> v(entries);
+  double sum = 0.0;
+  for (auto &x : v) {
+    x = gamma(*gen);
+    int p = pick(*gen);
+    if (p == 0) {
+      x = 0.0;
+    } else if (p == 1) {
+      x *= 1.0e-9;
+    }
+    sum += x;
+  }
+  std::vector<Float> row;
+  for (auto x : v) {
+    row.push_back(static_cast<Float>(sum > 0.0 ? x / sum : x));
+  }
+  for (::size_t t = 0; t < tail; ++t) {
+    row.push_back(static_cast<Float>(1000.0 * gamma(*gen) + t));
+  }
+  return row;
+}
+
+// Round trip @argument rows rows through @argument codec, one by one and
+// packed in place as a fetch decodes them; returns the failures
+int check(CODEC type, ::size_t value_size, ::size_t tail, ::size_t rows,
+          std::mt19937 *gen, double *worst) {
+  const ::size_t entries = value_size - tail;
+  DKV::Codec codec;
+  try {
+    codec.Init(type, value_size, tail);
+  } catch (std::invalid_argument &e) {
+    // The scale of a single q8 entry makes its record longer than the row
+    if (type == CODEC::Q8 && entries == 1) {
+      return 0;
+    }
+    std::cerr << type << " " << value_size << "/" << tail << ": " <<
+      e.what() << std::endl;
+    return 1;
+  }
+  const ::size_t record_size = codec.record_size();
+  int failures = 0;
+
+  std::vector<std::vector<Float> > in;
+  std::vector<Float> packed(rows * value_size);
+  for (::size_t r = 0; r < rows; ++r) {
+    in.push_back(make_row(gen, entries, tail));
+    codec.Encode(in[r].data(), &packed[r * record_size]);
+  }
+  codec.DecodeInPlace(packed.data(), rows);
+
+  for (::size_t r = 0; r < rows; ++r) {
+    std::vector<Float> encoded(record_size);
+    std::vector<Float> out(value_size);
+    codec.Encode(in[r].data(), encoded.data());
+    codec.Decode(encoded.data(), out.data());
+
+    std::vector<Float> round_trip(in[r]);
+    codec.RoundTrip(round_trip.data(), round_trip.data());
+
+    if (! std::equal(out.begin(), out.end(), &packed[r * value_size]) ||
+        ! std::equal(out.begin(), out.end(), round_trip.begin())) {
+      std::cerr << type << " " << value_size << "/" << tail <<
+        ": in-place decode differs" << std::endl;
+      ++failures;
+    }
+
+    double max = 0.0;
+    for (::size_t i = 0; i < entries; ++i) {
+      max = std::max(max, static_cast<double>(in[r][i]));
+    }
+    for (::size_t i = 0; i < value_size; ++i) {
+      double x = in[r][i];
+      double error = std::fabs(static_cast<double>(out[i]) - x);
+      double limit = (i < entries) ? bound(type, x, max) : 0.0;
+      if (error > limit) {
+        std::cerr << type << " " << value_size << "/" << tail << ": " << x <<
+          " at " << i << " decodes to " << out[i] << std::endl;
+        ++failures;
+      }
+      if (x > 0.0 && ! (out[i] > 0.0)) {
+        std::cerr << type << " " << value_size << "/" << tail << ": " << x <<
+          " at " << i << " decodes to 0" << std::endl;
+        ++failures;
+      }
+      if (limit > 0.0) {
+        worst[static_cast<int>(type)] =
+          std::max(worst[static_cast<int>(type)], error / limit);
+      }
+    }
+  }
+
+  return failures;
+}
+
+}   // namespace
+
+// Each codec must decode what it encodes within its error bound, keep the
+// full-precision tail exact, never decode a positive value to 0, and decode
+// packed records in place as the stores do, for row lengths that are not a
+// multiple of any vector width
+int main(int argc, char *argv[]) {
+  std::mt19937 gen(42);
+  const ::size_t rows = 64;
+  double worst[4] = { 0.0, 0.0, 0.0, 0.0 };
+  int failures = 0;
+
+  for (CODEC type : { CODEC::NONE, CODEC::FP16, CODEC::BF16, CODEC::Q8 }) {
+    for (::size_t entries : { 1, 2, 3, 7, 8, 15, 16, 17, 31, 33, 64, 100,
+                              257 }) {
+      for (::size_t tail = 0; tail <= 4; ++tail) {
+        failures += check(type, entries + tail, tail, rows, &gen, worst);
+      }
+    }
+  }
+
+  for (CODEC type : { CODEC::NONE, CODEC::FP16, CODEC::BF16, CODEC::Q8 }) {
+    std::cout << type << ": largest error " <<
+      worst[static_cast<int>(type)] << " of the bound" << std::endl;
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+
+  std::cout << "OK" << std::endl;
+
+  return 0;
+}
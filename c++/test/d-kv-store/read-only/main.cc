@@ -17,6 +17,7 @@
 #include <mcmc/options.h>
 
 #include <dkvstore/DKVStoreFile.h>
+#include <dkvstore/DKVStoreShm.h>
 #ifdef MCMC_ENABLE_RAMCLOUD
 #include <dkvstore/DKVStoreRamCloud.h>
 #endif
@@ -387,7 +388,7 @@ int main(int argc, char *argv[]) {
         DKV::TYPE::FILE
 #endif
         ),
-     "D-KV store type (file/ramcloud/rdma)")
+     "D-KV store type (file/shm/ramcloud/rdma)")
     ;
 
   po::variables_map vm;
@@ -420,6 +421,11 @@ int main(int argc, char *argv[]) {
       dkv_store.run();
       break;
     }
+    case DKV::TYPE::SHM: {
+      DKVWrapper<DKV::DKVShm::DKVStoreShm> dkv_store(options, remains);
+      dkv_store.run();
+      break;
+    }
 #ifdef MCMC_ENABLE_RAMCLOUD
     case DKV::TYPE::RAMCLOUD: {
       DKVWrapper<DKV::DKVRamCloud::DKVStoreRamCloud> dkv_store(options,
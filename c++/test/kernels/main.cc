@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <mcmc/kernels.h>
+#include <mcmc/random.h>
+
+using namespace mcmc;
+
+namespace {
+
+struct Edges {
+  ::size_t K;
+  std::vector<std::vector<Float> > pi;      // compact rows of K + 1
+  std::vector<std::vector<Float> > phi;
+  std::vector<Float> beta;
+  std::vector<Float> term;
+  std::vector<int32_t> a;
+  std::vector<int32_t> b;
+  std::vector<int> y;
+};
+
+Edges make_edges(Random::Random *rng, ::size_t K, ::size_t rows,
+                 ::size_t edges) {
+  Edges d;
+  d.K = K;
+  d.phi = rng->gamma(1.0, 1.0, rows, K);
+  for (auto &p : d.phi) {
+    Float sum = 0.0;
+    for (auto v : p) {
+      sum += v;
+    }
+    std::vector<Float> row(K + 1);
+    for (::size_t k = 0; k < K; ++k) {
+      row[k] = p[k] / sum;
+    }
+    row[K] = sum;
+    d.pi.push_back(row);
+  }
+  std::vector<std::vector<Float> > theta = rng->gamma(1.0, 1.0, K, 2);
+  for (auto &t : theta) {
+    d.beta.push_back(t[1] / (t[0] + t[1]));
+  }
+  d.term.resize(4 * K);
+  kernels::BetaTerms(theta, d.term.data());
+  for (::size_t e = 0; e < edges; ++e) {
+    d.a.push_back(rng->randint(0, rows - 1));
+    d.b.push_back(rng->randint(0, rows - 1));
+    d.y.push_back(rng->randint(0, 1));
+  }
+  return d;
+}
+
+// Run all kernels of @argument table over the edges; the outputs are
+// appended to @argument out, the time per edge and kernel is returned
+double run(const kernels::Table &table, const Edges &d, ::size_t rounds,
+           std::vector<Float> *out) {
+  const Float epsilon = 1.0e-7;
+  const ::size_t K = d.K;
+  std::vector<Float> phi_grads(K, 0.0);
+  std::vector<Float> compact_grads(K, 0.0);
+  std::vector<Float> grads_0(K, 0.0);
+  std::vector<Float> grads_1(K, 0.0);
+  Float likelihood = 0.0;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (::size_t r = 0; r < rounds; ++r) {
+    for (::size_t e = 0; e < d.a.size(); ++e) {
+      const Float *pi_a = d.pi[d.a[e]].data();
+      const Float *pi_b = d.pi[d.b[e]].data();
+      int y = d.y[e];
+      likelihood += table.edge_likelihood(K, pi_a, pi_b, y, d.beta.data(),
+                                          epsilon);
+      table.phi_grads(K, pi_a, d.phi[d.a[e]].data(), pi_a[K], pi_b, y,
+                      d.beta.data(), epsilon, phi_grads.data());
+      table.phi_grads_compact(K, pi_a, pi_b, y, d.beta.data(), epsilon,
+                              compact_grads.data());
+      table.beta_grads(K, pi_a, pi_b, y, d.beta.data(), epsilon,
+                       &d.term[2 * y * K], &d.term[(2 * y + 1) * K],
+                       grads_0.data(), grads_1.data());
+    }
+  }
+  auto stop = std::chrono::high_resolution_clock::now();
+
+  out->push_back(likelihood);
+  out->insert(out->end(), phi_grads.begin(), phi_grads.end());
+  out->insert(out->end(), compact_grads.begin(), compact_grads.end());
+  out->insert(out->end(), grads_0.begin(), grads_0.end());
+  out->insert(out->end(), grads_1.begin(), grads_1.end());
+
+  double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+  return ns / (rounds * d.a.size() * 4);
+}
+
+// The largest difference of @argument a and @argument b relative to the
+// magnitude of the values in @argument a
+double max_relative_error(const std::vector<Float> &a,
+                          const std::vector<Float> &b) {
+  double scale = 0.0;
+  for (auto v : a) {
+    scale = std::max(scale, std::fabs(static_cast<double>(v)));
+  }
+  double error = 0.0;
+  for (::size_t i = 0; i < a.size(); ++i) {
+    error = std::max(error, std::fabs(static_cast<double>(a[i]) - b[i]));
+  }
+  return (scale > 0.0) ? error / scale : error;
+}
+
+}   // namespace
+
+// The specialized kernels sum in a different order than the run-time K
+// kernels, so they must compute the same values up to rounding; and they
+// should be faster. The times are the best of @argument repeats.
+int main(int argc, char *argv[]) {
+  const ::size_t edges = (argc > 1) ? std::stoul(argv[1]) : 4096;
+  const ::size_t rounds = (argc > 2) ? std::stoul(argv[2]) : 4;
+  const ::size_t repeats = (argc > 3) ? std::stoul(argv[3]) : 5;
+  // float accumulates up to K = 1024 terms over all edges and rounds
+  const double tolerance = (sizeof(Float) == 4) ? 1.0e-4 : 1.0e-12;
+  Random::Random rng(42);
+  int failures = 0;
+
+  std::cout << std::setw(6) << "K" << std::setw(14) << "generic ns" <<
+    std::setw(14) << "fixed ns" << std::setw(10) << "speedup" <<
+    std::setw(10) << "error" << std::endl;
+  for (::size_t K : { 32, 64, 100, 128, 256, 512, 1024 }) {
+    Edges d = make_edges(&rng, K, 1024, edges);
+    const kernels::Table &generic = kernels::TableFor<0>();
+    const kernels::Table &fixed = kernels::ForK(K);
+
+    std::vector<Float> generic_out;
+    std::vector<Float> fixed_out;
+    // warm up, then time
+    run(generic, d, 1, &generic_out);
+    run(fixed, d, 1, &fixed_out);
+    double t_generic = 0.0;
+    double t_fixed = 0.0;
+    for (::size_t r = 0; r < repeats; ++r) {
+      generic_out.clear();
+      fixed_out.clear();
+      double t = run(generic, d, rounds, &generic_out);
+      t_generic = (r == 0) ? t : std::min(t_generic, t);
+      t = run(fixed, d, rounds, &fixed_out);
+      t_fixed = (r == 0) ? t : std::min(t_fixed, t);
+    }
+
+    if (fixed.fixed_k != K && ! (fixed.fixed_k == 0 && K == 100)) {
+      std::cerr << "K " << K << ": dispatched to " << fixed.fixed_k <<
+        std::endl;
+      ++failures;
+    }
+    double error = (generic_out.size() == fixed_out.size())
+                     ? max_relative_error(generic_out, fixed_out)
+                     : 1.0;
+    if (! (error <= tolerance)) {
+      std::cerr << "K " << K << ": specialized kernels differ by " <<
+        error << std::endl;
+      ++failures;
+    }
+
+    std::cout << std::setw(6) << K << std::fixed << std::setprecision(2) <<
+      std::setw(14) << t_generic;
+    if (fixed.fixed_k == 0) {
+      std::cout << std::setw(14) << "-" << std::setw(10) << "-";
+    } else {
+      std::cout << std::setw(14) << t_fixed << std::setw(10) <<
+        (t_generic / t_fixed);
+    }
+    std::cout << std::scientific << std::setprecision(1) <<
+      std::setw(10) << error << std::endl;
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <mcmc/mpi-threads.h>
+
+using namespace mcmc;
+
+int main(int argc, char *argv[]) {
+  const int ranks = (argc > 1) ? std::stoi(argv[1]) : 4;
+  std::atomic<int> failures(0);
+
+  auto check = [&failures](bool ok, int rank, const char *what) {
+    if (! ok) {
+      std::cerr << "Rank " << rank << ": " << what << " mismatch" << std::endl;
+      ++failures;
+    }
+  };
+
+  mpi_threads::Run(ranks, [ranks, &check](int rank) {
+    int size;
+    int me;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &me);
+    check(size == ranks && me == rank, rank, "size/rank");
+
+    // Bcast from the last rank
+    std::vector<double> b(3, rank);
+    MPI_Bcast(b.data(), b.size(), MPI_DOUBLE, ranks - 1, MPI_COMM_WORLD);
+    check(b[0] == ranks - 1 && b[2] == ranks - 1, rank, "Bcast");
+
+    // Scatterv: rank r receives r + 1 values, all r
+    std::vector<int> send;
+    std::vector<int> counts(ranks);
+    std::vector<int> displs(ranks);
+    if (rank == 0) {
+      for (int r = 0; r < ranks; ++r) {
+        counts[r] = r + 1;
+        displs[r] = send.size();
+        send.insert(send.end(), r + 1, r);
+      }
+    }
+    std::vector<int> recv(rank + 1, -1);
+    MPI_Scatterv(send.data(), counts.data(), displs.data(), MPI_INT,
+                 recv.data(), recv.size(), MPI_INT, 0, MPI_COMM_WORLD);
+    check(recv[0] == rank && recv[rank] == rank, rank, "Scatterv");
+
+    // Reduce in place at the root, Allreduce
+    long sum = rank + 1;
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &sum, &sum, 1, MPI_LONG, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    if (rank == 0) {
+      check(sum == ranks * (ranks + 1) / 2, rank, "Reduce");
+    }
+    float max = rank;
+    float all_max;
+    MPI_Allreduce(&max, &all_max, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+    check(all_max == ranks - 1, rank, "Allreduce");
+    int ok = (rank != 1);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    check(! ok || ranks == 1, rank, "Allreduce(LAND)");
+
+    // A ring of sends; probe for the size first
+    std::vector<int> token(rank + 1, rank);
+    MPI_Send(token.data(), token.size(), MPI_INT, (rank + 1) % ranks, 7,
+             MPI_COMM_WORLD);
+    MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, 7, MPI_COMM_WORLD, &status);
+    int count;
+    MPI_Get_count(&status, MPI_INT, &count);
+    int from = (rank + ranks - 1) % ranks;
+    check(status.MPI_SOURCE == from && count == from + 1, rank, "Probe");
+    std::vector<int> received(count);
+    MPI_Recv(received.data(), count, MPI_INT, from, 7, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    check(received[0] == from, rank, "Recv");
+
+    // Non-blocking barriers complete in order
+    MPI_Request first;
+    MPI_Request second;
+    MPI_Ibarrier(MPI_COMM_WORLD, &first);
+    MPI_Ibarrier(MPI_COMM_WORLD, &second);
+    MPI_Wait(&second, MPI_STATUS_IGNORE);
+    MPI_Wait(&first, MPI_STATUS_IGNORE);
+    check(first == MPI_REQUEST_NULL && second == MPI_REQUEST_NULL, rank,
+          "Ibarrier");
+
+    // A helper thread runs collectives on a duplicate communicator while
+    // its rank runs them on MPI_COMM_WORLD
+    MPI_Comm dup;
+    MPI_Comm_dup(MPI_COMM_WORLD, &dup);
+    long helper_sum = 0;
+    std::thread helper([&helper_sum, dup](std::function<void()> inherit) {
+      inherit();
+      for (int i = 0; i < 100; ++i) {
+        long one = 1;
+        MPI_Allreduce(&one, &helper_sum, 1, MPI_LONG, MPI_SUM, dup);
+      }
+    }, mpi_threads::Inherit());
+    for (int i = 0; i < 100; ++i) {
+      MPI_Barrier(MPI_COMM_WORLD);
+    }
+    helper.join();
+    check(helper_sum == ranks, rank, "Allreduce(dup)");
+    MPI_Comm_free(&dup);
+
+    // One-sided: all ranks add to the counter of rank 0, half of them with
+    // compare-and-swap, then read the values that rank 0 exposes
+    std::vector<uint64_t> exposed(2, 0);
+    exposed[1] = 42;
+    MPI_Win win;
+    MPI_Win_create(exposed.data(), exposed.size() * sizeof(uint64_t),
+                   sizeof(uint64_t), MPI_INFO_NULL, MPI_COMM_WORLD, &win);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    for (int i = 0; i < 100; ++i) {
+      uint64_t one = 1;
+      uint64_t old;
+      if (rank % 2 == 0) {
+        MPI_Fetch_and_op(&one, &old, MPI_UNSIGNED_LONG, 0, 0, MPI_SUM, win);
+      } else {
+        MPI_Fetch_and_op(NULL, &old, MPI_UNSIGNED_LONG, 0, 0, MPI_NO_OP, win);
+        while (true) {
+          uint64_t next = old + 1;
+          uint64_t seen;
+          MPI_Compare_and_swap(&next, &old, &seen, MPI_UNSIGNED_LONG, 0, 0,
+                               win);
+          if (seen == old) {
+            break;
+          }
+          old = seen;
+        }
+      }
+      MPI_Win_flush(0, win);
+    }
+    uint64_t answer;
+    MPI_Get(&answer, 1, MPI_UNSIGNED_LONG, 0, 1, 1, MPI_UNSIGNED_LONG, win);
+    MPI_Win_flush(0, win);
+    check(answer == 42, rank, "Get");
+    MPI_Win_unlock_all(win);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank == 0) {
+      check(exposed[0] == static_cast<uint64_t>(100 * ranks), rank,
+            "Fetch_and_op/Compare_and_swap");
+    }
+    MPI_Win_free(&win);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+  });
+
+  if (failures > 0) {
+    return 1;
+  }
+
+  std::cout << "OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <mcmc/out-of-core.h>
+#include <mcmc/random.h>
+#include <mcmc/learning/mcmc_sampler_stochastic.h>
+
+using namespace mcmc;
+using namespace mcmc::learning;
+
+namespace {
+
+const ::size_t nodes = 200;
+const ::size_t K = 8;
+
+// A random graph in the edge list format of -f
+void write_graph(const std::string &file, ::size_t nodes, ::size_t edges) {
+  Random::Random rng(42);
+  std::ofstream out(file);
+  out << "# out-of-core test" << std::endl;
+  out << "# x" << std::endl;
+  out << "# Nodes: " << nodes << std::endl;
+  out << "# FromNodeId ToNodeId" << std::endl;
+  for (::size_t e = 0; e < edges; ++e) {
+    int64_t a = rng.randint(0, nodes - 1);
+    int64_t b = rng.randint(0, nodes - 1);
+    if (a != b) {
+      out << a << " " << b << std::endl;
+    }
+  }
+}
+
+// Opens up the rows of pi and the out-of-core store. In memory, it samples
+// all neighbor sets of the minibatch before it updates any, as the
+// out-of-core sampler does, so both make the same random draws.
+class Sampler : public MCMCSamplerStochastic {
+ public:
+  Sampler(const Options &args) : MCMCSamplerStochastic(args) {
+  }
+
+  void update_phi_nodes(const std::vector<Vertex> &nodes,
+                        Float eps_t) override {
+    if (ooc_pi_) {
+      MCMCSamplerStochastic::update_phi_nodes(nodes, eps_t);
+      return;
+    }
+    std::vector<NeighborSet> neighbors(nodes.size());
+    for (::size_t n = 0; n < nodes.size(); ++n) {
+      sample_neighbor_nodes(&neighbors[n], num_node_sample, nodes[n],
+                            rng_[0]);
+    }
+    for (::size_t n = 0; n < nodes.size(); ++n) {
+      update_phi(nodes[n], neighbors[n], eps_t);
+    }
+  }
+
+  const Float *row(Vertex i) const {
+    return pi_row(i);
+  }
+
+  OutOfCorePi *out_of_core() {
+    return ooc_pi_.get();
+  }
+};
+
+std::vector<std::string> arguments(const std::string &graph,
+                                   const std::string &dir,
+                                   ::size_t iterations) {
+  return {
+    "-f", graph, "-K", std::to_string(K), "-m", "32", "-n", "16",
+    "-i", "5", "-h", "0.05", "-x", std::to_string(iterations),
+    "--mcmc.checkpoint-dir", dir,
+  };
+}
+
+}   // namespace
+
+// The out-of-core sampler must compute the same pi as the in-memory one, up
+// to the rounding of its compact rows. Both start from the same checkpoint
+// and draw in the same order; some of the rows are resident, the
+// others are prefetched from the mapping, and the file has all of them
+// after Sync().
+int main(int argc, char *argv[]) {
+  namespace fs = boost::filesystem;
+  const ::size_t start = 5;
+  const ::size_t steps = 20;
+  const double tolerance = (sizeof(Float) == 4) ? 1.0e-3 : 1.0e-9;
+
+  fs::path tmp = fs::temp_directory_path() /
+                   fs::unique_path("out-of-core-%%%%%%");
+  std::string dir = (tmp / "checkpoints").string();
+  std::string graph = (tmp / "graph.txt").string();
+  std::string file = (tmp / "pi").string();
+  fs::create_directories(dir);
+  write_graph(graph, nodes, 1600);
+
+  {
+    std::vector<std::string> args = arguments(graph, dir, start);
+    args.push_back("--mcmc.checkpoint-interval");
+    args.push_back(std::to_string(start));
+    Options options(args);
+    Sampler sampler(options);
+    sampler.init();
+    sampler.run();
+  }
+
+  std::vector<std::string> args = arguments(graph, dir, steps);
+  args.push_back("--mcmc.restart");
+  Options in_memory_options(args);
+  Sampler in_memory(in_memory_options);
+  in_memory.init();
+  in_memory.run();
+
+  args.push_back("--mcmc.out-of-core");
+  args.push_back(file);
+  args.push_back("--mcmc.out-of-core-cache");
+  args.push_back(std::to_string(nodes / 4));
+  Options out_of_core_options(args);
+  Sampler out_of_core(out_of_core_options);
+  out_of_core.init();
+  out_of_core.run();
+
+  int failures = 0;
+  double error = 0.0;
+  for (::size_t i = 0; i < nodes; ++i) {
+    const Float *a = in_memory.row(i);
+    const Float *b = out_of_core.row(i);
+    for (::size_t k = 0; k < K; ++k) {
+      error = std::max(error, std::fabs(static_cast<double>(a[k]) - b[k]) /
+                                std::fabs(static_cast<double>(a[k])));
+    }
+  }
+  if (! (error <= tolerance)) {
+    std::cerr << "Out-of-core pi differs by " << error << std::endl;
+    ++failures;
+  }
+
+  OutOfCorePi *ooc = out_of_core.out_of_core();
+  if (ooc->prefetched_pages() == 0) {
+    std::cerr << "Nothing prefetched" << std::endl;
+    ++failures;
+  }
+
+  ooc->Sync();
+  std::vector<Float> area(nodes * ooc->row_size());
+  std::ifstream in(file, std::ios::binary);
+  in.read(reinterpret_cast<char *>(area.data()), area.size() * sizeof(Float));
+  if (! in) {
+    std::cerr << "Cannot read " << file << std::endl;
+    ++failures;
+  } else {
+    for (::size_t i = 0; i < nodes; ++i) {
+      const Float *row = ooc->row(i);
+      if (! std::equal(row, row + ooc->row_size(),
+                       area.data() + i * ooc->row_size())) {
+        std::cerr << "Row " << i << " is not synced to the file" << std::endl;
+        ++failures;
+        break;
+      }
+    }
+  }
+
+  fs::remove_all(tmp);
+
+  if (failures > 0) {
+    return 1;
+  }
+
+  std::cout << "OK, pi differs by " << std::scientific << error <<
+    std::endl;
+
+  return 0;
+}
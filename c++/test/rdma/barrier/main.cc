@@ -14,6 +14,7 @@
 #include <mcmc/options.h>
 
 #include <dkvstore/DKVStoreFile.h>
+#include <dkvstore/DKVStoreShm.h>
 #ifdef MCMC_ENABLE_RAMCLOUD
 #include <dkvstore/DKVStoreRamCloud.h>
 #endif
@@ -295,7 +296,7 @@ int main(int argc, char *argv[]) {
       ("help", "help")
       ("dkv.type",
        po::value<DKV::TYPE>(&dkv_type)->multitoken()->default_value(DKV::TYPE::FILE),
-       "D-KV store type (file/ramcloud/rdma)")
+       "D-KV store type (file/shm/ramcloud/rdma)")
       ;
 
     po::variables_map vm;
@@ -326,6 +327,11 @@ int main(int argc, char *argv[]) {
 #endif
         break;
     }
+    case DKV::TYPE::SHM: {
+        DKVWrapper<DKV::DKVShm::DKVStoreShm> dkv_store(options, remains);
+        dkv_store.run();
+        break;
+    }
 #ifdef MCMC_ENABLE_RAMCLOUD
     case DKV::TYPE::RAMCLOUD: {
 #if 0
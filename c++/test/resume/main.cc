@@ -0,0 +1,122 @@
+#include <omp.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <mcmc/checkpoint.h>
+#include <mcmc/mpi-threads.h>
+#include <mcmc/random.h>
+#include <mcmc/learning/mcmc_sampler_stochastic_distr.h>
+
+using namespace mcmc;
+using namespace mcmc::learning;
+
+namespace {
+
+const int ranks = 3;
+const int threads = 2;
+
+// A random graph in the edge list format of -f
+void write_graph(const std::string &file, ::size_t nodes, ::size_t edges) {
+  Random::Random rng(42);
+  std::ofstream out(file);
+  out << "# resume test" << std::endl;
+  out << "# x" << std::endl;
+  out << "# Nodes: " << nodes << std::endl;
+  out << "# FromNodeId ToNodeId" << std::endl;
+  for (::size_t e = 0; e < edges; ++e) {
+    int64_t a = rng.randint(0, nodes - 1);
+    int64_t b = rng.randint(0, nodes - 1);
+    if (a != b) {
+      out << a << " " << b << std::endl;
+    }
+  }
+}
+
+// Run the distributed sampler with in-process ranks up to step
+// @argument iterations, checkpointing into @argument dir
+void run(const std::string &graph, const std::string &dir,
+         ::size_t iterations, ::size_t interval, bool restart) {
+  std::string shm_name = "/mcmc-resume-" + std::to_string(getpid());
+  mpi_threads::Run(ranks, [&](int rank) {
+    omp_set_num_threads(threads);
+    std::vector<std::string> args = {
+      "-f", graph, "-K", "4", "-m", "32", "-n", "16", "-i", "5",
+      "-h", "0.05", "-x", std::to_string(iterations),
+      "--mcmc.dkv-type", "shm",
+      "--dkv.shm.name", shm_name,
+      "--dkv.shm.ranks", std::to_string(ranks),
+      "--dkv.shm.rank", std::to_string(rank),
+      "--mcmc.checkpoint-interval", std::to_string(interval),
+      "--mcmc.checkpoint-dir", dir,
+    };
+    if (restart) {
+      args.push_back("--mcmc.restart");
+    }
+    Options options(args);
+    MCMCSamplerStochasticDistributed sampler(options);
+    sampler.init();
+    sampler.run();
+  });
+}
+
+std::string contents(const std::string &file) {
+  std::ifstream in(file, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+}   // namespace
+
+// A run that is checkpointed, stopped and restarted must end in the same
+// state as one that runs through: the checkpoints they write at the last
+// step are compared byte for byte, with several threads per rank
+int main(int argc, char *argv[]) {
+  namespace fs = boost::filesystem;
+  const ::size_t interval = 10;
+  const ::size_t steps = 2 * interval;
+
+  fs::path tmp = fs::temp_directory_path() / fs::unique_path("resume-%%%%%%");
+  std::string through = (tmp / "through").string();
+  std::string resumed = (tmp / "resumed").string();
+  std::string graph = (tmp / "graph.txt").string();
+  fs::create_directories(through);
+  fs::create_directories(resumed);
+  write_graph(graph, 200, 1600);
+
+  run(graph, through, steps, interval, false);
+  run(graph, resumed, interval, interval, false);
+  run(graph, resumed, steps, interval, true);
+
+  int failures = 0;
+  if (checkpoint::Latest(through) != steps ||
+      checkpoint::Latest(resumed) != steps) {
+    std::cerr << "No checkpoint at step " << steps << std::endl;
+    ++failures;
+  } else {
+    for (int rank = 0; rank < ranks; ++rank) {
+      std::string a = contents(checkpoint::Path(through, steps, rank));
+      std::string b = contents(checkpoint::Path(resumed, steps, rank));
+      if (a.empty() || a != b) {
+        std::cerr << "Rank " << rank << ": resumed state differs" << std::endl;
+        ++failures;
+      }
+    }
+  }
+
+  fs::remove_all(tmp);
+
+  if (failures > 0) {
+    return 1;
+  }
+
+  std::cout << "OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <mcmc/kernels.h>
+#include <mcmc/random.h>
+#include <mcmc/learning/mcmc_sampler_stochastic_sparse.h>
+
+using namespace mcmc;
+using namespace mcmc::learning;
+
+namespace {
+
+const ::size_t nodes = 200;
+const ::size_t K = 16;
+
+// A random graph in the edge list format of -f
+void write_graph(const std::string &file, ::size_t nodes, ::size_t edges) {
+  Random::Random rng(42);
+  std::ofstream out(file);
+  out << "# sparse test" << std::endl;
+  out << "# x" << std::endl;
+  out << "# Nodes: " << nodes << std::endl;
+  out << "# FromNodeId ToNodeId" << std::endl;
+  for (::size_t e = 0; e < edges; ++e) {
+    int64_t a = rng.randint(0, nodes - 1);
+    int64_t b = rng.randint(0, nodes - 1);
+    if (a != b) {
+      out << a << " " << b << std::endl;
+    }
+  }
+}
+
+// The largest difference of @argument a and @argument b relative to the
+// magnitude of the values in @argument a
+double max_relative_error(const std::vector<Float> &a,
+                          const std::vector<Float> &b) {
+  double scale = 0.0;
+  for (auto v : a) {
+    scale = std::max(scale, std::fabs(static_cast<double>(v)));
+  }
+  double error = 0.0;
+  for (::size_t i = 0; i < a.size(); ++i) {
+    error = std::max(error, std::fabs(static_cast<double>(a[i]) - b[i]));
+  }
+  return (scale > 0.0) ? error / scale : error;
+}
+
+// Opens up the sparse state, and expands it into the dense pi and phi that
+// it stands for
+class Sampler : public MCMCSamplerStochasticSparse {
+ public:
+  Sampler(const Options &args) : MCMCSamplerStochasticSparse(args) {
+  }
+
+  std::vector<Float> dense_phi(Vertex i) const {
+    std::vector<Float> phi(K, residual_[i]);
+    for (::size_t j = 0; j < m_; ++j) {
+      phi[active_[i * m_ + j]] = active_phi_[i * m_ + j];
+    }
+    return phi;
+  }
+
+  std::vector<Float> dense_pi(Vertex i) const {
+    std::vector<Float> pi = dense_phi(i);
+    for (auto &p : pi) {
+      p /= phi_sum_[i];
+    }
+    return pi;
+  }
+
+  int y(Vertex a, Vertex b) const {
+    Edge edge(std::min(a, b), std::max(a, b));
+    return edge.in(network.get_linked_edges()) ? 1 : 0;
+  }
+
+  NeighborSet neighbors(Vertex i, Random::Random *rng) {
+    NeighborSet neighbors;
+    sample_neighbor_nodes(&neighbors, num_node_sample, i, rng);
+    return neighbors;
+  }
+
+  // update_phi's candidates: the active communities of i and its neighbors
+  std::vector<int32_t> candidates(Vertex i,
+                                  const NeighborSet &neighbors) const {
+    std::set<int32_t> k(&active_[i * m_], &active_[i * m_] + m_);
+    for (auto n : neighbors) {
+      if (n != i) {
+        k.insert(&active_[n * m_], &active_[n * m_] + m_);
+      }
+    }
+    return std::vector<int32_t>(k.begin(), k.end());
+  }
+
+  // Check merge() of a and b against the dense pi; returns the failures
+  int check_merge(Vertex a, Vertex b) const {
+    Union u;
+    merge(a, b, &u);
+    std::set<int32_t> k(&active_[a * m_], &active_[a * m_] + m_);
+    k.insert(&active_[b * m_], &active_[b * m_] + m_);
+    if (k.size() != u.k.size() ||
+        ! std::equal(k.begin(), k.end(), u.k.begin())) {
+      std::cerr << "merge(" << a << ", " << b << "): wrong union" << std::endl;
+      return 1;
+    }
+    std::vector<Float> pi_a = dense_pi(a);
+    std::vector<Float> pi_b = dense_pi(b);
+    for (::size_t j = 0; j < u.k.size(); ++j) {
+      if (u.pi_a[j] != pi_a[u.k[j]] || u.pi_b[j] != pi_b[u.k[j]]) {
+        std::cerr << "merge(" << a << ", " << b << "): wrong pi" << std::endl;
+        return 1;
+      }
+    }
+    if (m_ < K && (u.rest_a != residual_[a] / phi_sum_[a] ||
+                   u.rest_b != residual_[b] / phi_sum_[b])) {
+      std::cerr << "merge(" << a << ", " << b << "): wrong rest" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  Float likelihood(Vertex a, Vertex b, bool y) const {
+    return pair_likelihood(a, b, y);
+  }
+
+  Float dense_likelihood(Vertex a, Vertex b, bool y) const {
+    std::vector<Float> pi_a = dense_pi(a);
+    std::vector<Float> pi_b = dense_pi(b);
+    return kernels::EdgeLikelihood<0>(K, pi_a.data(), pi_b.data(), y,
+                                      beta.data(), epsilon);
+  }
+
+  // phi_grads over @argument candidates, followed by the mean gradient
+  // outside them
+  std::vector<Float> grads(Vertex i, const NeighborSet &neighbors,
+                           const std::vector<int32_t> &candidates) {
+    for (::size_t c = 0; c < candidates.size(); ++c) {
+      candidate_of_[candidates[c]] = c;
+    }
+    std::vector<Float> grads;
+    Float outside;
+    phi_grads(i, neighbors, candidates, &grads, &outside);
+    for (auto k : candidates) {
+      candidate_of_[k] = -1;
+    }
+    grads.push_back(outside);
+    return grads;
+  }
+
+  // As grads(), from the dense kernels
+  std::vector<Float> dense_grads(Vertex i, const NeighborSet &neighbors,
+                                 const std::vector<int32_t> &candidates)
+      const {
+    std::vector<Float> pi_i = dense_pi(i);
+    std::vector<Float> phi_i = dense_phi(i);
+    std::vector<Float> all(K, FLOAT(0.0));
+    for (auto n : neighbors) {
+      if (n != i) {
+        std::vector<Float> pi_n = dense_pi(n);
+        kernels::PhiGrads<0>(K, pi_i.data(), phi_i.data(), phi_sum_[i],
+                             pi_n.data(), y(i, n), beta.data(), epsilon,
+                             all.data());
+      }
+    }
+    std::vector<Float> grads;
+    std::vector<bool> candidate(K, false);
+    for (auto k : candidates) {
+      grads.push_back(all[k]);
+      candidate[k] = true;
+    }
+    Float outside = FLOAT(0.0);
+    for (::size_t k = 0; k < K; ++k) {
+      if (! candidate[k]) {
+        outside += all[k];
+      }
+    }
+    if (candidates.size() < K) {
+      outside /= K - candidates.size();
+    }
+    grads.push_back(outside);
+    return grads;
+  }
+
+  // beta_grads as a flat K x 2 vector
+  std::vector<Float> theta_grads(const MinibatchSet &mini_batch) const {
+    std::vector<std::vector<Float> > grads;
+    beta_grads(mini_batch, &grads);
+    std::vector<Float> flat;
+    for (auto &g : grads) {
+      flat.insert(flat.end(), g.begin(), g.end());
+    }
+    return flat;
+  }
+
+  // As theta_grads(), from the dense kernels
+  std::vector<Float> dense_theta_grads(const MinibatchSet &mini_batch) const {
+    std::vector<Float> term(4 * K);
+    kernels::BetaTerms(theta, term.data());
+    std::vector<Float> grads_0(K, FLOAT(0.0));
+    std::vector<Float> grads_1(K, FLOAT(0.0));
+    for (auto &edge : mini_batch) {
+      int y = this->y(edge.first, edge.second);
+      std::vector<Float> pi_a = dense_pi(edge.first);
+      std::vector<Float> pi_b = dense_pi(edge.second);
+      kernels::BetaGrads<0>(K, pi_a.data(), pi_b.data(), y, beta.data(),
+                            epsilon, &term[2 * y * K],
+                            &term[(2 * y + 1) * K], grads_0.data(),
+                            grads_1.data());
+    }
+    std::vector<Float> flat;
+    for (::size_t k = 0; k < K; ++k) {
+      flat.push_back(grads_0[k]);
+      flat.push_back(grads_1[k]);
+    }
+    return flat;
+  }
+};
+
+// The sparse likelihood and gradients are exact for the dense pi that the
+// top m communities and the residual stand for; with m == K, that is all
+// of pi. Compare them with the dense kernels, after some iterations so the
+// state is not the initial one.
+int check(const std::string &graph, ::size_t m, double tolerance) {
+  std::vector<std::string> args = {
+    "-f", graph, "-K", std::to_string(K), "-m", "32", "-n", "16",
+    "-x", "10", "-i", "5", "-h", "0.05",
+    "--mcmc.sparse-m", std::to_string(m),
+  };
+  Options options(args);
+  Sampler sampler(options);
+  sampler.init();
+  sampler.run();
+
+  Random::Random rng(43);
+  int failures = 0;
+  double likelihood_error = 0.0;
+  double grads_error = 0.0;
+  for (::size_t t = 0; t < 100; ++t) {
+    Vertex a = rng.randint(0, nodes - 1);
+    Vertex b = rng.randint(0, nodes - 1);
+    failures += sampler.check_merge(a, b);
+    for (bool y : { false, true }) {
+      Float dense = sampler.dense_likelihood(a, b, y);
+      Float sparse = sampler.likelihood(a, b, y);
+      likelihood_error = std::max(likelihood_error,
+                                  std::fabs(static_cast<double>(dense) -
+                                            sparse) / dense);
+    }
+
+    NeighborSet neighbors = sampler.neighbors(a, &rng);
+    std::vector<int32_t> candidates = sampler.candidates(a, neighbors);
+    grads_error = std::max(grads_error, max_relative_error(
+                             sampler.dense_grads(a, neighbors, candidates),
+                             sampler.grads(a, neighbors, candidates)));
+  }
+
+  MinibatchSet mini_batch;
+  while (mini_batch.size() < 100) {
+    Vertex a = rng.randint(0, nodes - 1);
+    Vertex b = rng.randint(0, nodes - 1);
+    if (a != b) {
+      mini_batch.insert(Edge(std::min(a, b), std::max(a, b)));
+    }
+  }
+  double beta_error = max_relative_error(
+                        sampler.dense_theta_grads(mini_batch),
+                        sampler.theta_grads(mini_batch));
+
+  std::cout << std::scientific << std::setprecision(2) << "m " << m <<
+    ": likelihood error " << likelihood_error <<
+    ", phi grads error " << grads_error << ", beta grads error " <<
+    beta_error << std::endl;
+  for (double error : { likelihood_error, grads_error, beta_error }) {
+    if (! (error <= tolerance)) {
+      std::cerr << "m " << m << ": sparse differs from dense by " << error <<
+        std::endl;
+      ++failures;
+    }
+  }
+
+  return failures;
+}
+
+}   // namespace
+
+int main(int argc, char *argv[]) {
+  namespace fs = boost::filesystem;
+  const double tolerance = (sizeof(Float) == 4) ? 1.0e-4 : 1.0e-10;
+
+  fs::path tmp = fs::temp_directory_path() / fs::unique_path("sparse-%%%%%%");
+  std::string graph = (tmp / "graph.txt").string();
+  fs::create_directories(tmp);
+  write_graph(graph, nodes, 1600);
+
+  int failures = 0;
+  for (::size_t m : { static_cast< ::size_t>(4), K }) {
+    failures += check(graph, m, tolerance);
+  }
+
+  fs::remove_all(tmp);
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+
+  std::cout << "OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mcmc/work-stealing.h>
+
+// Each item must be taken exactly once, also if some threads are late
+// or never join
+int main(int argc, char *argv[]) {
+  const ::size_t threads = (argc > 1) ? std::stoul(argv[1]) : 4;
+  const ::size_t rounds = 100;
+  mcmc::WorkStealingRange schedule;
+  int failures = 0;
+
+  for (::size_t round = 0; round < rounds; ++round) {
+    const ::size_t n = 1 + round * 37;
+    std::vector<std::atomic<int> > taken(n);
+    for (auto &t : taken) {
+      t = 0;
+    }
+    if (round % 3 == 2) {
+      // Uneven shares, as from a NUMA-ordered schedule
+      std::vector< ::size_t> bounds(threads + 1, 0);
+      for (::size_t t = 1; t <= threads; ++t) {
+        bounds[t] = std::min(n, bounds[t - 1] + (n * t * t) / (threads * 3));
+      }
+      bounds[threads] = n;
+      schedule.Reset(bounds, 1 + round % 16);
+    } else {
+      schedule.Reset(n, threads, 1 + round % 16);
+    }
+
+    // Thread 0 stays away in odd rounds, unless it is alone
+    std::vector<std::thread> team;
+    for (::size_t me = (threads > 1) ? round % 2 : 0; me < threads; ++me) {
+      team.emplace_back([&schedule, &taken, me, round]() {
+        if (me == 1) {
+          std::this_thread::sleep_for(std::chrono::microseconds(round % 5));
+        }
+        ::size_t begin;
+        ::size_t end;
+        while (schedule.Next(me, &begin, &end)) {
+          for (::size_t i = begin; i < end; ++i) {
+            ++taken[i];
+          }
+        }
+      });
+    }
+    for (auto &t : team) {
+      t.join();
+    }
+
+    for (::size_t i = 0; i < n; ++i) {
+      if (taken[i] != 1) {
+        std::cerr << "Round " << round << ": item " << i << " taken " <<
+          taken[i] << " times" << std::endl;
+        ++failures;
+      }
+    }
+  }
+
+  if (failures > 0) {
+    return 1;
+  }
+
+  std::cout << "OK" << std::endl;
+
+  return 0;
+}